@@ -0,0 +1,261 @@
+/**********************************************************************
+ * Copyright (c) 2023
+ *  Sang-Hoon Kim <sanghoonkim@ajou.ac.kr>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTIABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ **********************************************************************/
+
+#ifndef __PIPESIM_MACHINE_H__
+#define __PIPESIM_MACHINE_H__
+
+#include <string.h>
+
+#include "types.h"
+#include "memory.h"
+
+/**
+ * The instruction mix retired in WB stage, by opcode and by funct. A branch
+ * or jr is resolved when the next instruction retires; the branch is taken
+ * if it is not the one after the branch, and jr counts where it has gone.
+ * The targets of jr are kept in a small hash table, and the ones not fitting
+ * in are counted together.
+ */
+#define NR_JR_TARGETS	64
+
+struct machine_stats {
+	unsigned long nr_opcodes[64];
+	unsigned long nr_functs[64];	/* Of opcode 0 */
+	unsigned long nr_taken;
+	unsigned long nr_not_taken;
+	struct {
+		unsigned int target;
+		unsigned long count;
+	} jr_targets[NR_JR_TARGETS];
+	unsigned long nr_jr_others;
+
+	unsigned int pending_pc;		/* The branch or jr to resolve, or 0 */
+	bool pending_jr;
+};
+
+/**
+ * A pipelined MIPS machine. All the state of the simulation lives here, so
+ * any number of machines can run side by side, each on its own thread. This
+ * is also the interface of libpipesim.a;
+ *
+ *   struct machine *m = machine_create();
+ *
+ *   __load_program(m, "testcases/program-r");
+ *   __run_program(m, 0);
+ *   ...
+ *   machine_destroy(m);
+ */
+struct machine {
+	/**
+	 * The 4 GiB address space, allocated page by page. The pipeline stops at
+	 * an access faulting on it, and leaves @memory.fault.
+	 */
+	struct guest_memory memory;
+
+	/* The MMU translating the fetches and the accesses in MEM stage. See memory.h */
+	struct guest_mmu mmu;
+
+	unsigned int registers[32];
+	unsigned int pc;
+
+	struct stage stages[NR_STAGES];	/* Pipelining stages */
+
+	/* Pipeline registers */
+	struct IF_ID if_id;
+	struct ID_EX id_ex;
+	struct EX_MEM ex_mem;
+	struct MEM_WB mem_wb;
+
+	int cycles;					/* Cycles executed so far */
+
+	/* The instruction in ID, kept for the later stages. See pa3.c */
+	unsigned int opcode__;
+	unsigned int types__;
+
+	/* The machine saved by @machine_snapshot(). The memory keeps its own */
+	struct machine *snapshot;
+
+	/* Instructions and cycles counted by PC while profiling, or NULL. See main.c */
+	struct machine_profile *profile;
+
+	/* Instruction mix retired since the machine is created. See main.c */
+	struct machine_stats stats;
+
+	/**
+	 * What is printed out to stdout, all off in a new machine. With @trace,
+	 * the program being loaded, and the pipeline every cycle along with the
+	 * registers every 10 cycles. The command-line interface turns it on.
+	 */
+	bool trace;
+	bool verbose;				/* The registers every cycle, and the instructions loaded */
+	bool verbose_memory;		/* The first words of the memory every cycle */
+};
+
+/**
+ * Create a machine in the initial state, and release it
+ */
+extern struct machine *machine_create(void);
+extern void machine_destroy(struct machine *m);
+
+/**
+ * Move the memory to the flat backend or back to the paged one. See memory.h
+ */
+extern int machine_set_memory(struct machine *m, bool flat, bool huge);
+
+/**
+ * Save the registers, the pipeline, and the memory, and put them back.
+ * Restoring takes time proportional to the pages changed since the snapshot.
+ */
+extern int machine_snapshot(struct machine *m);
+extern int machine_restore(struct machine *m);
+
+/**
+ * Write the registers, the pipeline, and the memory to a checkpoint file,
+ * and read them back. Checkpoints to the same file keep the pages changed
+ * since the previous one only, and are written in the background. See
+ * memory.c
+ */
+extern int machine_checkpoint(struct machine *m, const char *filename);
+extern int machine_resume(struct machine *m, const char *filename);
+
+/**
+ * Start counting the instructions and the cycles by PC, or stop it, and
+ * print the hottest ranges of the program counted so far
+ */
+extern int machine_profile(struct machine *m, bool enabled);
+extern void machine_report_profile(struct machine *m);
+
+/**
+ * Write the instruction mix of @m in JSON to a file, or to stderr if NULL
+ */
+extern int machine_write_stats(struct machine *m, const char *filename);
+
+extern int __load_program(struct machine *m, char * const filename);
+extern bool __run_cycle(struct machine *m);
+extern int __run_program(struct machine *m, unsigned int nr_cycles);
+
+/**
+ * Helper functions for the stages. See main.c for the details of them
+ */
+extern bool is_noop(struct machine *m, int stage);
+extern void make_stall(struct machine *m, int stage, int cycles);
+
+/**
+ * Words in the memory are big endian to the guest, and aligned ones are
+ * stored as host words. See memory.h. Unaligned words go byte by byte on the
+ * slow paths. They return false when the access by the instruction at @pc
+ * faults, leaving @memory.fault.
+ *
+ * While @__run_program() catches the faults on the flat memory, loads and
+ * stores access it without any check, and the faults go there. See memory.h.
+ * The flat memory is not used while the MMU is on, and @address is
+ * translated by the MMU first then.
+ */
+static inline bool fetch_word(struct machine *m, unsigned int address, unsigned int *word)
+{
+	const uint32_t *p = NULL;
+	unsigned int paddr = address;
+
+	if (m->mmu.enabled) {
+		if (!guest_word_aligned(address)) {
+			if (guest_mmu_load(&m->mmu, &m->memory, address, word, PAGE_EXEC)) return true;
+			goto fault;
+		}
+		if (!guest_mmu_translate(&m->mmu, &m->memory, address, PAGE_EXEC, &paddr)) goto fault;
+	}
+
+	if (guest_word_aligned(paddr)) {
+		p = (const uint32_t *)guest_translate(&m->memory, paddr, PAGE_EXEC);
+	}
+	if (p) {
+		*word = *p;
+		return true;
+	}
+	if (guest_fetch(&m->memory, paddr, word)) return true;
+fault:
+	m->memory.fault.pc = address;
+	return false;
+}
+
+static inline bool load_word(struct machine *m, unsigned int pc, unsigned int address,
+		unsigned int *word)
+{
+	const uint32_t *p = NULL;
+
+	if (guest_word_aligned(address)) {
+		if (m->memory.catch) {
+			*word = *(const uint32_t *)(m->memory.flat + address);
+			return true;
+		}
+		if (m->mmu.enabled &&
+				!guest_mmu_translate(&m->mmu, &m->memory, address, PAGE_READ, &address)) {
+			goto fault;
+		}
+		p = (const uint32_t *)guest_translate(&m->memory, address, PAGE_READ);
+	} else if (m->mmu.enabled) {
+		if (guest_mmu_load(&m->mmu, &m->memory, address, word, PAGE_READ)) return true;
+		goto fault;
+	}
+	if (p) {
+		*word = *p;
+		return true;
+	}
+	if (guest_load(&m->memory, address, word)) return true;
+fault:
+	m->memory.fault.pc = pc;
+	return false;
+}
+
+static inline bool store_word(struct machine *m, unsigned int pc, unsigned int address,
+		unsigned int word)
+{
+	uint32_t *p = NULL;
+
+	if (guest_word_aligned(address)) {
+		if (m->memory.catch) {
+			*(uint32_t *)(m->memory.flat + address) = word;
+			return true;
+		}
+		if (m->mmu.enabled &&
+				!guest_mmu_translate(&m->mmu, &m->memory, address, PAGE_WRITE, &address)) {
+			goto fault;
+		}
+		p = (uint32_t *)guest_translate(&m->memory, address, PAGE_WRITE | PAGE_DIRTY);
+	} else if (m->mmu.enabled) {
+		if (guest_mmu_store(&m->mmu, &m->memory, address, word)) return true;
+		goto fault;
+	}
+	if (p) {
+		*p = word;
+	} else if (!guest_store(&m->memory, address, word)) {
+		goto fault;
+	}
+	if (m->mmu.enabled) guest_mmu_stored(&m->mmu, address);
+	return true;
+fault:
+	m->memory.fault.pc = pc;
+	return false;
+}
+
+/**
+ * Pipelining stages. See pa3.c
+ */
+extern void IF_stage(struct machine *m, struct IF_ID *if_id);
+extern void ID_stage(struct machine *m, struct IF_ID *if_id, struct ID_EX *id_ex);
+extern void EX_stage(struct machine *m, struct ID_EX *id_ex, struct EX_MEM *ex_mem);
+extern void MEM_stage(struct machine *m, struct EX_MEM *ex_mem, struct MEM_WB *mem_wb);
+extern void WB_stage(struct machine *m, struct MEM_WB *mem_wb);
+
+#endif
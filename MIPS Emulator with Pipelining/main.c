@@ -20,8 +20,12 @@
 #include <string.h>
 #include <inttypes.h>
 #include <ctype.h>
+#include <setjmp.h>
+#include <getopt.h>
 
-#include "types.h"
+#include "machine.h"
+#include "sample.h"
+#include "counters.h"
 
 /* To avoid security error on Visual Studio */
 #define _CRT_SECURE_NO_WARNINGS
@@ -32,9 +36,9 @@
 #define MAX_COMMAND		256 /* Maximum length of command string */
 
 /**
- * memory[] emulates the memory of the machine
+ * Initial contents of the memory of the machine. The rest is zero-filled
  */
-unsigned char memory[1 << 20] = {	/* 1MB memory at 0x0000 0000 -- 0x0100 0000 */
+static const unsigned char initial_memory[] = {
 	0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77,
 	0xde, 0xad, 0xbe, 0xef, 0x00, 0x00, 0x00, 0x00,
 	'h',  'e',  'l',  'l',  'o',  ' ',  'w',  'o',
@@ -49,9 +53,9 @@ unsigned char memory[1 << 20] = {	/* 1MB memory at 0x0000 0000 -- 0x0100 0000 */
 #define INITIAL_SP	0x8000	/* Initial location for stack pointer */
 
 /**
- * Registers of the machine
+ * Initial values of the registers of the machine
  */
-unsigned int registers[32] = {
+static const unsigned int initial_registers[32] = {
 	0, 0, 0, 0, 0, 0, 0, 0,
 	0, 0, 0, 0, 0, 0, 0, 0,
 	0x10, INITIAL_PC, 0x20, 2, 0xbadacafe, 0xcdcdcdcd, 0xffffffff, 7,
@@ -68,32 +72,14 @@ const char *register_names[] = {
 	"t8", "t9", "k0", "k1", "gp", "sp", "fp", "ra"
 };
 
-/**
- * Program counter register
- */
-unsigned int pc = INITIAL_PC;
-
-/**
- * Pipelining
- */
-struct stage stages[NR_STAGES];
-
 static const char *stage_name[] = {
 	"IF", "ID", "EX", "MEM", "WB",
 };
 
-
 /**
- * Cycles executed so far
+ * Execution behavior parameters. What is printed out is up to the machine;
+ * see @trace in machine.h
  */
-static int __cycles = 0;
-
-/**
- * Execution behavior parameters
- */
-static bool __verbose = false;
-static bool __verbose_memory = false;
-static bool __auto_run = false;
 static const int __dump_interval = 10;
 
 
@@ -193,17 +179,17 @@ static inline bool strmatch(char * const str, const char *expect)
 }
 
 
-static void __pipeline_stat(void)
+static void __pipeline_stat(struct machine *m)
 {
-	fprintf(stderr, "\n### %d ###\n", __cycles);
+	fprintf(stderr, "\n### %d ###\n", m->cycles);
 	for (int i = 0; i < NR_STAGES; i++) {
 		fprintf(stderr, "%3s: 0x%08x  0x%08x  %d\n", stage_name[i],
-			stages[i].instruction.machine_code, stages[i].__pc, stages[i].nr_stalls);
+			m->stages[i].instruction.machine_code, m->stages[i].__pc, m->stages[i].nr_stalls);
 	}
 	fprintf(stderr, "\n");
 }
 
-static void __show_registers(char * const register_name)
+static void __show_registers(struct machine *m, char * const register_name)
 {
 	int from = 0, to = 0;
 	bool include_pc = false;
@@ -224,46 +210,677 @@ static void __show_registers(char * const register_name)
 	}
 
 	for (int i = from; i < to; i++) {
-		fprintf(stderr, "[%02d:%2s] 0x%08x    %u\n", i, register_names[i], registers[i], registers[i]);
+		fprintf(stderr, "[%02d:%2s] 0x%08x    %u\n", i, register_names[i], m->registers[i], m->registers[i]);
 	}
 	if (include_pc) {
-		fprintf(stderr, "[  pc ] 0x%08x\n", pc);
+		fprintf(stderr, "[  pc ] 0x%08x\n", m->pc);
 	}
 }
 
-static void __dump_memory(unsigned int addr, size_t length)
+static void __dump_memory(struct machine *m, unsigned int addr, size_t length)
 {
     for (size_t i = 0; i < length; i += 4) {
+        unsigned char b[4];
+
+        guest_peek(&m->memory, addr + i, b, sizeof(b));
         fprintf(stderr, "0x%08lx:  %02x %02x %02x %02x    %c %c %c %c\n",
-				addr + i,
-                memory[addr + i    ], memory[addr + i + 1],
-                memory[addr + i + 2], memory[addr + i + 3],
-                isprint(memory[addr + i    ]) ? memory[addr + i    ] : '.',
-				isprint(memory[addr + i + 1]) ? memory[addr + i + 1] : '.',
-				isprint(memory[addr + i + 2]) ? memory[addr + i + 2] : '.',
-				isprint(memory[addr + i + 3]) ? memory[addr + i + 3] : '.');
+				addr + i, b[0], b[1], b[2], b[3],
+                isprint(b[0]) ? b[0] : '.', isprint(b[1]) ? b[1] : '.',
+				isprint(b[2]) ? b[2] : '.', isprint(b[3]) ? b[3] : '.');
     }
 }
 
+static void __report_mmu(struct machine *m)
+{
+	const struct guest_mmu *mmu = &m->mmu;
+	unsigned long nr_lookups = mmu->nr_hits + mmu->nr_misses;
+
+	if (!mmu->enabled) {
+		fprintf(stderr, "mmu: off\n");
+		return;
+	}
+	fprintf(stderr, "mmu: page directory at 0x%08x, %lu lookups, %.2f%% hit in the TLB, %lu misses, %lu faults\n",
+			mmu->root, nr_lookups, nr_lookups ? 100.0 * mmu->nr_hits / nr_lookups : 0.0,
+			mmu->nr_misses, mmu->nr_faults);
+}
+
+
+/**********************************************************************
+ * machine_create
+ *
+ * DESCRIPTION
+ *   Allocate a machine with the initial memory and registers, @pc at
+ *   INITIAL_PC, and the empty pipeline. No program is loaded yet.
+ *
+ * RETURN
+ *   The new machine
+ *   NULL if the memory is not available
+ */
+struct machine *machine_create(void)
+{
+	struct machine *m = calloc(1, sizeof(*m));
+
+	if (!m) return NULL;
+
+	guest_memory_init(&m->memory);
+	if (guest_poke(&m->memory, 0x0, initial_memory, sizeof(initial_memory))) {
+		machine_destroy(m);
+		return NULL;
+	}
+	guest_mmu_set(&m->mmu, false, 0);
+	memcpy(m->registers, initial_registers, sizeof(initial_registers));
+	m->pc = INITIAL_PC;
+
+	return m;
+}
+
+/**
+ * Release the machine @m, writing back the files mapped writable first
+ */
+void machine_destroy(struct machine *m)
+{
+	if (!m) return;
+
+	guest_sync(&m->memory);
+	guest_memory_release(&m->memory);
+	machine_profile(m, false);
+	free(m->snapshot);
+	free(m);
+}
+
+
+/**********************************************************************
+ * machine_set_memory
+ *
+ * DESCRIPTION
+ *   Move the memory of @m to the flat backend if @flat, with transparent
+ *   huge pages if @huge, or to the paged one otherwise. The contents and the
+ *   permissions are kept while the pages become clean.
+ *
+ * RETURN
+ *   0 on success
+ *   -errno if the new memory is not available
+ */
+int machine_set_memory(struct machine *m, bool flat, bool huge)
+{
+	struct guest_memory memory;
+	int ret = 0;
+
+	if (flat) {
+		ret = guest_memory_init_flat(&memory, huge);
+	} else {
+		guest_memory_init(&memory);
+	}
+	if (!ret) ret = guest_memory_copy(&memory, &m->memory);
+	if (ret) {
+		guest_memory_release(&memory);
+		return ret;
+	}
+
+	guest_memory_release(&m->memory);
+	m->memory = memory;
+	return 0;
+}
+
+
+/**********************************************************************
+ * machine_snapshot
+ *
+ * DESCRIPTION
+ *   Take the snapshot of the registers, the pipeline, and the memory of @m.
+ *   The memory is copied on write, so this costs nothing but clearing the
+ *   dirty pages. Moving the memory with @machine_set_memory() drops it.
+ *
+ * RETURN
+ *   0 on success
+ *   -ENOMEM if the snapshot cannot be allocated
+ */
+int machine_snapshot(struct machine *m)
+{
+	if (!m->snapshot) {
+		m->snapshot = malloc(sizeof(*m->snapshot));
+		if (!m->snapshot) return -ENOMEM;
+	}
+	*m->snapshot = *m;
+	return guest_snapshot(&m->memory);
+}
+
+
+/**********************************************************************
+ * machine_restore
+ *
+ * DESCRIPTION
+ *   Put @m back to the snapshot. The profile and the stats keep counting on.
+ *
+ * RETURN
+ *   0 on success
+ *   -ENOENT if no snapshot is taken
+ *   -ENOMEM if the memory cannot be restored
+ */
+int machine_restore(struct machine *m)
+{
+	struct machine *snapshot = m->snapshot;
+	struct machine_profile *profile = m->profile;
+	struct machine_stats stats = m->stats;
+	struct guest_memory memory;
+
+	if (!snapshot || !m->memory.snapshot) return -ENOENT;
+
+	memory = m->memory;
+	*m = *snapshot;
+	m->memory = memory;
+	m->snapshot = snapshot;
+	m->profile = profile;
+	m->stats = stats;
+	return guest_restore(&m->memory);
+}
+
 
 /**
- * Pipeline registers
+ * The state of the machine in the checkpoints, along with the memory. The
+ * names of the instructions in the stages are not kept.
+ */
+struct machine_checkpoint {
+	unsigned int registers[32];
+	unsigned int pc;
+
+	struct stage stages[NR_STAGES];
+	struct IF_ID if_id;
+	struct ID_EX id_ex;
+	struct EX_MEM ex_mem;
+	struct MEM_WB mem_wb;
+
+	int cycles;
+	unsigned int opcode__;
+	unsigned int types__;
+};
+
+/**********************************************************************
+ * machine_checkpoint
+ *
+ * DESCRIPTION
+ *   Checkpoint the registers, the pipeline, and the memory of @m to the
+ *   file @filename. See @guest_checkpoint() for how the file is written.
+ *
+ * RETURN
+ *   0 on success
+ *   -ENOMEM if the checkpoint cannot be put together
+ */
+int machine_checkpoint(struct machine *m, const char *filename)
+{
+	struct machine_checkpoint state;
+
+	memset(&state, 0x00, sizeof(state));
+	memcpy(state.registers, m->registers, sizeof(m->registers));
+	state.pc = m->pc;
+	memcpy(state.stages, m->stages, sizeof(m->stages));
+	for (int i = 0; i < NR_STAGES; i++) {
+		state.stages[i].instruction.name = NULL;
+	}
+	state.if_id = m->if_id;
+	state.id_ex = m->id_ex;
+	state.ex_mem = m->ex_mem;
+	state.mem_wb = m->mem_wb;
+	state.cycles = m->cycles;
+	state.opcode__ = m->opcode__;
+	state.types__ = m->types__;
+
+	return guest_checkpoint(&m->memory, filename, &state, sizeof(state));
+}
+
+
+/**********************************************************************
+ * machine_resume
+ *
+ * DESCRIPTION
+ *   Put @m to the checkpoint in the file @filename. The memory stays on its
+ *   backend with the files mapped in, the MMU stays as it is with the TLB
+ *   flushed, and the snapshot is dropped.
+ *
+ * RETURN
+ *   0 on success
+ *   -errno if the checkpoint cannot be resumed. @m is left as it is then.
+ */
+int machine_resume(struct machine *m, const char *filename)
+{
+	struct machine_checkpoint state;
+	struct guest_memory memory;
+	int ret = 0;
+
+	if (m->memory.flat) {
+		ret = guest_memory_init_flat(&memory, false);
+	} else {
+		guest_memory_init(&memory);
+	}
+	if (!ret) ret = guest_map_share(&memory, &m->memory);
+	if (!ret) ret = guest_resume(&memory, filename, &state, sizeof(state));
+	if (ret) {
+		guest_memory_release(&memory);
+		return ret;
+	}
+
+	guest_sync(&m->memory);
+	guest_memory_release(&m->memory);
+	m->memory = memory;
+	memcpy(m->registers, state.registers, sizeof(m->registers));
+	m->pc = state.pc;
+	memcpy(m->stages, state.stages, sizeof(m->stages));
+	m->if_id = state.if_id;
+	m->id_ex = state.id_ex;
+	m->ex_mem = state.ex_mem;
+	m->mem_wb = state.mem_wb;
+	m->cycles = state.cycles;
+	m->opcode__ = state.opcode__;
+	m->types__ = state.types__;
+	guest_mmu_set(&m->mmu, m->mmu.enabled, m->mmu.root);
+	return 0;
+}
+
+
+/**
+ * The instructions and the cycles counted by PC. The counters are kept in an
+ * open-addressed hash table, which is doubled when it gets half full.
+ *
+ * An instruction is counted when it reaches WB stage, and each cycle is
+ * charged to the oldest instruction in the pipeline, which the younger ones
+ * are waiting behind. The cycles with the bubbles only are counted idle.
+ */
+#define NR_INITIAL_PC_COUNTERS	256
+#define NR_TOP_RANGES	10	/* Hot ranges to report */
+
+struct pc_counter {
+	unsigned int pc;
+	bool used;
+	unsigned long nr_instructions;
+	unsigned long nr_cycles;
+};
+
+struct machine_profile {
+	struct pc_counter *counters;
+	unsigned int nr_counters;	/* Power of 2 */
+	unsigned int nr_used;
+
+	unsigned long nr_instructions;
+	unsigned long nr_cycles;
+	unsigned long nr_idle;
+};
+
+static inline unsigned int __pc_hash(unsigned int pc, unsigned int nr_counters)
+{
+	return ((pc >> 2) * 2654435761u) & (nr_counters - 1);
+}
+
+static struct pc_counter *__find_pc_counter(struct pc_counter *counters, unsigned int nr_counters,
+		unsigned int pc)
+{
+	unsigned int i = __pc_hash(pc, nr_counters);
+
+	while (counters[i].used && counters[i].pc != pc) {
+		i = (i + 1) & (nr_counters - 1);
+	}
+	return counters + i;
+}
+
+/* The counter of @pc, or NULL if the table cannot grow for a new one */
+static struct pc_counter *__pc_counter(struct machine_profile *profile, unsigned int pc)
+{
+	struct pc_counter *counter = __find_pc_counter(profile->counters, profile->nr_counters, pc);
+
+	if (counter->used) return counter;
+
+	if ((profile->nr_used + 1) * 2 > profile->nr_counters) {
+		unsigned int nr_counters = profile->nr_counters * 2;
+		struct pc_counter *counters = calloc(nr_counters, sizeof(*counters));
+
+		if (!counters) return NULL;
+		for (unsigned int i = 0; i < profile->nr_counters; i++) {
+			if (!profile->counters[i].used) continue;
+			*__find_pc_counter(counters, nr_counters, profile->counters[i].pc) =
+					profile->counters[i];
+		}
+		free(profile->counters);
+		profile->counters = counters;
+		profile->nr_counters = nr_counters;
+		counter = __find_pc_counter(counters, nr_counters, pc);
+	}
+	*counter = (struct pc_counter) { .pc = pc, .used = true };
+	profile->nr_used++;
+	return counter;
+}
+
+static inline bool __is_instruction(struct machine *m, int stage)
+{
+	return m->stages[stage].__pc != 0 && m->stages[stage].instruction.machine_code != 0;
+}
+
+static void __profile_cycle(struct machine *m)
+{
+	struct machine_profile *profile = m->profile;
+	struct pc_counter *counter;
+	int stage = WB;
+
+	profile->nr_cycles++;
+	if (__is_instruction(m, WB)) {
+		counter = __pc_counter(profile, m->stages[WB].__pc);
+		if (counter) counter->nr_instructions++;
+		profile->nr_instructions++;
+	}
+
+	while (stage >= IF && !__is_instruction(m, stage)) stage--;
+	if (stage < IF) {
+		profile->nr_idle++;
+		return;
+	}
+	counter = __pc_counter(profile, m->stages[stage].__pc);
+	if (counter) counter->nr_cycles++;
+}
+
+
+/**********************************************************************
+ * machine_profile
+ *
+ * DESCRIPTION
+ *   Start counting the instructions and the cycles of @m by PC from zero if
+ *   @enabled, or stop it and drop the counts otherwise.
+ *
+ * RETURN
+ *   0 on success
+ *   -ENOMEM if the counters cannot be allocated
+ */
+int machine_profile(struct machine *m, bool enabled)
+{
+	struct machine_profile *profile = NULL;
+
+	if (enabled) {
+		profile = calloc(1, sizeof(*profile));
+		if (!profile) return -ENOMEM;
+
+		profile->nr_counters = NR_INITIAL_PC_COUNTERS;
+		profile->counters = calloc(profile->nr_counters, sizeof(*profile->counters));
+		if (!profile->counters) {
+			free(profile);
+			return -ENOMEM;
+		}
+	}
+
+	if (m->profile) free(m->profile->counters);
+	free(m->profile);
+	m->profile = profile;
+	return 0;
+}
+
+/**
+ * Disassemble @instr at @pc into @buffer with the names @__parse_instruction()
+ * gives. The words it does not know, including 0xffffffff, are shown as they are.
+ */
+static void __disassemble(unsigned int instr, unsigned int pc, char *buffer, size_t size)
+{
+	unsigned int opcode = instr >> 26;
+	struct instruction in;
+
+	if (!mips_instruction_set[opcode].name ||
+			(opcode == 0 && !r_type_instructions[instr & 0x3f].name)) {
+		snprintf(buffer, size, ".word 0x%08x", instr);
+		return;
+	}
+	__parse_instruction(instr, &in);
+
+	switch (in.type) {
+	case r_type:
+		if (in.r_type.funct == 0x08) {
+			snprintf(buffer, size, "%-5s %s", in.name, register_names[in.r_type.rs]);
+		} else if (in.r_type.funct <= 0x03) {
+			snprintf(buffer, size, "%-5s %s, %s, %u", in.name, register_names[in.r_type.rd],
+					register_names[in.r_type.rt], in.r_type.shamt);
+		} else {
+			snprintf(buffer, size, "%-5s %s, %s, %s", in.name, register_names[in.r_type.rd],
+					register_names[in.r_type.rs], register_names[in.r_type.rt]);
+		}
+		break;
+	case i_type:
+		if (in.opcode == 0x04 || in.opcode == 0x05) {
+			snprintf(buffer, size, "%-5s %s, %s, 0x%08x", in.name,
+					register_names[in.i_type.rs], register_names[in.i_type.rt],
+					pc + 4 + ((int16_t)in.i_type.imm << 2));
+		} else if (in.opcode == 0x23 || in.opcode == 0x2b) {
+			snprintf(buffer, size, "%-5s %s, %d(%s)", in.name, register_names[in.i_type.rt],
+					(int16_t)in.i_type.imm, register_names[in.i_type.rs]);
+		} else if (in.opcode == 0x0c || in.opcode == 0x0d) {
+			snprintf(buffer, size, "%-5s %s, %s, 0x%x", in.name, register_names[in.i_type.rt],
+					register_names[in.i_type.rs], in.i_type.imm);
+		} else {
+			snprintf(buffer, size, "%-5s %s, %s, %d", in.name, register_names[in.i_type.rt],
+					register_names[in.i_type.rs], (int16_t)in.i_type.imm);
+		}
+		break;
+	default:
+		snprintf(buffer, size, "%-5s 0x%08x", in.name,
+				((pc + 4) & 0xf0000000) | (in.j_type.target << 2));
+		break;
+	}
+}
+
+/* The instructions in a row run the same number of times, a basic block or more */
+struct pc_range {
+	unsigned int start;
+	unsigned int nr_instructions;
+	unsigned long count;
+	unsigned long nr_cycles;
+};
+
+static int __compare_pcs(const void *a, const void *b)
+{
+	const struct pc_counter *ca = a, *cb = b;
+
+	return (ca->pc > cb->pc) - (ca->pc < cb->pc);
+}
+
+static int __compare_pc_ranges(const void *a, const void *b)
+{
+	const struct pc_range *ra = a, *rb = b;
+
+	return (ra->nr_cycles < rb->nr_cycles) - (ra->nr_cycles > rb->nr_cycles);
+}
+
+/**********************************************************************
+ * machine_report_profile
+ *
+ * DESCRIPTION
+ *   Print the hottest ranges of the program by the cycles spent there, with
+ *   their disassembly and the cycles of each instruction. The instructions
+ *   next to each other and counted the same are put in a range.
  */
-static struct IF_ID if_id = { 0 };
-static struct ID_EX id_ex = { 0 };
-static struct EX_MEM ex_mem = { 0 };
-static struct MEM_WB mem_wb = { 0 };
+void machine_report_profile(struct machine *m)
+{
+	struct machine_profile *profile = m->profile;
+	struct pc_counter *counters;
+	struct pc_range *ranges;
+	unsigned int nr_counters = 0, nr_ranges = 0;
+
+	if (!profile) return;
+
+	counters = malloc(sizeof(*counters) * (profile->nr_used + 1));
+	ranges = malloc(sizeof(*ranges) * (profile->nr_used + 1));
+	if (!counters || !ranges) {
+		fprintf(stderr, "profile: %s\n", strerror(ENOMEM));
+		free(counters);
+		free(ranges);
+		return;
+	}
+	for (unsigned int i = 0; i < profile->nr_counters; i++) {
+		if (profile->counters[i].used) counters[nr_counters++] = profile->counters[i];
+	}
+	qsort(counters, nr_counters, sizeof(*counters), __compare_pcs);
+
+	for (unsigned int i = 0; i < nr_counters; i++) {
+		struct pc_range *last = nr_ranges ? ranges + nr_ranges - 1 : NULL;
+
+		if (last && last->count == counters[i].nr_instructions &&
+				counters[last->start + last->nr_instructions - 1].pc + 4 == counters[i].pc) {
+			last->nr_instructions++;
+			last->nr_cycles += counters[i].nr_cycles;
+		} else {
+			ranges[nr_ranges++] = (struct pc_range) {
+				i, 1, counters[i].nr_instructions, counters[i].nr_cycles,
+			};
+		}
+	}
+	qsort(ranges, nr_ranges, sizeof(*ranges), __compare_pc_ranges);
+
+	fprintf(stderr, "profile: %lu instructions in %lu cycles, %lu idle\n",
+			profile->nr_instructions, profile->nr_cycles, profile->nr_idle);
+	for (unsigned int r = 0; r < nr_ranges && r < NR_TOP_RANGES; r++) {
+		const struct pc_range *range = ranges + r;
+		const struct pc_counter *counter = counters + range->start;
+
+		fprintf(stderr, "profile: 0x%08x-0x%08x %10lu times  %5.1f%% instructions  %5.1f%% cycles\n",
+				counter->pc, counter->pc + range->nr_instructions * 4 - 4, range->count,
+				profile->nr_instructions ?
+					100.0 * range->count * range->nr_instructions / profile->nr_instructions : 0.0,
+				100.0 * range->nr_cycles / profile->nr_cycles);
+		for (unsigned int i = 0; i < range->nr_instructions; i++, counter++) {
+			unsigned char bytes[4];
+			char text[48];
+
+			guest_peek(&m->memory, counter->pc, bytes, sizeof(bytes));
+			__disassemble((bytes[0] << 24) | (bytes[1] << 16) | (bytes[2] << 8) | bytes[3],
+					counter->pc, text, sizeof(text));
+			fprintf(stderr, "profile:   0x%08x  %-28s %10lu cycles\n",
+					counter->pc, text, counter->nr_cycles);
+		}
+	}
+	free(counters);
+	free(ranges);
+}
 
 
+static void __count_jr_target(struct machine_stats *stats, unsigned int target)
+{
+	unsigned int slot = (target >> 2) & (NR_JR_TARGETS - 1);
+
+	for (unsigned int i = 0; i < NR_JR_TARGETS; i++, slot = (slot + 1) & (NR_JR_TARGETS - 1)) {
+		if (!stats->jr_targets[slot].count) stats->jr_targets[slot].target = target;
+		if (stats->jr_targets[slot].target == target) {
+			stats->jr_targets[slot].count++;
+			return;
+		}
+	}
+	stats->nr_jr_others++;
+}
+
 /**
- * Pipelining stages to be completed
+ * Count the instruction retiring in WB stage into @m->stats, and resolve the
+ * branch or jr retired before it. See machine.h
+ */
+static void __count_retired(struct machine *m)
+{
+	struct machine_stats *stats = &m->stats;
+	unsigned int pc = m->stages[WB].__pc;
+	unsigned int instr = m->stages[WB].instruction.machine_code;
+	unsigned int opcode = instr >> 26;
+
+	if (stats->pending_pc && stats->pending_jr) {
+		__count_jr_target(stats, pc);
+	} else if (stats->pending_pc) {
+		if (pc == stats->pending_pc + 4) {
+			stats->nr_not_taken++;
+		} else {
+			stats->nr_taken++;
+		}
+	}
+	stats->pending_pc = 0;
+
+	stats->nr_opcodes[opcode]++;
+	if (opcode == 0x00) {
+		stats->nr_functs[instr & 0x3f]++;
+		if ((instr & 0x3f) == 0x08) {
+			stats->pending_pc = pc;
+			stats->pending_jr = true;
+		}
+	} else if (opcode == 0x04 || opcode == 0x05) {
+		stats->pending_pc = pc;
+		stats->pending_jr = false;
+	}
+}
+
+/* Write the counts of the instructions in @set[] by their codes, as "name": count */
+static void __write_counts(FILE *fp, const struct mips_instruction *set, unsigned int nr_codes,
+		const unsigned long *counts, bool by_name, const char *skip)
+{
+	const char *sep = "";
+
+	for (unsigned int i = 0; i < nr_codes; i++) {
+		if (!set[i].name || (skip && !strcmp(set[i].name, skip))) continue;
+		if (by_name) {
+			fprintf(fp, "%s\"%s\": %lu", sep, set[i].name, counts[i]);
+		} else {
+			fprintf(fp, "%s\"0x%02x\": %lu", sep, i, counts[i]);
+		}
+		sep = ", ";
+	}
+}
+
+/**********************************************************************
+ * machine_write_stats
+ *
+ * DESCRIPTION
+ *   Write the instruction mix of @m in JSON to the file @filename, or to
+ *   stderr if it is NULL. The counts by opcode and by funct cover the
+ *   instructions in @mips_instruction_set[] and @r_type_instructions[]; the
+ *   others are counted as unknown.
+ *
+ * RETURN
+ *   0 on success
+ *   -EINVAL if the file cannot be opened
+ *   -EIO if the file cannot be written
  */
-extern void IF_stage(struct IF_ID *if_id);
-extern void ID_stage(struct IF_ID *if_id, struct ID_EX *id_ex);
-extern void EX_stage(struct ID_EX *id_ex, struct EX_MEM *ex_mem);
-extern void MEM_stage(struct EX_MEM *ex_mem, struct MEM_WB *mem_wb);
-extern void WB_stage(struct MEM_WB *mem_wb);
+int machine_write_stats(struct machine *m, const char *filename)
+{
+	const unsigned int nr_opcodes = sizeof(mips_instruction_set) / sizeof(*mips_instruction_set);
+	const unsigned int nr_functs = sizeof(r_type_instructions) / sizeof(*r_type_instructions);
+	const struct machine_stats *stats = &m->stats;
+	unsigned long nr_instructions = 0, nr_unknown = 0;
+	const char *sep = "";
+	FILE *fp = filename ? fopen(filename, "w") : stderr;
+
+	if (!fp) {
+		fprintf(stderr, "stats: cannot open %s\n", filename);
+		return -EINVAL;
+	}
+
+	for (unsigned int i = 0; i < 64; i++) {
+		nr_instructions += stats->nr_opcodes[i];
+		if (i >= nr_opcodes || !mips_instruction_set[i].name) nr_unknown += stats->nr_opcodes[i];
+		if (i >= nr_functs || !r_type_instructions[i].name) nr_unknown += stats->nr_functs[i];
+	}
 
+	fprintf(fp, "{\n  \"instructions\": %lu,\n  \"ops\": {", nr_instructions);
+	__write_counts(fp, mips_instruction_set, nr_opcodes, stats->nr_opcodes, true, "r-type");
+	fprintf(fp, ", ");
+	__write_counts(fp, r_type_instructions, nr_functs, stats->nr_functs, true, NULL);
+	fprintf(fp, "},\n  \"opcodes\": {");
+	__write_counts(fp, mips_instruction_set, nr_opcodes, stats->nr_opcodes, false, NULL);
+	fprintf(fp, "},\n  \"functs\": {");
+	__write_counts(fp, r_type_instructions, nr_functs, stats->nr_functs, false, NULL);
+	fprintf(fp, "},\n  \"unknown\": %lu,\n", nr_unknown);
+	fprintf(fp, "  \"branches\": {\"taken\": %lu, \"not_taken\": %lu},\n",
+			stats->nr_taken, stats->nr_not_taken);
+	fprintf(fp, "  \"loads\": %lu,\n  \"stores\": %lu,\n  \"jr_targets\": {",
+			stats->nr_opcodes[0x23], stats->nr_opcodes[0x2b]);
+	for (unsigned int i = 0; i < NR_JR_TARGETS; i++) {
+		if (!stats->jr_targets[i].count) continue;
+		fprintf(fp, "%s\"0x%08x\": %lu", sep, stats->jr_targets[i].target,
+				stats->jr_targets[i].count);
+		sep = ", ";
+	}
+	fprintf(fp, "},\n  \"jr_other_targets\": %lu\n}\n", stats->nr_jr_others);
+
+	if (fp != stderr && fclose(fp)) {
+		fprintf(stderr, "stats: cannot write %s\n", filename);
+		return -EIO;
+	}
+	return 0;
+}
 
 /**********************************************************************
  * is_noop(stage)
@@ -275,19 +892,19 @@ extern void WB_stage(struct MEM_WB *mem_wb);
  *   true if the stage @stage has nothing to do in this cycle
  *   false otherwise
  */
-bool is_noop(int stage)
+bool is_noop(struct machine *m, int stage)
 {
-	struct stage *s = &stages[stage];
+	struct stage *s = &m->stages[stage];
 	return s->instruction.machine_code == 0 && s->__pc == 0;
 }
 
-static bool __is_program_finished(void)
+static bool __is_program_finished(struct machine *m)
 {
 	int nr_idle_stages = 0;
 
 	/* Count idle stages */
 	for (int i = 0; i < NR_STAGES; i++) {
-		struct stage *s = stages + i;
+		struct stage *s = m->stages + i;
 		if (s->instruction.machine_code == 0x00 && s->__pc != 0) {
 			nr_idle_stages++;
 		}
@@ -305,15 +922,15 @@ static bool __is_program_finished(void)
  *   Make stage @stage to be stalled for @cycles cycles. Note that the
  *   earlier stages are also influenced.
  */
-void make_stall(int stage, int cycles)
+void make_stall(struct machine *m, int stage, int cycles)
 {
-	struct stage *s = stages + stage;
+	struct stage *s = m->stages + stage;
 	s->nr_stalls += cycles;
 }
 
-static bool __should_stall(int stage)
+static bool __should_stall(struct machine *m, int stage)
 {
-	struct stage *s = &stages[stage];
+	struct stage *s = &m->stages[stage];
 
 	if (!(s->nr_stalls)) return false;
 
@@ -321,6 +938,8 @@ static bool __should_stall(int stage)
 	return !!s->nr_stalls;
 }
 
+static bool __finish_cycle(struct machine *m);
+
 /**********************************************************************
  * __run_cycle()
  *
@@ -329,26 +948,27 @@ static bool __should_stall(int stage)
  *
  * RETURN
  *   true if the pipeline is not empty.
- *   false if the pipeline is empty (i.e., nothing to process anymore).
+ *   false if the pipeline is empty (i.e., nothing to process anymore), or
+ *   an instruction has faulted on the memory.
  */
-static bool __run_cycle(void)
+bool __run_cycle(struct machine *m)
 {
 	/**
 	 * Prepare stages for this cycle. Inject noop into stalled stages without
 	 * moving related pipeline registers.
 	 */
 	for (int i = NR_STAGES - 1; i > 0; i--) {
-		if (!__should_stall(i)) {
-			stages[i] = (struct stage) {
-				.instruction = stages[i - 1].instruction,
-				.__pc = stages[i - 1].__pc,
-				.nr_stalls = stages[i].nr_stalls,
+		if (!__should_stall(m, i)) {
+			m->stages[i] = (struct stage) {
+				.instruction = m->stages[i - 1].instruction,
+				.__pc = m->stages[i - 1].__pc,
+				.nr_stalls = m->stages[i].nr_stalls,
 			};
 		} else {
-			stages[i] = (struct stage) { /* Inject noop */
+			m->stages[i] = (struct stage) { /* Inject noop */
 				.instruction = { 0 },
 				.__pc = 0,
-				.nr_stalls = stages[i].nr_stalls,
+				.nr_stalls = m->stages[i].nr_stalls,
 			};
 			break;
 		}
@@ -359,32 +979,41 @@ static bool __run_cycle(void)
 	 * the reverse order** so that the output of an stage is processed by the
 	 * next stage properly.
 	 */
-	WB_stage(&mem_wb);
+	WB_stage(m, &m->mem_wb);
+
+	if (!m->stages[MEM].nr_stalls) MEM_stage(m, &m->ex_mem, &m->mem_wb);
 
-	if (stages[MEM].nr_stalls) goto done;
-	MEM_stage(&ex_mem, &mem_wb);
+	return __finish_cycle(m);
+}
+
+/**
+ * The rest of the cycle after MEM stage
+ */
+static bool __finish_cycle(struct machine *m)
+{
+	if (m->stages[MEM].nr_stalls) goto done;
 
-	if (stages[EX].nr_stalls) goto done;
-	EX_stage(&id_ex, &ex_mem);
+	if (m->stages[EX].nr_stalls) goto done;
+	EX_stage(m, &m->id_ex, &m->ex_mem);
 
-	if (stages[ID].nr_stalls) goto done;
+	if (m->stages[ID].nr_stalls) goto done;
 	/**
 	 * Parse the machine code read from IF stage
 	 */
-	__parse_instruction(stages[ID].instruction.machine_code, &stages[ID].instruction);
-	ID_stage(&if_id, &id_ex);
+	__parse_instruction(m->stages[ID].instruction.machine_code, &m->stages[ID].instruction);
+	ID_stage(m, &m->if_id, &m->id_ex);
 
 	/**
 	 * Handle IF stage stalls. It required extra attentions X-D
 	 */
-	if (__should_stall(IF)) {
-		stages[IF] = (struct stage) { /* Inject noop */
+	if (__should_stall(m, IF)) {
+		m->stages[IF] = (struct stage) { /* Inject noop */
 			.instruction = { 0 },
 			.__pc = 0,
-			.nr_stalls = stages[IF].nr_stalls,
+			.nr_stalls = m->stages[IF].nr_stalls,
 		};
 	} else {
-		IF_stage(&if_id);
+		IF_stage(m, &m->if_id);
 	}
 
 done:
@@ -392,13 +1021,18 @@ done:
 	/**
 	 * This cycle is done. Print out the current status to check
 	 */
-	__cycles++;
-
-	__pipeline_stat();
-	if (__verbose || __cycles % __dump_interval == 0) __show_registers("all");
-	if (__verbose_memory) __dump_memory(0x0, 16);
+	m->cycles++;
+	if (__is_instruction(m, WB)) __count_retired(m);
+	if (m->profile) __profile_cycle(m);
+
+	if (m->trace) {
+		__pipeline_stat(m);
+		if (m->verbose || m->cycles % __dump_interval == 0) __show_registers(m, "all");
+		if (m->verbose_memory) __dump_memory(m, 0x0, 16);
+	}
 
-	return __is_program_finished();
+	if (m->memory.fault.type != GUEST_FAULT_NONE) return false;
+	return __is_program_finished(m);
 }
 
 
@@ -410,21 +1044,50 @@ done:
  *   the framework runs to the end of the program, until @__run_cycle()
  *   returns false. When @nr_cycles is non-zero, it runs up to @nr_cycles.
  *
+ *   With the flat memory, MEM stage accesses it without any check. When
+ *   the access faults, the SIGSEGV handler comes back here, and MEM stage
+ *   is done again on the paged memory to finish the cycle as usual. The
+ *   flat memory is left alone while the MMU is on, and the hit rate of the
+ *   TLB is reported at the end.
+ *
  * RETURN
  *   0
+ *   -EFAULT if an instruction has faulted on the memory. @memory.fault tells
+ *   how.
  */
-static int __run_program(unsigned int nr_cycles)
+int __run_program(struct machine *m, unsigned int nr_cycles)
 {
-	unsigned int cycles = 0;
+	const struct guest_fault *fault = &m->memory.fault;
+	volatile unsigned int cycles = 0;
+	volatile bool running = true;
+	sigjmp_buf catch;
+
+	m->memory.fault.type = GUEST_FAULT_NONE;
+	if (m->memory.flat && !m->mmu.enabled) {
+		if (sigsetjmp(catch, 1)) {
+			guest_catch(&m->memory, NULL);
+			MEM_stage(m, &m->ex_mem, &m->mem_wb);
+			running = __finish_cycle(m);
+			if (running) cycles++;
+		}
+		guest_catch(&m->memory, &catch);
+	}
 
-	while (nr_cycles == 0 || (cycles < nr_cycles)) {
-		if (!__run_cycle()) break;
+	while (running && (nr_cycles == 0 || (cycles < nr_cycles))) {
+		if (!__run_cycle(m)) break;
 		cycles++;
 	}
+	guest_catch(&m->memory, NULL);
 
 	if (nr_cycles && cycles == nr_cycles) {
 		fprintf(stderr, "MAXIMUM CYCLES REACHED\n");
 	}
+	if (m->mmu.enabled) __report_mmu(m);
+	if (fault->type != GUEST_FAULT_NONE) {
+		fprintf(stderr, "%s at 0x%08x by the instruction at 0x%08x\n",
+				guest_fault_name(fault->type), fault->addr, fault->pc);
+		return -EFAULT;
+	}
 	return 0;
 }
 
@@ -450,79 +1113,359 @@ static int __run_program(unsigned int nr_cycles)
  *	 0 on successfully load the program
  *	 any other value otherwise
  */
-static int __load_program(char * const filename)
+int __load_program(struct machine *m, char * const filename)
 {
 	char buffer[80];
 	unsigned int addr = INITIAL_PC;
 	unsigned int nr_instructions = 0;
 	FILE *file = fopen(filename, "r");
 
-	printf("- Loading %s...\n", filename);
+	if (m->trace) printf("- Loading %s...\n", filename);
 
 	if (!file) {
-		printf("File %s does not exist\n", filename);
+		if (m->trace) printf("File %s does not exist\n", filename);
 		return -EINVAL;
 	}
 
 	while (fgets(buffer, sizeof(buffer), file)) {
 		unsigned int instr = strtoimax(buffer, NULL, 0);
 
-		if (__verbose) {
+		if (m->trace && m->verbose) {
 			struct instruction in;
 			__parse_instruction(instr, &in);
 			printf("  %3d: 0x%08x  %s\n", nr_instructions, instr, in.name);
 		}
 
-		memory[addr++] = (unsigned char)((instr & 0xff000000) >> 24);
-        memory[addr++] = (unsigned char)((instr & 0x00ff0000) >> 16);
-        memory[addr++] = (unsigned char)((instr & 0x0000ff00) >>  8);
-        memory[addr++] = (unsigned char)((instr & 0x000000ff) >>  0);
+		if (guest_poke(&m->memory, addr, (unsigned char []){
+				instr >> 24, instr >> 16, instr >> 8, instr }, 4)) {
+			fclose(file);
+			return -ENOMEM;
+		}
+		addr += 4;
 
 		nr_instructions++;
 	}
 	fclose(file);
-	if (__verbose) printf("\n");
+	if (!m->trace) return 0;
 
+	if (m->verbose) printf("\n");
 	printf("- %d instruction%s loaded\n", nr_instructions,
 			nr_instructions < 2 ? "" : "s");
 	printf("\n");
 	return 0;
 }
 
+
+/**
+ * Everything below is the command-line interface, which is left out of
+ * libpipesim.a. The commands drive @machine.
+ */
+#ifndef PIPESIM_LIBRARY
+static struct machine *machine = NULL;
+static bool __auto_run = false;
+
+/**
+ * @__run_program() sampled by the host timer @__sample_hz times a second, or
+ * not sampled if 0. A sample is the PC of the instruction in each stage, and
+ * 0 for a bubble. See sample.h
+ */
+static unsigned int __sample_hz = 0;
+
+/* The file the instruction mix is written to in JSON after each run, or NULL */
+static const char *__stats_file = NULL;
+
+#define NR_TOP_SAMPLES	20	/* Sampled instructions to report */
+
+struct stage_samples {
+	unsigned int pc;
+	unsigned long counts[NR_STAGES];
+	unsigned long total;
+};
+
+static int __compare_keys(const void *a, const void *b)
+{
+	uint64_t ka = *(const uint64_t *)a, kb = *(const uint64_t *)b;
+
+	return (ka > kb) - (ka < kb);
+}
+
+static int __compare_stage_samples(const void *a, const void *b)
+{
+	const struct stage_samples *sa = a, *sb = b;
+
+	return (sa->total < sb->total) - (sa->total > sb->total);
+}
+
+/* Print the instructions sampled most, and how often they are in each stage */
+static void __report_samples(struct sampler *sampler)
+{
+	unsigned long nr_samples = 0, nr_keys = 0, busy[NR_STAGES] = { 0 };
+	unsigned long max_keys = (sampler->head - sampler->tail) * NR_STAGES + 1;
+	uint64_t *keys = malloc(sizeof(*keys) * max_keys);
+	struct stage_samples *pcs = malloc(sizeof(*pcs) * max_keys);
+	unsigned int sample[NR_STAGES];
+	unsigned int nr_pcs = 0;
+
+	if (!keys || !pcs) {
+		fprintf(stderr, "sample: %s\n", strerror(ENOMEM));
+		goto out;
+	}
+	while (sampler_read(sampler, sample)) {
+		for (int i = 0; i < NR_STAGES; i++) {
+			if (!sample[i]) continue;
+			busy[i]++;
+			keys[nr_keys++] = ((uint64_t)sample[i] << 3) | i;
+		}
+		nr_samples++;
+	}
+	qsort(keys, nr_keys, sizeof(*keys), __compare_keys);
+	for (unsigned long k = 0; k < nr_keys; k++) {
+		unsigned int pc = keys[k] >> 3;
+
+		if (!nr_pcs || pcs[nr_pcs - 1].pc != pc) {
+			pcs[nr_pcs++] = (struct stage_samples) { .pc = pc, };
+		}
+		pcs[nr_pcs - 1].counts[keys[k] & 0x7]++;
+		pcs[nr_pcs - 1].total++;
+	}
+	qsort(pcs, nr_pcs, sizeof(*pcs), __compare_stage_samples);
+
+	fprintf(stderr, "sample: %lu samples at %u Hz, %lu dropped\n",
+			nr_samples, sampler->hz, sampler->nr_dropped);
+	if (!nr_samples) goto out;
+
+	fprintf(stderr, "sample: %-40s", "busy");
+	for (int i = 0; i < NR_STAGES; i++) {
+		fprintf(stderr, " %3s %5.1f%%", stage_name[i], 100.0 * busy[i] / nr_samples);
+	}
+	fprintf(stderr, "\n");
+	for (unsigned int p = 0; p < nr_pcs && p < NR_TOP_SAMPLES; p++) {
+		unsigned char bytes[4];
+		char text[48];
+
+		guest_peek(&machine->memory, pcs[p].pc, bytes, sizeof(bytes));
+		__disassemble((bytes[0] << 24) | (bytes[1] << 16) | (bytes[2] << 8) | bytes[3],
+				pcs[p].pc, text, sizeof(text));
+		fprintf(stderr, "sample: 0x%08x  %-28s", pcs[p].pc, text);
+		for (int i = 0; i < NR_STAGES; i++) {
+			fprintf(stderr, " %3s %5.1f%%", stage_name[i], 100.0 * pcs[p].counts[i] / nr_samples);
+		}
+		fprintf(stderr, "\n");
+	}
+out:
+	free(keys);
+	free(pcs);
+}
+
+/* --host-counters counts the host around @__run_program(). See counters.h */
+#define HOST_COUNTERS_OPTION	0x100
+static struct host_counters __host_counters = { .leader = -1 };
+
+/* Instructions retired so far, as counted in the stats */
+static unsigned long __nr_retired(void)
+{
+	unsigned long nr_retired = 0;
+
+	for (int i = 0; i < 64; i++) {
+		nr_retired += machine->stats.nr_opcodes[i];
+	}
+	return nr_retired;
+}
+
+/* Run @machine by @__run_program(), with the host counters if opened */
+static int __run_counted(unsigned int nr_cycles)
+{
+	unsigned long nr_retired = __nr_retired();
+	int ret;
+
+	host_counters_start(&__host_counters);
+	ret = __run_program(machine, nr_cycles);
+	host_counters_stop(&__host_counters);
+	host_counters_report(&__host_counters, __nr_retired() - nr_retired);
+	return ret;
+}
+
+/* Run @machine by @__run_program(), sampled if @__sample_hz is set */
+static int __run_sampled(unsigned int nr_cycles)
+{
+	struct sampler sampler = { 0 };
+	const volatile unsigned int *words[NR_STAGES];
+	int ret;
+
+	if (!__sample_hz) return __run_counted(nr_cycles);
+
+	for (int i = 0; i < NR_STAGES; i++) {
+		words[i] = &machine->stages[i].__pc;
+	}
+	ret = sampler_start(&sampler, __sample_hz, words, NR_STAGES);
+	if (ret) {
+		fprintf(stderr, "sample: %s\n", strerror(-ret));
+		sampler_release(&sampler);
+		return __run_counted(nr_cycles);
+	}
+	ret = __run_counted(nr_cycles);
+	sampler_stop(&sampler);
+
+	__report_samples(&sampler);
+	sampler_release(&sampler);
+	return ret;
+}
+
 static void __process_command(int argc, char *argv[])
 {
 	if (argc == 0) return;
 
 	if (strmatch(argv[0], "run") || strmatch(argv[0], "r")) {
 		if (argc == 1) {
-			__run_program(0);
+			__run_sampled(0);
 		} else if (argc == 2) {
-			__run_program(atoi(argv[1]));
+			__run_sampled(atoi(argv[1]));
 		} else {
 			printf("Usage: run [cycles to run]\n");
 		}
+		if (argc <= 2 && __stats_file) machine_write_stats(machine, __stats_file);
 	} else if (strmatch(argv[0], "show")) {
 		if (argc == 1) {
-			__show_registers("all");
+			__show_registers(machine, "all");
 		} else if (argc == 2) {
-			__show_registers(argv[1]);
+			__show_registers(machine, argv[1]);
 		} else {
 			printf("Usage: show { [register name] }\n");
 		}
 	} else if (strmatch(argv[0], "dump")) {
 		if (argc == 3) {
-			__dump_memory(strtoimax(argv[1], NULL, 0), strtoimax(argv[2], NULL, 0));
+			__dump_memory(machine, strtoimax(argv[1], NULL, 0), strtoimax(argv[2], NULL, 0));
 		} else {
 			printf("Usage: dump [start address] [length]\n");
 		}
 	} else if (strmatch(argv[0], "pipe")) {
-		__pipeline_stat();
+		__pipeline_stat(machine);
 	} else if (strmatch(argv[0], "reset")) {
-		__cycles = 0;
-		pc = INITIAL_PC;
+		machine->cycles = 0;
+		machine->pc = INITIAL_PC;
 	} else if (strmatch(argv[0], "next") || strmatch(argv[0], "n")) {
-		__run_cycle();
+		__run_cycle(machine);
+	} else if (strmatch(argv[0], "snapshot")) {
+		if (machine_snapshot(machine)) fprintf(stderr, "snapshot: %s\n", strerror(ENOMEM));
+	} else if (strmatch(argv[0], "restore")) {
+		int ret = machine_restore(machine);
+
+		if (ret == -ENOENT) {
+			printf("No snapshot is taken\n");
+		} else if (ret) {
+			fprintf(stderr, "restore: %s\n", strerror(-ret));
+		}
+	} else if (strmatch(argv[0], "checkpoint")) {
+		if (argc == 2) {
+			int ret = machine_checkpoint(machine, argv[1]);
+
+			if (ret) fprintf(stderr, "checkpoint: %s\n", strerror(-ret));
+		} else {
+			printf("Usage: checkpoint [file]\n");
+		}
+	} else if (strmatch(argv[0], "resume")) {
+		if (argc == 2) {
+			int ret = machine_resume(machine, argv[1]);
+
+			if (ret) fprintf(stderr, "resume: %s: %s\n", argv[1], strerror(-ret));
+		} else {
+			printf("Usage: resume [file]\n");
+		}
+	} else if (strmatch(argv[0], "mmu")) {
+		if (argc == 2 && strmatch(argv[1], "off")) {
+			guest_mmu_set(&machine->mmu, false, 0);
+		} else if (argc == 2) {
+			guest_mmu_set(&machine->mmu, true, strtoimax(argv[1], NULL, 0));
+		} else if (argc != 1) {
+			printf("Usage: mmu { [page directory address] | off }\n");
+		}
+		__report_mmu(machine);
+	} else if (strmatch(argv[0], "memory")) {
+		int ret = 0;
+
+		if (argc == 2 && strmatch(argv[1], "paged")) {
+			ret = machine_set_memory(machine, false, false);
+		} else if ((argc == 2 || argc == 3) && strmatch(argv[1], "flat")) {
+			ret = machine_set_memory(machine, true, argc == 3 && strmatch(argv[2], "huge"));
+		} else if (argc != 1) {
+			printf("Usage: memory { paged | flat [huge] }\n");
+		}
+		if (ret) fprintf(stderr, "memory: %s\n", strerror(-ret));
+		fprintf(stderr, "memory: %s, %lu pages, %u dirty\n", machine->memory.flat ? "flat" : "paged",
+				machine->memory.nr_pages, machine->memory.nr_dirty);
+	} else if (strmatch(argv[0], "map")) {
+		if (argc == 3 || (argc == 4 && (strmatch(argv[3], "ro") || strmatch(argv[3], "rw")))) {
+			int ret = guest_map(&machine->memory, argv[1], strtoimax(argv[2], NULL, 0),
+					argc == 4 && strmatch(argv[3], "rw"));
+
+			if (ret) fprintf(stderr, "map: %s: %s\n", argv[1], strerror(-ret));
+		} else {
+			printf("Usage: map [file] [address] { ro | rw }\n");
+		}
+	} else if (strmatch(argv[0], "sample")) {
+		if (argc == 2 && strmatch(argv[1], "off")) {
+			__sample_hz = 0;
+		} else if (argc == 2 && strtoimax(argv[1], NULL, 0) > 0 &&
+				strtoimax(argv[1], NULL, 0) <= MAX_SAMPLE_HZ) {
+			__sample_hz = strtoimax(argv[1], NULL, 0);
+		} else if (argc != 1) {
+			printf("Usage: sample { [hz] | off }\n");
+		}
+		if (__sample_hz) {
+			fprintf(stderr, "sample: %u Hz\n", __sample_hz);
+		} else {
+			fprintf(stderr, "sample: off\n");
+		}
+	} else if (strmatch(argv[0], "stats")) {
+		if (argc == 2 && strmatch(argv[1], "reset")) {
+			memset(&machine->stats, 0x00, sizeof(machine->stats));
+		} else if (argc <= 2) {
+			machine_write_stats(machine, argc == 2 ? argv[1] : NULL);
+		} else {
+			printf("Usage: stats { [file] | reset }\n");
+		}
+	} else if (strmatch(argv[0], "profile")) {
+		if (argc == 2 && strmatch(argv[1], "on")) {
+			int ret = machine_profile(machine, true);
+
+			if (ret) fprintf(stderr, "profile: %s\n", strerror(-ret));
+		} else if (argc == 2 && strmatch(argv[1], "off")) {
+			machine_report_profile(machine);
+			machine_profile(machine, false);
+		} else if (argc == 1 && machine->profile) {
+			machine_report_profile(machine);
+		} else if (argc == 1) {
+			printf("Not profiling\n");
+		} else {
+			printf("Usage: profile { on | off }\n");
+		}
 	}
+
+	/* Write back what the command has stored to the files mapped writable */
+	if (guest_sync(&machine->memory)) fprintf(stderr, "map: %s\n", strerror(ENOMEM));
+}
+
+/* -M [file]:[address][:ro|rw] maps the file as the map command does */
+static int __map_option(char *option)
+{
+	char *colon = strrchr(option, ':');
+	bool writable = false;
+	int ret;
+
+	if (colon && (strmatch(colon + 1, "ro") || strmatch(colon + 1, "rw"))) {
+		writable = strmatch(colon + 1, "rw");
+		*colon = '\0';
+		colon = strrchr(option, ':');
+	}
+	if (!colon) {
+		fprintf(stderr, "Usage: -M [file]:[address][:ro|rw]\n");
+		return -EINVAL;
+	}
+	*colon = '\0';
+
+	ret = guest_map(&machine->memory, option, strtoimax(colon + 1, NULL, 0), writable);
+	if (ret) fprintf(stderr, "map: %s: %s\n", option, strerror(-ret));
+	return ret;
 }
 
 static int __parse_command(char *command, int *nr_tokens, char *tokens[])
@@ -562,21 +1505,62 @@ int main(int argc, char * const argv[])
 	int opt;
 	char *input_file = "testcases/program-r";
 	unsigned int max_cycles = 0;
+	bool flat = false, huge = false;
+	static const struct option options[] = {
+		{ "host-counters", no_argument, NULL, HOST_COUNTERS_OPTION },
+		{ NULL, 0, NULL, 0 },
+	};
 
-	while ((opt = getopt(argc, argv, "c:vmr")) != -1) {
+	machine = machine_create();
+	if (!machine) {
+		fprintf(stderr, "Cannot allocate the machine\n");
+		return EXIT_FAILURE;
+	}
+	machine->trace = true;
+
+	while ((opt = getopt_long(argc, argv, "c:vmrfhpS:J:M:", options, NULL)) != -1) {
 		switch (opt) {
+		case HOST_COUNTERS_OPTION:
+			opt = host_counters_open(&__host_counters);
+			if (opt) fprintf(stderr, "host: counters unavailable, %s\n", strerror(-opt));
+			break;
 		case 'c':
 			max_cycles = atol(optarg);
 			break;
 		case 'v':
-			__verbose = true;
+			machine->verbose = true;
 			break;
 		case 'm':
-			__verbose_memory = true;
+			machine->verbose_memory = true;
 			break;
 		case 'r':
 			__auto_run = true;
 			break;
+		case 'h':
+			huge = true;
+			/* fall through */
+		case 'f':
+			flat = true;
+			break;
+		case 'M':
+			if (__map_option(optarg)) return EXIT_FAILURE;
+			break;
+		case 'S':
+			__sample_hz = atol(optarg);
+			if (!__sample_hz || __sample_hz > MAX_SAMPLE_HZ) {
+				fprintf(stderr, "Usage: -S [hz], up to %d\n", MAX_SAMPLE_HZ);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'J':
+			__stats_file = optarg;
+			break;
+		case 'p':
+			if (machine_profile(machine, true)) {
+				fprintf(stderr, "Cannot allocate the profile\n");
+				return EXIT_FAILURE;
+			}
+			break;
 		}
 	}
 
@@ -590,15 +1574,24 @@ int main(int argc, char * const argv[])
 		input_file = argv[optind];
 	}
 
-	if (__load_program(input_file)) {
+	if (flat && machine_set_memory(machine, true, huge)) {
+		fprintf(stderr, "Cannot reserve the flat memory\n");
+		return EXIT_FAILURE;
+	}
+
+	if (__load_program(machine, input_file)) {
 		return EXIT_FAILURE;
 	}
 
 	if (__auto_run) {
-		__run_program(max_cycles);
-		if (!__verbose && __cycles % __dump_interval != 0) {
-			__show_registers("all");
+		__run_sampled(max_cycles);
+		if (!machine->verbose && machine->cycles % __dump_interval != 0) {
+			__show_registers(machine, "all");
 		}
+		machine_report_profile(machine);
+		if (__stats_file) machine_write_stats(machine, __stats_file);
+		host_counters_close(&__host_counters);
+		machine_destroy(machine);
 		return EXIT_SUCCESS;
 	}
 
@@ -623,5 +1616,11 @@ int main(int argc, char * const argv[])
 		printf(">> ");
 	}
 
+	machine_report_profile(machine);
+	host_counters_close(&__host_counters);
+
+	/* Let the checkpoint being written finish */
+	machine_destroy(machine);
 	return EXIT_SUCCESS;
 }
+#endif
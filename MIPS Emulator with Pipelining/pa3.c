@@ -15,27 +15,7 @@
 
 #include <stdio.h>
 #include <stdint.h>
-#include "types.h"
-
-/***
- * External entities in other files.
- */
-extern struct stage stages[];		/* Pipelining stages */
-
-extern unsigned char memory[];		/* Memory */
-
-extern unsigned int registers[];	/* Registers */
-
-extern unsigned int pc;				/* Program counter */
-
-/**
- * Helper functions that might be useful. See main.c for the details of them
- */
-extern bool is_noop(int stage);
-extern void make_stall(int stage, int cycles);
-
-unsigned int opcode__;
-unsigned int types__;
+#include "machine.h"
 
 /**********************************************************************
  * List of instructions that should be supported
@@ -64,7 +44,7 @@ unsigned int types__;
  * | `jal`  | j-format | 0x03                    |
  */
 
-void IF_stage(struct IF_ID *if_id)
+void IF_stage(struct machine *m, struct IF_ID *if_id)
 {
     /***
      * No need to check whether this stage is idle or not for some reasons...
@@ -73,12 +53,9 @@ void IF_stage(struct IF_ID *if_id)
     /* TODO: Read one instruction in machine code from the memory */
     unsigned int machine_code = 0x0;
 
-    machine_code |= memory[pc] << 24;    // 첫 번째 바이트 (가장 높은 주소)
-    machine_code |= memory[pc + 1] << 16; // 두 번째 바이트
-    machine_code |= memory[pc + 2] << 8;  // 세 번째 바이트
-    machine_code |= memory[pc + 3];       // 네 번째 바이트 (가장 낮은 주소)
+    if (!fetch_word(m, m->pc, &machine_code)) machine_code = 0x0; // 실행 권한이 없으면 nop
 
-    printf("machine_code: %x\n", machine_code);
+    if (m->trace) printf("machine_code: %x\n", machine_code);
 
     /***
      * Set @stages[IF].instruction.machine_code with the read machine code
@@ -86,14 +63,14 @@ void IF_stage(struct IF_ID *if_id)
      * DO NOT REMOVE THOSE TWO STATEMENTS, as they are required by the
      * framework to work correctly.
      */
-    stages[IF].instruction.machine_code = machine_code;
-    stages[IF].__pc = pc;
+    m->stages[IF].instruction.machine_code = machine_code;
+    m->stages[IF].__pc = m->pc;
 
     /* TODO: Fill in IF-ID interstage register */
 
     if_id -> instruction = machine_code;
-    if_id -> next_pc = pc;
-    pc += 4;
+    if_id -> next_pc = m->pc;
+    m->pc += 4;
 
     /***
      * The framework processes @stage[IF].instruction.machine_code under
@@ -103,11 +80,11 @@ void IF_stage(struct IF_ID *if_id)
 }
 
 
-void ID_stage(struct IF_ID *if_id, struct ID_EX *id_ex)
+void ID_stage(struct machine *m, struct IF_ID *if_id, struct ID_EX *id_ex)
 {
-    struct instruction *instr = &stages[ID].instruction;
+    struct instruction *instr = &m->stages[ID].instruction;
 
-    if (is_noop(ID)) return;
+    if (is_noop(m, ID)) return;
 
     /***
      * Register write should be taken place in WB_stage,
@@ -118,11 +95,11 @@ void ID_stage(struct IF_ID *if_id, struct ID_EX *id_ex)
 
     instr->machine_code = if_id -> instruction;
     instr->opcode = (instr->machine_code >> 26) & 0x3f;
-    opcode__ = instr->opcode;
+    m->opcode__ = instr->opcode;
 
     if(instr->opcode == 0){
         instr->type = r_type;
-        types__ = r_type;
+        m->types__ = r_type;
         instr->r_type.rs = (instr->machine_code >> 21) & 0x1f;
         instr->r_type.rt = (instr->machine_code >> 16) & 0x1f;
         instr->r_type.rd = (instr->machine_code >> 11) & 0x1f;
@@ -139,12 +116,12 @@ void ID_stage(struct IF_ID *if_id, struct ID_EX *id_ex)
     }
     else if(instr->opcode == 0x02 || instr->opcode == 0x03){
         instr->type = j_type;
-        types__ = j_type;
+        m->types__ = j_type;
         instr->j_type.target = instr->machine_code & 0x3ffffff;
     }
     else{
         instr->type = i_type;
-        types__ = i_type;
+        m->types__ = i_type;
         instr->i_type.rs = (instr->machine_code >> 21) & 0x1f;
         instr->i_type.rt = (instr->machine_code >> 16) & 0x1f;
         instr->i_type.imm = instr->machine_code & 0xffff;
@@ -158,19 +135,19 @@ void ID_stage(struct IF_ID *if_id, struct ID_EX *id_ex)
 
 }
 
-void EX_stage(struct ID_EX *id_ex, struct EX_MEM *ex_mem)
+void EX_stage(struct machine *m, struct ID_EX *id_ex, struct EX_MEM *ex_mem)
 {
-    struct instruction *instr = &stages[EX].instruction;
+    struct instruction *instr = &m->stages[EX].instruction;
 //    struct instruction *ID_instr = &stages[ID].instruction;
 //
 //    printf("type : %d\n", ID_instr->type);
 //
 //    printf("types: %d\n", types);
 
-    if (is_noop(EX)) return;
+    if (is_noop(m, EX)) return;
 
     /* TODO: Good luck! */
-    if (types__ == r_type){
+    if (m->types__ == r_type){
         instr->r_type.rs = id_ex -> reg1_value;
         instr->r_type.rt = id_ex -> reg2_value;
         instr->r_type.rd = id_ex -> instr_20_16;
@@ -179,29 +156,29 @@ void EX_stage(struct ID_EX *id_ex, struct EX_MEM *ex_mem)
 
         switch (instr->r_type.funct) {
             case 0b100000:
-                ex_mem -> alu_out = registers[instr->r_type.rs] + registers[instr->r_type.rt];
+                ex_mem -> alu_out = m->registers[instr->r_type.rs] + m->registers[instr->r_type.rt];
                 break;
             case 0b100010:
-                ex_mem -> alu_out = registers[instr->r_type.rs] - registers[instr->r_type.rt];
+                ex_mem -> alu_out = m->registers[instr->r_type.rs] - m->registers[instr->r_type.rt];
                 break;
             case 0b100100:
-                ex_mem -> alu_out = registers[instr->r_type.rs] & registers[instr->r_type.rt];
+                ex_mem -> alu_out = m->registers[instr->r_type.rs] & m->registers[instr->r_type.rt];
                 break;
             case 0b100101:
-                ex_mem -> alu_out = registers[instr->r_type.rs] | registers[instr->r_type.rt];
+                ex_mem -> alu_out = m->registers[instr->r_type.rs] | m->registers[instr->r_type.rt];
                 break;
             case 0b100111:
-                ex_mem -> alu_out = ~(registers[instr->r_type.rs] | registers[instr->r_type.rt]);
+                ex_mem -> alu_out = ~(m->registers[instr->r_type.rs] | m->registers[instr->r_type.rt]);
                 break;
             case 0b000000:
-                ex_mem -> alu_out = registers[instr->r_type.rt] << instr->r_type.shamt;
+                ex_mem -> alu_out = m->registers[instr->r_type.rt] << instr->r_type.shamt;
                 break;
             case 0b000010:
-                ex_mem -> alu_out = registers[instr->r_type.rt] >> instr->r_type.shamt;
+                ex_mem -> alu_out = m->registers[instr->r_type.rt] >> instr->r_type.shamt;
                 break;
             case 0b000011: { // sra
-                int sig = (registers[instr->r_type.rt] >> 31) & 0x1;
-                int temp = registers[instr->r_type.rt] >> instr->r_type.shamt;
+                int sig = (m->registers[instr->r_type.rt] >> 31) & 0x1;
+                int temp = m->registers[instr->r_type.rt] >> instr->r_type.shamt;
 
                 int mask = 0;
 
@@ -211,43 +188,43 @@ void EX_stage(struct ID_EX *id_ex, struct EX_MEM *ex_mem)
                     ex_mem -> alu_out = temp | mask;
                 }
                 else{
-                    ex_mem -> alu_out = registers[instr->r_type.rt] >> instr->r_type.shamt;
+                    ex_mem -> alu_out = m->registers[instr->r_type.rt] >> instr->r_type.shamt;
                 }
                 break;
             }
             case 0b101010:
-                ex_mem -> alu_out = ((int) registers[instr->r_type.rs] < (int) registers[instr->r_type.rt] ? 1 : 0);
+                ex_mem -> alu_out = ((int) m->registers[instr->r_type.rs] < (int) m->registers[instr->r_type.rt] ? 1 : 0);
                 break;
         }
         ex_mem -> write_reg = instr->r_type.rd;
     }
-    else if(types__ == i_type){
+    else if(m->types__ == i_type){
         instr->i_type.rs = id_ex -> reg1_value;
         instr->i_type.rt = id_ex -> reg2_value;
         instr->i_type.imm = id_ex -> immediate;
 
-        switch (opcode__) {
+        switch (m->opcode__) {
             case 0b001000:
-                ex_mem -> alu_out = registers[instr->i_type.rs] + (int)instr->i_type.imm;
+                ex_mem -> alu_out = m->registers[instr->i_type.rs] + (int)instr->i_type.imm;
                 ex_mem -> write_reg = instr->i_type.rt;
                 break;
             case 0b001100:
-                ex_mem -> alu_out = registers[instr->i_type.rs] & (int)instr->i_type.imm;
+                ex_mem -> alu_out = m->registers[instr->i_type.rs] & (int)instr->i_type.imm;
                 ex_mem -> write_reg = instr->i_type.rt;
                 break;
             case 0b001101:
-                ex_mem -> alu_out = registers[instr->i_type.rs] | (int)instr->i_type.imm;
+                ex_mem -> alu_out = m->registers[instr->i_type.rs] | (int)instr->i_type.imm;
                 ex_mem -> write_reg = instr->i_type.rt;
                 break;
             case 0b001010:
-                ex_mem -> alu_out = (registers[instr->i_type.rs] < (int)instr->i_type.imm ? 1 : 0);
+                ex_mem -> alu_out = (m->registers[instr->i_type.rs] < (int)instr->i_type.imm ? 1 : 0);
                 ex_mem -> write_reg = instr->i_type.rt;
                 break;
             case 0b101011: // sw
-                ex_mem->alu_out = registers[id_ex->reg1_value] + (int)id_ex->immediate;
+                ex_mem->alu_out = m->registers[id_ex->reg1_value] + (int)id_ex->immediate;
                 break;
             case 0b100011: // lw
-                ex_mem->alu_out = registers[id_ex->reg1_value] + (int)id_ex->immediate;
+                ex_mem->alu_out = m->registers[id_ex->reg1_value] + (int)id_ex->immediate;
                 ex_mem->write_reg = id_ex->reg2_value;
                 break;
         }
@@ -256,27 +233,23 @@ void EX_stage(struct ID_EX *id_ex, struct EX_MEM *ex_mem)
 }
 
 
-void MEM_stage(struct EX_MEM *ex_mem, struct MEM_WB *mem_wb)
+void MEM_stage(struct machine *m, struct EX_MEM *ex_mem, struct MEM_WB *mem_wb)
 {
-    struct instruction *instr = &stages[MEM].instruction;
-    if (is_noop(MEM)) return;
+    struct instruction *instr = &m->stages[MEM].instruction;
+    if (is_noop(m, MEM)) return;
 
 
-    if(opcode__ == 0b100011){ //lw
+    if(m->opcode__ == 0b100011){ //lw
         int address = ex_mem -> alu_out;
         unsigned int word = 0;
-        for (int i=0; i<4; i++){
-            word = (word << 8) | memory[address + i];
-        }
+        load_word(m, m->stages[MEM].__pc, address, &word);
         mem_wb -> mem_out = word;
         mem_wb -> write_reg = ex_mem -> write_reg;
     }
-    else if(opcode__ == 0b101011){ //sw
+    else if(m->opcode__ == 0b101011){ //sw
         unsigned int address = ex_mem->alu_out;
         unsigned int word = ex_mem->write_value;
-        for (int i = 0; i < 4; i++) {
-            memory[address + i] = (word >> (24 - 8 * i)) & 0xFF;
-        }
+        store_word(m, m->stages[MEM].__pc, address, word);
     }
     else{
         mem_wb -> alu_out = ex_mem -> alu_out;
@@ -285,19 +258,19 @@ void MEM_stage(struct EX_MEM *ex_mem, struct MEM_WB *mem_wb)
 }
 
 
-void WB_stage(struct MEM_WB *mem_wb)
+void WB_stage(struct machine *m, struct MEM_WB *mem_wb)
 {
-    struct instruction *instr = &stages[WB].instruction;
+    struct instruction *instr = &m->stages[WB].instruction;
 
 
-    if (is_noop(WB)) return;
+    if (is_noop(m, WB)) return;
 
     /* TODO: Fingers crossed */
 
-    if (opcode__ == 0b100011){ //lw
-        registers[mem_wb->write_reg] = mem_wb->mem_out;
+    if (m->opcode__ == 0b100011){ //lw
+        m->registers[mem_wb->write_reg] = mem_wb->mem_out;
     }
     else{
-        registers[mem_wb->write_reg] = mem_wb->alu_out;
+        m->registers[mem_wb->write_reg] = mem_wb->alu_out;
     }
 }
@@ -0,0 +1,316 @@
+/**********************************************************************
+ * Copyright (c) 2019-2023
+ *  Sang-Hoon Kim <sanghoonkim@ajou.ac.kr>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTIABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ **********************************************************************/
+
+/**
+ * Ahead-of-time translation of the loaded program into C. The output defines
+ * @aot_image[] and @aot_run() declared in aot.h, and builds into a native
+ * program with the runtime in aot_runtime.c;
+ *
+ *   >> aot program-basic basic.aot.c
+ *   $ make basic.native
+ *
+ * The control-flow graph is recovered from the branches and jumps, and each
+ * basic block becomes a labelled block in @aot_run(). The blocks live in a
+ * single function so that the guest registers stay in locals, which the host
+ * compiler keeps in host registers across the blocks. jr goes through a
+ * switch over the block leaders. Anything the translation does not cover
+ * (jumps out of the program or into the middle of a block, memory accesses
+ * out of the memory, and stores into the program) returns to the runtime.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+
+#include "machine.h"
+
+
+static inline unsigned int aot_word(const struct machine *m, unsigned int addr)
+{
+	unsigned char bytes[4];
+
+	guest_peek(&m->memory, addr, bytes, sizeof(bytes));
+	return (bytes[0] << 24) | (bytes[1] << 16) | (bytes[2] << 8) | bytes[3];
+}
+
+static inline bool aot_in_program(const struct machine *m, unsigned int addr)
+{
+	return addr - INITIAL_PC < m->nr_decoded * 4 && !(addr & 0x3);
+}
+
+/**
+ * Destination of a branch or a jump @di at @addr
+ */
+static unsigned int aot_target(const struct decoded_instruction *di, unsigned int addr)
+{
+	if (di->op == OP_J || di->op == OP_JAL) {
+		return ((addr + 4) & 0xf0000000) | (di->imm << 2);
+	}
+	return addr + 4 + ((int16_t)di->imm << 2);
+}
+
+
+/**********************************************************************
+ * aot_find_leaders
+ *
+ * DESCRIPTION
+ *   Mark the first instructions of the basic blocks in @leaders[]. A block
+ *   starts at the entry, at the destinations of branches and jumps, and
+ *   right after them. The ones after jal are the return addresses of jr.
+ */
+static void aot_find_leaders(const struct machine *m, const struct decoded_instruction *program,
+		bool *leaders)
+{
+	leaders[0] = true;
+
+	for (unsigned int i = 0; i < m->nr_decoded; i++) {
+		const struct decoded_instruction *di = program + i;
+		unsigned int addr = INITIAL_PC + i * 4;
+
+		switch (di->op) {
+		case OP_BEQ:
+		case OP_BNE:
+		case OP_J:
+		case OP_JAL: {
+			unsigned int target = aot_target(di, addr);
+
+			if (aot_in_program(m, target)) leaders[(target - INITIAL_PC) / 4] = true;
+		}
+			/* fall through */
+		case OP_JR:
+		case OP_HALT:
+			if (i + 1 < m->nr_decoded) leaders[i + 1] = true;
+			break;
+		}
+	}
+}
+
+
+/**
+ * Continue at @target, which is a block leader if it is in the program
+ */
+static void aot_emit_goto(const struct machine *m, FILE *fp, const char *indent, unsigned int target)
+{
+	if (aot_in_program(m, target)) {
+		fprintf(fp, "%sgoto L_%08x;\n", indent, target);
+	} else {
+		fprintf(fp, "%s{ pc = 0x%08x; goto interpret; }\n", indent, target);
+	}
+}
+
+/**
+ * Compute the effective address of lw/sw at @addr, and let the runtime take
+ * the instruction when it falls out of the memory.
+ */
+static void aot_emit_address(FILE *fp, const struct decoded_instruction *di, unsigned int addr)
+{
+	fprintf(fp, "\taddress = r%u + 0x%xu;\n", di->rs, di->imm);
+	fprintf(fp, "\tif (address > MEMORY_SIZE - 4) { pc = 0x%08x; goto interpret; }\n", addr);
+}
+
+
+/**********************************************************************
+ * aot_emit_instruction
+ *
+ * DESCRIPTION
+ *   Write the C code for @di located at @addr.
+ */
+static void aot_emit_instruction(const struct machine *m, FILE *fp,
+		const struct decoded_instruction *di, unsigned int addr)
+{
+	unsigned int rs = di->rs, rt = di->rt, rd = di->rd;
+
+	switch (di->op) {
+	case OP_ADD:
+		fprintf(fp, "\tr%u = r%u + r%u;\n", rd, rs, rt);
+		break;
+	case OP_SUB:
+		fprintf(fp, "\tr%u = r%u - r%u;\n", rd, rs, rt);
+		break;
+	case OP_AND:
+		fprintf(fp, "\tr%u = r%u & r%u;\n", rd, rs, rt);
+		break;
+	case OP_OR:
+		fprintf(fp, "\tr%u = r%u | r%u;\n", rd, rs, rt);
+		break;
+	case OP_NOR:
+		fprintf(fp, "\tr%u = ~(r%u | r%u);\n", rd, rs, rt);
+		break;
+	case OP_SLL:
+		fprintf(fp, "\tr%u = r%u << %u;\n", rd, rt, di->shamt);
+		break;
+	case OP_SRL:
+		fprintf(fp, "\tr%u = r%u >> %u;\n", rd, rt, di->shamt);
+		break;
+	case OP_SRA:
+		fprintf(fp, "\tr%u = (int)r%u >> %u;\n", rd, rt, di->shamt);
+		break;
+	case OP_SLT:
+		fprintf(fp, "\tr%u = (int)r%u < (int)r%u;\n", rd, rs, rt);
+		break;
+	case OP_JR:
+		fprintf(fp, "\tpc = r%u;\n\tgoto dispatch;\n", rs);
+		break;
+	case OP_J:
+		aot_emit_goto(m, fp, "\t", aot_target(di, addr));
+		break;
+	case OP_JAL:
+		fprintf(fp, "\tr31 = 0x%08x;\n", addr + 4);
+		aot_emit_goto(m, fp, "\t", aot_target(di, addr));
+		break;
+	case OP_BEQ:
+	case OP_BNE:
+		fprintf(fp, "\tif (r%u %s r%u)\n", rs, di->op == OP_BEQ ? "==" : "!=", rt);
+		aot_emit_goto(m, fp, "\t\t", aot_target(di, addr));
+		break;
+	case OP_ADDI:
+		fprintf(fp, "\tr%u = r%u + %d;\n", rt, rs, (int16_t)di->imm);
+		break;
+	case OP_ANDI:
+		fprintf(fp, "\tr%u = r%u & 0x%xu;\n", rt, rs, di->imm);
+		break;
+	case OP_ORI:
+		fprintf(fp, "\tr%u = r%u | 0x%xu;\n", rt, rs, di->imm);
+		break;
+	case OP_SLTI:
+		fprintf(fp, "\tr%u = r%u < 0x%xu;\n", rt, rs, di->imm);
+		break;
+	case OP_LW:
+		aot_emit_address(fp, di, addr);
+		fprintf(fp, "\tr%u = (memory[address] << 24) | (memory[address + 1] << 16) |\n"
+				"\t\t\t(memory[address + 2] << 8) | memory[address + 3];\n", rt);
+		break;
+	case OP_SW:
+		aot_emit_address(fp, di, addr);
+		fprintf(fp, "\tmemory[address] = r%u >> 24;\n", rt);
+		fprintf(fp, "\tmemory[address + 1] = r%u >> 16;\n", rt);
+		fprintf(fp, "\tmemory[address + 2] = r%u >> 8;\n", rt);
+		fprintf(fp, "\tmemory[address + 3] = r%u;\n", rt);
+		fprintf(fp, "\tif (address + 3 >= INITIAL_PC && address < 0x%08x) {\n"
+				"\t\taot_modified = true;\n"
+				"\t\tpc = 0x%08x;\n"
+				"\t\tgoto interpret;\n"
+				"\t}\n", INITIAL_PC + m->nr_decoded * 4, addr + 4);
+		break;
+	case OP_HALT:
+		fprintf(fp, "\tpc = 0x%08x;\n\tgoto halt;\n", addr + 4);
+		break;
+	default:
+		fprintf(fp, "\t/* Unknown instruction */\n");
+		break;
+	}
+}
+
+
+/**********************************************************************
+ * aot_translate
+ *
+ * DESCRIPTION
+ *   Translate the loaded program into C, and write it to @filename.
+ *
+ * RETURN
+ *   0 on success
+ *   -ENOMEM if the program cannot be decoded
+ *   any other value otherwise
+ */
+int aot_translate(struct machine *m, const char *filename)
+{
+	struct decoded_instruction *program;
+	bool *leaders;
+	unsigned int nr_blocks = 0;
+	FILE *fp;
+
+	if (!m->nr_decoded) {
+		fprintf(stderr, "aot: no program is loaded\n");
+		return -EINVAL;
+	}
+
+	program = malloc(sizeof(*program) * m->nr_decoded);
+	leaders = calloc(m->nr_decoded, sizeof(*leaders));
+	if (!program || !leaders) {
+		fprintf(stderr, "aot: %s\n", strerror(ENOMEM));
+		free(leaders);
+		free(program);
+		return -ENOMEM;
+	}
+
+	fp = fopen(filename, "w");
+	if (!fp) {
+		fprintf(stderr, "aot: cannot open %s\n", filename);
+		free(leaders);
+		free(program);
+		return -EINVAL;
+	}
+
+	/* Decode from the memory since @decoded[] may be invalidated */
+	for (unsigned int i = 0; i < m->nr_decoded; i++) {
+		decode_instruction(aot_word(m, INITIAL_PC + i * 4), program + i);
+	}
+	aot_find_leaders(m, program, leaders);
+
+	fprintf(fp, "/* Generated by the aot command of pa2. Build with aot_runtime.c */\n\n");
+	fprintf(fp, "#include \"aot.h\"\n\n");
+
+	fprintf(fp, "const unsigned int nr_aot_image = %u;\n\n", m->nr_decoded);
+	fprintf(fp, "const unsigned int aot_image[] = {\n");
+	for (unsigned int i = 0; i < m->nr_decoded; i++) {
+		fprintf(fp, "\t0x%08x,\n", aot_word(m, INITIAL_PC + i * 4));
+	}
+	fprintf(fp, "};\n\n");
+
+	fprintf(fp, "enum aot_status aot_run(void)\n{\n");
+	for (unsigned int i = 0; i < 32; i++) {
+		fprintf(fp, "\tunsigned int r%u = registers[%u];\n", i, i);
+	}
+	fprintf(fp, "\tunsigned int address;\n");
+	fprintf(fp, "\tenum aot_status status;\n\n");
+
+	fprintf(fp, "dispatch:\n\tswitch (pc) {\n");
+	for (unsigned int i = 0; i < m->nr_decoded; i++) {
+		if (!leaders[i]) continue;
+		fprintf(fp, "\tcase 0x%08x: goto L_%08x;\n", INITIAL_PC + i * 4, INITIAL_PC + i * 4);
+	}
+	fprintf(fp, "\t}\n\tgoto interpret;\n");
+
+	for (unsigned int i = 0; i < m->nr_decoded; i++) {
+		unsigned int addr = INITIAL_PC + i * 4;
+
+		if (leaders[i]) {
+			fprintf(fp, "\nL_%08x:\n", addr);
+			nr_blocks++;
+		}
+		fprintf(fp, "\t/* 0x%08x: 0x%08x */\n", addr, aot_word(m, addr));
+		aot_emit_instruction(m, fp, program + i, addr);
+	}
+
+	fprintf(fp, "\ninterpret:\n\tstatus = AOT_INTERPRET;\n\tgoto out;\n");
+	fprintf(fp, "halt:\n\tstatus = AOT_HALT;\nout:\n");
+	for (unsigned int i = 0; i < 32; i++) {
+		fprintf(fp, "\tregisters[%u] = r%u;\n", i, i);
+	}
+	fprintf(fp, "\treturn status;\n}\n");
+
+	free(leaders);
+	free(program);
+	if (fclose(fp)) {
+		fprintf(stderr, "aot: cannot write %s\n", filename);
+		return -EIO;
+	}
+
+	fprintf(stderr, "aot: %u instructions in %u basic blocks translated to %s\n",
+			m->nr_decoded, nr_blocks, filename);
+	return 0;
+}
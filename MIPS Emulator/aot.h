@@ -0,0 +1,48 @@
+/**********************************************************************
+ * Copyright (c) 2019-2023
+ *  Sang-Hoon Kim <sanghoonkim@ajou.ac.kr>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTIABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ **********************************************************************/
+
+#ifndef __PA2_AOT_H__
+#define __PA2_AOT_H__
+
+#include "types.h"
+
+/**
+ * Interface between the C code generated by the "aot" command and the runtime
+ * in aot_runtime.c. The generated code provides the loaded image and
+ * @aot_run(), and the runtime provides the machine state and the commands.
+ */
+extern unsigned char memory[];		/* The first MEMORY_SIZE bytes of the memory */
+
+extern unsigned int registers[];	/* Registers */
+
+extern unsigned int pc;				/* Program counter */
+
+extern const unsigned int aot_image[];	/* Loaded program, including the halt */
+extern const unsigned int nr_aot_image;
+
+/**
+ * Whether the memory holds something other than @aot_image at INITIAL_PC, so
+ * that the translated code should not be used
+ */
+extern bool aot_modified;
+
+enum aot_status {
+	AOT_HALT = 0,		/* Met the halt instruction. @pc is past it */
+	AOT_INTERPRET,		/* Let the runtime interpret the instruction at @pc */
+};
+
+extern enum aot_status aot_run(void);
+
+#endif
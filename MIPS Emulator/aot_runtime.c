@@ -0,0 +1,397 @@
+/**********************************************************************
+ * Copyright (c) 2019-2023
+ *  Sang-Hoon Kim <sanghoonkim@ajou.ac.kr>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTIABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ **********************************************************************/
+
+/**
+ * Runtime of the programs translated by the "aot" command. It provides the
+ * machine state of pa2 and the same commands to drive it, so that the
+ * translated program can be run with the command files of pa2;
+ *
+ *   load	Put the translated program onto the memory (the file is ignored)
+ *   run	Run the translated program natively
+ *   show, dump, and machine code, which work as in pa2
+ *
+ * Whenever the translated code cannot go on, the runtime interprets the
+ * instructions in the memory, just like @run_program() of pa2. The memory
+ * past @memory[] is paged by memory.c over the rest of the 4 GiB, so that
+ * the interpreted accesses reach the same addresses as they do in pa2.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+#include <ctype.h>
+
+#include "aot.h"
+#include "memory.h"
+
+#define MAX_NR_TOKENS	32	/* Maximum length of tokens in a command */
+#define MAX_COMMAND	256 /* Maximum length of command string */
+
+/**
+ * Machine state. The initial values are the same as pa2
+ */
+unsigned char memory[MEMORY_SIZE] = {
+	0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77,
+	0xde, 0xad, 0xbe, 0xef, 0x00, 0x00, 0x00, 0x00,
+	'h',  'e',  'l',  'l',  'o',  ' ',  'w',  'o',
+	'r',  'l',  'd',  '!',  '!',  0x00, 0x00, 0x00,
+	'a',  'w',  'e',  's',  'o',  'm',  'e',  ' ',
+	'c',  'o',  'm',  'p',  'u',  't',  'e',  'r',
+	' ',  'a',  'r',  'c',  'h',  'i',  't',  'e',
+	'c',  't',  'u',  'r',  'e',  '.',  0x00, 0x00,
+};
+
+unsigned int registers[32] = {
+	0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0,
+	0x10, INITIAL_PC, 0x20, 3, 0xbadacafe, 0xcdcdcdcd, 0xffffffff, 7,
+	0, 0, 0, 0, 0, INITIAL_SP, 0, 0,
+};
+
+static const char *register_names[] = {
+	"zr", "at", "v0", "v1", "a0", "a1", "a2", "a3",
+	"t0", "t1", "t2", "t3", "t4", "t5", "t6", "t7",
+	"s0", "s1", "s2", "s3", "s4", "s5", "s6", "s7",
+	"t8", "t9", "k0", "k1", "gp", "sp", "fp", "ra"
+};
+
+unsigned int pc = INITIAL_PC;
+
+bool aot_modified = true;
+
+/* The memory from MEMORY_SIZE on, which the translated code leaves to us */
+static struct guest_memory high_memory;
+
+
+static inline bool strmatch(const char *str, const char *expect)
+{
+	return strcmp(str, expect) == 0;
+}
+
+
+/**
+ * Copy @length bytes at @addr out of the memory. The addresses wrap around
+ * the address space as they do in pa2.
+ */
+static void peek_memory(unsigned int addr, unsigned char *buffer, size_t length)
+{
+	for (size_t i = 0; i < length; i++, addr++) {
+		if (addr < MEMORY_SIZE) {
+			buffer[i] = memory[addr];
+		} else {
+			guest_peek(&high_memory, addr, buffer + i, 1);
+		}
+	}
+}
+
+static unsigned int load_word(unsigned int addr)
+{
+	unsigned char b[4];
+
+	peek_memory(addr, b, sizeof(b));
+	return (b[0] << 24) | (b[1] << 16) | (b[2] << 8) | b[3];
+}
+
+/**
+ * Store @word at @addr in big endian. The bytes past @memory[] are always in
+ * a row, even when the word wraps around, and go in first so that nothing is
+ * stored when their page cannot be allocated.
+ *
+ * RETURN
+ *   true on success
+ *   false if the host runs out of memory
+ */
+static bool store_word(unsigned int addr, unsigned int word)
+{
+	unsigned char b[4] = { word >> 24, word >> 16, word >> 8, word };
+	unsigned int first = 0, nr_high = 0;
+
+	for (unsigned int i = 0; i < 4; i++) {
+		if (addr + i < MEMORY_SIZE) continue;
+		if (!nr_high++) first = i;
+	}
+	if (nr_high && guest_poke(&high_memory, addr + first, b + first, nr_high)) {
+		return false;
+	}
+	for (unsigned int i = 0; i < 4; i++) {
+		if (addr + i < MEMORY_SIZE) memory[addr + i] = b[i];
+	}
+	return true;
+}
+
+
+/**********************************************************************
+ * interpret_instruction
+ *
+ * DESCRIPTION
+ *   Execute the machine code @instr as pa2 does. @pc should already point to
+ *   the next instruction. Stores into the program stop the translated code
+ *   from being used.
+ *
+ * RETURN
+ *   1 if successfully processed the instruction.
+ *   0 if @instr is 'halt' or unknown instructions
+ *   -1 if the store faults. @pc is left at the instruction
+ */
+static int interpret_instruction(unsigned int instr)
+{
+	unsigned int rs = (instr >> 21) & 0x1f, rt = (instr >> 16) & 0x1f;
+	unsigned int rd = (instr >> 11) & 0x1f, shamt = (instr >> 6) & 0x1f;
+	unsigned int imm = instr & 0xffff;
+	unsigned int address;
+
+	if (instr == 0xffffffff) return 0;
+
+	switch (instr >> 26) {
+	case 0x00:
+		switch (instr & 0x3f) {
+		case 0x20: registers[rd] = registers[rs] + registers[rt]; break;
+		case 0x22: registers[rd] = registers[rs] - registers[rt]; break;
+		case 0x24: registers[rd] = registers[rs] & registers[rt]; break;
+		case 0x25: registers[rd] = registers[rs] | registers[rt]; break;
+		case 0x27: registers[rd] = ~(registers[rs] | registers[rt]); break;
+		case 0x00: registers[rd] = registers[rt] << shamt; break;
+		case 0x02: registers[rd] = registers[rt] >> shamt; break;
+		case 0x03: registers[rd] = (int)registers[rt] >> shamt; break;
+		case 0x2a: registers[rd] = (int)registers[rs] < (int)registers[rt]; break;
+		case 0x08: pc = registers[rs]; break;
+		default: return 0;
+		}
+		break;
+	case 0x02:
+		pc = (pc & 0xf0000000) | ((instr & 0x03ffffff) << 2);
+		break;
+	case 0x03:
+		registers[31] = pc;
+		pc = (pc & 0xf0000000) | ((instr & 0x03ffffff) << 2);
+		break;
+	case 0x04:
+		if (registers[rs] == registers[rt]) pc += (int16_t)imm << 2;
+		break;
+	case 0x05:
+		if (registers[rs] != registers[rt]) pc += (int16_t)imm << 2;
+		break;
+	case 0x08: registers[rt] = registers[rs] + (int16_t)imm; break;
+	case 0x0c: registers[rt] = registers[rs] & imm; break;
+	case 0x0d: registers[rt] = registers[rs] | imm; break;
+	case 0x0a: registers[rt] = registers[rs] < imm; break;
+	case 0x23:
+		registers[rt] = load_word(registers[rs] + imm);
+		break;
+	case 0x2b:
+		address = registers[rs] + imm;
+		if (!store_word(address, registers[rt])) {
+			pc -= 4;
+			fprintf(stderr, "%s at 0x%08x by the instruction at 0x%08x\n",
+					guest_fault_name(GUEST_FAULT_NOMEM), address, pc);
+			return -1;
+		}
+		if (address + 3 >= INITIAL_PC && address < INITIAL_PC + nr_aot_image * 4) {
+			aot_modified = true;
+		}
+		break;
+	default:
+		return 0;
+	}
+	return 1;
+}
+
+
+/**
+ * Put the translated program onto the memory like @load_program() of pa2.
+ * A program past @memory[] goes on to the pages after it.
+ */
+static void load_program(void)
+{
+	for (unsigned int i = 0; i < nr_aot_image; i++) {
+		if (!store_word(INITIAL_PC + i * 4, aot_image[i])) {
+			fprintf(stderr, "load: %s\n", guest_fault_name(GUEST_FAULT_NOMEM));
+			return;
+		}
+	}
+	pc = INITIAL_PC + (nr_aot_image - 1) * 4;
+}
+
+
+/**********************************************************************
+ * run_program
+ *
+ * DESCRIPTION
+ *   Run the program from @INITIAL_PC. The translated code runs as long as
+ *   the memory holds the translated program, and the runtime interprets one
+ *   instruction whenever the translated code gives up. A faulting store
+ *   stops the program as it stops pa2.
+ */
+static void run_program(void)
+{
+	unsigned int code_end = INITIAL_PC + nr_aot_image * 4;
+
+	aot_modified = false;
+	for (unsigned int i = 0; i < nr_aot_image; i++) {
+		if (load_word(INITIAL_PC + i * 4) != aot_image[i]) aot_modified = true;
+	}
+
+	pc = INITIAL_PC;
+
+	while (1) {
+		unsigned int instr;
+
+		if (!aot_modified && pc - INITIAL_PC < code_end - INITIAL_PC && !(pc & 0x3)) {
+			if (aot_run() == AOT_HALT) break;
+		}
+
+		instr = load_word(pc);
+		pc += 4;
+		if (instr == 0xffffffff) break;
+
+		if (interpret_instruction(instr) < 0) break;
+	}
+}
+
+
+static void show_registers(const char *register_name)
+{
+	int from = 0, to = 0;
+	bool include_pc = false;
+
+	if (strmatch(register_name, "all")) {
+		from = 0;
+		to = 32;
+		include_pc = true;
+	} else if (strmatch(register_name, "pc")) {
+		include_pc = true;
+	} else {
+		for (int i = 0; i < sizeof(register_names) / sizeof(*register_names); i++) {
+			if (strmatch(register_name, register_names[i])) {
+				from = i;
+				to = i + 1;
+			}
+		}
+	}
+
+	for (int i = from; i < to; i++) {
+		fprintf(stderr, "[%02d:%2s] 0x%08x    %u\n", i, register_names[i], registers[i], registers[i]);
+	}
+	if (include_pc) {
+		fprintf(stderr, "[  pc ] 0x%08x\n", pc);
+	}
+}
+
+static void dump_memory(unsigned int addr, size_t length)
+{
+	for (size_t i = 0; i < length; i += 4) {
+		unsigned char b[4];
+
+		peek_memory(addr + i, b, sizeof(b));
+		fprintf(stderr, "0x%08lx:  %02x %02x %02x %02x    %c %c %c %c\n",
+				addr + i, b[0], b[1], b[2], b[3],
+				isprint(b[0]) ? b[0] : '.', isprint(b[1]) ? b[1] : '.',
+				isprint(b[2]) ? b[2] : '.', isprint(b[3]) ? b[3] : '.');
+	}
+}
+
+static void process_command(int argc, char *argv[])
+{
+	if (argc == 0) return;
+
+	if (strmatch(argv[0], "load")) {
+		load_program();
+	} else if (strmatch(argv[0], "run")) {
+		run_program();
+	} else if (strmatch(argv[0], "show")) {
+		if (argc == 1) {
+			show_registers("all");
+		} else if (argc == 2) {
+			show_registers(argv[1]);
+		} else {
+			printf("Usage: show { [register name] }\n");
+		}
+	} else if (strmatch(argv[0], "dump")) {
+		if (argc == 3) {
+			dump_memory(strtoimax(argv[1], NULL, 0), strtoimax(argv[2], NULL, 0));
+		} else {
+			printf("Usage: dump [start address] [length]\n");
+		}
+	} else {
+		interpret_instruction(strtoimax(argv[0], NULL, 0));
+	}
+}
+
+static int parse_command(char *command, int *nr_tokens, char *tokens[])
+{
+	char *curr = command;
+	int token_started = false;
+	*nr_tokens = 0;
+
+	while (*curr != '\0') {
+		if (isspace(*curr)) {
+			*curr = '\0';
+			token_started = false;
+		} else {
+			if (!token_started) {
+				tokens[*nr_tokens] = curr;
+				*nr_tokens += 1;
+				token_started = true;
+			}
+		}
+		curr++;
+	}
+
+	/* Exclude comments from tokens */
+	for (int i = 0; i < *nr_tokens; i++) {
+		if (strmatch(tokens[i], "//") || strmatch(tokens[i], "#")) {
+			*nr_tokens = i;
+			tokens[i] = NULL;
+		}
+	}
+
+	return 0;
+}
+
+int main(int argc, char *const argv[])
+{
+	char command[MAX_COMMAND] = {'\0'};
+	FILE *input = stdin;
+
+	guest_memory_init(&high_memory);
+
+	if (argc > 1) {
+		input = fopen(argv[1], "r");
+		if (!input) {
+			fprintf(stderr, "No input file %s\n", argv[1]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	while (fgets(command, sizeof(command), input)) {
+		char *tokens[MAX_NR_TOKENS] = {NULL};
+		int nr_tokens = 0;
+
+		for (size_t i = 0; i < strlen(command); i++) {
+			command[i] = tolower(command[i]);
+		}
+
+		if (parse_command(command, &nr_tokens, tokens) < 0)
+			continue;
+
+		process_command(nr_tokens, tokens);
+	}
+
+	if (input != stdin) fclose(input);
+
+	return EXIT_SUCCESS;
+}
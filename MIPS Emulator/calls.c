@@ -0,0 +1,400 @@
+/**********************************************************************
+ * Copyright (c) 2019-2023
+ *  Sang-Hoon Kim <sanghoonkim@ajou.ac.kr>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTIABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ **********************************************************************/
+
+/**
+ * The call-graph profiler. The loaded program runs with a shadow call stack
+ * kept by jal and jr ra, and the instructions are counted on the call paths
+ * they are run on;
+ *
+ *   >> run calls fib.folded fib.map
+ *   $ flamegraph.pl fib.folded > fib.svg
+ *
+ * writes a line for each call path in the folded-stack format, the frames
+ * from the entry down to the callee joined by ';' and followed by the
+ * instructions run in the callee itself, which the flame-graph scripts take
+ * as they are. The paths with the most instructions inclusive of their
+ * callees are printed at the end.
+ *
+ * The paths are kept as a tree, a node for each call site of a callee on a
+ * path, so a recursion as deep as n takes n nodes only. jal goes down to the
+ * child node of the callee, and jr ra goes back up when it returns to the
+ * address the jal of a frame has left in ra. Any other jr ra, say, the last
+ * one to the halt, is taken as a jump. The instructions are added to the
+ * node at every call and return, not one by one.
+ *
+ * The stack is up to MAX_CALL_DEPTH deep, and the tree up to MAX_CALL_NODES
+ * nodes. The calls beyond them are run in the node they are made from, and
+ * the returns from them are matched by counting.
+ *
+ * The callees are named by the symbol map if any, a line for each symbol as
+ * "<address> <name>" or as nm prints "<address> <type> <name>". The addresses
+ * are in hex.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "machine.h"
+
+#define MAX_CALL_DEPTH		4096
+#define MAX_CALL_NODES		(1 << 20)
+#define MAX_SYMBOL_NAME		64
+#define MAX_SYMBOL_LINE		256
+#define NR_TOP_CALL_PATHS	10	/* Paths to report */
+#define MAX_REPORT_FRAMES	8	/* Frames of a path reported */
+
+struct call_node {
+	unsigned int callee;
+	unsigned int parent;
+	unsigned int child;			/* First child, or 0 if none */
+	unsigned int sibling;		/* Next child of the parent, or 0 */
+	unsigned long nr_calls;
+	unsigned long self;			/* Instructions run in the callee itself */
+	unsigned long total;		/* And in its callees */
+};
+
+struct call_frame {
+	unsigned int node;
+	unsigned int ret;			/* Where the callee returns to */
+};
+
+struct call_symbol {
+	unsigned int addr;
+	char name[MAX_SYMBOL_NAME];
+};
+
+struct call_graph {
+	struct call_node *nodes;	/* @nodes[0] is the entry */
+	unsigned int nr_nodes;
+	unsigned int max_nodes;
+
+	struct call_frame *stack;
+	unsigned int depth;
+	unsigned int max_depth;
+	unsigned long nr_untracked;	/* Frames beyond the limits */
+
+	unsigned long nr_calls;
+	unsigned long nr_returns;
+	unsigned long nr_dropped;	/* Calls made beyond the limits */
+
+	struct call_symbol *symbols;	/* Sorted by the addresses */
+	unsigned int nr_symbols;
+};
+
+static int compare_call_symbols(const void *a, const void *b)
+{
+	const struct call_symbol *sa = a, *sb = b;
+
+	return (sa->addr > sb->addr) - (sa->addr < sb->addr);
+}
+
+static int calls_load_symbols(struct call_graph *cg, const char *filename)
+{
+	char line[MAX_SYMBOL_LINE];
+	unsigned int capacity = 0;
+	FILE *fp = fopen(filename, "r");
+
+	if (!fp) {
+		fprintf(stderr, "calls: cannot open %s\n", filename);
+		return -EINVAL;
+	}
+
+	while (fgets(line, sizeof(line), fp)) {
+		char *tokens[3] = { NULL };
+		unsigned int nr_tokens = 0;
+		struct call_symbol *symbol;
+
+		if (line[strspn(line, " \t\r\n")] == '\0' || line[0] == '#') continue;
+
+		for (char *token = strtok(line, " \t\r\n"); token; token = strtok(NULL, " \t\r\n")) {
+			if (nr_tokens == 3) goto broken;
+			tokens[nr_tokens++] = token;
+		}
+		if (nr_tokens < 2) goto broken;
+
+		if (cg->nr_symbols == capacity) {
+			capacity = capacity ? capacity * 2 : 256;
+			cg->symbols = realloc(cg->symbols, sizeof(*cg->symbols) * capacity);
+			if (!cg->symbols) goto broken;
+		}
+		symbol = cg->symbols + cg->nr_symbols++;
+		symbol->addr = strtoumax(tokens[0], NULL, 16);
+		snprintf(symbol->name, sizeof(symbol->name), "%s", tokens[nr_tokens - 1]);
+	}
+	fclose(fp);
+
+	qsort(cg->symbols, cg->nr_symbols, sizeof(*cg->symbols), compare_call_symbols);
+	return 0;
+
+broken:
+	fprintf(stderr, "calls: %s is not a symbol map\n", filename);
+	fclose(fp);
+	return -EINVAL;
+}
+
+/* Name @addr by the symbol covering it, or by the address */
+static void calls_name(const struct call_graph *cg, unsigned int addr, char *buffer, size_t size)
+{
+	unsigned int lo = 0, hi = cg->nr_symbols;
+
+	while (lo < hi) {
+		unsigned int mid = (lo + hi) / 2;
+
+		if (cg->symbols[mid].addr <= addr) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	if (!lo) {
+		snprintf(buffer, size, "0x%08x", addr);
+	} else if (cg->symbols[lo - 1].addr == addr) {
+		snprintf(buffer, size, "%s", cg->symbols[lo - 1].name);
+	} else {
+		snprintf(buffer, size, "%s+0x%x", cg->symbols[lo - 1].name, addr - cg->symbols[lo - 1].addr);
+	}
+}
+
+/* The child of @parent for @callee, which is added if it is not there yet */
+static unsigned int calls_child(struct call_graph *cg, unsigned int parent, unsigned int callee)
+{
+	struct call_node *node;
+	unsigned int child;
+
+	for (child = cg->nodes[parent].child; child; child = cg->nodes[child].sibling) {
+		if (cg->nodes[child].callee == callee) return child;
+	}
+
+	if (cg->nr_nodes == cg->max_nodes) {
+		unsigned int max_nodes = cg->max_nodes * 2;
+
+		if (max_nodes > MAX_CALL_NODES) return 0;
+		node = realloc(cg->nodes, sizeof(*cg->nodes) * max_nodes);
+		if (!node) return 0;
+		cg->nodes = node;
+		cg->max_nodes = max_nodes;
+	}
+
+	child = cg->nr_nodes++;
+	cg->nodes[child] = (struct call_node) {
+		.callee = callee,
+		.parent = parent,
+		.sibling = cg->nodes[parent].child,
+	};
+	cg->nodes[parent].child = child;
+	return child;
+}
+
+static void calls_enter(struct call_graph *cg, unsigned int callee, unsigned int ret)
+{
+	unsigned int node = 0;
+
+	cg->nr_calls++;
+	if (!cg->nr_untracked && cg->depth < MAX_CALL_DEPTH) {
+		node = calls_child(cg, cg->stack[cg->depth].node, callee);
+	}
+	if (!node) {
+		cg->nr_untracked++;
+		cg->nr_dropped++;
+		return;
+	}
+
+	cg->nodes[node].nr_calls++;
+	cg->stack[++cg->depth] = (struct call_frame) { node, ret };
+	if (cg->depth > cg->max_depth) cg->max_depth = cg->depth;
+}
+
+static void calls_leave(struct call_graph *cg, unsigned int target)
+{
+	if (cg->nr_untracked) {
+		cg->nr_untracked--;
+		cg->nr_returns++;
+	} else if (cg->depth && cg->stack[cg->depth].ret == target) {
+		cg->depth--;
+		cg->nr_returns++;
+	}
+}
+
+/* Write the last @nr_frames frames of the path down to @node joined by ';' */
+static void calls_write_path(const struct call_graph *cg, FILE *fp, unsigned int node,
+		unsigned int nr_frames)
+{
+	char name[MAX_SYMBOL_NAME + 16];
+
+	if (node && nr_frames > 1) {
+		calls_write_path(cg, fp, cg->nodes[node].parent, nr_frames - 1);
+		fputc(';', fp);
+	}
+	calls_name(cg, cg->nodes[node].callee, name, sizeof(name));
+	fputs(name, fp);
+}
+
+static int calls_write_folded(const struct call_graph *cg, const char *filename)
+{
+	FILE *fp = fopen(filename, "w");
+
+	if (!fp) {
+		fprintf(stderr, "calls: cannot open %s\n", filename);
+		return -EINVAL;
+	}
+	for (unsigned int i = 0; i < cg->nr_nodes; i++) {
+		if (!cg->nodes[i].self) continue;
+
+		calls_write_path(cg, fp, i, MAX_CALL_DEPTH + 1);
+		fprintf(fp, " %lu\n", cg->nodes[i].self);
+	}
+	if (fclose(fp)) {
+		fprintf(stderr, "calls: cannot write %s\n", filename);
+		return -EIO;
+	}
+	return 0;
+}
+
+/* A path to report, by the instructions inclusive of its callees */
+struct call_path {
+	unsigned long total;
+	unsigned int node;
+};
+
+static int compare_call_paths(const void *a, const void *b)
+{
+	const struct call_path *pa = a, *pb = b;
+
+	return (pa->total < pb->total) - (pa->total > pb->total);
+}
+
+static void calls_report(const struct call_graph *cg, unsigned long nr_instructions)
+{
+	struct call_path *paths = malloc(sizeof(*paths) * cg->nr_nodes);
+
+	fprintf(stderr, "calls: %lu instructions, %lu calls, %lu returns, %u paths, %u deep\n",
+			nr_instructions, cg->nr_calls, cg->nr_returns, cg->nr_nodes, cg->max_depth);
+	if (cg->nr_dropped) {
+		fprintf(stderr, "calls: %lu calls beyond %u frames or %u paths run in their callers\n",
+				cg->nr_dropped, MAX_CALL_DEPTH, MAX_CALL_NODES);
+	}
+	if (!paths) return;
+
+	for (unsigned int i = 0; i < cg->nr_nodes; i++) {
+		paths[i] = (struct call_path) { cg->nodes[i].total, i };
+	}
+	qsort(paths, cg->nr_nodes, sizeof(*paths), compare_call_paths);
+
+	fprintf(stderr, "calls: %20s %20s %10s  path\n", "inclusive", "exclusive", "calls");
+	for (unsigned int i = 0; i < cg->nr_nodes && i < NR_TOP_CALL_PATHS; i++) {
+		const struct call_node *node = cg->nodes + paths[i].node;
+		unsigned int nr_frames = 1;
+
+		for (unsigned int n = paths[i].node; n; n = cg->nodes[n].parent) nr_frames++;
+
+		fprintf(stderr, "calls: %12lu %5.1f%% %12lu %5.1f%% %10lu  ", node->total,
+				100.0 * node->total / nr_instructions, node->self,
+				100.0 * node->self / nr_instructions, node->nr_calls);
+		if (nr_frames > MAX_REPORT_FRAMES) {
+			calls_write_path(cg, stderr, 0, 1);
+			fprintf(stderr, ";...;");
+			nr_frames = MAX_REPORT_FRAMES - 1;
+		}
+		calls_write_path(cg, stderr, paths[i].node, nr_frames);
+		fputc('\n', stderr);
+	}
+	free(paths);
+}
+
+
+/**********************************************************************
+ * run_calls
+ *
+ * DESCRIPTION
+ *   Run the loaded program like @run_program() while keeping the shadow
+ *   call stack, and report the call paths. The folded stacks are written
+ *   to @folded unless it is NULL, and the callees are named by the symbol
+ *   map @symbols unless it is NULL. Loops are not run in bulk so that every
+ *   iteration is counted. With the MMU on, the program is just run by
+ *   @run_program().
+ *
+ * RETURN
+ *   0
+ *   -EFAULT as @run_program() does
+ *   -EINVAL if the files cannot be read or written
+ *   -ENOMEM if the call graph cannot be allocated
+ */
+int run_calls(struct machine *m, const char *folded, const char *symbols)
+{
+	struct decoded_instruction scratch;
+	struct call_graph cg = { .max_nodes = 1024, };
+	unsigned long nr_instructions = 0, mark = 0;
+	bool running = true;
+	int ret = 0;
+
+	/* The calls are followed by the physical addresses only */
+	if (m->mmu.enabled) return run_program(m);
+
+	if (symbols && calls_load_symbols(&cg, symbols)) return -EINVAL;
+
+	cg.nodes = malloc(sizeof(*cg.nodes) * cg.max_nodes);
+	cg.stack = malloc(sizeof(*cg.stack) * (MAX_CALL_DEPTH + 1));
+	if (!cg.nodes || !cg.stack) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	machine_start(m);
+	m->stats.engine = "calls";
+	cg.nodes[0] = (struct call_node) { .callee = m->pc, .nr_calls = 1, };
+	cg.nr_nodes = 1;
+	cg.stack[0] = (struct call_frame) { 0, 0 };
+
+	while (running) {
+		const struct decoded_instruction *di = fetch_decoded(m, m->pc, &scratch);
+
+		m->pc += 4;
+		nr_instructions++;
+		running = di->op != OP_HALT && execute_instruction(m, di) >= 0;
+
+		/* The instructions so far are run in the frame being left */
+		if (di->op == OP_JAL) {
+			cg.nodes[cg.stack[cg.depth].node].self += nr_instructions - mark;
+			mark = nr_instructions;
+			calls_enter(&cg, m->pc, m->registers[31]);
+		} else if (di->op == OP_JR && di->rs == 31) {
+			cg.nodes[cg.stack[cg.depth].node].self += nr_instructions - mark;
+			mark = nr_instructions;
+			calls_leave(&cg, m->pc);
+		}
+	}
+	cg.nodes[cg.stack[cg.depth].node].self += nr_instructions - mark;
+
+	/* The children come after their parents */
+	for (unsigned int i = 0; i < cg.nr_nodes; i++) {
+		cg.nodes[i].total = cg.nodes[i].self;
+	}
+	for (unsigned int i = cg.nr_nodes - 1; i > 0; i--) {
+		cg.nodes[cg.nodes[i].parent].total += cg.nodes[i].total;
+	}
+
+	calls_report(&cg, nr_instructions);
+	if (folded) ret = calls_write_folded(&cg, folded);
+	if (!ret) ret = machine_halt(m);
+
+out:
+	free(cg.nodes);
+	free(cg.stack);
+	free(cg.symbols);
+	return ret;
+}
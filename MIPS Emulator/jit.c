@@ -0,0 +1,1794 @@
+/**********************************************************************
+ * Copyright (c) 2019-2023
+ *  Sang-Hoon Kim <sanghoonkim@ajou.ac.kr>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTIABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ **********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "machine.h"
+
+
+#if defined(__x86_64__)
+
+/**
+ * State shared by translated blocks. The inline caches and the return
+ * address stack are updated by the translated code directly.
+ */
+#define JIT_RAS_SIZE	16	/* Entries of the return address stack. Power of 2 */
+#define JIT_HEAT_SIZE	4096	/* Countdowns to record traces. Power of 2 */
+
+struct jit_context {
+	uint64_t nr_ic_hits;		/* Indirect jumps resolved by inline caches */
+	uint64_t nr_ic_misses;
+	uint64_t nr_ras_hits;		/* Returns resolved by the return address stack */
+	uint64_t nr_ras_misses;
+	uint64_t nr_block_instructions;	/* Instructions run in basic blocks */
+	uint64_t nr_trace_instructions;	/* Instructions run in traces */
+	uint64_t nr_trace_exits;		/* Side exits taken from traces */
+	unsigned int ras_top;
+	unsigned int __pad;
+	struct jit_ras_entry {
+		unsigned int pc;		/* Guest return address */
+		unsigned int __pad;
+		void *code;				/* Translated code at @pc, or NULL */
+	} ras[JIT_RAS_SIZE];
+	int heat[JIT_HEAT_SIZE];	/* Backward branches to go until loop headers are traced */
+};
+
+/**
+ * Translated blocks are called with the base of @registers, the page tables
+ * of the memory, and the context, which are kept in rdi, rsi, and rdx while
+ * running the translated code. They return the address of the next
+ * instruction to run in the lower 32 bits. The upper bits tell why the block
+ * is exited.
+ */
+typedef uint64_t (*jit_block_fn)(unsigned int *registers, guest_pte_t **tables,
+		struct jit_context *context);
+
+enum jit_exit_reason {
+	JIT_EXIT_NEXT = 0,		/* Continue from the returned address */
+	JIT_EXIT_HALT,			/* Met the halt instruction */
+	JIT_EXIT_INTERPRET,		/* Let the interpreter process the instruction */
+	JIT_EXIT_FLUSH,			/* The code is overwritten. Flush translations */
+	JIT_EXIT_IC_MISS,		/* Missed the inline cache in bits 40-63 */
+	JIT_EXIT_HOT,			/* The loop header at the address got hot */
+};
+
+#define JIT_EXIT(reason, addr)	(((uint64_t)(reason) << 32) | (addr))
+
+#define JIT_CODE_SIZE			(4 << 20)	/* Size of the code cache */
+#define JIT_MAX_BLOCKS			(1 << 14)
+#define JIT_MAX_BLOCK_INSTRUCTIONS	64
+#define JIT_MAX_BLOCK_BYTES		16384	/* Upper bound of a translated block. lw/sw walk the page tables inline */
+#define JIT_MAX_LINKS			(JIT_MAX_BLOCKS * 4)
+#define JIT_MAX_IC_SITES		JIT_MAX_BLOCKS
+
+#define JIT_MAX_TRACE_INSTRUCTIONS	JIT_MAX_BLOCK_INSTRUCTIONS
+#define JIT_TRACE_THRESHOLD		64		/* Backward branches to a loop header to trace it */
+#define JIT_TRACE_BACKOFF		1024	/* Wait after failing to record a trace */
+
+struct jit_block {
+	unsigned int pc;			/* Guest address of the first instruction */
+	unsigned int nr_instructions;
+	jit_block_fn code;
+	size_t size;
+	unsigned int first_link;	/* Links from the exits of this block */
+	unsigned int nr_links;
+	bool trace;					/* Recorded trace from a loop header */
+};
+
+/**
+ * A place in the code cache to be patched to the translation of @target.
+ * A jump exit becomes a direct jump to it, and a return address stack slot
+ * gets its address. Links to the same target are chained through @next.
+ */
+enum jit_link_type {
+	JIT_LINK_JUMP = 0,
+	JIT_LINK_ADDRESS,
+};
+
+struct jit_link {
+	unsigned char *at;
+	unsigned int target;
+	enum jit_link_type type;
+	int next;
+};
+
+/**
+ * An inline cache at a jr. Patching @value and @jump installs the most
+ * recently missed target.
+ */
+struct jit_ic_site {
+	unsigned char *value;
+	unsigned char *jump;
+};
+
+/**
+ * The code cache and the state around it are shared by all machines in the
+ * process. A machine holds @jit_owner while it runs on them, and is pointed
+ * to by @jit_machine.
+ */
+static pthread_mutex_t jit_owner = PTHREAD_MUTEX_INITIALIZER;
+static struct machine *jit_machine = NULL;
+
+/**
+ * Code cache. @jit_blocks_at[i] points to the translation starting from the
+ * instruction at INITIAL_PC + 4 * i, and @jit_links_at[i] is the first link
+ * waiting for the translation.
+ */
+static unsigned char *jit_code = NULL;
+static size_t jit_code_used = 0;
+
+static struct jit_block jit_blocks[JIT_MAX_BLOCKS];
+static unsigned int nr_jit_blocks = 0;
+static struct jit_block **jit_blocks_at = NULL;
+static unsigned int nr_jit_blocks_at = 0;
+
+static struct jit_link jit_links[JIT_MAX_LINKS];
+static unsigned int nr_jit_links = 0;
+static int *jit_links_at = NULL;
+
+static struct jit_ic_site jit_ic_sites[JIT_MAX_IC_SITES];
+static unsigned int nr_jit_ic_sites = 0;
+
+static struct jit_context jit_context;
+
+/**
+ * Statistics
+ */
+static unsigned long jit_nr_translated = 0;
+static unsigned long jit_nr_flushes = 0;
+static unsigned long jit_nr_dispatches = 0;
+static unsigned long jit_nr_interpreted = 0;
+static unsigned long jit_nr_chained = 0;
+static unsigned long jit_nr_traces = 0;
+static unsigned long jit_nr_trace_aborts = 0;
+
+static inline double jit_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/**
+ * Code emitters. @jit_ptr points to where the next byte goes
+ */
+static unsigned char *jit_ptr;
+
+static inline void emit8(unsigned char byte)
+{
+	*jit_ptr++ = byte;
+}
+
+static inline void emit32(uint32_t value)
+{
+	memcpy(jit_ptr, &value, sizeof(value));
+	jit_ptr += sizeof(value);
+}
+
+static inline void emit64(uint64_t value)
+{
+	memcpy(jit_ptr, &value, sizeof(value));
+	jit_ptr += sizeof(value);
+}
+
+/* <op> r32, [rdi + @reg * 4]. @modrm_reg is 0 for eax, 1 for ecx */
+static inline void emit_reg_op(unsigned char op, unsigned char modrm_reg, unsigned int reg)
+{
+	emit8(op);
+	emit8(0x47 | (modrm_reg << 3));
+	emit8(reg * 4);
+}
+
+#define emit_load_eax(reg)	emit_reg_op(0x8b, 0, reg)	/* mov eax, [rdi + reg * 4] */
+#define emit_load_ecx(reg)	emit_reg_op(0x8b, 1, reg)	/* mov ecx, [rdi + reg * 4] */
+#define emit_store_eax(reg)	emit_reg_op(0x89, 0, reg)	/* mov [rdi + reg * 4], eax */
+
+/* movabs rax, @value; ret */
+static inline void emit_return(uint64_t value)
+{
+	if (value >> 32) {
+		emit8(0x48); emit8(0xb8); emit64(value);
+	} else {
+		emit8(0xb8); emit32(value);
+	}
+	emit8(0xc3);
+}
+
+/* inc qword [rdx + @offset] */
+static inline void emit_count(size_t offset)
+{
+	emit8(0x48); emit8(0xff); emit8(0x42); emit8(offset);
+}
+
+/**
+ * Record that @at should be linked to the translation of @target
+ */
+static void jit_add_link(unsigned char *at, unsigned int target, enum jit_link_type type)
+{
+	if (target - INITIAL_PC >= jit_machine->nr_decoded * 4 || (target & 0x3)) return;
+	if (nr_jit_links == JIT_MAX_LINKS) return;
+
+	jit_links[nr_jit_links++] = (struct jit_link) {
+		.at = at,
+		.target = target,
+		.type = type,
+		.next = -1,
+	};
+}
+
+/**
+ * Leave the block to @target with "mov eax, @target; ret", which is patched
+ * to a direct jump once @target is translated.
+ */
+static void emit_exit(unsigned int target)
+{
+	jit_add_link(jit_ptr, target, JIT_LINK_JUMP);
+	emit_return(target);
+}
+
+/**
+ * Push @ret and its translation to the return address stack. The address of
+ * the translation is filled when the return site gets translated.
+ */
+static void emit_push_ras(unsigned int ret)
+{
+	emit8(0x8b); emit8(0x4a); emit8(offsetof(struct jit_context, ras_top));	/* mov ecx, [top] */
+	emit8(0xff); emit8(0xc1);							/* inc ecx */
+	emit8(0x83); emit8(0xe1); emit8(JIT_RAS_SIZE - 1);	/* and ecx, mask */
+	emit8(0x89); emit8(0x4a); emit8(offsetof(struct jit_context, ras_top));	/* mov [top], ecx */
+	emit8(0xc1); emit8(0xe1); emit8(4);					/* shl ecx, 4 */
+	emit8(0xc7); emit8(0x44); emit8(0x0a);				/* mov [rdx + rcx + pc], ret */
+	emit8(offsetof(struct jit_context, ras) + offsetof(struct jit_ras_entry, pc));
+	emit32(ret);
+
+	jit_add_link(jit_ptr + 2, ret, JIT_LINK_ADDRESS);
+	emit8(0x48); emit8(0xb8); emit64(0);				/* movabs rax, code */
+	emit8(0x48); emit8(0x89); emit8(0x44); emit8(0x0a);	/* mov [rdx + rcx + code], rax */
+	emit8(offsetof(struct jit_context, ras) + offsetof(struct jit_ras_entry, code));
+}
+
+/**
+ * Jump to the target of jr in eax. Returns through "jr ra" are predicted by
+ * the return address stack first, and then all jr go through the inline
+ * cache of the site. Misses return to the dispatcher to update the cache.
+ */
+static void emit_indirect_jump(unsigned int rs)
+{
+	unsigned int site = nr_jit_ic_sites;
+	unsigned char *miss;
+
+	if (rs == 31) {
+		emit8(0x8b); emit8(0x4a); emit8(offsetof(struct jit_context, ras_top));	/* mov ecx, [top] */
+		emit8(0xff); emit8(0x4a); emit8(offsetof(struct jit_context, ras_top));	/* dec dword [top] */
+		emit8(0x83); emit8(0x62); emit8(offsetof(struct jit_context, ras_top));	/* and dword [top], mask */
+		emit8(JIT_RAS_SIZE - 1);
+		emit8(0x83); emit8(0xe1); emit8(JIT_RAS_SIZE - 1);	/* and ecx, mask */
+		emit8(0xc1); emit8(0xe1); emit8(4);					/* shl ecx, 4 */
+		emit8(0x3b); emit8(0x44); emit8(0x0a);				/* cmp eax, [rdx + rcx + pc] */
+		emit8(offsetof(struct jit_context, ras) + offsetof(struct jit_ras_entry, pc));
+		emit8(0x75); miss = jit_ptr; emit8(0);				/* jne miss */
+		emit8(0x48); emit8(0x8b); emit8(0x4c); emit8(0x0a);	/* mov rcx, [rdx + rcx + code] */
+		emit8(offsetof(struct jit_context, ras) + offsetof(struct jit_ras_entry, code));
+		emit8(0x48); emit8(0x85); emit8(0xc9);				/* test rcx, rcx */
+		emit8(0x74); emit8(6);								/* jz miss */
+		emit_count(offsetof(struct jit_context, nr_ras_hits));
+		emit8(0xff); emit8(0xe1);							/* jmp rcx */
+		*miss = jit_ptr - (miss + 1);
+		emit_count(offsetof(struct jit_context, nr_ras_misses));
+	}
+
+	if (nr_jit_ic_sites == JIT_MAX_IC_SITES) {
+		emit8(0xc3);										/* ret */
+		return;
+	}
+	nr_jit_ic_sites++;
+
+	jit_ic_sites[site].value = jit_ptr + 1;
+	emit8(0x3d); emit32(0xffffffff);					/* cmp eax, target */
+	emit8(0x75); emit8(9);								/* jne miss */
+	emit_count(offsetof(struct jit_context, nr_ic_hits));
+	jit_ic_sites[site].jump = jit_ptr + 1;
+	emit8(0xe9); emit32(0);								/* jmp translation */
+	emit_count(offsetof(struct jit_context, nr_ic_misses));
+	emit8(0x48); emit8(0xb9);							/* movabs rcx, reason */
+	emit64(((uint64_t)site << 40) | ((uint64_t)JIT_EXIT_IC_MISS << 32));
+	emit8(0x48); emit8(0x09); emit8(0xc8);				/* or rax, rcx */
+	emit8(0xc3);										/* ret */
+}
+
+/**
+ * Compute the effective address of lw/sw into eax, and walk the page tables
+ * as @guest_translate() does. The host address ends up in r8 + r9. The block
+ * is left to the interpreter when the page is not there, does not have all
+ * @flags, or the word is not aligned, so that the interpreter brings in the
+ * page, marks it dirty, reports the fault, or goes byte by byte. An aligned
+ * word is a host word in the page, and never crosses it.
+ */
+static void emit_effective_address(const struct decoded_instruction *di, unsigned int addr,
+		guest_pte_t flags)
+{
+	unsigned char *miss[4], *hit;
+
+	emit_load_eax(di->rs);
+	emit8(0x05); emit32(di->imm);				/* add eax, imm */
+	emit8(0x89); emit8(0xc1);					/* mov ecx, eax */
+	emit8(0xc1); emit8(0xe9); emit8(GUEST_TABLE_SHIFT);		/* shr ecx, GUEST_TABLE_SHIFT */
+	emit8(0x4c); emit8(0x8b); emit8(0x04); emit8(0xce);		/* mov r8, [rsi + rcx * 8] */
+	emit8(0x4d); emit8(0x85); emit8(0xc0);		/* test r8, r8 */
+	emit8(0x74); miss[0] = jit_ptr; emit8(0);	/* jz miss */
+	emit8(0x89); emit8(0xc1);					/* mov ecx, eax */
+	emit8(0xc1); emit8(0xe9); emit8(GUEST_PAGE_SHIFT);		/* shr ecx, GUEST_PAGE_SHIFT */
+	emit8(0x81); emit8(0xe1); emit32(NR_GUEST_TABLE_ENTRIES - 1);	/* and ecx, mask */
+	emit8(0x4d); emit8(0x8b); emit8(0x04); emit8(0xc8);		/* mov r8, [r8 + rcx * 8] */
+	emit8(0x44); emit8(0x89); emit8(0xc1);		/* mov ecx, r8d */
+	emit8(0x81); emit8(0xe1); emit32(flags);	/* and ecx, flags */
+	emit8(0x81); emit8(0xf9); emit32(flags);	/* cmp ecx, flags */
+	emit8(0x75); miss[1] = jit_ptr; emit8(0);	/* jne miss */
+	emit8(0x41); emit8(0x89); emit8(0xc1);		/* mov r9d, eax */
+	emit8(0x41); emit8(0x81); emit8(0xe1); emit32(GUEST_PAGE_SIZE - 1);	/* and r9d, offset mask */
+	emit8(0xa8); emit8(0x03);					/* test al, 3 */
+	emit8(0x75); miss[2] = jit_ptr; emit8(0);	/* jnz miss */
+	emit8(0x49); emit8(0x81); emit8(0xe0); emit32(~(uint32_t)PAGE_FLAGS);	/* and r8, ~PAGE_FLAGS */
+	emit8(0xeb); hit = jit_ptr; emit8(0);		/* jmp hit */
+
+	for (int i = 0; i < 3; i++) *miss[i] = jit_ptr - (miss[i] + 1);
+	emit_return(JIT_EXIT(JIT_EXIT_INTERPRET, addr));
+	*hit = jit_ptr - (hit + 1);
+}
+
+static inline unsigned int jit_heat_slot(unsigned int header)
+{
+	return ((header - INITIAL_PC) / 4) & (JIT_HEAT_SIZE - 1);
+}
+
+/**
+ * Count down the heat of the loop header @target at a backward branch, and
+ * leave the block to record a trace from @target when it gets hot.
+ */
+static void emit_heat(unsigned int target)
+{
+	unsigned char *skip;
+
+	emit8(0xff); emit8(0x8a);							/* dec dword [rdx + heat] */
+	emit32(offsetof(struct jit_context, heat) + jit_heat_slot(target) * 4);
+	emit8(0x75); skip = jit_ptr; emit8(0);				/* jnz skip */
+	emit_return(JIT_EXIT(JIT_EXIT_HOT, target));
+	*skip = jit_ptr - (skip + 1);
+}
+
+static inline bool jit_is_backward(unsigned int target, unsigned int addr)
+{
+	return target <= addr && target - INITIAL_PC < jit_machine->nr_decoded * 4 && !(target & 0x3);
+}
+
+/**********************************************************************
+ * jit_emit_instruction
+ *
+ * DESCRIPTION
+ *   Emit the host code for @di located at @addr.
+ *
+ * RETURN
+ *   true if @di ends the block
+ *   false otherwise
+ */
+static bool jit_emit_instruction(const struct decoded_instruction *di, unsigned int addr)
+{
+	unsigned int next = addr + 4;
+
+	switch (di->op) {
+	case OP_ADD:
+	case OP_SUB:
+	case OP_AND:
+	case OP_OR:
+	case OP_NOR: {
+		static const unsigned char alu_ops[] = {
+			[OP_ADD] = 0x03, [OP_SUB] = 0x2b,
+			[OP_AND] = 0x23, [OP_OR] = 0x0b, [OP_NOR] = 0x0b,
+		};
+		emit_load_eax(di->rs);
+		emit_reg_op(alu_ops[di->op], 0, di->rt);
+		if (di->op == OP_NOR) {
+			emit8(0xf7); emit8(0xd0);			/* not eax */
+		}
+		emit_store_eax(di->rd);
+		break;
+	}
+	case OP_SLL:
+	case OP_SRL:
+	case OP_SRA: {
+		static const unsigned char shift_ops[] = {
+			[OP_SLL] = 0xe0, [OP_SRL] = 0xe8, [OP_SRA] = 0xf8,
+		};
+		emit_load_eax(di->rt);
+		emit8(0xc1); emit8(shift_ops[di->op]); emit8(di->shamt);
+		emit_store_eax(di->rd);
+		break;
+	}
+	case OP_SLT:
+		emit_load_eax(di->rs);
+		emit_reg_op(0x3b, 0, di->rt);			/* cmp eax, rt */
+		emit8(0x0f); emit8(0x9c); emit8(0xc0);	/* setl al */
+		emit8(0x0f); emit8(0xb6); emit8(0xc0);	/* movzx eax, al */
+		emit_store_eax(di->rd);
+		break;
+	case OP_ADDI:
+		emit_load_eax(di->rs);
+		emit8(0x05); emit32((int16_t)di->imm);	/* add eax, simm */
+		emit_store_eax(di->rt);
+		break;
+	case OP_ANDI:
+		emit_load_eax(di->rs);
+		emit8(0x25); emit32(di->imm);			/* and eax, imm */
+		emit_store_eax(di->rt);
+		break;
+	case OP_ORI:
+		emit_load_eax(di->rs);
+		emit8(0x0d); emit32(di->imm);			/* or eax, imm */
+		emit_store_eax(di->rt);
+		break;
+	case OP_SLTI:
+		emit_load_eax(di->rs);
+		emit8(0x3d); emit32(di->imm);			/* cmp eax, imm */
+		emit8(0x0f); emit8(0x92); emit8(0xc0);	/* setb al */
+		emit8(0x0f); emit8(0xb6); emit8(0xc0);	/* movzx eax, al */
+		emit_store_eax(di->rt);
+		break;
+	case OP_LW:
+		emit_effective_address(di, addr, PAGE_READ);
+		emit8(0x43); emit8(0x8b); emit8(0x04); emit8(0x08);	/* mov eax, [r8 + r9] */
+		emit_store_eax(di->rt);
+		break;
+	case OP_SW:
+		emit_effective_address(di, addr, PAGE_WRITE | PAGE_DIRTY);
+		emit_load_ecx(di->rt);
+		emit8(0x43); emit8(0x89); emit8(0x0c); emit8(0x08);	/* mov [r8 + r9], ecx */
+		/* Flush the translations when the store hits the loaded program */
+		emit8(0x8d); emit8(0x88); emit32(-(INITIAL_PC - 3));	/* lea ecx, [rax - INITIAL_PC + 3] */
+		emit8(0x81); emit8(0xf9); emit32(jit_machine->nr_decoded * 4 + 3);	/* cmp ecx, size + 3 */
+		emit8(0x73); emit8(11);					/* jae +11 */
+		emit_return(JIT_EXIT(JIT_EXIT_FLUSH, next));
+		break;
+	case OP_BEQ:
+	case OP_BNE: {
+		unsigned int target = next + ((int16_t)di->imm << 2);
+		unsigned char *skip;
+
+		emit_load_eax(di->rs);
+		emit_reg_op(0x3b, 0, di->rt);			/* cmp eax, rt */
+		emit8(di->op == OP_BEQ ? 0x75 : 0x74);	/* jne/je skip */
+		skip = jit_ptr; emit8(0);
+		if (jit_is_backward(target, addr)) emit_heat(target);
+		emit_exit(target);
+		*skip = jit_ptr - (skip + 1);
+		emit_exit(next);
+		return true;
+	}
+	case OP_J:
+	case OP_JAL: {
+		unsigned int target = (next & 0xf0000000) | (di->imm << 2);
+
+		if (di->op == OP_JAL) {
+			emit8(0xc7); emit8(0x47); emit8(31 * 4); emit32(next);	/* mov [ra], next */
+			emit_push_ras(next);
+		} else if (jit_is_backward(target, addr)) {
+			emit_heat(target);
+		}
+		emit_exit(target);
+		return true;
+	}
+	case OP_JR:
+		emit_load_eax(di->rs);
+		emit_indirect_jump(di->rs);
+		return true;
+	case OP_HALT:
+		emit_return(JIT_EXIT(JIT_EXIT_HALT, next));
+		return true;
+	default: /* Unknown instructions do nothing */
+		break;
+	}
+	return false;
+}
+
+
+/**********************************************************************
+ * jit_flush
+ *
+ * DESCRIPTION
+ *   Drop all translations and pre-decoded instructions so that they are
+ *   built again from the memory.
+ */
+static void jit_flush(void)
+{
+	nr_jit_blocks = 0;
+	jit_code_used = 0;
+	memset(jit_blocks_at, 0x00, sizeof(*jit_blocks_at) * nr_jit_blocks_at);
+
+	nr_jit_links = 0;
+	memset(jit_links_at, 0xff, sizeof(*jit_links_at) * nr_jit_blocks_at);
+	nr_jit_ic_sites = 0;
+	memset(jit_context.ras, 0x00, sizeof(jit_context.ras));
+	for (unsigned int i = 0; i < JIT_HEAT_SIZE; i++) {
+		jit_context.heat[i] = JIT_TRACE_THRESHOLD;
+	}
+
+	for (unsigned int i = 0; i < jit_machine->nr_decoded; i++) {
+		jit_machine->decoded[i].valid = false;
+	}
+	jit_nr_flushes++;
+}
+
+
+/**********************************************************************
+ * jit_patch
+ *
+ * DESCRIPTION
+ *   Point @link to the translated @block.
+ */
+static void jit_patch(const struct jit_link *link, const struct jit_block *block)
+{
+	if (link->type == JIT_LINK_JUMP) {
+		int32_t rel = (unsigned char *)block->code - (link->at + 5);
+
+		link->at[0] = 0xe9;						/* jmp rel32 */
+		memcpy(link->at + 1, &rel, sizeof(rel));
+		jit_nr_chained++;
+	} else {
+		uint64_t code = (uintptr_t)block->code;
+
+		memcpy(link->at, &code, sizeof(code));
+	}
+}
+
+
+/**********************************************************************
+ * jit_emit_block
+ *
+ * DESCRIPTION
+ *   Translate the basic block starting from @start into the code cache. The
+ *   block ends at a branch, a jump, or the halt instruction. The instructions
+ *   are read from the memory directly so that this can run on the compiler
+ *   thread. The caller should make sure the code cache has enough room.
+ *
+ * RETURN
+ *   The translated block, which is not visible to @jit_blocks_at[] yet
+ */
+static struct jit_block *jit_emit_block(unsigned int start)
+{
+	struct decoded_instruction di = { .op = OP_NOP, };
+	struct jit_block *block;
+	unsigned int addr = start;
+	unsigned int code_end = INITIAL_PC + jit_machine->nr_decoded * 4;
+	unsigned char *count;
+
+	block = jit_blocks + nr_jit_blocks++;
+	*block = (struct jit_block) {
+		.pc = start,
+		.code = (jit_block_fn)(jit_code + jit_code_used),
+		.first_link = nr_jit_links,
+	};
+	jit_ptr = jit_code + jit_code_used;
+
+	/* add qword [rdx + nr_block_instructions], nr_instructions. Becomes a jump to its trace */
+	emit8(0x48); emit8(0x83); emit8(0x42); emit8(offsetof(struct jit_context, nr_block_instructions));
+	count = jit_ptr; emit8(0);
+
+	while (true) {
+		unsigned char bytes[4];
+
+		if (addr >= code_end || block->nr_instructions == JIT_MAX_BLOCK_INSTRUCTIONS) {
+			emit_exit(addr);
+			break;
+		}
+		block->nr_instructions++;
+		guest_peek(&jit_machine->memory, addr, bytes, sizeof(bytes));
+		decode_instruction((bytes[0] << 24) | (bytes[1] << 16) | (bytes[2] << 8) | bytes[3], &di);
+		if (jit_emit_instruction(&di, addr)) break;
+		addr += 4;
+	}
+
+	/* The halt ending the block is not counted, as in the interpreter */
+	*count = block->nr_instructions - (di.op == OP_HALT);
+	block->size = jit_ptr - (unsigned char *)block->code;
+	block->nr_links = nr_jit_links - block->first_link;
+	jit_code_used += block->size;
+	jit_nr_translated++;
+
+	return block;
+}
+
+
+/**
+ * Whether the code cache has room for one more block
+ */
+static inline bool jit_has_room(void)
+{
+	return JIT_CODE_SIZE - jit_code_used >= JIT_MAX_BLOCK_BYTES &&
+			nr_jit_blocks < JIT_MAX_BLOCKS &&
+			nr_jit_ic_sites + JIT_MAX_BLOCK_INSTRUCTIONS <= JIT_MAX_IC_SITES;
+}
+
+
+/**********************************************************************
+ * jit_install
+ *
+ * DESCRIPTION
+ *   Make the translated @block visible to the dispatcher, and chain it with
+ *   other translations. The exits of @block are patched to their targets if
+ *   they are translated already, or wait for the targets to be translated.
+ *   Then the ones waiting for @block are patched.
+ */
+static void jit_install(struct jit_block *block)
+{
+	unsigned int index = (block->pc - INITIAL_PC) / 4;
+
+	jit_blocks_at[index] = block;
+
+	for (unsigned int l = block->first_link; l < block->first_link + block->nr_links; l++) {
+		struct jit_link *link = jit_links + l;
+		unsigned int target = (link->target - INITIAL_PC) / 4;
+
+		if (jit_blocks_at[target]) {
+			jit_patch(link, jit_blocks_at[target]);
+			continue;
+		}
+		link->next = jit_links_at[target];
+		jit_links_at[target] = l;
+	}
+
+	for (int l = jit_links_at[index]; l >= 0; l = jit_links[l].next) {
+		jit_patch(jit_links + l, block);
+	}
+	jit_links_at[index] = -1;
+}
+
+
+/**********************************************************************
+ * jit_translate
+ *
+ * DESCRIPTION
+ *   Translate the basic block starting from @start and install it. The code
+ *   cache is flushed when it is full.
+ *
+ * RETURN
+ *   The translated block
+ */
+static struct jit_block *jit_translate(unsigned int start)
+{
+	struct jit_block *block;
+
+	if (!jit_has_room()) jit_flush();
+
+	block = jit_emit_block(start);
+	jit_install(block);
+
+	return block;
+}
+
+
+/**********************************************************************
+ * jit_update_ic
+ *
+ * DESCRIPTION
+ *   Install @block to the inline cache @site that missed it.
+ */
+static void jit_update_ic(unsigned int site, const struct jit_block *block)
+{
+	struct jit_ic_site *ic = jit_ic_sites + site;
+	int32_t rel = (unsigned char *)block->code - (ic->jump + 4);
+
+	memcpy(ic->value, &block->pc, sizeof(block->pc));
+	memcpy(ic->jump, &rel, sizeof(rel));
+}
+
+
+/**
+ * Traces. Backward branches count down the heat of their loop headers, and
+ * when a header gets hot, the path taken from it is recorded while the
+ * interpreter runs one iteration of the loop. The path is translated into a
+ * straight-line block that jumps back to its start, with a guard at every
+ * branch and jr to leave the trace when the execution takes another way.
+ * The trace then replaces the translation of the header.
+ */
+struct jit_trace_entry {
+	unsigned int addr;
+	struct decoded_instruction di;
+	unsigned int next;			/* Address executed after this */
+};
+
+struct jit_side_exit {
+	unsigned char *jump;		/* rel32 of the guard */
+	unsigned int target;		/* Where to continue. ~0 for the target of jr in eax */
+	unsigned int nr_instructions;	/* Run in the iteration when leaving */
+};
+
+
+/**********************************************************************
+ * jit_record_trace
+ *
+ * DESCRIPTION
+ *   Run the loop from the header at @pc with the interpreter, and record the
+ *   instructions into @trace until the control comes back to the header.
+ *
+ * RETURN
+ *   The number of the instructions recorded
+ *   0 if the path does not come back in JIT_MAX_TRACE_INSTRUCTIONS, or leaves
+ *   the loaded program
+ */
+static unsigned int jit_record_trace(struct jit_trace_entry *trace)
+{
+	struct decoded_instruction scratch;
+	unsigned int header = jit_machine->pc;
+	unsigned int nr = 0;
+
+	while (nr < JIT_MAX_TRACE_INSTRUCTIONS) {
+		const struct decoded_instruction *di = fetch_decoded(jit_machine, jit_machine->pc, &scratch);
+		unsigned int address = jit_machine->registers[di->rs] + di->imm;
+
+		/* Let the dispatcher run the halt */
+		if (di->op == OP_HALT) return 0;
+
+		trace[nr] = (struct jit_trace_entry) {
+			.addr = jit_machine->pc,
+			.di = *di,
+		};
+		jit_machine->pc += 4;
+		if (execute_instruction(jit_machine, &trace[nr].di) < 0) return 0;
+		jit_nr_interpreted++;
+		trace[nr++].next = jit_machine->pc;
+
+		if (di->op == OP_SW && address + 3 >= INITIAL_PC &&
+				address < INITIAL_PC + jit_machine->nr_decoded * 4) {
+			jit_flush();
+			return 0;
+		}
+		if (jit_machine->pc == header) return nr;
+		if (jit_machine->pc - INITIAL_PC >= jit_machine->nr_decoded * 4 || (jit_machine->pc & 0x3)) return 0;
+	}
+	return 0;
+}
+
+
+/**********************************************************************
+ * jit_emit_trace
+ *
+ * DESCRIPTION
+ *   Translate the recorded @trace of @nr instructions into the code cache.
+ *   Side exits are put after the loop so that the loop body runs straight.
+ *   Each of them accounts the instructions run in the iteration before it
+ *   is taken. The caller should make sure the code cache has enough room.
+ *
+ * RETURN
+ *   The translated trace, which is not visible to @jit_blocks_at[] yet
+ */
+static struct jit_block *jit_emit_trace(const struct jit_trace_entry *trace, unsigned int nr)
+{
+	struct jit_side_exit exits[JIT_MAX_TRACE_INSTRUCTIONS];
+	unsigned int nr_exits = 0;
+	struct jit_block *block;
+
+	block = jit_blocks + nr_jit_blocks++;
+	*block = (struct jit_block) {
+		.pc = trace[0].addr,
+		.nr_instructions = nr,
+		.code = (jit_block_fn)(jit_code + jit_code_used),
+		.first_link = nr_jit_links,
+		.trace = true,
+	};
+	jit_ptr = jit_code + jit_code_used;
+
+	for (unsigned int i = 0; i < nr; i++) {
+		const struct decoded_instruction *di = &trace[i].di;
+		unsigned int next = trace[i].addr + 4;
+
+		switch (di->op) {
+		case OP_BEQ:
+		case OP_BNE: {
+			bool taken = trace[i].next != next;
+
+			emit_load_eax(di->rs);
+			emit_reg_op(0x3b, 0, di->rt);			/* cmp eax, rt */
+			/* Leave when the other way is taken */
+			emit8(0x0f); emit8((di->op == OP_BEQ) == taken ? 0x85 : 0x84);	/* jne/je exit */
+			exits[nr_exits++] = (struct jit_side_exit) {
+				.jump = jit_ptr,
+				.target = taken ? next : next + ((int16_t)di->imm << 2),
+				.nr_instructions = i + 1,
+			};
+			emit32(0);
+			break;
+		}
+		case OP_J:
+			break;
+		case OP_JAL:
+			emit8(0xc7); emit8(0x47); emit8(31 * 4); emit32(next);	/* mov [ra], next */
+			break;
+		case OP_JR:
+			emit_load_eax(di->rs);
+			emit8(0x3d); emit32(trace[i].next);	/* cmp eax, target */
+			emit8(0x0f); emit8(0x85);			/* jne exit */
+			exits[nr_exits++] = (struct jit_side_exit) {
+				.jump = jit_ptr,
+				.target = ~0U,
+				.nr_instructions = i + 1,
+			};
+			emit32(0);
+			break;
+		default:
+			jit_emit_instruction(di, trace[i].addr);
+			break;
+		}
+	}
+
+	/* add qword [rdx + nr_trace_instructions], nr; jmp start */
+	emit8(0x48); emit8(0x81); emit8(0x42); emit8(offsetof(struct jit_context, nr_trace_instructions));
+	emit32(nr);
+	emit8(0xe9); emit32((unsigned char *)block->code - (jit_ptr + 4));
+
+	for (unsigned int i = 0; i < nr_exits; i++) {
+		int32_t rel = jit_ptr - (exits[i].jump + 4);
+
+		memcpy(exits[i].jump, &rel, sizeof(rel));
+		emit8(0x48); emit8(0x81); emit8(0x42); emit8(offsetof(struct jit_context, nr_trace_instructions));
+		emit32(exits[i].nr_instructions);
+		emit_count(offsetof(struct jit_context, nr_trace_exits));
+		if (exits[i].target == ~0U) {
+			emit8(0xc3);						/* ret with the target in eax */
+		} else {
+			emit_exit(exits[i].target);
+		}
+	}
+
+	block->size = jit_ptr - (unsigned char *)block->code;
+	block->nr_links = nr_jit_links - block->first_link;
+	jit_code_used += block->size;
+
+	return block;
+}
+
+
+/**********************************************************************
+ * jit_form_trace
+ *
+ * DESCRIPTION
+ *   Record the trace from the loop header at @pc that just got hot, and
+ *   install it in place of the translation of the header. Translations
+ *   chained to the header get to the trace through the jump patched at the
+ *   start of the translation. On return, @pc is where to continue.
+ */
+static void jit_form_trace(void)
+{
+	struct jit_trace_entry trace[JIT_MAX_TRACE_INSTRUCTIONS];
+	unsigned int index = (jit_machine->pc - INITIAL_PC) / 4;
+	int *heat = jit_context.heat + jit_heat_slot(jit_machine->pc);
+	struct jit_block *block;
+	unsigned long nr_flushes = jit_nr_flushes;
+	unsigned int nr;
+
+	if (jit_blocks_at[index] && jit_blocks_at[index]->trace) {
+		*heat = INT32_MAX;
+		return;
+	}
+
+	nr = jit_record_trace(trace);
+	if (!nr) {
+		if (nr_flushes == jit_nr_flushes) *heat = JIT_TRACE_BACKOFF;
+		jit_nr_trace_aborts++;
+		return;
+	}
+
+	if (!jit_has_room()) jit_flush();
+	block = jit_emit_trace(trace, nr);
+
+	if (jit_blocks_at[index]) {
+		unsigned char *entry = (unsigned char *)jit_blocks_at[index]->code;
+		int32_t rel = (unsigned char *)block->code - (entry + 5);
+
+		entry[0] = 0xe9;						/* jmp trace */
+		memcpy(entry + 1, &rel, sizeof(rel));
+	}
+	jit_install(block);
+
+	*heat = INT32_MAX;
+	jit_nr_traces++;
+}
+
+
+/**
+ * Instructions run by the translated code so far. The blocks count theirs
+ * as they are entered, and the traces as they are left.
+ */
+static inline uint64_t jit_nr_translated_run(void)
+{
+	return jit_context.nr_block_instructions + jit_context.nr_trace_instructions;
+}
+
+/**
+ * Print out the statistics of the translations
+ */
+static void jit_report(void)
+{
+	uint64_t total = jit_context.nr_trace_instructions +
+			jit_context.nr_block_instructions + jit_nr_interpreted;
+
+	fprintf(stderr, "jit: %lu blocks translated, %zu bytes in code cache, "
+			"%lu flushes, %lu dispatches, %lu instructions interpreted\n",
+			jit_nr_translated, jit_code_used, jit_nr_flushes,
+			jit_nr_dispatches, jit_nr_interpreted);
+	fprintf(stderr, "jit: %lu exits chained, inline cache %lu hits / %lu misses, "
+			"return address stack %lu hits / %lu misses\n",
+			jit_nr_chained, jit_context.nr_ic_hits, jit_context.nr_ic_misses,
+			jit_context.nr_ras_hits, jit_context.nr_ras_misses);
+	fprintf(stderr, "jit: %lu traces formed, %lu aborted, %lu side exits, trace coverage %.1f%% "
+			"(%lu instructions in traces, %lu in blocks, %lu interpreted)\n",
+			jit_nr_traces, jit_nr_trace_aborts, jit_context.nr_trace_exits,
+			total ? 100.0 * jit_context.nr_trace_instructions / total : 0.0,
+			jit_context.nr_trace_instructions, jit_context.nr_block_instructions,
+			jit_nr_interpreted);
+}
+
+
+/**
+ * Persistent translation cache. When PA2_JIT_CACHE names a directory, the
+ * translations of a program are saved there at the end of the run, and the
+ * next run of the same program maps them into the code cache instead of
+ * translating the blocks again.
+ *
+ * A cache file is named after the hash of the loaded image, and starts with
+ * struct jit_cache_header followed by the blocks, the links, and the inline
+ * cache sites. The code follows at @code_offset, which is page-aligned so that
+ * it can be mapped to the code cache directly. Translations are valid only for
+ * the emulator binary that made them, so the header also carries the hash of
+ * the emulator binary.
+ *
+ * Everything in the code is relative to the start of the code cache except
+ * the return address stack slots, which are patched again while loading.
+ */
+#define JIT_CACHE_ENV		"PA2_JIT_CACHE"
+#define JIT_CACHE_MAGIC		"PA2JIT\0"
+#define JIT_CACHE_VERSION	3
+#define JIT_CACHE_PAGE		4096
+
+struct jit_cache_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t code_offset;
+	uint64_t build;				/* Hash of the emulator binary */
+	uint64_t image;				/* Hash of the loaded program */
+	uint32_t nr_decoded;
+	uint32_t nr_blocks;
+	uint32_t nr_links;
+	uint32_t nr_ic_sites;
+	uint64_t code_size;
+};
+
+struct jit_cache_block {
+	uint32_t pc;
+	uint32_t nr_instructions;
+	uint32_t offset;			/* From the start of the code */
+	uint32_t size;
+	uint32_t first_link;
+	uint32_t nr_links;
+	uint32_t trace;
+};
+
+struct jit_cache_link {
+	uint32_t offset;
+	uint32_t target;
+	uint32_t type;
+};
+
+struct jit_cache_ic_site {
+	uint32_t value;
+	uint32_t jump;
+};
+
+static uint64_t jit_cache_image = 0;	/* Hash of the image at the start */
+static size_t jit_code_mapped = 0;		/* Bytes of the code cache mapped from a file */
+
+/* FNV-1a */
+static uint64_t jit_hash(uint64_t hash, const void *data, size_t size)
+{
+	const unsigned char *p = data;
+
+	for (size_t i = 0; i < size; i++) {
+		hash = (hash ^ p[i]) * 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+#define JIT_HASH_INIT	0xcbf29ce484222325ULL
+
+/**
+ * Hash of the running emulator binary. Falls back to the build time of this
+ * file when the binary cannot be read.
+ */
+static uint64_t jit_build_id(void)
+{
+	static uint64_t build = 0;
+	unsigned char buffer[65536];
+	size_t size;
+	FILE *fp;
+
+	if (build) return build;
+
+	build = JIT_HASH_INIT;
+	fp = fopen("/proc/self/exe", "rb");
+	if (!fp) {
+		build = jit_hash(build, __DATE__ " " __TIME__, sizeof(__DATE__ " " __TIME__));
+		return build;
+	}
+	while ((size = fread(buffer, 1, sizeof(buffer), fp)) > 0) {
+		build = jit_hash(build, buffer, size);
+	}
+	fclose(fp);
+
+	return build;
+}
+
+static uint64_t jit_image_hash(void)
+{
+	uint64_t hash = jit_hash(JIT_HASH_INIT, &jit_machine->nr_decoded, sizeof(jit_machine->nr_decoded));
+
+	for (unsigned int i = 0; i < jit_machine->nr_decoded; i++) {
+		unsigned char bytes[4];
+
+		guest_peek(&jit_machine->memory, INITIAL_PC + i * 4, bytes, sizeof(bytes));
+		hash = jit_hash(hash, bytes, sizeof(bytes));
+	}
+	return hash;
+}
+
+static bool jit_cache_path(char *path, size_t size, uint64_t image)
+{
+	const char *dir = getenv(JIT_CACHE_ENV);
+
+	if (!dir || !*dir) return false;
+
+	snprintf(path, size, "%s/%016llx.jit", dir, (unsigned long long)image);
+	return true;
+}
+
+/**
+ * Put back the anonymous memory under the code cache mapped from a file
+ */
+static void jit_cache_unmap(void)
+{
+	if (!jit_code_mapped) return;
+
+	if (mmap(jit_code, jit_code_mapped, PROT_READ | PROT_WRITE | PROT_EXEC,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED) {
+		fprintf(stderr, "jit: cannot restore the code cache\n");
+		exit(EXIT_FAILURE);
+	}
+	jit_code_mapped = 0;
+}
+
+
+/**********************************************************************
+ * jit_cache_load
+ *
+ * DESCRIPTION
+ *   Map the saved translations of the loaded program into the code cache, and
+ *   install them. Cache files for other emulator binaries or formats, and
+ *   broken ones are ignored.
+ *
+ * RETURN
+ *   true if the translations are loaded
+ *   false otherwise
+ */
+static bool jit_cache_load(void)
+{
+	char path[4096];
+	struct jit_cache_header header;
+	struct jit_cache_block *blocks = NULL;
+	struct jit_cache_link *links;
+	struct jit_cache_ic_site *ic_sites;
+	size_t tables, mapped;
+	struct stat st;
+	double begin = jit_now();
+	bool loaded = false;
+	int fd;
+
+	jit_cache_image = jit_image_hash();
+	if (!jit_cache_path(path, sizeof(path), jit_cache_image)) return false;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) goto out;
+
+	if (pread(fd, &header, sizeof(header), 0) != sizeof(header)) goto out;
+	if (memcmp(header.magic, JIT_CACHE_MAGIC, sizeof(header.magic)) ||
+			header.version != JIT_CACHE_VERSION ||
+			header.build != jit_build_id() ||
+			header.image != jit_cache_image ||
+			header.nr_decoded != jit_machine->nr_decoded) goto out;
+	if (header.nr_blocks > JIT_MAX_BLOCKS || header.nr_links > JIT_MAX_LINKS ||
+			header.nr_ic_sites > JIT_MAX_IC_SITES ||
+			header.code_size > JIT_CODE_SIZE || header.code_offset % JIT_CACHE_PAGE) goto out;
+
+	tables = sizeof(*blocks) * header.nr_blocks + sizeof(*links) * header.nr_links +
+			sizeof(*ic_sites) * header.nr_ic_sites;
+	if (sizeof(header) + tables > header.code_offset) goto out;
+	if (fstat(fd, &st) || (uint64_t)st.st_size < header.code_offset + header.code_size) goto out;
+
+	blocks = malloc(tables ? tables : 1);
+	if (!blocks) goto out;
+	if (pread(fd, blocks, tables, sizeof(header)) != (ssize_t)tables) goto out;
+	links = (struct jit_cache_link *)(blocks + header.nr_blocks);
+	ic_sites = (struct jit_cache_ic_site *)(links + header.nr_links);
+
+	for (unsigned int i = 0; i < header.nr_blocks; i++) {
+		struct jit_cache_block *b = blocks + i;
+
+		if (b->pc - INITIAL_PC >= jit_machine->nr_decoded * 4 || (b->pc & 0x3) ||
+				(uint64_t)b->offset + b->size > header.code_size ||
+				(uint64_t)b->first_link + b->nr_links > header.nr_links) goto out;
+	}
+	for (unsigned int i = 0; i < header.nr_links; i++) {
+		struct jit_cache_link *l = links + i;
+
+		if (l->target - INITIAL_PC >= jit_machine->nr_decoded * 4 || (l->target & 0x3) ||
+				l->type > JIT_LINK_ADDRESS ||
+				(uint64_t)l->offset + sizeof(uint64_t) > header.code_size) goto out;
+	}
+	for (unsigned int i = 0; i < header.nr_ic_sites; i++) {
+		if ((uint64_t)ic_sites[i].value + 4 > header.code_size ||
+				(uint64_t)ic_sites[i].jump + 4 > header.code_size) goto out;
+	}
+
+	mapped = (header.code_size + JIT_CACHE_PAGE - 1) & ~(size_t)(JIT_CACHE_PAGE - 1);
+	if (mapped) {
+		if (mmap(jit_code, mapped, PROT_READ | PROT_WRITE | PROT_EXEC,
+				MAP_PRIVATE | MAP_FIXED, fd, header.code_offset) == MAP_FAILED) {
+			jit_code_mapped = mapped;
+			jit_cache_unmap();
+			goto out;
+		}
+		jit_code_mapped = mapped;
+	}
+	jit_code_used = header.code_size;
+
+	for (unsigned int i = 0; i < header.nr_links; i++) {
+		jit_links[i] = (struct jit_link) {
+			.at = jit_code + links[i].offset,
+			.target = links[i].target,
+			.type = links[i].type,
+			.next = -1,
+		};
+	}
+	nr_jit_links = header.nr_links;
+
+	for (unsigned int i = 0; i < header.nr_ic_sites; i++) {
+		jit_ic_sites[i].value = jit_code + ic_sites[i].value;
+		jit_ic_sites[i].jump = jit_code + ic_sites[i].jump;
+	}
+	nr_jit_ic_sites = header.nr_ic_sites;
+
+	for (unsigned int i = 0; i < header.nr_blocks; i++) {
+		jit_blocks[i] = (struct jit_block) {
+			.pc = blocks[i].pc,
+			.nr_instructions = blocks[i].nr_instructions,
+			.code = (jit_block_fn)(jit_code + blocks[i].offset),
+			.size = blocks[i].size,
+			.first_link = blocks[i].first_link,
+			.nr_links = blocks[i].nr_links,
+			.trace = blocks[i].trace,
+		};
+	}
+	nr_jit_blocks = header.nr_blocks;
+
+	for (unsigned int i = 0; i < nr_jit_blocks; i++) {
+		jit_install(jit_blocks + i);
+	}
+	loaded = true;
+
+out:
+	free(blocks);
+	if (fd >= 0) close(fd);
+
+	if (loaded) {
+		fprintf(stderr, "jit: warm start, %u blocks loaded from %s in %.3f ms\n",
+				nr_jit_blocks, path, (jit_now() - begin) * 1e3);
+	} else {
+		fprintf(stderr, "jit: cold start, no usable translations in %s\n", path);
+	}
+	return loaded;
+}
+
+
+/**********************************************************************
+ * jit_cache_save
+ *
+ * DESCRIPTION
+ *   Save the translations in the code cache for the next run. Nothing is
+ *   saved if the code cache has been flushed or the program has modified
+ *   itself, since the translations may not match the loaded image then. The
+ *   file is replaced atomically so that concurrent runs never see a partial
+ *   one.
+ */
+static void jit_cache_save(void)
+{
+	char path[4096], temp[4096 + 32];
+	struct jit_cache_header header = {
+		.magic = JIT_CACHE_MAGIC,
+		.version = JIT_CACHE_VERSION,
+	};
+	struct jit_cache_block *blocks;
+	struct jit_cache_link *links;
+	struct jit_cache_ic_site *ic_sites;
+	size_t tables;
+	double begin = jit_now();
+	bool saved = false;
+	FILE *fp;
+
+	if (!jit_cache_path(path, sizeof(path), jit_cache_image)) return;
+	if (!jit_nr_translated || jit_nr_flushes) return;
+	if (jit_image_hash() != jit_cache_image) return;
+
+	header.build = jit_build_id();
+	header.image = jit_cache_image;
+	header.nr_decoded = jit_machine->nr_decoded;
+	header.nr_blocks = nr_jit_blocks;
+	header.nr_links = nr_jit_links;
+	header.nr_ic_sites = nr_jit_ic_sites;
+	header.code_size = jit_code_used;
+
+	tables = sizeof(*blocks) * nr_jit_blocks + sizeof(*links) * nr_jit_links +
+			sizeof(*ic_sites) * nr_jit_ic_sites;
+	header.code_offset = (sizeof(header) + tables + JIT_CACHE_PAGE - 1) &
+			~(JIT_CACHE_PAGE - 1);
+
+	blocks = calloc(1, header.code_offset - sizeof(header));
+	links = (struct jit_cache_link *)(blocks + nr_jit_blocks);
+	ic_sites = (struct jit_cache_ic_site *)(links + nr_jit_links);
+
+	for (unsigned int i = 0; i < nr_jit_blocks; i++) {
+		blocks[i] = (struct jit_cache_block) {
+			.pc = jit_blocks[i].pc,
+			.nr_instructions = jit_blocks[i].nr_instructions,
+			.offset = (unsigned char *)jit_blocks[i].code - jit_code,
+			.size = jit_blocks[i].size,
+			.first_link = jit_blocks[i].first_link,
+			.nr_links = jit_blocks[i].nr_links,
+			.trace = jit_blocks[i].trace,
+		};
+	}
+	for (unsigned int i = 0; i < nr_jit_links; i++) {
+		links[i] = (struct jit_cache_link) {
+			.offset = jit_links[i].at - jit_code,
+			.target = jit_links[i].target,
+			.type = jit_links[i].type,
+		};
+	}
+	for (unsigned int i = 0; i < nr_jit_ic_sites; i++) {
+		ic_sites[i].value = jit_ic_sites[i].value - jit_code;
+		ic_sites[i].jump = jit_ic_sites[i].jump - jit_code;
+	}
+
+	mkdir(getenv(JIT_CACHE_ENV), 0755);
+	snprintf(temp, sizeof(temp), "%s.%d", path, (int)getpid());
+
+	fp = fopen(temp, "wb");
+	if (fp) {
+		saved = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+				fwrite(blocks, header.code_offset - sizeof(header), 1, fp) == 1 &&
+				fwrite(jit_code, jit_code_used, 1, fp) == 1;
+		if (fclose(fp)) saved = false;
+		if (saved && rename(temp, path)) saved = false;
+		if (!saved) unlink(temp);
+	}
+	free(blocks);
+
+	if (saved) {
+		fprintf(stderr, "jit: %u blocks saved to %s in %.3f ms\n",
+				nr_jit_blocks, path, (jit_now() - begin) * 1e3);
+	} else {
+		fprintf(stderr, "jit: cannot save translations to %s\n", path);
+	}
+}
+
+
+/**********************************************************************
+ * jit_setup
+ *
+ * DESCRIPTION
+ *   Prepare the code cache for the loaded program, and reset the statistics.
+ *   The saved translations of the program are loaded if there are.
+ *
+ * RETURN
+ *   0 on success
+ *   any other value if the code cache is not available, or the program is
+ *   not executable where it is
+ */
+static int jit_setup(void)
+{
+	/* Translations do not check the permissions of the code */
+	if (!program_executable(jit_machine)) return -1;
+
+	if (!jit_code) {
+		jit_code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (jit_code == MAP_FAILED) {
+			jit_code = NULL;
+			fprintf(stderr, "jit: cannot allocate the code cache, fall back to the interpreter\n");
+			return -1;
+		}
+	}
+
+	if (nr_jit_blocks_at != jit_machine->nr_decoded) {
+		jit_blocks_at = realloc(jit_blocks_at, sizeof(*jit_blocks_at) * jit_machine->nr_decoded);
+		jit_links_at = realloc(jit_links_at, sizeof(*jit_links_at) * jit_machine->nr_decoded);
+		nr_jit_blocks_at = jit_machine->nr_decoded;
+	}
+	jit_cache_unmap();
+	memset(&jit_context, 0x00, sizeof(jit_context));
+	jit_flush();
+
+	jit_nr_translated = jit_nr_flushes = 0;
+	jit_nr_dispatches = jit_nr_interpreted = 0;
+	jit_nr_chained = 0;
+	jit_nr_traces = jit_nr_trace_aborts = 0;
+
+	jit_cache_load();
+	return 0;
+}
+
+
+/**********************************************************************
+ * run_jit
+ *
+ * DESCRIPTION
+ *   Run the loaded program like @run_program(), but translate basic blocks
+ *   into the host x86-64 code and run them natively. Translations are cached
+ *   by the guest address, and chained to each other so that the control
+ *   goes from one to another without returning to the dispatcher here.
+ *   Instructions out of the loaded program are processed by the interpreter.
+ *
+ * RETURN
+ *   0
+ *   -EFAULT as @run_program() does
+ */
+int run_jit(struct machine *m)
+{
+	struct decoded_instruction scratch;
+	const struct decoded_instruction *di;
+	uint64_t translated;
+	int status;
+
+	double begin = jit_now();
+
+	pthread_mutex_lock(&jit_owner);
+	jit_machine = m;
+	if (jit_setup()) {
+		pthread_mutex_unlock(&jit_owner);
+		return run_program(m);
+	}
+
+	machine_start(jit_machine);
+	jit_machine->stats.engine = "jit";
+	translated = jit_nr_translated_run();
+
+	while (true) {
+		unsigned int index = (jit_machine->pc - INITIAL_PC) / 4;
+		unsigned int address;
+		uint64_t ret;
+
+		if (index < jit_machine->nr_decoded && !(jit_machine->pc & 0x3)) {
+			struct jit_block *block = jit_blocks_at[index];
+
+			if (!block) block = jit_translate(jit_machine->pc);
+
+			jit_nr_dispatches++;
+			ret = block->code(jit_machine->registers, jit_machine->memory.tables, &jit_context);
+			jit_machine->pc = (unsigned int)ret;
+
+			switch ((ret >> 32) & 0xff) {
+			case JIT_EXIT_NEXT:
+				continue;
+			case JIT_EXIT_HALT:
+				goto out;
+			case JIT_EXIT_FLUSH:
+				jit_flush();
+				continue;
+			case JIT_EXIT_IC_MISS:
+				index = (jit_machine->pc - INITIAL_PC) / 4;
+				if (index < jit_machine->nr_decoded && !(jit_machine->pc & 0x3)) {
+					unsigned long nr_flushes = jit_nr_flushes;
+
+					block = jit_blocks_at[index];
+					if (!block) block = jit_translate(jit_machine->pc);
+
+					/* The site is gone if the translation flushed the cache */
+					if (nr_flushes == jit_nr_flushes) {
+						jit_update_ic(ret >> 40, block);
+					}
+					continue;
+				}
+				break;
+			case JIT_EXIT_HOT:
+				jit_form_trace();
+				continue;
+			case JIT_EXIT_INTERPRET:
+				break;
+			}
+		}
+
+		/* Process one instruction with the interpreter */
+		jit_nr_interpreted++;
+		di = fetch_decoded(jit_machine, jit_machine->pc, &scratch);
+		jit_machine->pc += 4;
+		if (di->op == OP_HALT) break;
+
+		address = jit_machine->registers[di->rs] + di->imm;
+		if (execute_instruction(jit_machine, di) < 0) break;
+
+		if (di->op == OP_SW && address + 3 >= INITIAL_PC &&
+				address < INITIAL_PC + jit_machine->nr_decoded * 4) {
+			jit_flush();
+		}
+	}
+
+out:
+	status = machine_halt(jit_machine);
+	jit_machine->stats.nr_translated += jit_nr_translated_run() - translated;
+	fprintf(stderr, "jit: %.3f s total\n", jit_now() - begin);
+	jit_cache_save();
+	jit_report();
+	pthread_mutex_unlock(&jit_owner);
+	return status;
+}
+
+/**
+ * Tiered execution. The program starts in the interpreter, and basic blocks
+ * executed @jit_hot_threshold times are handed to the compiler thread. The
+ * compiler thread translates them into the code cache and puts them to
+ * @jit_ready[], and the main thread installs them at block boundaries. The
+ * main thread is the only one that runs and patches the translated code.
+ *
+ * @jit_lock protects the code cache and the queues. The compiler thread
+ * translates with the lock held, and a flush empties the queues with the
+ * lock held, so no translation made before a flush is installed after it.
+ */
+#define JIT_QUEUE_SIZE	256
+#define JIT_HOT_THRESHOLD	50	/* Default of @run_tiered() */
+
+static unsigned int jit_hot_threshold = JIT_HOT_THRESHOLD;
+
+static pthread_t jit_compiler_thread;
+static bool jit_compiler_running = false;
+static bool jit_compiler_stop = false;
+static pthread_mutex_t jit_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jit_wakeup = PTHREAD_COND_INITIALIZER;
+
+static unsigned int jit_requests[JIT_QUEUE_SIZE];
+static unsigned int jit_requests_head = 0, jit_requests_tail = 0;
+
+static struct jit_block *jit_ready[JIT_QUEUE_SIZE];
+static unsigned int nr_jit_ready = 0;
+static bool jit_cache_full = false;		/* Set by the compiler thread to ask for a flush */
+
+static unsigned int *jit_heat = NULL;		/* Executions of the blocks */
+static unsigned int nr_jit_heat = 0;
+
+/**
+ * Time spent in each tier
+ */
+static double jit_time_interpreter = 0.0;
+static double jit_time_translated = 0.0;
+static double jit_time_compiler = 0.0;
+
+
+/**********************************************************************
+ * jit_compiler
+ *
+ * DESCRIPTION
+ *   Body of the compiler thread. Translate the requested blocks one by one
+ *   until @jit_compiler_stop is set.
+ */
+static void *jit_compiler(void *arg)
+{
+	(void)arg;
+
+	pthread_mutex_lock(&jit_lock);
+	while (true) {
+		unsigned int start;
+		struct jit_block *block;
+		double begin;
+
+		while (jit_requests_head == jit_requests_tail && !jit_compiler_stop) {
+			pthread_cond_wait(&jit_wakeup, &jit_lock);
+		}
+		if (jit_compiler_stop) break;
+
+		start = jit_requests[jit_requests_head++ % JIT_QUEUE_SIZE];
+
+		if (!jit_has_room() || nr_jit_ready == JIT_QUEUE_SIZE) {
+			/* Let the main thread flush the code cache */
+			__atomic_store_n(&jit_cache_full, true, __ATOMIC_RELEASE);
+			continue;
+		}
+
+		begin = jit_now();
+		block = jit_emit_block(start);
+		jit_ready[nr_jit_ready] = block;
+		__atomic_store_n(&nr_jit_ready, nr_jit_ready + 1, __ATOMIC_RELEASE);
+		jit_time_compiler += jit_now() - begin;
+	}
+	pthread_mutex_unlock(&jit_lock);
+
+	return NULL;
+}
+
+
+/**
+ * Ask the compiler thread to translate the block at @start. The thread is
+ * started on the first request so that short programs never pay for it.
+ */
+static void jit_request(unsigned int start)
+{
+	if (!jit_compiler_running) {
+		jit_compiler_stop = false;
+		if (pthread_create(&jit_compiler_thread, NULL, jit_compiler, NULL)) return;
+		jit_compiler_running = true;
+	}
+
+	/* Do not wait for the compiler thread. Ask again next time instead */
+	if (pthread_mutex_trylock(&jit_lock)) {
+		jit_heat[(start - INITIAL_PC) / 4]--;
+		return;
+	}
+	if (jit_requests_tail - jit_requests_head < JIT_QUEUE_SIZE) {
+		jit_requests[jit_requests_tail++ % JIT_QUEUE_SIZE] = start;
+		pthread_cond_signal(&jit_wakeup);
+	} else {
+		/* Ask again when it gets hot again */
+		jit_heat[(start - INITIAL_PC) / 4] = 0;
+	}
+	pthread_mutex_unlock(&jit_lock);
+}
+
+
+/**
+ * Drop the pending requests and translations after the code cache is
+ * flushed, and let the blocks start cold again. @jit_lock is held.
+ */
+static void jit_tiered_drop(void)
+{
+	jit_requests_head = jit_requests_tail = 0;
+	nr_jit_ready = 0;
+	jit_cache_full = false;
+	memset(jit_heat, 0x00, sizeof(*jit_heat) * nr_jit_heat);
+}
+
+/**
+ * Flush the translations on behalf of the compiler thread
+ */
+static void jit_tiered_flush(void)
+{
+	pthread_mutex_lock(&jit_lock);
+	jit_flush();
+	jit_tiered_drop();
+	pthread_mutex_unlock(&jit_lock);
+}
+
+
+/**
+ * Install the translations completed by the compiler thread. This is retried
+ * at the next block boundary if the compiler thread is busy.
+ */
+static void jit_install_ready(void)
+{
+	if (pthread_mutex_trylock(&jit_lock)) return;
+
+	if (jit_cache_full) {
+		jit_flush();
+		jit_tiered_drop();
+	}
+	for (unsigned int i = 0; i < nr_jit_ready; i++) {
+		jit_install(jit_ready[i]);
+	}
+	nr_jit_ready = 0;
+	pthread_mutex_unlock(&jit_lock);
+}
+
+
+/**
+ * Stop the compiler thread
+ */
+static void jit_stop_compiler(void)
+{
+	if (!jit_compiler_running) return;
+
+	pthread_mutex_lock(&jit_lock);
+	jit_compiler_stop = true;
+	pthread_cond_signal(&jit_wakeup);
+	pthread_mutex_unlock(&jit_lock);
+
+	pthread_join(jit_compiler_thread, NULL);
+	jit_compiler_running = false;
+}
+
+
+/**********************************************************************
+ * run_tiered
+ *
+ * DESCRIPTION
+ *   Run the loaded program like @run_program(), starting in the interpreter.
+ *   Basic blocks that are executed @threshold times get translated by the
+ *   compiler thread in background, and the translations are used from the
+ *   next time they are reached. If @threshold is 0, JIT_HOT_THRESHOLD is
+ *   used. Hot loop headers are traced as @run_jit() does.
+ *
+ * RETURN
+ *   0
+ *   -EFAULT as @run_program() does
+ */
+int run_tiered(struct machine *m, unsigned int threshold)
+{
+	struct decoded_instruction scratch;
+	bool block_start = true;
+	double now, begin;
+	uint64_t translated;
+	int status;
+
+	pthread_mutex_lock(&jit_owner);
+	jit_machine = m;
+	jit_hot_threshold = threshold ? threshold : JIT_HOT_THRESHOLD;
+	if (jit_setup()) {
+		pthread_mutex_unlock(&jit_owner);
+		return run_program(m);
+	}
+
+	if (nr_jit_heat != jit_machine->nr_decoded) {
+		jit_heat = realloc(jit_heat, sizeof(*jit_heat) * jit_machine->nr_decoded);
+		nr_jit_heat = jit_machine->nr_decoded;
+	}
+	memset(jit_heat, 0x00, sizeof(*jit_heat) * nr_jit_heat);
+	jit_requests_head = jit_requests_tail = 0;
+	nr_jit_ready = 0;
+	jit_cache_full = false;
+	jit_time_interpreter = jit_time_translated = jit_time_compiler = 0.0;
+
+	machine_start(jit_machine);
+	jit_machine->stats.engine = "tiered";
+	translated = jit_nr_translated_run();
+	begin = now = jit_now();
+
+	while (true) {
+		const struct decoded_instruction *di;
+		unsigned int index = (jit_machine->pc - INITIAL_PC) / 4;
+		unsigned int address = 0;
+
+		if (block_start && index < jit_machine->nr_decoded && !(jit_machine->pc & 0x3)) {
+			struct jit_block *block;
+			uint64_t ret;
+
+			if (__atomic_load_n(&nr_jit_ready, __ATOMIC_ACQUIRE) ||
+					__atomic_load_n(&jit_cache_full, __ATOMIC_ACQUIRE)) {
+				jit_install_ready();
+			}
+
+			block = jit_blocks_at[index];
+			if (block) {
+				double then = jit_now();
+
+				jit_time_interpreter += then - now;
+				jit_nr_dispatches++;
+				ret = block->code(jit_machine->registers, jit_machine->memory.tables, &jit_context);
+				jit_machine->pc = (unsigned int)ret;
+				now = jit_now();
+				jit_time_translated += now - then;
+
+				switch ((ret >> 32) & 0xff) {
+				case JIT_EXIT_HALT:
+					goto out;
+				case JIT_EXIT_FLUSH:
+					jit_tiered_flush();
+					continue;
+				case JIT_EXIT_IC_MISS:
+					index = (jit_machine->pc - INITIAL_PC) / 4;
+					if (index < jit_machine->nr_decoded && !(jit_machine->pc & 0x3) && jit_blocks_at[index]) {
+						jit_update_ic(ret >> 40, jit_blocks_at[index]);
+					}
+					continue;
+				case JIT_EXIT_HOT: {
+					unsigned long nr_flushes = jit_nr_flushes;
+
+					/* Keep the compiler thread off the code cache while tracing */
+					pthread_mutex_lock(&jit_lock);
+					jit_form_trace();
+					if (nr_flushes != jit_nr_flushes) jit_tiered_drop();
+					pthread_mutex_unlock(&jit_lock);
+					continue;
+				}
+				case JIT_EXIT_INTERPRET:
+					break;
+				default:
+					continue;
+				}
+			} else if (++jit_heat[index] == jit_hot_threshold) {
+				jit_request(jit_machine->pc);
+			}
+		}
+
+		/* Process one instruction with the interpreter */
+		jit_nr_interpreted++;
+		di = fetch_decoded(jit_machine, jit_machine->pc, &scratch);
+		jit_machine->pc += 4;
+		if (di->op == OP_HALT) break;
+
+		if (di->op == OP_SW) address = jit_machine->registers[di->rs] + di->imm;
+		if (execute_instruction(jit_machine, di) < 0) break;
+
+		switch (di->op) {
+		case OP_SW:
+			if (address + 3 >= INITIAL_PC && address < INITIAL_PC + jit_machine->nr_decoded * 4) {
+				jit_tiered_flush();
+			}
+			block_start = false;
+			break;
+		case OP_BEQ:
+		case OP_BNE:
+		case OP_J:
+		case OP_JAL:
+		case OP_JR:
+			block_start = true;
+			break;
+		default:
+			block_start = false;
+			break;
+		}
+	}
+
+out:
+	status = machine_halt(jit_machine);
+	jit_machine->stats.nr_translated += jit_nr_translated_run() - translated;
+	jit_time_interpreter += jit_now() - now;
+	jit_stop_compiler();
+
+	jit_cache_save();
+	jit_report();
+	fprintf(stderr, "jit: %.3f s total, %.3f s in interpreter, %.3f s in translated code, "
+			"%.3f s in compiler thread\n", jit_now() - begin, jit_time_interpreter,
+			jit_time_translated, jit_time_compiler);
+	pthread_mutex_unlock(&jit_owner);
+	return status;
+}
+
+#else
+
+int run_jit(struct machine *m)
+{
+	fprintf(stderr, "jit: not supported on this host, fall back to the interpreter\n");
+	return run_program(m);
+}
+
+int run_tiered(struct machine *m, unsigned int threshold)
+{
+	return run_jit(m);
+}
+
+#endif
@@ -0,0 +1,379 @@
+/**********************************************************************
+ * Copyright (c) 2019-2023
+ *  Sang-Hoon Kim <sanghoonkim@ajou.ac.kr>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTIABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ **********************************************************************/
+
+/**
+ * Lockstep execution. Up to LOCKSTEP_LANES machines loaded with the same
+ * program run together, one lane each. The registers of the lanes are kept
+ * side by side so that an instruction is executed once for all the lanes
+ * at the same pc with vector instructions;
+ *
+ *   registers[rd] = registers[rs] + registers[rt]
+ *
+ * adds 16 pairs of registers at once. Lanes whose branches go different ways
+ * split up. The lanes with the lowest pc run first while the others wait,
+ * so the lanes join again when the lagging ones reach the others.
+ *
+ * Loads and stores go to the memory of each lane through the accessors of
+ * the interpreter, and a lane faulting on its memory stops there. Anything
+ * else not worth vectorizing is run on each lane by @execute_instruction(),
+ * so the lanes end up exactly as @run_program() leaves them.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "machine.h"
+
+typedef uint32_t lanes_t __attribute__((vector_size(LOCKSTEP_LANES * 4)));
+typedef int32_t slanes_t __attribute__((vector_size(LOCKSTEP_LANES * 4)));
+
+struct lockstep {
+	lanes_t registers[32];
+	lanes_t pc;
+
+	struct machine **lanes;
+	unsigned int nr_lanes;
+	unsigned int live;			/* Bitmap of the lanes not halted yet */
+
+	/**
+	 * Whether any of the lanes has stored to @code_page, where the code may
+	 * differ by lanes. Checked again when the lanes move to another page or
+	 * make another page dirty, which @nr_dirtied counts.
+	 */
+	unsigned int code_page;
+	bool code_dirty;
+	unsigned long code_nr_dirtied;
+	unsigned long nr_dirtied;
+
+	struct lockstep_stats *stats;
+};
+
+/**
+ * Registers touched by an instruction. They are passed to the machine of a
+ * lane around @execute_instruction(); the ones not written just come back.
+ */
+#define NR_LANE_REGISTERS	4
+
+static inline void lockstep_lane_registers(const struct decoded_instruction *di,
+		unsigned int regs[NR_LANE_REGISTERS])
+{
+	regs[0] = di->rs;
+	regs[1] = di->rt;
+	regs[2] = di->rd;
+	regs[3] = 31;
+}
+
+/**
+ * Run @di on the lane @l at @pc by @execute_instruction()
+ */
+static inline void lockstep_execute_lane(struct lockstep *ls, unsigned int l,
+		unsigned int pc, const struct decoded_instruction *di)
+{
+	struct machine *m = ls->lanes[l];
+	unsigned int regs[NR_LANE_REGISTERS];
+
+	lockstep_lane_registers(di, regs);
+	for (int i = 0; i < NR_LANE_REGISTERS; i++) {
+		m->registers[regs[i]] = ls->registers[regs[i]][l];
+	}
+	m->pc = pc + 4;
+
+	if (execute_instruction(m, di) < 0) {
+		ls->live &= ~(1 << l);
+		return;
+	}
+
+	for (int i = 0; i < NR_LANE_REGISTERS; i++) {
+		ls->registers[regs[i]][l] = m->registers[regs[i]];
+	}
+	ls->pc[l] = m->pc;
+}
+
+static inline void lockstep_halt_lane(struct lockstep *ls, unsigned int l, unsigned int pc)
+{
+	ls->lanes[l]->pc = pc + 4;
+	machine_halt(ls->lanes[l]);
+	ls->live &= ~(1 << l);
+}
+
+static inline void lockstep_fault_lane(struct lockstep *ls, unsigned int l, unsigned int pc)
+{
+	machine_fault(ls->lanes[l], pc);
+	ls->live &= ~(1 << l);
+}
+
+static inline bool lockstep_code_dirty(struct lockstep *ls, unsigned int pc)
+{
+	unsigned int page = pc >> GUEST_PAGE_SHIFT;
+
+	if (page == ls->code_page && ls->nr_dirtied == ls->code_nr_dirtied) return ls->code_dirty;
+
+	ls->code_page = page;
+	ls->code_nr_dirtied = ls->nr_dirtied;
+	ls->code_dirty = false;
+	for (unsigned int l = 0; l < ls->nr_lanes; l++) {
+		if (guest_translate(&ls->lanes[l]->memory, pc, PAGE_DIRTY)) ls->code_dirty = true;
+	}
+	return ls->code_dirty;
+}
+
+
+/**********************************************************************
+ * lockstep_step
+ *
+ * DESCRIPTION
+ *   Pick the lanes with the lowest pc, and run the instruction there on
+ *   them. This is built once for each instruction set in the host, so the
+ *   vector operations below turn into AVX-512, AVX2, or whatever the
+ *   compiler falls back to.
+ *
+ * RETURN
+ *   true if some lanes are still running
+ *   false if all the lanes have halted
+ */
+static inline __attribute__((always_inline)) bool lockstep_step(struct lockstep *ls)
+{
+	lanes_t *R = ls->registers;
+	struct decoded_instruction scratch;
+	const struct decoded_instruction *di;
+	unsigned int pc = UINT32_MAX, active = 0, first;
+	unsigned int rs, rt, rd;
+	lanes_t mask = {}, next;
+
+	if (!ls->live) return false;
+
+	/* Any pc can be reached by jr, so the halted lanes are told by @live */
+	for (unsigned int l = 0; l < ls->nr_lanes; l++) {
+		if ((ls->live & (1 << l)) && ls->pc[l] <= pc) pc = ls->pc[l];
+	}
+	for (unsigned int l = 0; l < ls->nr_lanes; l++) {
+		if ((ls->live & (1 << l)) && ls->pc[l] == pc) {
+			active |= 1 << l;
+			mask[l] = UINT32_MAX;
+		}
+	}
+	first = __builtin_ctz(active);
+	next = (lanes_t){} + (pc + 4);
+
+	if (ls->stats) {
+		ls->stats->nr_steps++;
+		ls->stats->nr_lane_steps += __builtin_popcount(active);
+	}
+
+	/* Lanes have modified the code. Fetch the instruction on each lane */
+	if (lockstep_code_dirty(ls, pc)) {
+		for (unsigned int l = first; l < ls->nr_lanes; l++) {
+			if (!(active & (1 << l))) continue;
+
+			di = fetch_decoded(ls->lanes[l], pc, &scratch);
+			if (di->op == OP_HALT) {
+				lockstep_halt_lane(ls, l, pc);
+			} else {
+				lockstep_execute_lane(ls, l, pc, di);
+			}
+		}
+		return true;
+	}
+
+	di = fetch_decoded(ls->lanes[first], pc, &scratch);
+	rs = di->rs, rt = di->rt, rd = di->rd;
+
+#define SET(r, value)	R[r] = ((value) & mask) | (R[r] & ~mask)
+	switch (di->op) {
+	case OP_ADD:
+		SET(rd, R[rs] + R[rt]);
+		break;
+	case OP_SUB:
+		SET(rd, R[rs] - R[rt]);
+		break;
+	case OP_AND:
+		SET(rd, R[rs] & R[rt]);
+		break;
+	case OP_OR:
+		SET(rd, R[rs] | R[rt]);
+		break;
+	case OP_NOR:
+		SET(rd, ~(R[rs] | R[rt]));
+		break;
+	case OP_SLL:
+		SET(rd, R[rt] << di->shamt);
+		break;
+	case OP_SRL:
+		SET(rd, R[rt] >> di->shamt);
+		break;
+	case OP_SRA:
+		SET(rd, (lanes_t)((slanes_t)R[rt] >> di->shamt));
+		break;
+	case OP_SLT:
+		SET(rd, (lanes_t)((slanes_t)R[rs] < (slanes_t)R[rt]) & 1);
+		break;
+	case OP_ADDI:
+		SET(rt, R[rs] + (unsigned int)(int16_t)di->imm);
+		break;
+	case OP_ANDI:
+		SET(rt, R[rs] & di->imm);
+		break;
+	case OP_ORI:
+		SET(rt, R[rs] | di->imm);
+		break;
+	case OP_SLTI:
+		SET(rt, (lanes_t)(R[rs] < di->imm) & 1);
+		break;
+	case OP_JR:
+		next = R[rs];
+		break;
+	case OP_JAL:
+		SET(31, next);
+		/* Fall through */
+	case OP_J:
+		next = (lanes_t){} + (((pc + 4) & 0xf0000000) | (di->imm << 2));
+		break;
+	case OP_BEQ:
+	case OP_BNE: {
+		lanes_t taken = (lanes_t)(R[rs] == R[rt]);
+
+		if (di->op == OP_BNE) taken = ~taken;
+		next = (((lanes_t){} + (pc + 4 + ((int16_t)di->imm << 2))) & taken) | (next & ~taken);
+		break;
+	}
+	case OP_LW: {
+		lanes_t address = R[rs] + di->imm;
+
+		/* Gather from the memory of each lane */
+		for (unsigned int l = first; l < ls->nr_lanes; l++) {
+			unsigned int word;
+
+			if (!(active & (1 << l))) continue;
+
+			if (load_word(ls->lanes[l], address[l], &word)) {
+				R[rt][l] = word;
+			} else {
+				lockstep_fault_lane(ls, l, pc);
+				mask[l] = 0;
+			}
+		}
+		break;
+	}
+	case OP_SW: {
+		lanes_t address = R[rs] + di->imm;
+
+		for (unsigned int l = first; l < ls->nr_lanes; l++) {
+			struct guest_memory *memory = &ls->lanes[l]->memory;
+			unsigned int nr_dirty = memory->nr_dirty;
+
+			if (!(active & (1 << l))) continue;
+
+			if (!store_word(ls->lanes[l], address[l], R[rt][l])) {
+				lockstep_fault_lane(ls, l, pc);
+				mask[l] = 0;
+			} else if (memory->nr_dirty != nr_dirty) {
+				ls->nr_dirtied++;
+			}
+		}
+		break;
+	}
+	case OP_HALT:
+		for (unsigned int l = first; l < ls->nr_lanes; l++) {
+			if (!(active & (1 << l))) continue;
+
+			/* Let each lane see if the instruction is a fault rather than 'halt' */
+			if (l != first) fetch_decoded(ls->lanes[l], pc, &scratch);
+			lockstep_halt_lane(ls, l, pc);
+		}
+		return true;
+	default:
+		/* Unknown instructions. Run them on each lane */
+		for (unsigned int l = first; l < ls->nr_lanes; l++) {
+			if (active & (1 << l)) lockstep_execute_lane(ls, l, pc, di);
+		}
+		return true;
+	}
+#undef SET
+
+	ls->pc = (next & mask) | (ls->pc & ~mask);
+	return true;
+}
+
+#define LOCKSTEP_RUN(name, isa)	\
+	static isa void name(struct lockstep *ls) { while (lockstep_step(ls)); }
+
+LOCKSTEP_RUN(lockstep_run_generic, )
+#if defined(__x86_64__)
+LOCKSTEP_RUN(lockstep_run_avx2, __attribute__((target("avx2"))))
+LOCKSTEP_RUN(lockstep_run_avx512, __attribute__((target("avx512f"))))
+#endif
+
+
+/**********************************************************************
+ * run_lockstep
+ *
+ * DESCRIPTION
+ *   Run the program loaded on @nr_lanes machines in @lanes, each from its
+ *   @entry to the halt instruction, in lockstep. The machines are left as if
+ *   @run_program() has run on each of them. @stats, if given, accumulates
+ *   how well the lanes have kept together.
+ *
+ * RETURN
+ *   0 on success
+ *   any other value if @nr_lanes is out of the range
+ */
+int run_lockstep(struct machine *lanes[], unsigned int nr_lanes, struct lockstep_stats *stats)
+{
+	struct lockstep *ls;
+
+	if (!nr_lanes || nr_lanes > LOCKSTEP_LANES) return -1;
+
+	ls = aligned_alloc(sizeof(lanes_t), sizeof(*ls));
+	if (!ls) return -1;
+
+	*ls = (struct lockstep) {
+		.lanes = lanes,
+		.nr_lanes = nr_lanes,
+		.live = (1 << nr_lanes) - 1,
+		.code_page = UINT32_MAX,
+		.stats = stats,
+	};
+	for (unsigned int l = 0; l < nr_lanes; l++) {
+		for (int r = 0; r < 32; r++) {
+			ls->registers[r][l] = lanes[l]->registers[r];
+		}
+		machine_start(lanes[l]);
+		ls->pc[l] = lanes[l]->pc;
+	}
+
+#if defined(__x86_64__)
+	if (__builtin_cpu_supports("avx512f")) {
+		if (stats) stats->isa = "avx512f";
+		lockstep_run_avx512(ls);
+	} else if (__builtin_cpu_supports("avx2")) {
+		if (stats) stats->isa = "avx2";
+		lockstep_run_avx2(ls);
+	} else
+#endif
+	{
+		if (stats) stats->isa = "generic";
+		lockstep_run_generic(ls);
+	}
+
+	for (unsigned int l = 0; l < nr_lanes; l++) {
+		for (int r = 0; r < 32; r++) {
+			lanes[l]->registers[r] = ls->registers[r][l];
+		}
+	}
+	free(ls);
+	return 0;
+}
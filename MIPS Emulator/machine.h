@@ -0,0 +1,340 @@
+/**********************************************************************
+ * Copyright (c) 2019-2023
+ *  Sang-Hoon Kim <sanghoonkim@ajou.ac.kr>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTIABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ **********************************************************************/
+
+#ifndef __PA2_MACHINE_H__
+#define __PA2_MACHINE_H__
+
+#include <errno.h>
+#include <string.h>
+
+#include "types.h"
+#include "memory.h"
+
+struct threaded_instruction;
+
+/**
+ * The instruction mix. The instructions are counted by @execute_instruction()
+ * as they are run, and @run_program() adds the iterations it runs in bulk.
+ * @run_threaded() counts them in its handlers. The JIT counts the ones run by
+ * the translated code in @nr_translated as the blocks are entered and the
+ * traces are left, without breaking them down. Written out in JSON by
+ * @machine_write_stats().
+ */
+#define NR_JR_TARGETS	64
+
+struct machine_stats {
+	unsigned long nr_ops[NR_DECODED_OPS];
+	unsigned long nr_taken;			/* beq and bne taken */
+	struct {
+		unsigned int target;
+		unsigned long count;		/* 0 if the slot is free */
+	} jr_targets[NR_JR_TARGETS];
+	unsigned long nr_jr_others;		/* jr to targets beyond @jr_targets[] */
+	unsigned long nr_translated;	/* Run by the translated code, not in the above */
+	const char *engine;				/* Engine of the last run, or NULL */
+};
+
+/**
+ * A MIPS machine. All the state the execution engines work on lives here,
+ * so any number of machines can run side by side, each on its own thread.
+ * This is also the interface of libpa2.a;
+ *
+ *   struct machine *m = machine_create();
+ *
+ *   load_program(m, "testcases/program-basic");
+ *   m->registers[4] = 10;
+ *   run_program(m);
+ *   ...
+ *   machine_destroy(m);
+ */
+struct machine {
+	/**
+	 * The 4 GiB address space, allocated page by page. The engines stop at
+	 * an access faulting on it, and leave @memory.fault and @pc at the
+	 * instruction. Dirty pages are kept by the interpreters, which are
+	 * @run_program(), @run_threaded(), and @process_instruction(), so that
+	 * the memory can be put back by copying the dirty pages only.
+	 */
+	struct guest_memory memory;
+
+	/**
+	 * The MMU. While it is on, the addresses of the program are virtual, and
+	 * @run_program() runs it with the memory as the physical one. See
+	 * memory.h
+	 */
+	struct guest_mmu mmu;
+
+	unsigned int registers[32];
+	unsigned int pc;
+	unsigned int entry;			/* Where the engines start. INITIAL_PC by default */
+
+	/**
+	 * Pre-decoded instructions of the loaded program. @decoded[i] corresponds
+	 * to the instruction at INITIAL_PC + 4 * i, and @nr_decoded covers up to
+	 * the 'halt' instruction appended by @load_program().
+	 */
+	struct decoded_instruction *decoded;
+	unsigned int nr_decoded;
+
+	struct threaded_instruction *threaded;	/* Program laid out for @run_threaded() */
+
+	/* Registers and @pc saved by @machine_snapshot(). The memory keeps its own */
+	struct {
+		unsigned int registers[32];
+		unsigned int pc;
+	} snapshot;
+
+	/* Loops run in bulk by @run_program(), and the bytes they have copied or filled */
+	unsigned long nr_bulk_loops;
+	unsigned long nr_bulk_bytes;
+
+	/* Instruction mix of what has run since the program is loaded */
+	struct machine_stats stats;
+};
+
+/**
+ * Create a machine in the initial state, and release it
+ */
+extern struct machine *machine_create(void);
+extern void machine_destroy(struct machine *m);
+
+/**
+ * Change the backend and the permissions of the pages of the memory, and
+ * map host files into it. See memory.h
+ */
+extern int machine_set_memory(struct machine *m, bool flat, bool huge);
+extern int machine_protect(struct machine *m, unsigned int addr, size_t length,
+		unsigned int prot);
+extern int machine_map(struct machine *m, const char *filename, unsigned int addr,
+		bool writable);
+
+/**
+ * Save the registers, @pc, and the memory, and put them back. Restoring
+ * takes time proportional to the pages changed since the snapshot.
+ */
+extern int machine_snapshot(struct machine *m);
+extern int machine_restore(struct machine *m);
+
+/**
+ * Write the registers, @pc, and the memory to a checkpoint file, and read
+ * them back. Checkpoints to the same file keep the pages changed since the
+ * previous one only, and are written in the background. See memory.c
+ */
+extern int machine_checkpoint(struct machine *m, const char *filename);
+extern int machine_resume(struct machine *m, const char *filename);
+
+extern int machine_write_stats(struct machine *m, const char *filename);
+
+extern int load_program(struct machine *m, char * const filename);
+extern int process_instruction(struct machine *m, unsigned int instr);
+
+/**
+ * Execution engines. They run the loaded program from @entry to the halt
+ * instruction. @run_jit() and @run_tiered() share one code cache in the
+ * process, so machines take turns on them.
+ */
+extern int run_program(struct machine *m);
+extern int run_threaded(struct machine *m);
+extern int run_jit(struct machine *m);
+extern int run_tiered(struct machine *m, unsigned int threshold);
+extern int run_pairs(struct machine *m);
+extern int run_profile(struct machine *m);
+extern int run_sample(struct machine *m, unsigned int hz);
+
+/**
+ * Run the loaded program with a shadow call stack, and write the call paths
+ * in the folded-stack format. See calls.c
+ */
+extern int run_calls(struct machine *m, const char *folded, const char *symbols);
+
+/**
+ * Run up to LOCKSTEP_LANES machines with the same program together, one
+ * vector lane each. See lockstep.c
+ */
+#define LOCKSTEP_LANES	16
+
+struct lockstep_stats {
+	unsigned long nr_steps;			/* Instructions issued */
+	unsigned long nr_lane_steps;	/* Instructions run on the lanes */
+	const char *isa;				/* Vector instructions used */
+};
+
+extern int run_lockstep(struct machine *lanes[], unsigned int nr_lanes,
+		struct lockstep_stats *stats);
+
+extern int aot_translate(struct machine *m, const char *filename);
+
+/**
+ * Run the loaded program as many instances on copies of @m. See sweep.c
+ */
+extern int run_sweep(struct machine *m, int argc, char *argv[]);
+
+/**
+ * Building blocks of the engines
+ */
+
+/**********************************************************************
+ * invalidate_decoded
+ *
+ * DESCRIPTION
+ *   Drop the pre-decoded instructions overlapping [@addr, @addr + 4) so that
+ *   they are decoded again from the memory when they are fetched next time.
+ */
+static inline void invalidate_decoded(struct machine *m, unsigned int addr)
+{
+	unsigned int code_end = INITIAL_PC + m->nr_decoded * 4;
+
+	for (unsigned int a = addr & ~0x3; a < addr + 4; a += 4) {
+		if (a >= INITIAL_PC && a < code_end) {
+			m->decoded[(a - INITIAL_PC) / 4].valid = false;
+		}
+	}
+}
+
+/**
+ * Words in the memory are big endian to the guest, and aligned ones are
+ * stored as host words. See memory.h. Unaligned words go byte by byte on the
+ * slow paths. @store_word() keeps the dirty pages and the pre-decoded
+ * instructions up to date. They return false when the access faults, leaving
+ * @memory.fault.
+ *
+ * While the engine catches the faults on the flat memory, they access it
+ * without any check, and the faults go to the engine. See memory.h. The flat
+ * memory is not used while the MMU is on, and @address is translated by the
+ * MMU first then.
+ */
+static inline bool load_word(struct machine *m, unsigned int address, unsigned int *word)
+{
+	const uint32_t *p;
+
+	if (!guest_word_aligned(address)) {
+		if (m->mmu.enabled) return guest_mmu_load(&m->mmu, &m->memory, address, word, PAGE_READ);
+		return guest_load(&m->memory, address, word);
+	}
+
+	if (m->memory.catch) {
+		*word = *(const uint32_t *)(m->memory.flat + address);
+		return true;
+	}
+	if (m->mmu.enabled && !guest_mmu_translate(&m->mmu, &m->memory, address, PAGE_READ, &address)) {
+		return false;
+	}
+
+	p = (const uint32_t *)guest_translate(&m->memory, address, PAGE_READ);
+	if (!p) return guest_load(&m->memory, address, word);
+
+	*word = *p;
+	return true;
+}
+
+static inline bool store_word(struct machine *m, unsigned int address, unsigned int word)
+{
+	uint32_t *p;
+
+	if (!guest_word_aligned(address)) {
+		if (m->mmu.enabled) {
+			unsigned int last = address + 3;
+
+			/* Either end of the word may be on a page mapped elsewhere */
+			if (!guest_mmu_store(&m->mmu, &m->memory, address, word)) return false;
+			guest_mmu_translate(&m->mmu, &m->memory, last, PAGE_WRITE, &last);
+			invalidate_decoded(m, last);
+			guest_mmu_translate(&m->mmu, &m->memory, address, PAGE_WRITE, &address);
+		} else if (!guest_store(&m->memory, address, word)) {
+			return false;
+		}
+	} else if (m->memory.catch) {
+		*(uint32_t *)(m->memory.flat + address) = word;
+	} else {
+		if (m->mmu.enabled &&
+				!guest_mmu_translate(&m->mmu, &m->memory, address, PAGE_WRITE, &address)) {
+			return false;
+		}
+		p = (uint32_t *)guest_translate(&m->memory, address, PAGE_WRITE | PAGE_DIRTY);
+		if (!p) {
+			if (!guest_store(&m->memory, address, word)) return false;
+		} else {
+			*p = word;
+		}
+		if (m->mmu.enabled) guest_mmu_stored(&m->mmu, address);
+	}
+	invalidate_decoded(m, address);
+	return true;
+}
+
+/**
+ * Start running from @entry with no fault
+ */
+static inline void machine_start(struct machine *m)
+{
+	m->pc = m->entry;
+	m->memory.fault.type = GUEST_FAULT_NONE;
+}
+
+/**
+ * Stop at the instruction at @pc faulting on the memory
+ */
+static inline int machine_fault(struct machine *m, unsigned int pc)
+{
+	m->memory.fault.pc = pc;
+	m->pc = pc;
+	return -EFAULT;
+}
+
+/**
+ * Finish at the halt instruction, or at the instruction @fetch_decoded() has
+ * turned into 'halt' since it cannot be fetched
+ */
+static inline int machine_halt(struct machine *m)
+{
+	if (m->memory.fault.type == GUEST_FAULT_NONE) return 0;
+	return machine_fault(m, m->memory.fault.pc);
+}
+
+/**
+ * Whether the loaded program can be run from its pages where it is loaded,
+ * with the MMU off. The engines that translate the program as a whole leave
+ * the program to @run_program() unless it is.
+ */
+static inline bool program_executable(const struct machine *m)
+{
+	if (m->mmu.enabled) return false;
+	return guest_check(&m->memory, INITIAL_PC, m->nr_decoded * 4, PAGE_EXEC);
+}
+
+/**
+ * Count jr to @target in @stats. The targets are hashed into @jr_targets[],
+ * and counted together once it is full.
+ */
+static inline void count_jr_target(struct machine_stats *stats, unsigned int target)
+{
+	unsigned int slot = (target >> 2) & (NR_JR_TARGETS - 1);
+
+	for (unsigned int i = 0; i < NR_JR_TARGETS; i++, slot = (slot + 1) & (NR_JR_TARGETS - 1)) {
+		if (!stats->jr_targets[slot].count) stats->jr_targets[slot].target = target;
+		if (stats->jr_targets[slot].target == target) {
+			stats->jr_targets[slot].count++;
+			return;
+		}
+	}
+	stats->nr_jr_others++;
+}
+
+extern void decode_instruction(unsigned int instr, struct decoded_instruction *di);
+extern const struct decoded_instruction *fetch_decoded(struct machine *m, unsigned int addr,
+		struct decoded_instruction *scratch);
+extern int execute_instruction(struct machine *m, const struct decoded_instruction *di);
+
+#endif
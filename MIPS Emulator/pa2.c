@@ -19,6 +19,12 @@
 #include <string.h>
 #include <inttypes.h>
 #include <ctype.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#include "machine.h"
+#include "sample.h"
+#include "counters.h"
 
 /*====================================================================*/
 /*          ****** DO NOT MODIFY ANYTHING FROM THIS LINE ******       */
@@ -31,17 +37,13 @@
 #define MAX_TOKEN_LEN	64	/* Maximum length of single token */
 #define MAX_COMMAND	256 /* Maximum length of command string */
 
-typedef unsigned char bool;
-#define true	1
-#define false	0
-
 const char *__color_start = "[1;32;40m";
 const char *__color_end = "[0m";
 
 /**
- * memory[] emulates the memory of the machine
+ * Initial contents of the memory of the machine. The rest is zero-filled
  */
-static unsigned char memory[1 << 20] = {	/* 1MB memory at 0x0000 0000 -- 0x0100 0000 */
+static const unsigned char initial_memory[] = {
 	0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77,
 	0xde, 0xad, 0xbe, 0xef, 0x00, 0x00, 0x00, 0x00,
 	'h',  'e',  'l',  'l',  'o',  ' ',  'w',  'o',
@@ -52,13 +54,10 @@ static unsigned char memory[1 << 20] = {	/* 1MB memory at 0x0000 0000 -- 0x0100
 	'c',  't',  'u',  'r',  'e',  '.',  0x00, 0x00,
 };
 
-#define INITIAL_PC	0x1000	/* Initial value for PC register */
-#define INITIAL_SP	0x8000	/* Initial location for stack pointer */
-
 /**
- * Registers of the machine
+ * Initial values of the registers of the machine
  */
-static unsigned int registers[32] = {
+static const unsigned int initial_registers[32] = {
 	0, 0, 0, 0, 0, 0, 0, 0,
 	0, 0, 0, 0, 0, 0, 0, 0,
 	0x10, INITIAL_PC, 0x20, 3, 0xbadacafe, 0xcdcdcdcd, 0xffffffff, 7,
@@ -75,11 +74,6 @@ const char *register_names[] = {
 	"t8", "t9", "k0", "k1", "gp", "sp", "fp", "ra"
 };
 
-/**
- * Program counter register
- */
-static unsigned int pc = INITIAL_PC;
-
 /**
  * strmatch()
  *
@@ -91,320 +85,1890 @@ static unsigned int pc = INITIAL_PC;
  *   1 if @str and @expect are the same
  *   0 otherwise
  */
-static inline bool strmatch(char * const str, const char *expect)
+static inline bool strmatch(char * const str, const char *expect)
+{
+	return (strlen(str) == strlen(expect)) && (strncmp(str, expect, strlen(expect)) == 0);
+}
+
+/*          ****** DO NOT MODIFY ANYTHING UP TO THIS LINE ******      */
+/*====================================================================*/
+
+
+/**********************************************************************
+ * machine_create
+ *
+ * DESCRIPTION
+ *   Allocate a machine with the initial memory and registers, and @pc at
+ *   INITIAL_PC. No program is loaded yet.
+ *
+ * RETURN
+ *   The new machine
+ *   NULL if the memory is not available
+ */
+struct machine *machine_create(void)
+{
+	struct machine *m = calloc(1, sizeof(*m));
+
+	if (!m) return NULL;
+
+	guest_memory_init(&m->memory);
+	if (guest_poke(&m->memory, 0x0, initial_memory, sizeof(initial_memory))) {
+		machine_destroy(m);
+		return NULL;
+	}
+	guest_mmu_set(&m->mmu, false, 0);
+	memcpy(m->registers, initial_registers, sizeof(initial_registers));
+	m->pc = INITIAL_PC;
+	m->entry = INITIAL_PC;
+
+	return m;
+}
+
+
+/**********************************************************************
+ * machine_destroy
+ *
+ * DESCRIPTION
+ *   Release the machine @m and everything the engines have built for it.
+ *   The files mapped writable are written back first.
+ */
+void machine_destroy(struct machine *m)
+{
+	if (!m) return;
+
+	guest_sync(&m->memory);
+	guest_memory_release(&m->memory);
+	free(m->decoded);
+	free(m->threaded);
+	free(m);
+}
+
+
+/**********************************************************************
+ * machine_set_memory
+ *
+ * DESCRIPTION
+ *   Move the memory of @m to the flat backend if @flat, with transparent
+ *   huge pages if @huge, or to the paged one otherwise. The contents and the
+ *   permissions are kept while the pages become clean.
+ *
+ * RETURN
+ *   0 on success
+ *   -errno if the new memory is not available
+ */
+int machine_set_memory(struct machine *m, bool flat, bool huge)
+{
+	struct guest_memory memory;
+	int ret = 0;
+
+	if (flat) {
+		ret = guest_memory_init_flat(&memory, huge);
+	} else {
+		guest_memory_init(&memory);
+	}
+	if (!ret) ret = guest_memory_copy(&memory, &m->memory);
+	if (ret) {
+		guest_memory_release(&memory);
+		return ret;
+	}
+
+	guest_memory_release(&m->memory);
+	m->memory = memory;
+	return 0;
+}
+
+
+/**********************************************************************
+ * machine_protect
+ *
+ * DESCRIPTION
+ *   Set the permissions of the pages over [@addr, @addr + @length) to @prot,
+ *   a combination of PAGE_READ, PAGE_WRITE, and PAGE_EXEC. The instructions
+ *   pre-decoded on the pages are dropped so that fetching them checks the
+ *   new permissions.
+ *
+ * RETURN
+ *   0 on success
+ *   -ENOMEM if the pages cannot be allocated
+ */
+int machine_protect(struct machine *m, unsigned int addr, size_t length, unsigned int prot)
+{
+	uint64_t start = addr & ~(GUEST_PAGE_SIZE - 1);
+	uint64_t end = ((uint64_t)addr + length + GUEST_PAGE_SIZE - 1) & ~(uint64_t)(GUEST_PAGE_SIZE - 1);
+
+	if (start < INITIAL_PC) start = INITIAL_PC;
+	if (end > INITIAL_PC + m->nr_decoded * 4) end = INITIAL_PC + m->nr_decoded * 4;
+	for (uint64_t a = start; a < end; a += 4) {
+		invalidate_decoded(m, a);
+	}
+	return guest_protect(&m->memory, addr, length, prot);
+}
+
+
+/**********************************************************************
+ * machine_map
+ *
+ * DESCRIPTION
+ *   Map the host file @filename into the memory of @m at @addr, writable
+ *   to the guest and written back if @writable. See @guest_map(). The
+ *   instructions pre-decoded over the file are dropped.
+ *
+ * RETURN
+ *   0 on success
+ *   -errno if the file cannot be mapped
+ */
+int machine_map(struct machine *m, const char *filename, unsigned int addr, bool writable)
+{
+	uint64_t end = INITIAL_PC + m->nr_decoded * 4;
+	int ret = guest_map(&m->memory, filename, addr, writable);
+
+	if (ret) return ret;
+	for (uint64_t a = addr > INITIAL_PC ? addr : INITIAL_PC; a < end; a += 4) {
+		invalidate_decoded(m, a);
+	}
+	return 0;
+}
+
+
+/**********************************************************************
+ * machine_snapshot
+ *
+ * DESCRIPTION
+ *   Take the snapshot of the registers, @pc, and the memory of @m. The
+ *   memory is copied on write, so this costs nothing but clearing the
+ *   dirty pages. Moving the memory with @machine_set_memory() drops it.
+ *
+ * RETURN
+ *   0
+ */
+int machine_snapshot(struct machine *m)
+{
+	memcpy(m->snapshot.registers, m->registers, sizeof(m->registers));
+	m->snapshot.pc = m->pc;
+	return guest_snapshot(&m->memory);
+}
+
+
+/**********************************************************************
+ * machine_restore
+ *
+ * DESCRIPTION
+ *   Put @m back to the snapshot. The program is decoded again where the
+ *   pages put back overlap it, and the TLB is flushed as the page tables
+ *   may be put back too.
+ *
+ * RETURN
+ *   0 on success
+ *   -ENOENT if no snapshot is taken
+ *   -ENOMEM if the memory cannot be restored
+ */
+int machine_restore(struct machine *m)
+{
+	unsigned int code_end = INITIAL_PC + m->nr_decoded * 4;
+
+	if (!m->memory.snapshot) return -ENOENT;
+
+	for (unsigned int i = 0; i < m->memory.nr_saved; i++) {
+		unsigned int start = m->memory.saved[i].page << GUEST_PAGE_SHIFT;
+
+		if (start + GUEST_PAGE_SIZE <= INITIAL_PC || start >= code_end) continue;
+		for (unsigned int a = start; a < start + GUEST_PAGE_SIZE; a += 4) {
+			invalidate_decoded(m, a);
+		}
+	}
+	memcpy(m->registers, m->snapshot.registers, sizeof(m->registers));
+	m->pc = m->snapshot.pc;
+	guest_mmu_set(&m->mmu, m->mmu.enabled, m->mmu.root);
+	return guest_restore(&m->memory);
+}
+
+
+
+/**********************************************************************
+ * decode_instruction
+ *
+ * DESCRIPTION
+ *   Split the machine code @instr into its fields and figure out the
+ *   operation to perform. The result is stored in @di.
+ */
+void decode_instruction(unsigned int instr, struct decoded_instruction *di)
+{
+	unsigned int opcode = instr >> 26;
+
+	*di = (struct decoded_instruction) {
+		.op = OP_NOP,
+		.rs = (instr >> 21) & 0x1f,
+		.rt = (instr >> 16) & 0x1f,
+		.rd = (instr >> 11) & 0x1f,
+		.shamt = (instr >> 6) & 0x1f,
+		.valid = true,
+		.imm = instr & 0xffff,
+	};
+
+	if (instr == 0xffffffff) {
+		di->op = OP_HALT;
+		return;
+	}
+
+	switch (opcode) {
+	case 0x00:
+		switch (instr & 0x3f) {
+		case 0x20: di->op = OP_ADD; break;
+		case 0x22: di->op = OP_SUB; break;
+		case 0x24: di->op = OP_AND; break;
+		case 0x25: di->op = OP_OR; break;
+		case 0x27: di->op = OP_NOR; break;
+		case 0x00: di->op = OP_SLL; break;
+		case 0x02: di->op = OP_SRL; break;
+		case 0x03: di->op = OP_SRA; break;
+		case 0x2a: di->op = OP_SLT; break;
+		case 0x08: di->op = OP_JR; break;
+		}
+		break;
+	case 0x02:
+		di->op = OP_J;
+		di->imm = instr & 0x03ffffff;
+		break;
+	case 0x03:
+		di->op = OP_JAL;
+		di->imm = instr & 0x03ffffff;
+		break;
+	case 0x04: di->op = OP_BEQ; break;
+	case 0x05:
+		di->op = OP_BNE;
+		if (di->imm & 0x8000) di->idiom = IDIOM_UNKNOWN;
+		break;
+	case 0x08: di->op = OP_ADDI; break;
+	case 0x0c: di->op = OP_ANDI; break;
+	case 0x0d: di->op = OP_ORI; break;
+	case 0x0a: di->op = OP_SLTI; break;
+	case 0x23: di->op = OP_LW; break;
+	case 0x2b: di->op = OP_SW; break;
+	}
+}
+
+
+/**********************************************************************
+ * execute_instruction
+ *
+ * DESCRIPTION
+ *   Execute the pre-decoded instruction @di. @pc should already point to
+ *   the next instruction.
+ *
+ * RETURN
+ *   1 if successfully processed the instruction.
+ *   0 if @di is 'halt' or unknown instructions
+ *   -EFAULT if the instruction faults on the memory. @pc is put back to it.
+ */
+int execute_instruction(struct machine *m, const struct decoded_instruction *di)
+{
+	unsigned int rs = di->rs, rt = di->rt, rd = di->rd;
+
+	m->stats.nr_ops[di->op]++;
+	switch (di->op) {
+	case OP_ADD:
+		m->registers[rd] = m->registers[rs] + m->registers[rt];
+		break;
+	case OP_SUB:
+		m->registers[rd] = m->registers[rs] - m->registers[rt];
+		break;
+	case OP_AND:
+		m->registers[rd] = m->registers[rs] & m->registers[rt];
+		break;
+	case OP_OR:
+		m->registers[rd] = m->registers[rs] | m->registers[rt];
+		break;
+	case OP_NOR:
+		m->registers[rd] = ~(m->registers[rs] | m->registers[rt]);
+		break;
+	case OP_SLL:
+		m->registers[rd] = m->registers[rt] << di->shamt;
+		break;
+	case OP_SRL:
+		m->registers[rd] = m->registers[rt] >> di->shamt;
+		break;
+	case OP_SRA:
+		m->registers[rd] = (int)m->registers[rt] >> di->shamt;
+		break;
+	case OP_SLT:
+		m->registers[rd] = ((int)m->registers[rs] < (int)m->registers[rt]) ? 1 : 0;
+		break;
+	case OP_JR:
+		m->pc = m->registers[rs];
+		count_jr_target(&m->stats, m->pc);
+		break;
+	case OP_J:
+		m->pc = (m->pc & 0xf0000000) | (di->imm << 2);
+		break;
+	case OP_JAL:
+		m->registers[31] = m->pc;
+		m->pc = (m->pc & 0xf0000000) | (di->imm << 2);
+		break;
+	case OP_BEQ:
+		if (m->registers[rs] == m->registers[rt]) {
+			m->pc = m->pc + ((int16_t)di->imm << 2);
+			m->stats.nr_taken++;
+		}
+		break;
+	case OP_BNE:
+		if (m->registers[rs] != m->registers[rt]) {
+			m->pc = m->pc + ((int16_t)di->imm << 2);
+			m->stats.nr_taken++;
+		}
+		break;
+	case OP_ADDI:
+		m->registers[rt] = m->registers[rs] + (int16_t)di->imm;
+		break;
+	case OP_ANDI:
+		m->registers[rt] = m->registers[rs] & di->imm;
+		break;
+	case OP_ORI:
+		m->registers[rt] = m->registers[rs] | di->imm;
+		break;
+	case OP_SLTI:
+		m->registers[rt] = m->registers[rs] < di->imm ? 1 : 0;
+		break;
+	case OP_LW:
+		if (!load_word(m, m->registers[rs] + di->imm, m->registers + rt)) {
+			return machine_fault(m, m->pc - 4);
+		}
+		break;
+	case OP_SW:
+		if (!store_word(m, m->registers[rs] + di->imm, m->registers[rt])) {
+			return machine_fault(m, m->pc - 4);
+		}
+		break;
+	default: /* halt and unknown instructions */
+		return 0;
+	}
+	return 1;
+}
+
+
+/**********************************************************************
+ * process_instruction
+ *
+ * DESCRIPTION
+ *   Execute the machine code given through @instr. The following table lists
+ *   up the instructions to support. Note that a pseudo instruction 'halt'
+ *   (0xffffffff) is added for the testing purpose. Also '*' instrunctions are
+ *   the ones that are newly added to PA2.
+ *
+ * | Name   | Format    | Opcode / opcode + funct |
+ * | ------ | --------- | ----------------------- |
+ * | `add`  | r-format  | 0 + 0x20                |
+ * | `addi` | i-format  | 0x08                    |
+ * | `sub`  | r-format  | 0 + 0x22                |
+ * | `and`  | r-format  | 0 + 0x24                |
+ * | `andi` | i-format  | 0x0c                    |
+ * | `or`   | r-format  | 0 + 0x25                |
+ * | `ori`  | i-format  | 0x0d                    |
+ * | `nor`  | r-format  | 0 + 0x27                |
+ * | `sll`  | r-format  | 0 + 0x00                |
+ * | `srl`  | r-format  | 0 + 0x02                |
+ * | `sra`  | r-format  | 0 + 0x03                |
+ * | `lw`   | i-format  | 0x23                    |
+ * | `sw`   | i-format  | 0x2b                    |
+ * | `slt`  | r-format* | 0 + 0x2a                |
+ * | `slti` | i-format* | 0x0a                    |
+ * | `beq`  | i-format* | 0x04                    |
+ * | `bne`  | i-format* | 0x05                    |
+ * | `jr`   | r-format* | 0 + 0x08                |
+ * | `j`    | j-format* | 0x02                    |
+ * | `jal`  | j-format* | 0x03                    |
+ * | `halt` | special*  | @instr == 0xffffffff    |
+ *
+ * RETURN VALUE
+ *   1 if successfully processed the instruction.
+ *   0 if @instr is 'halt' or unknown instructions
+ *   -EFAULT if @instr faults on the memory
+ */
+int process_instruction(struct machine *m, unsigned int instr)
+{
+	struct decoded_instruction di;
+	unsigned int pc = m->pc;
+
+	decode_instruction(instr, &di);
+	if (di.op == OP_HALT || di.op == OP_NOP) return 0;
+
+	if (execute_instruction(m, &di) < 0) return machine_fault(m, pc);
+	return 1;
+}
+
+
+/**********************************************************************
+ * fetch_decoded
+ *
+ * DESCRIPTION
+ *   Return the pre-decoded instruction at @addr. Instructions invalidated
+ *   by @invalidate_decoded() are decoded again from the memory. Instructions
+ *   outside the loaded program are decoded into @scratch.
+ *
+ *   An instruction on a page without the execute permission reads as 'halt'
+ *   while the fault is left to @memory.fault. The engines stop there.
+ */
+const struct decoded_instruction *fetch_decoded(struct machine *m, unsigned int addr,
+		struct decoded_instruction *scratch)
+{
+	unsigned int instr;
+	struct decoded_instruction *di = scratch;
+	unsigned int index = (addr - INITIAL_PC) / 4;
+	const unsigned char *p;
+
+	if (index < m->nr_decoded && !(addr & 0x3)) {
+		di = m->decoded + index;
+		if (di->valid) return di;
+	}
+
+	p = guest_word_aligned(addr) ? guest_translate(&m->memory, addr, PAGE_EXEC) : NULL;
+	if (p) {
+		instr = *(const uint32_t *)p;
+	} else if (!guest_fetch(&m->memory, addr, &instr)) {
+		static const struct decoded_instruction fault = { .op = OP_HALT, };
+
+		m->memory.fault.pc = addr;
+		return &fault;
+	}
+	decode_instruction(instr, di);
+	return di;
+}
+
+
+/**
+ * Decode the @nr_decoded instructions from INITIAL_PC in the memory
+ */
+static int decode_program(struct machine *m, unsigned int nr_decoded)
+{
+	m->nr_decoded = nr_decoded;
+	m->decoded = realloc(m->decoded, sizeof(*m->decoded) * m->nr_decoded);
+	if (!m->decoded) {
+		m->nr_decoded = 0;
+		return -ENOMEM;
+	}
+	for (unsigned int i = 0; i < m->nr_decoded; i++) {
+		unsigned char bytes[4];
+
+		guest_peek(&m->memory, INITIAL_PC + i * 4, bytes, sizeof(bytes));
+		decode_instruction((bytes[0] << 24) | (bytes[1] << 16) | (bytes[2] << 8) | bytes[3],
+				m->decoded + i);
+	}
+	return 0;
+}
+
+
+/**********************************************************************
+ * load_program(filename)
+ *
+ * DESCRIPTION
+        *   Load the instructions in the file @filename onto the memory starting at
+*   @INITIAL_PC. Each line in the program file looks like;
+*
+*	 [MIPS instruction started with 0x prefix]  // optional comments
+*
+*   For example,
+*
+*   0x8c090008
+*   0xac090020	// sw t1, zero + 32
+*   0x8c080000
+*
+*   implies three MIPS instructions to load. Each machine instruction may
+*   be followed by comments like the second instruction. However you can simply
+*   call strtoimax(linebuffer, NULL, 0) to read the machine code while
+*   ignoring the comment parts.
+*
+*	 The program DOES NOT include the 'halt' instruction. Thus, make sure the
+*	 'halt' instruction is appended to the loaded instructions to terminate
+        *	 your program properly.
+*
+*	 Refer to the @main() for reading data from files. (fopen, fgets, fclose).
+*
+* RETURN
+*	 0 on successfully load the program
+        *	 any other value otherwise
+*/
+
+int load_program(struct machine *m, char * const filename) {
+    char linebuffer[100];
+    FILE *fp = fopen(filename, "r");
+    unsigned int hexvalue = 0;
+    m->pc = INITIAL_PC;
+
+    if (fp == NULL) {
+        printf("Error opening file!\n");
+        return -EINVAL;
+    }
+
+    while (fgets(linebuffer, sizeof(linebuffer), fp)) {
+        unsigned char bytes[4];
+
+        hexvalue = strtoimax(linebuffer, NULL, 0);
+
+        for (int i = 0; i < 4; i++) {
+            bytes[3 - i] = (hexvalue >> (8 * i)) & 0xff;
+        }
+        if (guest_poke(&m->memory, m->pc, bytes, sizeof(bytes))) {
+            fclose(fp);
+            return -ENOMEM;
+        }
+        m->pc += 4;
+    }
+    fclose(fp);
+
+    if (guest_poke(&m->memory, m->pc, (unsigned char []){ 0xff, 0xff, 0xff, 0xff }, 4)) {
+        return -ENOMEM;
+    }
+
+    memset(&m->stats, 0x00, sizeof(m->stats));
+
+    /* Decode the loaded instructions, including the trailing halt, once */
+    return decode_program(m, (m->pc - INITIAL_PC) / 4 + 1);
+
+}
+
+
+/**
+ * The state of the machine in the checkpoints, along with the memory
+ */
+struct machine_checkpoint {
+	unsigned int registers[32];
+	unsigned int pc;
+	unsigned int entry;
+	unsigned int nr_decoded;		/* Instructions of the loaded program */
+};
+
+/**********************************************************************
+ * machine_checkpoint
+ *
+ * DESCRIPTION
+ *   Checkpoint the registers, @pc, and the memory of @m to the file
+ *   @filename. See @guest_checkpoint() for how the file is written.
+ *
+ * RETURN
+ *   0 on success
+ *   -ENOMEM if the checkpoint cannot be put together
+ */
+int machine_checkpoint(struct machine *m, const char *filename)
+{
+	struct machine_checkpoint state = {
+		.pc = m->pc,
+		.entry = m->entry,
+		.nr_decoded = m->nr_decoded,
+	};
+
+	memcpy(state.registers, m->registers, sizeof(m->registers));
+	return guest_checkpoint(&m->memory, filename, &state, sizeof(state));
+}
+
+
+/**********************************************************************
+ * machine_resume
+ *
+ * DESCRIPTION
+ *   Put @m to the checkpoint in the file @filename, and decode the program
+ *   there again. The memory stays on its backend with the files mapped in,
+ *   the MMU stays as it is with the TLB flushed, and the snapshot is
+ *   dropped.
+ *
+ * RETURN
+ *   0 on success
+ *   -errno if the checkpoint cannot be resumed. @m is left as it is then.
+ */
+int machine_resume(struct machine *m, const char *filename)
+{
+	struct machine_checkpoint state;
+	struct guest_memory memory;
+	int ret = 0;
+
+	if (m->memory.flat) {
+		ret = guest_memory_init_flat(&memory, false);
+	} else {
+		guest_memory_init(&memory);
+	}
+	if (!ret) ret = guest_map_share(&memory, &m->memory);
+	if (!ret) ret = guest_resume(&memory, filename, &state, sizeof(state));
+	if (ret) {
+		guest_memory_release(&memory);
+		return ret;
+	}
+
+	guest_sync(&m->memory);
+	guest_memory_release(&m->memory);
+	m->memory = memory;
+	memcpy(m->registers, state.registers, sizeof(m->registers));
+	m->pc = state.pc;
+	m->entry = state.entry;
+	guest_mmu_set(&m->mmu, m->mmu.enabled, m->mmu.root);
+	return decode_program(m, state.nr_decoded);
+}
+#define MAX_IDIOM_INSTRUCTIONS	6	/* Longest loop body recognized, with bne */
+
+/**
+ * A loop recognized by @recognize_loop(). Every iteration loads the word at
+ * @src + @src_offset into @value (copy only), stores @value at @dst +
+ * @dst_offset, and adds 4 to the pointers and @step to @counter.
+ */
+struct loop_shape {
+	enum loop_idiom idiom;
+	unsigned int src, dst;		/* Pointer registers. They can be the same */
+	unsigned int src_offset, dst_offset;
+	unsigned int value;
+	int counter;				/* -1 if there is no counter */
+	int step;
+	unsigned int induction;		/* Register compared by bne, and its step */
+	int induction_step;
+	unsigned int bound;			/* Register compared with @induction */
+};
+
+/* Step of @reg in the loop, or 0 if @reg is not changed in the loop */
+static int loop_step(const struct loop_shape *shape, unsigned int reg)
+{
+	if (reg == shape->src || reg == shape->dst) return 4;
+	if ((int)reg == shape->counter) return shape->step;
+	return 0;
+}
+
+
+/**********************************************************************
+ * recognize_loop
+ *
+ * DESCRIPTION
+ *   See if the loop from @start closed by the bne at @end is a word-copy
+ *   or a word-fill loop, and fill @shape. The recognized loops are;
+ *
+ *   copy:  lw   v, o1(s)          fill:  sw   v, o(d)
+ *          sw   v, o2(d)                 addi d, d, 4
+ *          addi s, s, 4                  [addi c, c, k]
+ *          addi d, d, 4   (if s != d)    bne  x, y, start
+ *          [addi c, c, k]
+ *          bne  x, y, start
+ *
+ *   The addi may come in any order, and one of x and y should be s, d, or c
+ *   while the other one does not change in the loop.
+ *
+ * RETURN
+ *   true if the loop is recognized
+ *   false otherwise
+ */
+static bool recognize_loop(struct machine *m, unsigned int start, unsigned int end, struct loop_shape *shape)
+{
+	struct decoded_instruction scratch[MAX_IDIOM_INSTRUCTIONS];
+	const struct decoded_instruction *body[MAX_IDIOM_INSTRUCTIONS];
+	unsigned int nr = (end - start) / 4 + 1;
+	unsigned int i = 0;
+	bool src_stepped = false, dst_stepped = false;
+	const struct decoded_instruction *bne;
+
+	if (nr < 3 || nr > MAX_IDIOM_INSTRUCTIONS) return false;
+	for (unsigned int j = 0; j < nr; j++) {
+		body[j] = fetch_decoded(m, start + j * 4, scratch + j);
+	}
+
+	*shape = (struct loop_shape) { .counter = -1, };
+
+	if (body[0]->op == OP_LW) {
+		shape->idiom = IDIOM_COPY;
+		shape->src = body[0]->rs;
+		shape->src_offset = body[0]->imm;
+		shape->value = body[0]->rt;
+		i++;
+		if (body[i]->op != OP_SW || body[i]->rt != shape->value) return false;
+	} else {
+		shape->idiom = IDIOM_FILL;
+		if (body[i]->op != OP_SW) return false;
+		shape->value = body[i]->rt;
+	}
+	shape->dst = body[i]->rs;
+	shape->dst_offset = body[i]->imm;
+	if (shape->idiom == IDIOM_FILL) shape->src = shape->dst;
+	i++;
+
+	for (; i < nr - 1; i++) {
+		const struct decoded_instruction *di = body[i];
+		int imm = (int16_t)di->imm;
+
+		if (di->op != OP_ADDI || di->rs != di->rt || !imm) return false;
+
+		if (di->rt == shape->src && !src_stepped && imm == 4) {
+			src_stepped = true;
+			if (shape->src == shape->dst) dst_stepped = true;
+		} else if (di->rt == shape->dst && !dst_stepped && imm == 4) {
+			dst_stepped = true;
+		} else if (shape->counter < 0 && di->rt != shape->src && di->rt != shape->dst) {
+			shape->counter = di->rt;
+			shape->step = imm;
+		} else {
+			return false;
+		}
+	}
+	if (!src_stepped || !dst_stepped) return false;
+
+	/* The loaded or stored value should not be a pointer nor the counter */
+	if (loop_step(shape, shape->value)) return false;
+
+	bne = body[nr - 1];
+	if (loop_step(shape, bne->rs) && !loop_step(shape, bne->rt) &&
+			(shape->idiom == IDIOM_FILL || bne->rt != shape->value)) {
+		shape->induction = bne->rs;
+		shape->bound = bne->rt;
+	} else if (loop_step(shape, bne->rt) && !loop_step(shape, bne->rs) &&
+			(shape->idiom == IDIOM_FILL || bne->rs != shape->value)) {
+		shape->induction = bne->rt;
+		shape->bound = bne->rs;
+	} else {
+		return false;
+	}
+	shape->induction_step = loop_step(shape, shape->induction);
+
+	return true;
+}
+
+
+/**
+ * Bytes from @dst and @src up to @length staying in a page on both sides
+ */
+static inline uint64_t bulk_chunk(unsigned int dst, unsigned int src, uint64_t length)
+{
+	uint64_t room = GUEST_PAGE_SIZE - (dst & (GUEST_PAGE_SIZE - 1));
+
+	if (room > GUEST_PAGE_SIZE - (src & (GUEST_PAGE_SIZE - 1))) {
+		room = GUEST_PAGE_SIZE - (src & (GUEST_PAGE_SIZE - 1));
+	}
+	return room < length ? room : length;
+}
+
+/**
+ * Bring in the pages over [@addr, @addr + @length) for @flags ahead of the
+ * bulk loop, so that it either runs to the end or does not run at all
+ */
+static bool bulk_page_in(struct machine *m, unsigned int addr, uint64_t length, guest_pte_t flags)
+{
+	if (!guest_check(&m->memory, addr, length, flags)) return false;
+
+	for (uint64_t done = 0; done < length; done += bulk_chunk(addr + done, addr + done, length - done)) {
+		if (!guest_page_in(&m->memory, addr + done, flags)) {
+			m->memory.fault.type = GUEST_FAULT_NONE;
+			return false;
+		}
+	}
+	return true;
+}
+
+/**********************************************************************
+ * run_bulk_loop
+ *
+ * DESCRIPTION
+ *   Called when the bne @di at @addr has just jumped back to the start of
+ *   its loop. If the loop copies or fills words, run the remaining
+ *   iterations at once with memmove() and memset() on @memory, and leave
+ *   the registers and @pc as the iterations would do. Loops with stores
+ *   overlapping their sources ahead, or into the loaded program are left to
+ *   the interpreter, and so are the ones faulting on the way.
+ */
+static void run_bulk_loop(struct machine *m, const struct decoded_instruction *di,
+		unsigned int addr)
+{
+	struct loop_shape shape;
+	unsigned int start = m->pc, index = (addr - INITIAL_PC) / 4;
+	unsigned int diff, step, n;
+	uint64_t src, dst, length;
+
+	if (!recognize_loop(m, m->pc, addr, &shape)) {
+		if (index < m->nr_decoded && di == m->decoded + index) m->decoded[index].idiom = IDIOM_NONE;
+		return;
+	}
+	if (index < m->nr_decoded && di == m->decoded + index) m->decoded[index].idiom = shape.idiom;
+
+	/* Number of the remaining iterations, until @induction reaches @bound */
+	if (shape.induction_step > 0) {
+		diff = m->registers[shape.bound] - m->registers[shape.induction];
+		step = shape.induction_step;
+	} else {
+		diff = m->registers[shape.induction] - m->registers[shape.bound];
+		step = -shape.induction_step;
+	}
+	if (!diff || diff % step) return;
+	n = diff / step;
+
+	src = (unsigned int)(m->registers[shape.src] + shape.src_offset);
+	dst = (unsigned int)(m->registers[shape.dst] + shape.dst_offset);
+	length = (uint64_t)n * 4;
+
+	/* The pages hold host words. Unaligned words are not bytes in a row there */
+	if (!guest_word_aligned(dst) || !guest_word_aligned(src)) return;
+	if (dst + length > (1ULL << 32)) return;
+	if (dst < INITIAL_PC + m->nr_decoded * 4 && dst + length > INITIAL_PC) return;
+	if (!bulk_page_in(m, dst, length, PAGE_WRITE | PAGE_DIRTY)) return;
+
+	if (shape.idiom == IDIOM_COPY) {
+		if (src + length > (1ULL << 32)) return;
+		/* Copying forward reads ahead of the stores only when @dst is below */
+		if (dst > src && dst < src + length) return;
+		if (!bulk_page_in(m, src, length, PAGE_READ)) return;
+		if (!load_word(m, src + length - 4, m->registers + shape.value)) return;
+
+		/* Page by page, forward. memmove() takes care of the overlap in a page */
+		for (uint64_t done = 0, chunk; done < length; done += chunk) {
+			unsigned char *to = guest_translate(&m->memory, dst + done, PAGE_WRITE);
+			unsigned char *from = guest_translate(&m->memory, src + done, PAGE_READ);
+
+			chunk = bulk_chunk(dst + done, src + done, length - done);
+			memmove(to, from, chunk);
+		}
+	} else {
+		unsigned int word = m->registers[shape.value];
+
+		for (uint64_t done = 0, chunk; done < length; done += chunk) {
+			unsigned char *to = guest_translate(&m->memory, dst + done, PAGE_WRITE);
+
+			chunk = bulk_chunk(dst + done, dst + done, length - done);
+			if ((word & 0xff) * 0x01010101 == word) {
+				memset(to, word & 0xff, chunk);
+				continue;
+			}
+			memcpy(to, &word, 4);
+			/* Double the filled part to the end of the chunk */
+			for (uint64_t filled = 4; filled < chunk; filled *= 2) {
+				memcpy(to + filled, to, chunk - filled < filled ? chunk - filled : filled);
+			}
+		}
+	}
+
+	m->registers[shape.src] += 4 * n;
+	if (shape.dst != shape.src) m->registers[shape.dst] += 4 * n;
+	if (shape.counter >= 0) m->registers[shape.counter] += shape.step * n;
+	m->pc = addr + 4;
+
+	m->nr_bulk_loops++;
+	m->nr_bulk_bytes += length;
+
+	/* The iterations run in bulk, the last of which has not taken bne */
+	for (unsigned int a = start; a <= addr; a += 4) {
+		struct decoded_instruction scratch;
+
+		m->stats.nr_ops[fetch_decoded(m, a, &scratch)->op] += n;
+	}
+	m->stats.nr_taken += n - 1;
+}
+
+
+/**********************************************************************
+ * run_mmu
+ *
+ * DESCRIPTION
+ *   @run_program() with the MMU on. Every fetch is translated, and the
+ *   instruction is taken from the pre-decoded ones by its physical address,
+ *   which @store_word() invalidates. Loops are not run in bulk as they may
+ *   cross pages mapped anywhere.
+ */
+static int run_mmu(struct machine *m)
+{
+	struct decoded_instruction scratch;
+
+	while (1) {
+		const struct decoded_instruction *di = &scratch;
+		unsigned int addr, instr;
+
+		if (guest_word_aligned(m->pc)) {
+			if (!guest_mmu_translate(&m->mmu, &m->memory, m->pc, PAGE_EXEC, &addr)) {
+				return machine_fault(m, m->pc);
+			}
+			di = fetch_decoded(m, addr, &scratch);
+			if (m->memory.fault.type != GUEST_FAULT_NONE) return machine_fault(m, m->pc);
+		} else {
+			if (!guest_mmu_load(&m->mmu, &m->memory, m->pc, &instr, PAGE_EXEC)) {
+				return machine_fault(m, m->pc);
+			}
+			decode_instruction(instr, &scratch);
+		}
+
+		m->pc += 4;
+		if (di->op == OP_HALT) return 0;
+
+		if (execute_instruction(m, di) < 0) return -EFAULT;
+	}
+}
+
+
+/**********************************************************************
+ * run_program
+ *
+ * DESCRIPTION
+ *   Start running the program that is loaded by @load_program function above.
+ *   If you implement @load_program() properly, the first instruction is placed
+ *   at @INITIAL_PC. Using @pc, which is the program counter of this processor,
+ *   you can emulate the MIPS processor by
+ *
+ *   1. Read instruction from @pc
+ *   2. Increment @pc by 4
+ *   3. Call @process_instruction(instruction)
+ *   4. Repeat until @process_instruction() returns 0
+ *
+ *   The instructions are read from the pre-decoded instructions prepared by
+ *   @load_program() so that they are not decoded again on every execution.
+ *   Word-copy and word-fill loops are run in bulk by @run_bulk_loop().
+ *   With the flat memory, lw and sw access it without any check, and the
+ *   faults are caught by the SIGSEGV handler which comes back here.
+ *
+ * RETURN
+ *   0
+ *   -EFAULT if the program faults on the memory. @memory.fault tells how,
+ *   and @pc is left at the instruction.
+ */
+int run_program(struct machine *m) {
+    struct decoded_instruction scratch;
+    sigjmp_buf fault;
+    machine_start(m);
+    m->stats.engine = "interpreter";
+
+    if (m->mmu.enabled) return run_mmu(m);
+
+    if (m->memory.flat) {
+        /* Faulted in lw or sw, which have left @pc at the next instruction */
+        if (sigsetjmp(fault, 1)) {
+            const struct decoded_instruction *di;
+            unsigned int address;
+            bool done;
+
+            /**
+             * Redo the access on the paged path, which brings in the page or
+             * reports the fault. It has been counted already
+             */
+            guest_catch(&m->memory, NULL);
+            di = fetch_decoded(m, m->pc - 4, &scratch);
+            address = m->registers[di->rs] + di->imm;
+            if (di->op == OP_LW) {
+                done = load_word(m, address, m->registers + di->rt);
+            } else {
+                done = store_word(m, address, m->registers[di->rt]);
+            }
+            if (!done) return machine_fault(m, m->pc - 4);
+        }
+        guest_catch(&m->memory, &fault);
+    }
+
+    while (1) {
+        const struct decoded_instruction *di = fetch_decoded(m, m->pc, &scratch);
+        unsigned int addr = m->pc;
+
+        m->pc += 4;
+        if (di->op == OP_HALT) break;
+
+        if (execute_instruction(m, di) < 0) break;
+
+        /* Taken backward bne. See if the loop can be run in bulk */
+        if (di->idiom && m->pc != addr + 4) run_bulk_loop(m, di, addr);
+    }
+    guest_catch(&m->memory, NULL);
+    return machine_halt(m);
+ }
+
+
+/**
+ * An instruction laid out for the direct-threaded engine. @handler is the
+ * address of the label processing the instruction in @run_threaded(), and
+ * @target points to the destination of a branch or a jump when it falls in
+ * the loaded program.
+ */
+struct threaded_instruction {
+	const void *handler;
+	struct threaded_instruction *target;
+	unsigned char rs;
+	unsigned char rt;
+	unsigned char rd;
+	unsigned char shamt;
+	unsigned int imm;
+};
+
+/**
+ * Instruction groups run by a single handler in @run_threaded(). The fused
+ * handler is put on the first instruction of a group only, and the others
+ * keep their own handlers so that branches into the middle of the group
+ * still work. Longer groups come first to be preferred. Use "run pairs" to
+ * see which groups are worth fusing on a workload.
+ */
+enum fused_op {
+	FUSED_LW_ADDI_JR = 0,	/* Function epilogue */
+	FUSED_ADDI_JR,
+	FUSED_SLTI_BEQ,			/* Compare and branch */
+	FUSED_SLTI_BNE,
+	FUSED_SLT_BEQ,
+	FUSED_SLT_BNE,
+	FUSED_LW_ADD,
+
+	NR_FUSED_OPS,
+};
+
+static const struct fusion {
+	unsigned int nr_ops;
+	unsigned char ops[3];
+} fusions[NR_FUSED_OPS] = {
+	[FUSED_LW_ADDI_JR] = { 3, { OP_LW, OP_ADDI, OP_JR } },
+	[FUSED_ADDI_JR] = { 2, { OP_ADDI, OP_JR } },
+	[FUSED_SLTI_BEQ] = { 2, { OP_SLTI, OP_BEQ } },
+	[FUSED_SLTI_BNE] = { 2, { OP_SLTI, OP_BNE } },
+	[FUSED_SLT_BEQ] = { 2, { OP_SLT, OP_BEQ } },
+	[FUSED_SLT_BNE] = { 2, { OP_SLT, OP_BNE } },
+	[FUSED_LW_ADD] = { 2, { OP_LW, OP_ADD } },
+};
+
+/**********************************************************************
+ * thread_instruction
+ *
+ * DESCRIPTION
+ *   Lay out @threaded[@index] from the pre-decoded instruction at the
+ *   corresponding address. @handlers maps the operations to the labels in
+ *   @run_threaded().
+ */
+static void thread_instruction(struct machine *m, unsigned int index, const void * const handlers[])
+{
+	struct decoded_instruction scratch;
+	unsigned int addr = INITIAL_PC + index * 4;
+	const struct decoded_instruction *di = fetch_decoded(m, addr, &scratch);
+	struct threaded_instruction *ti = m->threaded + index;
+	unsigned int target;
+
+	*ti = (struct threaded_instruction) {
+		.handler = handlers[di->op],
+		.rs = di->rs,
+		.rt = di->rt,
+		.rd = di->rd,
+		.shamt = di->shamt,
+		.imm = di->imm,
+	};
+
+	if (di->op == OP_J || di->op == OP_JAL) {
+		target = ((addr + 4) & 0xf0000000) | (di->imm << 2);
+	} else if (di->op == OP_BEQ || di->op == OP_BNE) {
+		target = addr + 4 + ((int16_t)di->imm << 2);
+	} else {
+		return;
+	}
+
+	if (target - INITIAL_PC < m->nr_decoded * 4 && !(target & 0x3)) {
+		ti->target = m->threaded + (target - INITIAL_PC) / 4;
+	}
+}
+
+/**********************************************************************
+ * fuse_instruction
+ *
+ * DESCRIPTION
+ *   Put the handler of @fused_handlers for the first group in @fusions that
+ *   starts at @threaded[@index]. Groups over instructions waiting to be
+ *   threaded again (@stale) are left alone.
+ */
+static void fuse_instruction(struct machine *m, unsigned int index,
+		const void * const fused_handlers[], const void *stale)
+{
+	struct decoded_instruction scratch;
+
+	for (unsigned int f = 0; f < NR_FUSED_OPS; f++) {
+		const struct fusion *fusion = fusions + f;
+		unsigned int i;
+
+		if (index + fusion->nr_ops > m->nr_decoded) continue;
+
+		for (i = 0; i < fusion->nr_ops; i++) {
+			unsigned int addr = INITIAL_PC + (index + i) * 4;
+
+			if (m->threaded[index + i].handler == stale) break;
+			if (fetch_decoded(m, addr, &scratch)->op != fusion->ops[i]) break;
+		}
+		if (i == fusion->nr_ops) {
+			m->threaded[index].handler = fused_handlers[f];
+			return;
+		}
+	}
+}
+
+/**********************************************************************
+ * run_threaded
+ *
+ * DESCRIPTION
+ *   Run the loaded program like @run_program(), but through direct-threaded
+ *   code. Each instruction jumps to the handler of the next one through the
+ *   labels-as-values extension of GCC, so there is neither a central dispatch
+ *   loop nor the decoding step. @pc and the registers are kept in the local
+ *   variables during the execution, and are synchronized with the machine
+ *   when the program leaves the loaded region or finishes.
+ *
+ * RETURN
+ *   0
+ *   -EFAULT as @run_program() does
+ */
+#ifdef __GNUC__
+int run_threaded(struct machine *m)
+{
+	static const void *handlers[NR_DECODED_OPS] = {
+		[OP_NOP] = &&do_nop,
+		[OP_ADD] = &&do_add,
+		[OP_SUB] = &&do_sub,
+		[OP_AND] = &&do_and,
+		[OP_OR] = &&do_or,
+		[OP_NOR] = &&do_nor,
+		[OP_SLL] = &&do_sll,
+		[OP_SRL] = &&do_srl,
+		[OP_SRA] = &&do_sra,
+		[OP_SLT] = &&do_slt,
+		[OP_JR] = &&do_jr,
+		[OP_J] = &&do_j,
+		[OP_JAL] = &&do_jal,
+		[OP_BEQ] = &&do_beq,
+		[OP_BNE] = &&do_bne,
+		[OP_ADDI] = &&do_addi,
+		[OP_ANDI] = &&do_andi,
+		[OP_ORI] = &&do_ori,
+		[OP_SLTI] = &&do_slti,
+		[OP_LW] = &&do_lw,
+		[OP_SW] = &&do_sw,
+		[OP_HALT] = &&do_halt,
+	};
+	static const void *fused_handlers[NR_FUSED_OPS] = {
+		[FUSED_LW_ADDI_JR] = &&do_lw_addi_jr,
+		[FUSED_ADDI_JR] = &&do_addi_jr,
+		[FUSED_SLTI_BEQ] = &&do_slti_beq,
+		[FUSED_SLTI_BNE] = &&do_slti_bne,
+		[FUSED_SLT_BEQ] = &&do_slt_beq,
+		[FUSED_SLT_BNE] = &&do_slt_bne,
+		[FUSED_LW_ADD] = &&do_lw_add,
+	};
+	struct decoded_instruction scratch;
+	struct threaded_instruction *ip;
+	unsigned int regs[32];
+	unsigned int code_end = INITIAL_PC + m->nr_decoded * 4;
+	unsigned int address;
+
+#define THREADED_PC(ip)	(INITIAL_PC + (unsigned int)((ip) - m->threaded) * 4)
+#define DISPATCH()		goto *ip->handler
+#define NEXT()			do { ip++; DISPATCH(); } while (0)
+#define JUMP(addr)		do { m->pc = (addr); goto do_lookup; } while (0)
+#define LOAD(address, r)	do { if (!load_word(m, address, regs + (r))) goto do_fault; } while (0)
+#define COUNT(op)		m->stats.nr_ops[op]++
+
+	machine_start(m);
+	if (!m->nr_decoded || !program_executable(m)) return run_program(m);
+	m->stats.engine = "threaded";
+
+	/* One more past the program, in case the trailing halt is overwritten */
+	m->threaded = realloc(m->threaded, sizeof(*m->threaded) * (m->nr_decoded + 1));
+	if (!m->threaded) return run_program(m);
+
+	for (unsigned int i = 0; i < m->nr_decoded; i++) {
+		thread_instruction(m, i, handlers);
+	}
+	for (unsigned int i = 0; i < m->nr_decoded; i++) {
+		fuse_instruction(m, i, fused_handlers, &&do_stale);
+	}
+	m->threaded[m->nr_decoded] = (struct threaded_instruction) { .handler = &&do_end };
+	memcpy(regs, m->registers, sizeof(regs));
+
+do_lookup:
+	if (m->pc - INITIAL_PC >= m->nr_decoded * 4 || (m->pc & 0x3)) {
+		/* Out of the loaded program. Step through it as @run_program() does */
+		memcpy(m->registers, regs, sizeof(regs));
+		do {
+			const struct decoded_instruction *di = fetch_decoded(m, m->pc, &scratch);
+
+			m->pc += 4;
+			if (di->op == OP_HALT) return machine_halt(m);
+
+			if (execute_instruction(m, di) < 0) return -EFAULT;
+		} while (m->pc - INITIAL_PC >= m->nr_decoded * 4 || (m->pc & 0x3));
+		memcpy(regs, m->registers, sizeof(regs));
+	}
+	ip = m->threaded + (m->pc - INITIAL_PC) / 4;
+	DISPATCH();
+
+do_nop:
+	COUNT(OP_NOP);
+	NEXT();
+do_add:
+	COUNT(OP_ADD);
+	regs[ip->rd] = regs[ip->rs] + regs[ip->rt];
+	NEXT();
+do_sub:
+	COUNT(OP_SUB);
+	regs[ip->rd] = regs[ip->rs] - regs[ip->rt];
+	NEXT();
+do_and:
+	COUNT(OP_AND);
+	regs[ip->rd] = regs[ip->rs] & regs[ip->rt];
+	NEXT();
+do_or:
+	COUNT(OP_OR);
+	regs[ip->rd] = regs[ip->rs] | regs[ip->rt];
+	NEXT();
+do_nor:
+	COUNT(OP_NOR);
+	regs[ip->rd] = ~(regs[ip->rs] | regs[ip->rt]);
+	NEXT();
+do_sll:
+	COUNT(OP_SLL);
+	regs[ip->rd] = regs[ip->rt] << ip->shamt;
+	NEXT();
+do_srl:
+	COUNT(OP_SRL);
+	regs[ip->rd] = regs[ip->rt] >> ip->shamt;
+	NEXT();
+do_sra:
+	COUNT(OP_SRA);
+	regs[ip->rd] = (int)regs[ip->rt] >> ip->shamt;
+	NEXT();
+do_slt:
+	COUNT(OP_SLT);
+	regs[ip->rd] = ((int)regs[ip->rs] < (int)regs[ip->rt]) ? 1 : 0;
+	NEXT();
+do_jr:
+	COUNT(OP_JR);
+	count_jr_target(&m->stats, regs[ip->rs]);
+	JUMP(regs[ip->rs]);
+do_jal:
+	COUNT(OP_JAL);
+	regs[31] = THREADED_PC(ip) + 4;
+	goto do_jump;
+do_j:
+	COUNT(OP_J);
+do_jump:
+	if (ip->target) {
+		ip = ip->target;
+		DISPATCH();
+	}
+	JUMP(((THREADED_PC(ip) + 4) & 0xf0000000) | (ip->imm << 2));
+do_beq:
+	COUNT(OP_BEQ);
+	if (regs[ip->rs] != regs[ip->rt]) NEXT();
+	goto do_branch;
+do_bne:
+	COUNT(OP_BNE);
+	if (regs[ip->rs] == regs[ip->rt]) NEXT();
+do_branch:
+	m->stats.nr_taken++;
+	if (ip->target) {
+		ip = ip->target;
+		DISPATCH();
+	}
+	JUMP(THREADED_PC(ip) + 4 + ((int16_t)ip->imm << 2));
+do_addi:
+	COUNT(OP_ADDI);
+	regs[ip->rt] = regs[ip->rs] + (int16_t)ip->imm;
+	NEXT();
+do_andi:
+	COUNT(OP_ANDI);
+	regs[ip->rt] = regs[ip->rs] & ip->imm;
+	NEXT();
+do_ori:
+	COUNT(OP_ORI);
+	regs[ip->rt] = regs[ip->rs] | ip->imm;
+	NEXT();
+do_slti:
+	COUNT(OP_SLTI);
+	regs[ip->rt] = regs[ip->rs] < ip->imm ? 1 : 0;
+	NEXT();
+do_lw:
+	COUNT(OP_LW);
+	address = regs[ip->rs] + ip->imm;
+	LOAD(address, ip->rt);
+	NEXT();
+do_sw:
+	COUNT(OP_SW);
+	address = regs[ip->rs] + ip->imm;
+	if (!store_word(m, address, regs[ip->rt])) goto do_fault;
+	if (address + 3 >= INITIAL_PC && address < code_end) {
+		/* Self-modifying code. Thread the overwritten instructions and the
+		 * groups fused with them again */
+		for (unsigned int a = (address & ~0x3) - 8; a < address + 4; a += 4) {
+			if (a >= INITIAL_PC && a < code_end) {
+				m->threaded[(a - INITIAL_PC) / 4].handler = &&do_stale;
+			}
+		}
+	}
+	NEXT();
+do_stale:
+	thread_instruction(m, ip - m->threaded, handlers);
+	fuse_instruction(m, ip - m->threaded, fused_handlers, &&do_stale);
+	DISPATCH();
+
+	/* Fused groups. @ip steps to each instruction of the group in turn */
+do_lw_addi_jr:
+	COUNT(OP_LW);
+	address = regs[ip->rs] + ip->imm;
+	LOAD(address, ip->rt);
+	ip++;
+	/* Fall through */
+do_addi_jr:
+	COUNT(OP_ADDI);
+	regs[ip->rt] = regs[ip->rs] + (int16_t)ip->imm;
+	ip++;
+	goto do_jr;
+do_slti_beq:
+	COUNT(OP_SLTI);
+	regs[ip->rt] = regs[ip->rs] < ip->imm ? 1 : 0;
+	ip++;
+	goto do_beq;
+do_slti_bne:
+	COUNT(OP_SLTI);
+	regs[ip->rt] = regs[ip->rs] < ip->imm ? 1 : 0;
+	ip++;
+	goto do_bne;
+do_slt_beq:
+	COUNT(OP_SLT);
+	regs[ip->rd] = ((int)regs[ip->rs] < (int)regs[ip->rt]) ? 1 : 0;
+	ip++;
+	goto do_beq;
+do_slt_bne:
+	COUNT(OP_SLT);
+	regs[ip->rd] = ((int)regs[ip->rs] < (int)regs[ip->rt]) ? 1 : 0;
+	ip++;
+	goto do_bne;
+do_lw_add:
+	COUNT(OP_LW);
+	address = regs[ip->rs] + ip->imm;
+	LOAD(address, ip->rt);
+	ip++;
+	COUNT(OP_ADD);
+	regs[ip->rd] = regs[ip->rs] + regs[ip->rt];
+	NEXT();
+do_halt:
+	m->pc = THREADED_PC(ip) + 4;
+	memcpy(m->registers, regs, sizeof(regs));
+	return machine_halt(m);
+do_end:
+	/* Fallen off the end of the program. Go on out of it */
+	JUMP(THREADED_PC(ip));
+do_fault:
+	memcpy(m->registers, regs, sizeof(regs));
+	return machine_fault(m, THREADED_PC(ip));
+
+#undef THREADED_PC
+#undef DISPATCH
+#undef NEXT
+#undef JUMP
+#undef LOAD
+#undef COUNT
+}
+#else
+int run_threaded(struct machine *m)
+{
+	return run_program(m);
+}
+#endif
+
+
+/**
+ * Names of the pre-decoded operations for the reports
+ */
+static const char * const op_names[NR_DECODED_OPS] = {
+	[OP_NOP] = "nop", [OP_ADD] = "add", [OP_SUB] = "sub", [OP_AND] = "and",
+	[OP_OR] = "or", [OP_NOR] = "nor", [OP_SLL] = "sll", [OP_SRL] = "srl",
+	[OP_SRA] = "sra", [OP_SLT] = "slt", [OP_JR] = "jr", [OP_J] = "j",
+	[OP_JAL] = "jal", [OP_BEQ] = "beq", [OP_BNE] = "bne", [OP_ADDI] = "addi",
+	[OP_ANDI] = "andi", [OP_ORI] = "ori", [OP_SLTI] = "slti", [OP_LW] = "lw",
+	[OP_SW] = "sw", [OP_HALT] = "halt",
+};
+
+#define NR_TOP_GROUPS	10	/* Groups of each length to report */
+
+struct op_group {
+	unsigned long count;
+	unsigned int nr_ops;
+	unsigned char ops[3];
+};
+
+static int compare_op_groups(const void *a, const void *b)
+{
+	const struct op_group *ga = a, *gb = b;
+
+	return (ga->count < gb->count) - (ga->count > gb->count);
+}
+
+static bool is_fused(const struct op_group *group)
+{
+	for (unsigned int f = 0; f < NR_FUSED_OPS; f++) {
+		if (fusions[f].nr_ops == group->nr_ops &&
+				!memcmp(fusions[f].ops, group->ops, group->nr_ops)) return true;
+	}
+	return false;
+}
+
+
+/**********************************************************************
+ * run_pairs
+ *
+ * DESCRIPTION
+ *   Run the loaded program like @run_program() while counting the pairs
+ *   and the triples of operations that run back to back without a jump in
+ *   between, and print the most frequent ones. They are the candidates for
+ *   @fusions. The ones fused already are marked with '*'. With the MMU on,
+ *   the program is just run by @run_program().
+ *
+ * RETURN
+ *   0
+ *   -EFAULT as @run_program() does
+ *   -ENOMEM if the counters cannot be allocated
+ */
+int run_pairs(struct machine *m)
+{
+	unsigned long (*pairs)[NR_DECODED_OPS];
+	unsigned long (*triples)[NR_DECODED_OPS][NR_DECODED_OPS];
+	struct op_group *groups;
+	struct decoded_instruction scratch;
+	unsigned long nr_instructions = 0;
+	unsigned int last = 0;
+	int prev = -1, prev2 = -1;
+
+	/* The pairs are counted on the physical program only */
+	if (m->mmu.enabled) return run_program(m);
+
+	pairs = calloc(NR_DECODED_OPS, sizeof(*pairs));
+	triples = calloc(NR_DECODED_OPS, sizeof(*triples));
+	groups = malloc(sizeof(*groups) * NR_DECODED_OPS * NR_DECODED_OPS * NR_DECODED_OPS);
+	if (!pairs || !triples || !groups) {
+		free(pairs);
+		free(triples);
+		free(groups);
+		return -ENOMEM;
+	}
+	machine_start(m);
+	m->stats.engine = "pairs";
+
+	while (1) {
+		const struct decoded_instruction *di = fetch_decoded(m, m->pc, &scratch);
+
+		if (m->pc != last + 4) prev = prev2 = -1;
+		if (prev >= 0) {
+			pairs[prev][di->op]++;
+			if (prev2 >= 0) triples[prev2][prev][di->op]++;
+		}
+		prev2 = prev;
+		prev = di->op;
+		last = m->pc;
+		nr_instructions++;
+
+		m->pc += 4;
+		if (di->op == OP_HALT) break;
+
+		if (execute_instruction(m, di) < 0) break;
+	}
+
+	fprintf(stderr, "pairs: %lu instructions\n", nr_instructions);
+	for (unsigned int nr_ops = 2; nr_ops <= 3; nr_ops++) {
+		unsigned int nr_groups = 0;
+
+		for (unsigned int a = 0; a < NR_DECODED_OPS; a++) {
+			for (unsigned int b = 0; b < NR_DECODED_OPS; b++) {
+				if (nr_ops == 2) {
+					if (!pairs[a][b]) continue;
+					groups[nr_groups++] = (struct op_group) {
+						pairs[a][b], 2, { a, b },
+					};
+					continue;
+				}
+				for (unsigned int c = 0; c < NR_DECODED_OPS; c++) {
+					if (!triples[a][b][c]) continue;
+					groups[nr_groups++] = (struct op_group) {
+						triples[a][b][c], 3, { a, b, c },
+					};
+				}
+			}
+		}
+		qsort(groups, nr_groups, sizeof(*groups), compare_op_groups);
+
+		for (unsigned int i = 0; i < nr_groups && i < NR_TOP_GROUPS; i++) {
+			char name[32];
+
+			snprintf(name, sizeof(name), "%s+%s%s%s", op_names[groups[i].ops[0]],
+					op_names[groups[i].ops[1]], nr_ops == 3 ? "+" : "",
+					nr_ops == 3 ? op_names[groups[i].ops[2]] : "");
+			fprintf(stderr, "pairs: %-16s %12lu  %5.1f%% %s\n", name, groups[i].count,
+					100.0 * groups[i].count / nr_instructions, is_fused(groups + i) ? "*" : "");
+		}
+	}
+	free(pairs);
+	free(triples);
+	free(groups);
+	return machine_halt(m);
+}
+
+
+/**
+ * Disassemble @di at @pc into @buffer for the reports, with @op_names and
+ * @register_names
+ */
+static void disassemble(const struct decoded_instruction *di, unsigned int pc, char *buffer,
+		size_t size)
 {
-	return (strlen(str) == strlen(expect)) && (strncmp(str, expect, strlen(expect)) == 0);
+	const char *name = op_names[di->op], *rs = register_names[di->rs],
+			*rt = register_names[di->rt], *rd = register_names[di->rd];
+
+	switch (di->op) {
+	case OP_ADD: case OP_SUB: case OP_AND: case OP_OR: case OP_NOR: case OP_SLT:
+		snprintf(buffer, size, "%-5s %s, %s, %s", name, rd, rs, rt);
+		break;
+	case OP_SLL: case OP_SRL: case OP_SRA:
+		snprintf(buffer, size, "%-5s %s, %s, %u", name, rd, rt, di->shamt);
+		break;
+	case OP_JR:
+		snprintf(buffer, size, "%-5s %s", name, rs);
+		break;
+	case OP_J: case OP_JAL:
+		snprintf(buffer, size, "%-5s 0x%08x", name, ((pc + 4) & 0xf0000000) | (di->imm << 2));
+		break;
+	case OP_BEQ: case OP_BNE:
+		snprintf(buffer, size, "%-5s %s, %s, 0x%08x", name, rs, rt,
+				pc + 4 + ((int16_t)di->imm << 2));
+		break;
+	case OP_ADDI:
+		snprintf(buffer, size, "%-5s %s, %s, %d", name, rt, rs, (int16_t)di->imm);
+		break;
+	case OP_ANDI: case OP_ORI: case OP_SLTI:
+		snprintf(buffer, size, "%-5s %s, %s, 0x%x", name, rt, rs, di->imm);
+		break;
+	case OP_LW: case OP_SW:
+		snprintf(buffer, size, "%-5s %s, 0x%x(%s)", name, rt, di->imm, rs);
+		break;
+	default:
+		snprintf(buffer, size, "%s", name);
+		break;
+	}
 }
 
-/*          ****** DO NOT MODIFY ANYTHING UP TO THIS LINE ******      */
-/*====================================================================*/
+#define NR_TOP_RANGES	10	/* Hot ranges to report */
+
+/* Instructions in a row run the same number of times, a basic block or more */
+struct pc_range {
+	unsigned int start;
+	unsigned int nr_instructions;
+	unsigned long count;
+};
+
+static int compare_pc_ranges(const void *a, const void *b)
+{
+	const struct pc_range *ra = a, *rb = b;
+	unsigned long wa = ra->count * ra->nr_instructions, wb = rb->count * rb->nr_instructions;
 
+	return (wa < wb) - (wa > wb);
+}
 
 /**********************************************************************
- * process_instruction
+ * run_profile
  *
  * DESCRIPTION
- *   Execute the machine code given through @instr. The following table lists
- *   up the instructions to support. Note that a pseudo instruction 'halt'
- *   (0xffffffff) is added for the testing purpose. Also '*' instrunctions are
- *   the ones that are newly added to PA2.
+ *   Run the loaded program like @run_program() while counting where it
+ *   spends its time, and print the hottest ranges of the program with
+ *   their disassembly. Loops are not run in bulk so that every iteration
+ *   is counted. With the MMU on, the program is just run by @run_program().
  *
- * | Name   | Format    | Opcode / opcode + funct |
- * | ------ | --------- | ----------------------- |
- * | `add`  | r-format  | 0 + 0x20                |
- * | `addi` | i-format  | 0x08                    |
- * | `sub`  | r-format  | 0 + 0x22                |
- * | `and`  | r-format  | 0 + 0x24                |
- * | `andi` | i-format  | 0x0c                    |
- * | `or`   | r-format  | 0 + 0x25                |
- * | `ori`  | i-format  | 0x0d                    |
- * | `nor`  | r-format  | 0 + 0x27                |
- * | `sll`  | r-format  | 0 + 0x00                |
- * | `srl`  | r-format  | 0 + 0x02                |
- * | `sra`  | r-format  | 0 + 0x03                |
- * | `lw`   | i-format  | 0x23                    |
- * | `sw`   | i-format  | 0x2b                    |
- * | `slt`  | r-format* | 0 + 0x2a                |
- * | `slti` | i-format* | 0x0a                    |
- * | `beq`  | i-format* | 0x04                    |
- * | `bne`  | i-format* | 0x05                    |
- * | `jr`   | r-format* | 0 + 0x08                |
- * | `j`    | j-format* | 0x02                    |
- * | `jal`  | j-format* | 0x03                    |
- * | `halt` | special*  | @instr == 0xffffffff    |
+ *   The counts are taken per basic block rather than per instruction to
+ *   keep the overhead low. The instructions run in a row from a jump target
+ *   to the next jump are added to @runs[] as a difference; the count of the
+ *   first instruction goes up and the one past the last goes down, and the
+ *   counts of the instructions are summed up at the end. Nothing is done
+ *   for the instructions in between.
  *
- * RETURN VALUE
- *   1 if successfully processed the instruction.
- *   0 if @instr is 'halt' or unknown instructions
+ * RETURN
+ *   0
+ *   -EFAULT as @run_program() does
+ *   -ENOMEM if the counters cannot be allocated
  */
-static int process_instruction(unsigned int instr)
-{
-	char binary[100]={'\0',};
-	char opcode[10]={'\0',}; char rs[10]={'\0',}; char rt[10]={'\0',}; 
-	char rd[10]={'\0',}; char shamt[10]={'\0',}; char funct[10]={'\0',};
-	char imm[100]={'\0',};
-	char addr[100]={'\0',};
-	char hex_chars[100], hex_value[100];  
-	int immed_hex = 0;
-	int rs_num=0, rt_num=0, rd_num=0, shamt_num=0, immed_num=0,addr_num=0;
-	unsigned int bitmask = 1 << 31;
-	
-	for (int i=0; i<32; i++){ // 16진수 -> 2진수
-		if(instr & bitmask) strcat(binary, "1");
-		else strcat(binary, "0");
-		instr <<=1;
-	}
-	for(int i=0; i<6; i++){
-		opcode[i] = binary[i];
-	}
-
-	if(!strcmp(opcode, "000000")){ // R-format
-		for(int i=0; i<5; i++){
-			rs[i] = binary[i+6];
-			rt[i] = binary[i+11];
-			rd[i] = binary[i+16];
-		}
-		rs_num = strtol(rs, NULL, 2);
-		rt_num = strtol(rt, NULL, 2);
-		rd_num = strtol(rd, NULL, 2);
-		
-		for(int i=0; i<5; i++){
-			shamt[i] = binary[i+21];
-		}
-		shamt_num = strtol(shamt, NULL, 2);
+int run_profile(struct machine *m)
+{
+	struct decoded_instruction scratch;
+	struct pc_range *ranges;
+	long *runs;
+	unsigned long nr_instructions = 0, nr_outside = 0, count = 0;
+	unsigned int nr_ranges = 0;
+	unsigned int start;
+	bool running = true;
 
-		for(int i=0; i<6; i++){
-			funct[i] = binary[i+26];
-		}
-	}
-	else if(!strcmp(opcode, "000010") || !strcmp(opcode, "000011")){ // J-format
-		for(int i=0; i<26; i++){
-			addr[i] = binary[i+6];
-		}
-		addr_num = strtol(addr, NULL, 2);
+	/* The program is profiled by the physical addresses only */
+	if (m->mmu.enabled) return run_program(m);
 
+	runs = calloc(m->nr_decoded + 1, sizeof(*runs));
+	ranges = malloc(sizeof(*ranges) * (m->nr_decoded + 1));
+	if (!runs || !ranges) {
+		free(runs);
+		free(ranges);
+		return -ENOMEM;
 	}
-	else{ // I-format
-		for(int i=0; i<5; i++){
-			rs[i] = binary[i+6];
-			rt[i] = binary[i+11];
-		}
-		rs_num = strtol(rs, NULL, 2);
-		rt_num = strtol(rt, NULL, 2);
+	machine_start(m);
+	m->stats.engine = "profile";
+	start = m->pc;
 
-		for(int i=0; i<16; i++){
-			imm[i] = binary[i+16];
-		}
+	while (running) {
+		const struct decoded_instruction *di = fetch_decoded(m, m->pc, &scratch);
+		unsigned int addr = m->pc;
 
-		immed_num = strtol(imm, NULL, 2); // 2진수
+		m->pc += 4;
+		running = di->op != OP_HALT && execute_instruction(m, di) >= 0;
 
+		/* A jump or a taken branch ends the block, and so do halt and a fault */
+		if (m->pc != addr + 4 || !running) {
+			unsigned int first = (start - INITIAL_PC) >> 2, last = (addr - INITIAL_PC) >> 2;
 
-        for (int i = 0; i < 4; i++) {
-            unsigned short int bin_to_hex = (immed_num >> (12 - 4 * i)) & 0xF; //
-            if (bin_to_hex<= 9) {
-                hex_value[i] = '0' + bin_to_hex;
-            } else {
-                hex_value[i] = 'A' + (bin_to_hex - 10);
-            }
-        }
+			if (first <= last && last < m->nr_decoded) {
+				runs[first]++;
+				runs[last + 1]--;
+			} else {
+				nr_outside += start <= addr ? (addr - start) / 4 + 1 : 1;
+			}
+			start = m->pc;
+		}
+	}
 
-		immed_hex = strtol(hex_value, NULL, 16);		
+	for (unsigned int i = 0; i < m->nr_decoded; i++) {
+		count += runs[i];
+		nr_instructions += count;
+		if (!count) continue;
 
+		if (nr_ranges && ranges[nr_ranges - 1].count == count &&
+				ranges[nr_ranges - 1].start + ranges[nr_ranges - 1].nr_instructions == i) {
+			ranges[nr_ranges - 1].nr_instructions++;
+		} else {
+			ranges[nr_ranges++] = (struct pc_range) { i, 1, count };
+		}
 	}
+	nr_instructions += nr_outside;
+	qsort(ranges, nr_ranges, sizeof(*ranges), compare_pc_ranges);
 
-	if(!strcmp(funct, "100000")){ //add
-		registers[rd_num] = registers[rs_num] + registers[rt_num];
-	}
-	else if(!strcmp(funct, "100010")){ //sub
-		registers[rd_num] = registers[rs_num] - registers[rt_num];
-	}
-	else if(!strcmp(funct, "100100")){ //and
-		registers[rd_num] = registers[rs_num] & registers[rt_num];
-	}
-	else if(!strcmp(funct, "100101")){ //or
-		registers[rd_num] = registers[rs_num] | registers[rt_num];
-	}
-	else if(!strcmp(funct, "100111")){ //nor
-		registers[rd_num] = ~(registers[rs_num] | registers[rt_num]);
-	}
-	else if(!strcmp(funct, "000000")){ //sll
-		registers[rd_num] = registers[rt_num] << shamt_num;
-	}
-	else if(!strcmp(funct, "000010")){ //srl
-		registers[rd_num] = registers[rt_num] >> shamt_num;
-	}
-	else if(!strcmp(funct, "000011")){ //sra
-        int sign_bit = (registers[rt_num] >> 31) & 0x1;
-        int temp = registers[rt_num] >> shamt_num;
+	fprintf(stderr, "profile: %lu instructions, %lu outside the program\n",
+			nr_instructions, nr_outside);
+	for (unsigned int r = 0; r < nr_ranges && r < NR_TOP_RANGES; r++) {
+		const struct pc_range *range = ranges + r;
+		unsigned int from = INITIAL_PC + range->start * 4;
 
-        int mask = 0;
-        if (sign_bit) {
-            mask = (1 << (32 - shamt_num)) - 1;
-            mask <<= shamt_num;
-        }
-        registers[rd_num] = temp | mask;
-    }
-	else if(!strcmp(funct, "101010")){ //slt
-        int rs_value = 0;
-        rs_value = (int)registers[rs_num];
-        int rt_value = 0;
-        rt_value = (int)registers[rt_num];
-		registers[rd_num] = (rs_value < rt_value) ? 1 : 0;
-	}
-	else if(!strcmp(funct, "001000")){ //jr
-		pc = registers[rs_num];
-	}
-	else if(!strcmp(opcode, "000010")){ //j
-		pc = (pc & 0xf0000000) | (addr_num << 2);
-	}
-	else if(!strcmp(opcode, "000011")){ //jal
-		registers[31] = pc;
-		pc = (pc & 0xf0000000) | (addr_num << 2);
-	}
-	else if(!strcmp(opcode, "000100")){ //beq
-		if(registers[rs_num] == registers[rt_num]) {
-            int16_t signed_immed = (int16_t)immed_num;
-            pc = pc + (signed_immed << 2);
-        }
-	}
-	else if(!strcmp(opcode, "000101")){ //bne
-		if(registers[rs_num] != registers[rt_num]) {
-            int16_t signed_immed = (int16_t)immed_num;
-            pc = pc + (signed_immed << 2);
-        }
-	}
-	else if(!strcmp(opcode, "001000")){ //addi
-        int16_t signed_immed = (int16_t)immed_num;
-		registers[rt_num] = registers[rs_num] +signed_immed;
-	}
-	else if(!strcmp(opcode, "001100")){ //andi
-		registers[rt_num] = registers[rs_num] & immed_num;
-	}
-	else if(!strcmp(opcode, "001101")){ //ori
-		registers[rt_num] = registers[rs_num] | immed_num;
-	}
+		fprintf(stderr, "profile: 0x%08x-0x%08x %12lu times  %5.1f%%\n",
+				from, from + range->nr_instructions * 4 - 4, range->count,
+				100.0 * range->count * range->nr_instructions / nr_instructions);
+		for (unsigned int i = 0; i < range->nr_instructions; i++) {
+			struct decoded_instruction di;
+			unsigned char bytes[4];
+			char text[48];
 
-	else if(!strcmp(opcode, "100011")){ //lw
-        int address = 0;
-        address = registers[rs_num] + immed_hex;
-        unsigned int word = 0;
-        for (int i = 0; i < 4; i++) {
-            word = (word << 8) | memory[address + i];
-        }
-        registers[rt_num] = word;
+			guest_peek(&m->memory, from + i * 4, bytes, sizeof(bytes));
+			decode_instruction((bytes[0] << 24) | (bytes[1] << 16) | (bytes[2] << 8) | bytes[3], &di);
+			disassemble(&di, from + i * 4, text, sizeof(text));
+			fprintf(stderr, "profile:   0x%08x  %s\n", from + i * 4, text);
+		}
 	}
-	else if(!strcmp(opcode, "101011")){ //sw
-        unsigned int address = 0;
-        address = registers[rs_num] + immed_hex;
-        unsigned int word = registers[rt_num];
+	free(runs);
+	free(ranges);
+	return machine_halt(m);
+}
 
-        for (int i = 0; i < 4; i++) {
-            memory[address + i] = (word >> (24 - 8 * i)) & 0xFF;
-        }
-	}
+#define NR_TOP_SAMPLES	20	/* Sampled instructions to report */
 
-	else if(!strcmp(opcode, "001010")){ //slti
-		registers[rt_num] = registers[rs_num] < immed_num ? 1 : 0;
-	}
-	else{ //halt
-        return 0;
-	}
-	return 0;
+/* Samples of an instruction */
+struct pc_samples {
+	unsigned int pc;
+	unsigned long count;
+};
+
+static int compare_pcs(const void *a, const void *b)
+{
+	unsigned int pa = *(const unsigned int *)a, pb = *(const unsigned int *)b;
+
+	return (pa > pb) - (pa < pb);
 }
 
+static int compare_pc_samples(const void *a, const void *b)
+{
+	const struct pc_samples *sa = a, *sb = b;
+
+	return (sa->count < sb->count) - (sa->count > sb->count);
+}
 
 /**********************************************************************
- * load_program(filename)
+ * run_sample
  *
  * DESCRIPTION
-        *   Load the instructions in the file @filename onto the memory starting at
-*   @INITIAL_PC. Each line in the program file looks like;
-*
-*	 [MIPS instruction started with 0x prefix]  // optional comments
-*
-*   For example,
-*
-*   0x8c090008
-*   0xac090020	// sw t1, zero + 32
-*   0x8c080000
-*
-*   implies three MIPS instructions to load. Each machine instruction may
-*   be followed by comments like the second instruction. However you can simply
-*   call strtoimax(linebuffer, NULL, 0) to read the machine code while
-*   ignoring the comment parts.
-*
-*	 The program DOES NOT include the 'halt' instruction. Thus, make sure the
-*	 'halt' instruction is appended to the loaded instructions to terminate
-        *	 your program properly.
-*
-*	 Refer to the @main() for reading data from files. (fopen, fgets, fclose).
-*
-* RETURN
-*	 0 on successfully load the program
-        *	 any other value otherwise
-*/
+ *   Run the loaded program by @run_program() while @pc is sampled @hz times
+ *   a second of the CPU time, and print the instructions sampled most. The
+ *   engine runs as it is, so what is measured is not changed. See sample.h
+ *
+ *   @pc is taken as the engine has last stored it, the instruction about
+ *   to run or the one being run. The instructions are disassembled unless
+ *   the MMU is on.
+ *
+ * RETURN
+ *   What @run_program() returns
+ *   -errno if the sampler cannot be started
+ */
+int run_sample(struct machine *m, unsigned int hz)
+{
+	struct sampler sampler = { 0 };
+	const volatile unsigned int *words[] = { &m->pc };
+	struct pc_samples *counts;
+	unsigned int *pcs;
+	unsigned long nr_samples = 0;
+	unsigned int nr_counts = 0;
+	int ret = sampler_start(&sampler, hz, words, 1);
 
-static int load_program(char * const filename) {
-    char linebuffer[100];
-    FILE *fp = fopen(filename, "r");
-    unsigned int hexvalue = 0;
-    pc = INITIAL_PC;
+	if (ret) {
+		sampler_release(&sampler);
+		return ret;
+	}
+	ret = run_program(m);
+	sampler_stop(&sampler);
 
-    if (fp == NULL) {
-        printf("Error opening file!\n");
-        return -EINVAL;
-    }
+	pcs = malloc(sizeof(*pcs) * (sampler.head - sampler.tail + 1));
+	counts = malloc(sizeof(*counts) * (sampler.head - sampler.tail + 1));
+	if (!pcs || !counts) {
+		free(pcs);
+		free(counts);
+		sampler_release(&sampler);
+		return -ENOMEM;
+	}
+	while (sampler_read(&sampler, pcs + nr_samples)) nr_samples++;
 
-    while (fgets(linebuffer, sizeof(linebuffer), fp)) {
-        hexvalue = strtoimax(linebuffer, NULL, 0);
+	qsort(pcs, nr_samples, sizeof(*pcs), compare_pcs);
+	for (unsigned long i = 0; i < nr_samples; i++) {
+		if (nr_counts && counts[nr_counts - 1].pc == pcs[i]) {
+			counts[nr_counts - 1].count++;
+		} else {
+			counts[nr_counts++] = (struct pc_samples) { pcs[i], 1 };
+		}
+	}
+	qsort(counts, nr_counts, sizeof(*counts), compare_pc_samples);
 
-        for (int i = 0; i < 4; i++) {
-            memory[pc + (3 - i)] = (hexvalue >> (8 * i)) & 0xff;
-        }
-        pc += 4;
-    }
+	fprintf(stderr, "sample: %lu samples at %u Hz, %lu dropped\n",
+			nr_samples, hz, sampler.nr_dropped);
+	for (unsigned int i = 0; i < nr_counts && i < NR_TOP_SAMPLES; i++) {
+		char text[48] = "";
 
-    for (int i = 0; i < 4; i++) {
-        memory[pc + (3 - i)] = 0xff;
-    }
-    fclose(fp);
-    return 0;
+		if (!m->mmu.enabled) {
+			struct decoded_instruction di;
+			unsigned char bytes[4];
 
+			guest_peek(&m->memory, counts[i].pc, bytes, sizeof(bytes));
+			decode_instruction((bytes[0] << 24) | (bytes[1] << 16) | (bytes[2] << 8) | bytes[3], &di);
+			disassemble(&di, counts[i].pc, text, sizeof(text));
+		}
+		fprintf(stderr, "sample: 0x%08x %10lu  %5.1f%%  %s\n", counts[i].pc, counts[i].count,
+				100.0 * counts[i].count / nr_samples, text);
+	}
+	free(pcs);
+	free(counts);
+	sampler_release(&sampler);
+	return ret;
 }
+
+
+/**
+ * Opcodes and functs of the operations for @machine_write_stats(). The
+ * r-format ones have the opcode 0, and nop and halt have none.
+ */
+#define NO_OPCODE	0xff
+
+static const struct {
+	unsigned char opcode;
+	unsigned char funct;
+} op_encodings[NR_DECODED_OPS] = {
+	[OP_NOP] = { NO_OPCODE, }, [OP_HALT] = { NO_OPCODE, },
+	[OP_ADD] = { 0x00, 0x20 }, [OP_SUB] = { 0x00, 0x22 }, [OP_AND] = { 0x00, 0x24 },
+	[OP_OR] = { 0x00, 0x25 }, [OP_NOR] = { 0x00, 0x27 }, [OP_SLL] = { 0x00, 0x00 },
+	[OP_SRL] = { 0x00, 0x02 }, [OP_SRA] = { 0x00, 0x03 }, [OP_SLT] = { 0x00, 0x2a },
+	[OP_JR] = { 0x00, 0x08 }, [OP_J] = { 0x02, }, [OP_JAL] = { 0x03, },
+	[OP_BEQ] = { 0x04, }, [OP_BNE] = { 0x05, }, [OP_ADDI] = { 0x08, },
+	[OP_ANDI] = { 0x0c, }, [OP_ORI] = { 0x0d, }, [OP_SLTI] = { 0x0a, },
+	[OP_LW] = { 0x23, }, [OP_SW] = { 0x2b, },
+};
+
 /**********************************************************************
- * run_program
+ * machine_write_stats
  *
  * DESCRIPTION
- *   Start running the program that is loaded by @load_program function above.
- *   If you implement @load_program() properly, the first instruction is placed
- *   at @INITIAL_PC. Using @pc, which is the program counter of this processor,
- *   you can emulate the MIPS processor by
- *
- *   1. Read instruction from @pc
- *   2. Increment @pc by 4
- *   3. Call @process_instruction(instruction)
- *   4. Repeat until @process_instruction() returns 0
+ *   Write the instruction mix of @m in JSON to the file @filename, or to
+ *   stderr if it is NULL. The counts by opcode and by funct cover the
+ *   instructions supported; unknown ones are counted apart. "instructions"
+ *   includes the ones run by the translated code, which are not broken down
+ *   any further, and "complete" is false when there are any of them.
  *
  * RETURN
- *   0
+ *   0 on success
+ *   -EINVAL if the file cannot be opened
+ *   -EIO if the file cannot be written
  */
-static int run_program(void) {
-    unsigned int instruct;
-    pc = INITIAL_PC;
+int machine_write_stats(struct machine *m, const char *filename)
+{
+	const struct machine_stats *stats = &m->stats;
+	unsigned long opcodes[64] = { 0 }, functs[64] = { 0 };
+	bool has_opcode[64] = { false }, has_funct[64] = { false };
+	unsigned long nr_instructions = 0;
+	const char *sep = "";
+	FILE *fp = filename ? fopen(filename, "w") : stderr;
 
-    while (1) {
-        instruct = (memory[pc] << 24) | (memory[pc + 1] << 16) |
-                      (memory[pc + 2] << 8) | memory[pc + 3];
+	if (!fp) {
+		fprintf(stderr, "stats: cannot open %s\n", filename);
+		return -EINVAL;
+	}
 
-        if (instruct == 0xffffffff) {
-            pc += 4;
-            break;
-        }
-        pc += 4;
-        process_instruction(instruct);
-    }
-    return 0;
- }
+	for (unsigned int op = 0; op < NR_DECODED_OPS; op++) {
+		nr_instructions += stats->nr_ops[op];
+		if (op_encodings[op].opcode == NO_OPCODE) continue;
+
+		opcodes[op_encodings[op].opcode] += stats->nr_ops[op];
+		has_opcode[op_encodings[op].opcode] = true;
+		if (op_encodings[op].opcode == 0x00) {
+			functs[op_encodings[op].funct] += stats->nr_ops[op];
+			has_funct[op_encodings[op].funct] = true;
+		}
+	}
+
+	if (stats->engine) {
+		fprintf(fp, "{\n  \"engine\": \"%s\",\n", stats->engine);
+	} else {
+		fprintf(fp, "{\n  \"engine\": null,\n");
+	}
+	fprintf(fp, "  \"complete\": %s,\n", stats->nr_translated ? "false" : "true");
+	fprintf(fp, "  \"instructions\": %lu,\n  \"translated\": %lu,\n  \"ops\": {",
+			nr_instructions + stats->nr_translated, stats->nr_translated);
+	for (unsigned int op = 0; op < NR_DECODED_OPS; op++) {
+		if (op_encodings[op].opcode == NO_OPCODE) continue;
+		fprintf(fp, "%s\"%s\": %lu", sep, op_names[op], stats->nr_ops[op]);
+		sep = ", ";
+	}
+	fprintf(fp, "},\n  \"opcodes\": {");
+	sep = "";
+	for (unsigned int i = 0; i < 64; i++) {
+		if (!has_opcode[i]) continue;
+		fprintf(fp, "%s\"0x%02x\": %lu", sep, i, opcodes[i]);
+		sep = ", ";
+	}
+	fprintf(fp, "},\n  \"functs\": {");
+	sep = "";
+	for (unsigned int i = 0; i < 64; i++) {
+		if (!has_funct[i]) continue;
+		fprintf(fp, "%s\"0x%02x\": %lu", sep, i, functs[i]);
+		sep = ", ";
+	}
+	fprintf(fp, "},\n  \"unknown\": %lu,\n", stats->nr_ops[OP_NOP]);
+	fprintf(fp, "  \"branches\": {\"taken\": %lu, \"not_taken\": %lu},\n", stats->nr_taken,
+			stats->nr_ops[OP_BEQ] + stats->nr_ops[OP_BNE] - stats->nr_taken);
+	fprintf(fp, "  \"loads\": %lu,\n  \"stores\": %lu,\n  \"jr_targets\": {",
+			stats->nr_ops[OP_LW], stats->nr_ops[OP_SW]);
+	sep = "";
+	for (unsigned int i = 0; i < NR_JR_TARGETS; i++) {
+		if (!stats->jr_targets[i].count) continue;
+		fprintf(fp, "%s\"0x%08x\": %lu", sep, stats->jr_targets[i].target,
+				stats->jr_targets[i].count);
+		sep = ", ";
+	}
+	fprintf(fp, "},\n  \"jr_other_targets\": %lu\n}\n", stats->nr_jr_others);
+
+	if (fp != stderr && fclose(fp)) {
+		fprintf(stderr, "stats: cannot write %s\n", filename);
+		return -EIO;
+	}
+	return 0;
+}
+
+
+/**
+ * Everything below is the command-line interface, which is left out of
+ * libpa2.a. The commands drive @machine.
+ */
+#ifndef PA2_LIBRARY
+static struct machine *machine = NULL;
 
 
 /*====================================================================*/
@@ -429,24 +1993,71 @@ static int run_program(void) {
         }
 
         for (int i = from; i < to; i++) {
-            fprintf(stderr, "[%02d:%2s] 0x%08x    %u\n", i, register_names[i], registers[i], registers[i]);
+            fprintf(stderr, "[%02d:%2s] 0x%08x    %u\n", i, register_names[i], machine->registers[i], machine->registers[i]);
         }
         if (include_pc) {
-            fprintf(stderr, "[  pc ] 0x%08x\n", pc);
+            fprintf(stderr, "[  pc ] 0x%08x\n", machine->pc);
         }
     }
 
     static void __dump_memory(unsigned int addr, size_t length) {
         for (size_t i = 0; i < length; i += 4) {
+            unsigned char b[4];
+
+            guest_peek(&machine->memory, addr + i, b, sizeof(b));
             fprintf(stderr, "0x%08lx:  %02x %02x %02x %02x    %c %c %c %c\n",
-                    addr + i,
-                    memory[addr + i], memory[addr + i + 1],
-                    memory[addr + i + 2], memory[addr + i + 3],
-                    isprint(memory[addr + i]) ? memory[addr + i] : '.',
-                    isprint(memory[addr + i + 1]) ? memory[addr + i + 1] : '.',
-                    isprint(memory[addr + i + 2]) ? memory[addr + i + 2] : '.',
-                    isprint(memory[addr + i + 3]) ? memory[addr + i + 3] : '.');
+                    addr + i, b[0], b[1], b[2], b[3],
+                    isprint(b[0]) ? b[0] : '.', isprint(b[1]) ? b[1] : '.',
+                    isprint(b[2]) ? b[2] : '.', isprint(b[3]) ? b[3] : '.');
+        }
+    }
+
+    static void __report_fault(void) {
+        const struct guest_fault *fault = &machine->memory.fault;
+
+        fprintf(stderr, "%s at 0x%08x by the instruction at 0x%08x\n",
+                guest_fault_name(fault->type), fault->addr, fault->pc);
+    }
+
+    static void __report_mmu(void) {
+        const struct guest_mmu *mmu = &machine->mmu;
+        unsigned long nr_lookups = mmu->nr_hits + mmu->nr_misses;
+
+        if (!mmu->enabled) {
+            fprintf(stderr, "mmu: off\n");
+            return;
+        }
+        fprintf(stderr, "mmu: page directory at 0x%08x, %lu lookups, %.2f%% hit in the TLB, %lu misses, %lu faults\n",
+                mmu->root, nr_lookups, nr_lookups ? 100.0 * mmu->nr_hits / nr_lookups : 0.0,
+                mmu->nr_misses, mmu->nr_faults);
+    }
+
+    static unsigned int __parse_protection(const char *rwx) {
+        unsigned int prot = 0;
+
+        for (; *rwx; rwx++) {
+            if (*rwx == 'r') prot |= PAGE_READ;
+            if (*rwx == 'w') prot |= PAGE_WRITE;
+            if (*rwx == 'x') prot |= PAGE_EXEC;
+        }
+        return prot;
+    }
+
+    /* -J [file] writes the instruction mix in JSON after each run */
+    static const char *__stats_file = NULL;
+
+    /* --host-counters counts the host around @run_program(). See counters.h */
+    #define HOST_COUNTERS_OPTION 0x100
+    static struct host_counters __host_counters = { .leader = -1 };
+
+    /* Instructions counted in the stats so far, by @run_program() */
+    static unsigned long __nr_counted(void) {
+        unsigned long nr_counted = 0;
+
+        for (int op = 0; op < NR_DECODED_OPS; op++) {
+            nr_counted += machine->stats.nr_ops[op];
         }
+        return nr_counted;
     }
 
     static void __process_command(int argc, char *argv[]) {
@@ -454,15 +2065,72 @@ static int run_program(void) {
 
         if (strmatch(argv[0], "load")) {
             if (argc == 2) {
-                load_program(argv[1]);
+                load_program(machine, argv[1]);
             } else {
                 printf("Usage: load [program filename]\n");
             }
         } else if (strmatch(argv[0], "run")) {
+            int ret = 0;
+
             if (argc == 1) {
-                run_program();
+                unsigned long nr_counted = __nr_counted();
+
+                host_counters_start(&__host_counters);
+                ret = run_program(machine);
+                host_counters_stop(&__host_counters);
+                host_counters_report(&__host_counters, __nr_counted() - nr_counted);
+            } else if (argc == 2 && strmatch(argv[1], "threaded")) {
+                ret = run_threaded(machine);
+            } else if (argc == 2 && strmatch(argv[1], "pairs")) {
+                ret = run_pairs(machine);
+            } else if (argc == 2 && strmatch(argv[1], "profile")) {
+                ret = run_profile(machine);
+            } else if ((argc == 2 || argc == 3) && strmatch(argv[1], "sample")) {
+                ret = run_sample(machine, argc == 3 ? strtoimax(argv[2], NULL, 0) : 1000);
+                if (ret && ret != -EFAULT) fprintf(stderr, "sample: %s\n", strerror(-ret));
+            } else if (argc >= 2 && argc <= 4 && strmatch(argv[1], "calls")) {
+                ret = run_calls(machine, argc >= 3 ? argv[2] : NULL, argc == 4 ? argv[3] : NULL);
+            } else if (argc == 2 && strmatch(argv[1], "jit")) {
+                ret = run_jit(machine);
+            } else if ((argc == 2 || argc == 3) && strmatch(argv[1], "tiered")) {
+                ret = run_tiered(machine, argc == 3 ? strtoimax(argv[2], NULL, 0) : 0);
+            } else {
+                printf("Usage: run { threaded | pairs | profile | sample [hz] | calls [folded file] [symbol map] | jit | tiered [hot threshold] }\n");
+            }
+            if (ret == -EFAULT) __report_fault();
+            if (machine->mmu.enabled) __report_mmu();
+            if (__stats_file) machine_write_stats(machine, __stats_file);
+        } else if (strmatch(argv[0], "stats")) {
+            if (argc == 2 && strmatch(argv[1], "reset")) {
+                memset(&machine->stats, 0x00, sizeof(machine->stats));
+            } else if (argc <= 2) {
+                machine_write_stats(machine, argc == 2 ? argv[1] : NULL);
+            } else {
+                printf("Usage: stats { [file] | reset }\n");
+            }
+        } else if (strmatch(argv[0], "mmu")) {
+            if (argc == 2 && strmatch(argv[1], "off")) {
+                guest_mmu_set(&machine->mmu, false, 0);
+            } else if (argc == 2) {
+                guest_mmu_set(&machine->mmu, true, strtoimax(argv[1], NULL, 0));
+            } else if (argc != 1) {
+                printf("Usage: mmu { [page directory address] | off }\n");
+            }
+            __report_mmu();
+        } else if (strmatch(argv[0], "bulk")) {
+            fprintf(stderr, "bulk: %lu loops, %lu bytes copied or filled\n",
+                    machine->nr_bulk_loops, machine->nr_bulk_bytes);
+        } else if (strmatch(argv[0], "aot")) {
+            if (argc == 3) {
+                if (!load_program(machine, argv[1])) aot_translate(machine, argv[2]);
+            } else {
+                printf("Usage: aot [program filename] [output filename]\n");
+            }
+        } else if (strmatch(argv[0], "sweep")) {
+            if (argc >= 2) {
+                if (!load_program(machine, argv[1])) run_sweep(machine, argc - 2, argv + 2);
             } else {
-                printf("Usage: run\n");
+                printf("Usage: sweep [program filename] { [register]=[value] | [register]=[from]..[to] | csv=[filename] | threads=[n] | lanes=[n] | [register] | [address]:[length] }\n");
             }
         } else if (strmatch(argv[0], "show")) {
             if (argc == 1) {
@@ -478,6 +2146,61 @@ static int run_program(void) {
             } else {
                 printf("Usage: dump [start address] [length]\n");
             }
+        } else if (strmatch(argv[0], "memory")) {
+            int ret = 0;
+
+            if (argc == 2 && strmatch(argv[1], "paged")) {
+                ret = machine_set_memory(machine, false, false);
+            } else if ((argc == 2 || argc == 3) && strmatch(argv[1], "flat")) {
+                ret = machine_set_memory(machine, true, argc == 3 && strmatch(argv[2], "huge"));
+            } else if (argc != 1) {
+                printf("Usage: memory { paged | flat [huge] }\n");
+            }
+            if (ret) fprintf(stderr, "memory: %s\n", strerror(-ret));
+            fprintf(stderr, "memory: %s, %lu pages, %u dirty\n", machine->memory.flat ? "flat" : "paged",
+                    machine->memory.nr_pages, machine->memory.nr_dirty);
+        } else if (strmatch(argv[0], "snapshot")) {
+            machine_snapshot(machine);
+        } else if (strmatch(argv[0], "restore")) {
+            int ret = machine_restore(machine);
+
+            if (ret == -ENOENT) {
+                printf("No snapshot is taken\n");
+            } else if (ret) {
+                fprintf(stderr, "restore: %s\n", strerror(-ret));
+            }
+        } else if (strmatch(argv[0], "checkpoint")) {
+            if (argc == 2) {
+                int ret = machine_checkpoint(machine, argv[1]);
+
+                if (ret) fprintf(stderr, "checkpoint: %s\n", strerror(-ret));
+            } else {
+                printf("Usage: checkpoint [file]\n");
+            }
+        } else if (strmatch(argv[0], "resume")) {
+            if (argc == 2) {
+                int ret = machine_resume(machine, argv[1]);
+
+                if (ret) fprintf(stderr, "resume: %s: %s\n", argv[1], strerror(-ret));
+            } else {
+                printf("Usage: resume [file]\n");
+            }
+        } else if (strmatch(argv[0], "protect")) {
+            if (argc == 4) {
+                machine_protect(machine, strtoimax(argv[1], NULL, 0),
+                        strtoimax(argv[2], NULL, 0), __parse_protection(argv[3]));
+            } else {
+                printf("Usage: protect [start address] [length] { r | w | x | - }\n");
+            }
+        } else if (strmatch(argv[0], "map")) {
+            if (argc == 3 || (argc == 4 && (strmatch(argv[3], "ro") || strmatch(argv[3], "rw")))) {
+                int ret = machine_map(machine, argv[1], strtoimax(argv[2], NULL, 0),
+                        argc == 4 && strmatch(argv[3], "rw"));
+
+                if (ret) fprintf(stderr, "map: %s: %s\n", argv[1], strerror(-ret));
+            } else {
+                printf("Usage: map [file] [address] { ro | rw }\n");
+            }
         } else {
 #ifdef INPUT_ASSEMBLY
             /**
@@ -488,11 +2211,38 @@ static int run_program(void) {
             if (!instr) {
                 instr = translate(argc, argv);
             }
-            process_instruction(instr);
+            if (process_instruction(machine, instr) == -EFAULT) __report_fault();
 #else
-            process_instruction(strtoimax(argv[0], NULL, 0));
+            if (process_instruction(machine, strtoimax(argv[0], NULL, 0)) == -EFAULT) {
+                __report_fault();
+            }
 #endif
         }
+
+        /* Write back what the command has stored to the files mapped writable */
+        if (guest_sync(&machine->memory)) fprintf(stderr, "map: %s\n", strerror(ENOMEM));
+    }
+
+    /* -M [file]:[address][:ro|rw] maps the file as the map command does */
+    static int __map_option(char *option) {
+        char *colon = strrchr(option, ':');
+        bool writable = false;
+        int ret;
+
+        if (colon && (strmatch(colon + 1, "ro") || strmatch(colon + 1, "rw"))) {
+            writable = strmatch(colon + 1, "rw");
+            *colon = '\0';
+            colon = strrchr(option, ':');
+        }
+        if (!colon) {
+            fprintf(stderr, "Usage: -M [file]:[address][:ro|rw]\n");
+            return -EINVAL;
+        }
+        *colon = '\0';
+
+        ret = machine_map(machine, option, strtoimax(colon + 1, NULL, 0), writable);
+        if (ret) fprintf(stderr, "map: %s: %s\n", option, strerror(-ret));
+        return ret;
     }
 
     static int __parse_command(char *command, int *nr_tokens, char *tokens[]) {
@@ -528,11 +2278,36 @@ static int run_program(void) {
     int main(int argc, char *const argv[]) {
         char command[MAX_COMMAND] = {'\0'};
         FILE *input = stdin;
+        int opt;
+
+        machine = machine_create();
+        if (!machine) {
+            fprintf(stderr, "Cannot allocate the machine\n");
+            return EXIT_FAILURE;
+        }
 
-        if (argc > 1) {
-            input = fopen(argv[1], "r");
+        static const struct option options[] = {
+            { "host-counters", no_argument, NULL, HOST_COUNTERS_OPTION },
+            { NULL, 0, NULL, 0 },
+        };
+
+        while ((opt = getopt_long(argc, argv, "M:J:", options, NULL)) != -1) {
+            if (opt == HOST_COUNTERS_OPTION) {
+                int ret = host_counters_open(&__host_counters);
+
+                if (ret) fprintf(stderr, "host: counters unavailable, %s\n", strerror(-ret));
+            } else if (opt == 'J') {
+                __stats_file = optarg;
+            } else if (opt != 'M' || __map_option(optarg)) {
+                machine_destroy(machine);
+                return EXIT_FAILURE;
+            }
+        }
+
+        if (argc > optind) {
+            input = fopen(argv[optind], "r");
             if (!input) {
-                fprintf(stderr, "No input file %s\n", argv[1]);
+                fprintf(stderr, "No input file %s\n", argv[optind]);
                 return EXIT_FAILURE;
             }
         }
@@ -575,6 +2350,9 @@ static int run_program(void) {
         }
 
         if (input != stdin) fclose(input);
+        host_counters_close(&__host_counters);
+        machine_destroy(machine);
 
         return EXIT_SUCCESS;
-    }
\ No newline at end of file
+    }
+#endif
@@ -0,0 +1,652 @@
+/**********************************************************************
+ * Copyright (c) 2019-2023
+ *  Sang-Hoon Kim <sanghoonkim@ajou.ac.kr>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTIABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ **********************************************************************/
+
+/**
+ * Parameter sweeps. The loaded program runs as many instances, each on a
+ * copy of the machine with its own register values, across the host cores;
+ *
+ *   >> sweep testcases/program-fibonacci pc=0x1004 a0=1..25 v0
+ *
+ * runs the program from 0x1004 for a0 = 1, 2, ..., 25, and prints v0 of each
+ * instance along with the fault it has stopped at, if any. Every worker thread keeps one machine, and puts it back to the
+ * loaded image between instances by copying the dirty pages only.
+ *
+ * Instances are dealt out to the workers in equal ranges. A worker that runs
+ * out of its range steals the upper half of the range of another worker.
+ *
+ * With lanes=<n>, a worker takes <n> instances at a time and runs them in
+ * lockstep on the vector units. See lockstep.c
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "machine.h"
+
+/***
+ * External entities in other files.
+ */
+extern const char *register_names[];
+
+#define MAX_SWEEP_PARAMETERS	32
+#define MAX_SWEEP_OUTPUTS		32
+#define MAX_SWEEP_THREADS		256
+#define MAX_SWEEP_CSV_LINE		1024
+
+/**
+ * Values of a register over the instances. A range or a constant in the
+ * command gives @from to @from + @count - 1. A column of the CSV file gives
+ * @values[].
+ */
+struct sweep_parameter {
+	unsigned int reg;			/* 0-31, or 32 for pc */
+	unsigned int from;
+	unsigned int count;
+	unsigned int *values;		/* Column of the CSV file, or NULL */
+};
+
+/**
+ * What to collect from each instance. A register, or @length bytes of the
+ * memory from @addr.
+ */
+struct sweep_output {
+	int reg;					/* -1 for a memory range */
+	unsigned int addr;
+	unsigned int length;
+};
+
+struct sweep {
+	struct machine *image;		/* Machine with the loaded program */
+
+	struct sweep_parameter parameters[MAX_SWEEP_PARAMETERS];
+	unsigned int nr_parameters;
+	unsigned int nr_rows;		/* Rows of the CSV file. 1 without it */
+
+	struct sweep_output outputs[MAX_SWEEP_OUTPUTS];
+	unsigned int nr_outputs;
+
+	unsigned int nr_lanes;		/* Instances run in lockstep. 1 to run them one by one */
+
+	uint64_t nr_instances;
+	size_t row_size;			/* Bytes of the outputs of an instance */
+	unsigned char *results;
+	struct guest_fault *faults;	/* GUEST_FAULT_NONE for the instances halted */
+};
+
+/**
+ * A worker thread. @range holds the instances yet to run, the next one in the
+ * lower 32 bits and the end in the upper 32 bits, so that the worker and the
+ * thieves update it with a single compare-and-swap.
+ */
+struct sweep_worker {
+	pthread_t thread;
+	struct sweep *sweep;
+	struct sweep_worker *workers;
+	unsigned int id;
+	unsigned int nr_workers;
+	uint64_t range;
+	unsigned long nr_run;
+	unsigned long nr_faulted;
+	unsigned long nr_stolen;	/* Ranges stolen from the others */
+	struct lockstep_stats lockstep;
+} __attribute__((aligned(64)));
+
+#define SWEEP_RANGE(next, end)	(((uint64_t)(end) << 32) | (next))
+#define SWEEP_NEXT(range)		((unsigned int)(range))
+#define SWEEP_END(range)		((unsigned int)((range) >> 32))
+
+
+static inline double sweep_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Register number of @name, 32 for pc, or -1 if there is no such register
+ */
+static int sweep_register(const char *name)
+{
+	if (!strcmp(name, "pc")) return 32;
+
+	for (int i = 0; i < 32; i++) {
+		if (!strcmp(name, register_names[i])) return i;
+	}
+	return -1;
+}
+
+
+/**********************************************************************
+ * sweep_load_csv
+ *
+ * DESCRIPTION
+ *   Read the register values of the instances from the CSV file @filename.
+ *   The first line names the registers, and each following line gives the
+ *   values for an instance.
+ *
+ * RETURN
+ *   0 on success
+ *   any other value otherwise
+ */
+static int sweep_load_csv(struct sweep *s, const char *filename)
+{
+	char line[MAX_SWEEP_CSV_LINE];
+	struct sweep_parameter *columns = s->parameters + s->nr_parameters;
+	unsigned int nr_columns = 0, capacity = 0;
+	FILE *fp = fopen(filename, "r");
+
+	if (!fp) {
+		fprintf(stderr, "sweep: cannot open %s\n", filename);
+		return -EINVAL;
+	}
+
+	if (!fgets(line, sizeof(line), fp)) goto broken;
+	for (char *name = strtok(line, ", \t\r\n"); name; name = strtok(NULL, ", \t\r\n")) {
+		int reg = sweep_register(name);
+
+		if (reg < 0 || s->nr_parameters + nr_columns == MAX_SWEEP_PARAMETERS) goto broken;
+		columns[nr_columns++] = (struct sweep_parameter) { .reg = reg, };
+	}
+	if (!nr_columns) goto broken;
+	s->nr_parameters += nr_columns;
+
+	s->nr_rows = 0;
+	while (fgets(line, sizeof(line), fp)) {
+		unsigned int c = 0;
+
+		if (line[strspn(line, " \t\r\n")] == '\0' || line[0] == '#') continue;
+
+		if (s->nr_rows == capacity) {
+			capacity = capacity ? capacity * 2 : 1024;
+			for (unsigned int i = 0; i < nr_columns; i++) {
+				columns[i].values = realloc(columns[i].values,
+						sizeof(*columns[i].values) * capacity);
+				if (!columns[i].values) goto broken;
+			}
+		}
+		for (char *value = strtok(line, ", \t\r\n"); value; value = strtok(NULL, ", \t\r\n")) {
+			if (c == nr_columns) goto broken;
+			columns[c++].values[s->nr_rows] = strtoimax(value, NULL, 0);
+		}
+		if (c != nr_columns) goto broken;
+		s->nr_rows++;
+	}
+	fclose(fp);
+	return 0;
+
+broken:
+	fprintf(stderr, "sweep: %s is not a CSV file of register values\n", filename);
+	fclose(fp);
+	return -EINVAL;
+}
+
+
+/**********************************************************************
+ * sweep_parse
+ *
+ * DESCRIPTION
+ *   Fill @s from the arguments of the sweep command, which are;
+ *
+ *   <reg>=<value>         set <reg>, which can be pc, to <value>
+ *   <reg>=<from>..<to>    run an instance for each value from <from> to <to>
+ *   csv=<file>            run an instance for each line of <file>. Only one
+ *                         csv= can be given
+ *   threads=<n>           run on <n> threads instead of one per host core
+ *   lanes=<n>             run <n> instances in lockstep on each thread
+ *   <reg>                 collect <reg> of the instances
+ *   <addr>:<length>       collect <length> bytes of the memory from <addr>
+ *
+ *   Instances run over all the combinations of the ranges and the lines.
+ *
+ * RETURN
+ *   0 on success
+ *   any other value otherwise
+ */
+static int sweep_parse(struct sweep *s, int argc, char *argv[], unsigned int *nr_threads)
+{
+	bool csv = false;
+
+	s->nr_rows = 1;
+
+	for (int i = 0; i < argc; i++) {
+		char *arg = argv[i];
+		char *value = strchr(arg, '=');
+		char *colon = strchr(arg, ':');
+
+		if (value) {
+			struct sweep_parameter *p = s->parameters + s->nr_parameters;
+			char *dots;
+			int reg;
+
+			*value++ = '\0';
+			if (!strcmp(arg, "csv")) {
+				/* The columns of all the files would share @s->nr_rows */
+				if (csv) {
+					fprintf(stderr, "sweep: only one csv= is allowed\n");
+					return -EINVAL;
+				}
+				csv = true;
+				if (sweep_load_csv(s, value)) return -EINVAL;
+				continue;
+			}
+			if (!strcmp(arg, "threads")) {
+				*nr_threads = strtoimax(value, NULL, 0);
+				if (!*nr_threads || *nr_threads > MAX_SWEEP_THREADS) return -EINVAL;
+				continue;
+			}
+			if (!strcmp(arg, "lanes")) {
+				s->nr_lanes = strtoimax(value, NULL, 0);
+				if (!s->nr_lanes || s->nr_lanes > LOCKSTEP_LANES) return -EINVAL;
+				continue;
+			}
+
+			reg = sweep_register(arg);
+			if (reg < 0 || s->nr_parameters == MAX_SWEEP_PARAMETERS) return -EINVAL;
+
+			*p = (struct sweep_parameter) {
+				.reg = reg,
+				.from = strtoimax(value, NULL, 0),
+				.count = 1,
+			};
+			dots = strstr(value, "..");
+			if (dots) {
+				unsigned int to = strtoimax(dots + 2, NULL, 0);
+
+				if (to < p->from) return -EINVAL;
+				p->count = to - p->from + 1;
+				if (!p->count) return -EINVAL;
+			}
+			s->nr_parameters++;
+		} else {
+			struct sweep_output *o = s->outputs + s->nr_outputs;
+
+			if (s->nr_outputs == MAX_SWEEP_OUTPUTS) return -EINVAL;
+
+			if (colon) {
+				*o = (struct sweep_output) {
+					.reg = -1,
+					.addr = strtoimax(arg, NULL, 0),
+					.length = strtoimax(colon + 1, NULL, 0),
+				};
+				if (!o->length || (uint64_t)o->addr + o->length > (1ULL << 32)) return -EINVAL;
+			} else {
+				o->reg = sweep_register(arg);
+				if (o->reg < 0) return -EINVAL;
+			}
+			s->nr_outputs++;
+		}
+	}
+
+	s->nr_instances = s->nr_rows;
+	for (unsigned int i = 0; i < s->nr_parameters; i++) {
+		if (!s->parameters[i].values) s->nr_instances *= s->parameters[i].count;
+	}
+	return 0;
+}
+
+/**
+ * Value of the parameter @p for the instance @instance. The instance numbers
+ * are the CSV line in the lowest digit, followed by the ranges in order.
+ */
+static unsigned int sweep_value(const struct sweep *s, const struct sweep_parameter *p,
+		uint64_t instance)
+{
+	uint64_t stride = s->nr_rows;
+
+	if (p->values) return p->values[instance % s->nr_rows];
+
+	for (const struct sweep_parameter *q = s->parameters; q < p; q++) {
+		if (!q->values) stride *= q->count;
+	}
+	return p->from + (instance / stride) % p->count;
+}
+
+
+/**
+ * Put the machine @m of a worker back to the loaded image, and set the
+ * registers of @instance
+ */
+static void sweep_prepare(struct sweep *s, struct machine *m, uint64_t instance)
+{
+	const struct machine *image = s->image;
+
+	guest_memory_reset(&m->memory, &image->memory);
+	memcpy(m->decoded, image->decoded, sizeof(*m->decoded) * image->nr_decoded);
+	memcpy(m->registers, image->registers, sizeof(m->registers));
+	m->entry = image->entry;
+	guest_mmu_set(&m->mmu, image->mmu.enabled, image->mmu.root);
+
+	for (unsigned int i = 0; i < s->nr_parameters; i++) {
+		const struct sweep_parameter *p = s->parameters + i;
+		unsigned int value = sweep_value(s, p, instance);
+
+		if (p->reg == 32) {
+			m->entry = value;
+		} else {
+			m->registers[p->reg] = value;
+		}
+	}
+}
+
+/**
+ * Keep the outputs of @instance run on @m in the result table, along with
+ * the fault @m has stopped at
+ *
+ * RETURN
+ *   true if @instance has faulted
+ *   false if it has halted
+ */
+static bool sweep_collect(struct sweep *s, struct machine *m, uint64_t instance)
+{
+	unsigned char *row = s->results + s->row_size * instance;
+
+	s->faults[instance] = m->memory.fault;
+
+	for (unsigned int i = 0; i < s->nr_outputs; i++) {
+		const struct sweep_output *o = s->outputs + i;
+
+		if (o->reg < 0) {
+			guest_peek(&m->memory, o->addr, row, o->length);
+			row += o->length;
+		} else {
+			unsigned int value = o->reg == 32 ? m->pc : m->registers[o->reg];
+
+			memcpy(row, &value, sizeof(value));
+			row += sizeof(value);
+		}
+	}
+	return m->memory.fault.type != GUEST_FAULT_NONE;
+}
+
+/**
+ * Take up to @nr next instances of @w
+ *
+ * RETURN
+ *   The number of instances taken from @instance
+ *   0 if the range of @w is empty
+ */
+static unsigned int sweep_take(struct sweep_worker *w, unsigned int nr, unsigned int *instance)
+{
+	uint64_t range = __atomic_load_n(&w->range, __ATOMIC_ACQUIRE);
+
+	while (SWEEP_NEXT(range) < SWEEP_END(range)) {
+		unsigned int next = SWEEP_NEXT(range), end = SWEEP_END(range);
+
+		if (nr > end - next) nr = end - next;
+		if (__atomic_compare_exchange_n(&w->range, &range, SWEEP_RANGE(next + nr, end),
+				false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			*instance = next;
+			return nr;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Steal the upper half of the range of another worker into the empty range
+ * of @w. Victims are tried in turn from the next worker.
+ *
+ * RETURN
+ *   true if something is stolen
+ *   false if all the others have run out of their ranges
+ */
+static bool sweep_steal(struct sweep_worker *w)
+{
+	for (unsigned int i = 1; i < w->nr_workers; i++) {
+		struct sweep_worker *victim = w->workers + (w->id + i) % w->nr_workers;
+		uint64_t range = __atomic_load_n(&victim->range, __ATOMIC_ACQUIRE);
+
+		while (SWEEP_NEXT(range) < SWEEP_END(range)) {
+			unsigned int next = SWEEP_NEXT(range), end = SWEEP_END(range);
+			unsigned int middle = next + (end - next) / 2;
+
+			if (__atomic_compare_exchange_n(&victim->range, &range,
+					SWEEP_RANGE(next, middle),
+					false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+				__atomic_store_n(&w->range, SWEEP_RANGE(middle, end), __ATOMIC_RELEASE);
+				w->nr_stolen++;
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+static void *sweep_worker(void *arg)
+{
+	struct sweep_worker *w = arg;
+	struct sweep *s = w->sweep;
+	struct machine *lanes[LOCKSTEP_LANES] = { NULL };
+	unsigned int instance, nr;
+	int ret;
+
+	for (unsigned int l = 0; l < s->nr_lanes; l++) {
+		struct machine *m = machine_create();
+
+		if (!m) goto out;
+		lanes[l] = m;
+
+		guest_memory_release(&m->memory);
+		if (guest_memory_copy(&m->memory, &s->image->memory)) goto out;
+		m->nr_decoded = s->image->nr_decoded;
+		m->decoded = malloc(sizeof(*m->decoded) * m->nr_decoded);
+		if (!m->decoded) goto out;
+	}
+
+	do {
+		while ((nr = sweep_take(w, s->nr_lanes, &instance))) {
+			for (unsigned int l = 0; l < nr; l++) {
+				sweep_prepare(s, lanes[l], instance + l);
+			}
+			if (s->nr_lanes == 1) {
+				ret = run_program(lanes[0]);
+			} else {
+				ret = run_lockstep(lanes, nr, &w->lockstep);
+			}
+			/* The faults are of each lane. Anything else leaves the rows unrun */
+			if (ret && ret != -EFAULT) goto out;
+
+			for (unsigned int l = 0; l < nr; l++) {
+				if (sweep_collect(s, lanes[l], instance + l)) w->nr_faulted++;
+			}
+			w->nr_run += nr;
+		}
+	} while (sweep_steal(w));
+
+out:
+	for (unsigned int l = 0; l < s->nr_lanes; l++) {
+		if (lanes[l]) machine_destroy(lanes[l]);
+	}
+	return NULL;
+}
+
+/**
+ * Print the result table. Each line has the instance number, the values of
+ * the parameters, the outputs, and the fault of the instance or '-'.
+ */
+static void sweep_print(const struct sweep *s)
+{
+	printf("%10s", "instance");
+	for (unsigned int i = 0; i < s->nr_parameters; i++) {
+		unsigned int reg = s->parameters[i].reg;
+
+		printf(" %10s", reg == 32 ? "pc" : register_names[reg]);
+	}
+	printf(" |");
+	for (unsigned int i = 0; i < s->nr_outputs; i++) {
+		const struct sweep_output *o = s->outputs + i;
+
+		if (o->reg < 0) {
+			printf(" 0x%08x:%u", o->addr, o->length);
+		} else {
+			printf(" %10s", o->reg == 32 ? "pc" : register_names[o->reg]);
+		}
+	}
+	printf(" | fault\n");
+
+	for (uint64_t n = 0; n < s->nr_instances; n++) {
+		const unsigned char *row = s->results + s->row_size * n;
+		const struct guest_fault *fault = s->faults + n;
+
+		printf("%10" PRIu64, n);
+		for (unsigned int i = 0; i < s->nr_parameters; i++) {
+			printf(" 0x%08x", sweep_value(s, s->parameters + i, n));
+		}
+		printf(" |");
+		for (unsigned int i = 0; i < s->nr_outputs; i++) {
+			const struct sweep_output *o = s->outputs + i;
+
+			if (o->reg < 0) {
+				printf(" ");
+				for (unsigned int b = 0; b < o->length; b++) printf("%02x", row[b]);
+				row += o->length;
+			} else {
+				unsigned int value;
+
+				memcpy(&value, row, sizeof(value));
+				printf(" 0x%08x", value);
+				row += sizeof(value);
+			}
+		}
+		if (fault->type == GUEST_FAULT_NONE) {
+			printf(" | -\n");
+		} else {
+			printf(" | %s at 0x%08x by the instruction at 0x%08x\n",
+					guest_fault_name(fault->type), fault->addr, fault->pc);
+		}
+	}
+}
+
+
+/**********************************************************************
+ * run_sweep
+ *
+ * DESCRIPTION
+ *   Run the program loaded on @m as many instances as the arguments of the
+ *   sweep command in @argv ask for. See @sweep_parse() for the arguments.
+ *   @m itself is left untouched as the image of the instances.
+ *
+ * RETURN
+ *   0 on success
+ *   any other value otherwise
+ */
+int run_sweep(struct machine *m, int argc, char *argv[])
+{
+	struct sweep s = { .image = m, .nr_lanes = 1, };
+	struct sweep_worker *workers = NULL;
+	unsigned int nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned long nr_stolen = 0;
+	uint64_t nr_run = 0, nr_faulted = 0;
+	struct lockstep_stats lockstep = { 0 };
+	double begin, elapsed;
+	int ret = -EINVAL;
+
+	if (!m->nr_decoded) {
+		fprintf(stderr, "sweep: no program is loaded\n");
+		return -EINVAL;
+	}
+	if (sweep_parse(&s, argc, argv, &nr_threads)) {
+		fprintf(stderr, "sweep: invalid arguments\n");
+		goto out;
+	}
+	if (!s.nr_instances || s.nr_instances > UINT32_MAX) {
+		fprintf(stderr, "sweep: %" PRIu64 " instances are out of the range\n", s.nr_instances);
+		goto out;
+	}
+	/* The lanes fetch the loaded program where it is */
+	if (m->mmu.enabled) s.nr_lanes = 1;
+	if (nr_threads < 1) nr_threads = 1;
+	if (nr_threads > MAX_SWEEP_THREADS) nr_threads = MAX_SWEEP_THREADS;
+	if (nr_threads > s.nr_instances) nr_threads = s.nr_instances;
+
+	for (unsigned int i = 0; i < s.nr_outputs; i++) {
+		s.row_size += s.outputs[i].reg < 0 ? s.outputs[i].length : sizeof(unsigned int);
+	}
+	s.results = malloc(s.row_size * s.nr_instances + 1);
+	s.faults = malloc(sizeof(*s.faults) * s.nr_instances);
+	workers = aligned_alloc(64, sizeof(*workers) * nr_threads);
+	if (!s.results || !s.faults || !workers) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	begin = sweep_now();
+	for (unsigned int i = 0; i < nr_threads; i++) {
+		workers[i] = (struct sweep_worker) {
+			.sweep = &s,
+			.workers = workers,
+			.id = i,
+			.nr_workers = nr_threads,
+			.range = SWEEP_RANGE(s.nr_instances * i / nr_threads,
+					s.nr_instances * (i + 1) / nr_threads),
+		};
+	}
+	for (unsigned int i = 0; i < nr_threads; i++) {
+		if (pthread_create(&workers[i].thread, NULL, sweep_worker, workers + i)) {
+			/* Others steal the instances of the ones not started */
+			workers[i].thread = pthread_self();
+		}
+	}
+	for (unsigned int i = 0; i < nr_threads; i++) {
+		if (!pthread_equal(workers[i].thread, pthread_self())) {
+			pthread_join(workers[i].thread, NULL);
+		}
+		nr_run += workers[i].nr_run;
+		nr_faulted += workers[i].nr_faulted;
+		nr_stolen += workers[i].nr_stolen;
+		lockstep.nr_steps += workers[i].lockstep.nr_steps;
+		lockstep.nr_lane_steps += workers[i].lockstep.nr_lane_steps;
+		if (workers[i].lockstep.isa) lockstep.isa = workers[i].lockstep.isa;
+	}
+	elapsed = sweep_now() - begin;
+
+	/* Some workers could not set up or run their lanes, so the rows left are garbage */
+	if (nr_run != s.nr_instances) {
+		fprintf(stderr, "sweep: %" PRIu64 " of %" PRIu64 " instances are not run\n",
+				s.nr_instances - nr_run, s.nr_instances);
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	sweep_print(&s);
+	fprintf(stderr, "sweep: %" PRIu64 " instances on %u threads in %.3f s, "
+			"%.0f instances/s, %lu ranges stolen, %" PRIu64 " faulted\n",
+			s.nr_instances, nr_threads, elapsed, s.nr_instances / elapsed, nr_stolen,
+			nr_faulted);
+	if (lockstep.nr_steps) {
+		fprintf(stderr, "sweep: %u lanes on %s, %.1f lanes busy per instruction\n",
+				s.nr_lanes, lockstep.isa,
+				(double)lockstep.nr_lane_steps / lockstep.nr_steps);
+	}
+	ret = 0;
+
+out:
+	for (unsigned int i = 0; i < s.nr_parameters; i++) {
+		free(s.parameters[i].values);
+	}
+	free(s.results);
+	free(s.faults);
+	free(workers);
+	return ret;
+}
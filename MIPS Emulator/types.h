@@ -0,0 +1,84 @@
+/**********************************************************************
+ * Copyright (c) 2019-2023
+ *  Sang-Hoon Kim <sanghoonkim@ajou.ac.kr>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTIABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ **********************************************************************/
+
+#ifndef __PA2_TYPES_H__
+#define __PA2_TYPES_H__
+
+typedef unsigned char bool;
+#define true	1
+#define false	0
+
+#define MEMORY_SIZE	(1 << 20)	/* 1MB the AOT code accesses directly. See memory.h for the machine */
+
+#define INITIAL_PC	0x1000	/* Initial value for PC register */
+#define INITIAL_SP	0x8000	/* Initial location for stack pointer */
+
+/**
+ * Operations of the pre-decoded instructions
+ */
+enum decoded_op {
+	OP_NOP = 0,	/* Unknown instructions are silently ignored */
+	OP_ADD,
+	OP_SUB,
+	OP_AND,
+	OP_OR,
+	OP_NOR,
+	OP_SLL,
+	OP_SRL,
+	OP_SRA,
+	OP_SLT,
+	OP_JR,
+	OP_J,
+	OP_JAL,
+	OP_BEQ,
+	OP_BNE,
+	OP_ADDI,
+	OP_ANDI,
+	OP_ORI,
+	OP_SLTI,
+	OP_LW,
+	OP_SW,
+	OP_HALT,
+
+	NR_DECODED_OPS,
+};
+
+/**
+ * Shapes of the loops closed by a backward bne, which are run in bulk
+ */
+enum loop_idiom {
+	IDIOM_NONE = 0,		/* Not a loop, or none of below */
+	IDIOM_UNKNOWN,		/* Backward bne not examined yet */
+	IDIOM_COPY,			/* lw, sw, and pointer increments */
+	IDIOM_FILL,			/* sw and pointer increments */
+};
+
+/**
+ * An instruction decoded into its fields. @imm keeps the zero-extended
+ * 16-bit immediate for i-format instructions and the 26-bit target for
+ * j-format instructions. @idiom tells the shape of the loop closed by bne.
+ */
+struct decoded_instruction {
+	unsigned char op;
+	unsigned char rs;
+	unsigned char rt;
+	unsigned char rd;
+	unsigned char shamt;
+	bool valid;
+	unsigned char idiom;
+	unsigned int imm;
+};
+
+#endif
@@ -0,0 +1,205 @@
+/**********************************************************************
+ * Copyright (c) 2019-2023
+ *  Sang-Hoon Kim <sanghoonkim@ajou.ac.kr>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTIABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ **********************************************************************/
+
+/**
+ * The hardware counters of the host. See counters.h
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "counters.h"
+
+static const struct {
+	unsigned int type;
+	unsigned long config;
+} host_events[NR_HOST_COUNTERS] = {
+	[HOST_CYCLES] = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+	[HOST_INSTRUCTIONS] = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+	[HOST_BRANCHES] = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_INSTRUCTIONS },
+	[HOST_BRANCH_MISSES] = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+	[HOST_CACHE_REFERENCES] = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES },
+	[HOST_CACHE_MISSES] = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+};
+
+/* The group as read from the leader, in the order the counters are opened */
+struct host_group_read {
+	uint64_t nr;
+	uint64_t time_enabled;
+	uint64_t time_running;
+	uint64_t values[NR_HOST_COUNTERS];
+};
+
+static int perf_event_open(struct perf_event_attr *attr, int group_fd)
+{
+	return syscall(SYS_perf_event_open, attr, 0, -1, group_fd, 0);
+}
+
+
+/**********************************************************************
+ * host_counters_open
+ *
+ * DESCRIPTION
+ *   Open the counters of the host into @c, the ones the host has only. They
+ *   are stopped until @host_counters_start().
+ *
+ * RETURN
+ *   0 if any of them is opened
+ *   -errno of the first counter otherwise, say, -ENOENT if the host has no
+ *   such counter, or -EACCES if perf_event_paranoid does not allow it
+ */
+int host_counters_open(struct host_counters *c)
+{
+	int ret = 0;
+
+	memset(c, 0x00, sizeof(*c));
+	c->leader = -1;
+
+	for (int i = 0; i < NR_HOST_COUNTERS; i++) {
+		struct perf_event_attr attr = {
+			.type = host_events[i].type,
+			.size = sizeof(attr),
+			.config = host_events[i].config,
+			.disabled = c->leader < 0,
+			.exclude_kernel = 1,
+			.exclude_hv = 1,
+			.read_format = PERF_FORMAT_GROUP |
+					PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING,
+		};
+
+		c->fds[i] = perf_event_open(&attr, c->leader < 0 ? -1 : c->fds[c->leader]);
+		if (c->fds[i] < 0) {
+			if (!ret) ret = -errno;
+			continue;
+		}
+		if (c->leader < 0) c->leader = i;
+	}
+	return c->leader < 0 ? ret : 0;
+}
+
+
+/**
+ * Close the counters of @c
+ */
+void host_counters_close(struct host_counters *c)
+{
+	if (c->leader < 0) return;
+
+	for (int i = NR_HOST_COUNTERS - 1; i >= 0; i--) {
+		if (c->fds[i] >= 0) close(c->fds[i]);
+		c->fds[i] = -1;
+	}
+	c->leader = -1;
+	c->running = false;
+}
+
+
+/**
+ * Start counting from zero
+ */
+void host_counters_start(struct host_counters *c)
+{
+	if (c->leader < 0) return;
+
+	ioctl(c->fds[c->leader], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+	ioctl(c->fds[c->leader], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+	c->running = true;
+}
+
+
+/**
+ * Stop counting, and read the counts into @c->values. The counters not
+ * opened are left 0
+ */
+void host_counters_stop(struct host_counters *c)
+{
+	struct host_group_read group;
+	unsigned int n = 0;
+
+	if (!c->running) return;
+
+	ioctl(c->fds[c->leader], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+	c->running = false;
+
+	memset(c->values, 0x00, sizeof(c->values));
+	if (read(c->fds[c->leader], &group, sizeof(group)) < (ssize_t)(sizeof(uint64_t) * 3)) return;
+
+	for (int i = 0; i < NR_HOST_COUNTERS && n < group.nr; i++) {
+		if (c->fds[i] < 0) continue;
+
+		c->values[i] = group.values[n++];
+		if (group.time_running && group.time_running < group.time_enabled) {
+			c->values[i] = (double)c->values[i] * group.time_enabled / group.time_running;
+		}
+	}
+}
+
+
+/* @count per @per of the counter @count, or n/a if it is not counted */
+static const char *host_per(char *buffer, size_t size, const struct host_counters *c,
+		int count, double per)
+{
+	if (c->fds[count] < 0 || !per) return "n/a";
+
+	snprintf(buffer, size, "%.2f", c->values[count] / per);
+	return buffer;
+}
+
+/* @count of @total @what in percent, or n/a if either is not counted */
+static const char *host_ratio(char *buffer, size_t size, const struct host_counters *c,
+		int count, int total, const char *what)
+{
+	if (c->fds[count] < 0 || c->fds[total] < 0) return "n/a";
+
+	snprintf(buffer, size, "%.2f%% of %lu %s",
+			c->values[total] ? 100.0 * c->values[count] / c->values[total] : 0.0,
+			c->values[total], what);
+	return buffer;
+}
+
+/**********************************************************************
+ * host_counters_report
+ *
+ * DESCRIPTION
+ *   Print the counts of the last run to stderr; the host cycles and
+ *   instructions per guest instruction if @nr_guest_instructions is known,
+ *   the instructions per cycle, and the branch-miss and the cache-miss
+ *   rates. The counters the host does not have are shown as n/a.
+ */
+void host_counters_report(const struct host_counters *c, unsigned long nr_guest_instructions)
+{
+	char cycles[32], instructions[32], ipc[32], branches[64], caches[64];
+
+	if (c->leader < 0) return;
+
+	fprintf(stderr, "host: %s cycles, %s instructions per guest instruction, %s IPC\n",
+			host_per(cycles, sizeof(cycles), c, HOST_CYCLES, nr_guest_instructions),
+			host_per(instructions, sizeof(instructions), c, HOST_INSTRUCTIONS,
+					nr_guest_instructions),
+			c->fds[HOST_CYCLES] < 0 ? "n/a" : host_per(ipc, sizeof(ipc), c, HOST_INSTRUCTIONS,
+					c->values[HOST_CYCLES]));
+	fprintf(stderr, "host: branch misses %s, cache misses %s\n",
+			host_ratio(branches, sizeof(branches), c, HOST_BRANCH_MISSES, HOST_BRANCHES,
+					"branches"),
+			host_ratio(caches, sizeof(caches), c, HOST_CACHE_MISSES, HOST_CACHE_REFERENCES,
+					"references"));
+}
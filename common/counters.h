@@ -0,0 +1,63 @@
+/**********************************************************************
+ * Copyright (c) 2019-2023
+ *  Sang-Hoon Kim <sanghoonkim@ajou.ac.kr>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTIABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ **********************************************************************/
+
+#ifndef __MIPS_COUNTERS_H__
+#define __MIPS_COUNTERS_H__
+
+#include "types.h"		/* Of the emulator built with this file */
+
+/**
+ * The hardware counters of the host, read by perf_event_open(2) around the
+ * runs of the engines to see how well the host runs the emulator;
+ *
+ *   host_counters_open(&counters);
+ *   host_counters_start(&counters);
+ *   run_program(m);
+ *   host_counters_stop(&counters);
+ *   host_counters_report(&counters, nr_guest_instructions);
+ *
+ * The counters are opened as a group led by the first of them opened, so
+ * they are counted over the same time. Only the user space of the process
+ * is counted, which any process may do unless perf_event_paranoid is 3 or
+ * above. The ones the host does not have, say, in a virtual machine, are
+ * left out, and the counts are scaled up when the kernel has multiplexed
+ * the group with the others.
+ */
+enum host_counter_type {
+	HOST_CYCLES = 0,
+	HOST_INSTRUCTIONS,
+	HOST_BRANCHES,
+	HOST_BRANCH_MISSES,
+	HOST_CACHE_REFERENCES,		/* Of the last-level cache */
+	HOST_CACHE_MISSES,
+
+	NR_HOST_COUNTERS,
+};
+
+struct host_counters {
+	int fds[NR_HOST_COUNTERS];		/* -1 if not opened */
+	int leader;						/* Index of the group leader, or -1 */
+	bool running;
+
+	unsigned long values[NR_HOST_COUNTERS];	/* Counted by the last run */
+};
+
+extern int host_counters_open(struct host_counters *c);
+extern void host_counters_close(struct host_counters *c);
+extern void host_counters_start(struct host_counters *c);
+extern void host_counters_stop(struct host_counters *c);
+extern void host_counters_report(const struct host_counters *c, unsigned long nr_guest_instructions);
+
+#endif
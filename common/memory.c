@@ -0,0 +1,1477 @@
+/**********************************************************************
+ * Copyright (c) 2019-2023
+ *  Sang-Hoon Kim <sanghoonkim@ajou.ac.kr>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTIABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ **********************************************************************/
+
+/**
+ * Slow paths of the guest memory. See memory.h for the layout.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "memory.h"
+
+static inline guest_pte_t *guest_pte(const struct guest_memory *mem, unsigned int addr)
+{
+	guest_pte_t *table = mem->tables[addr >> GUEST_TABLE_SHIFT];
+
+	if (!table) return NULL;
+	return table + ((addr >> GUEST_PAGE_SHIFT) & (NR_GUEST_TABLE_ENTRIES - 1));
+}
+
+static inline unsigned char *guest_pte_page(guest_pte_t pte)
+{
+	return (unsigned char *)(pte & ~(guest_pte_t)PAGE_FLAGS);
+}
+
+static inline unsigned int guest_page_room(unsigned int addr)
+{
+	return GUEST_PAGE_SIZE - (addr & (GUEST_PAGE_SIZE - 1));
+}
+
+/**
+ * Copy @length bytes in the guest order from @offset of @page to @out, and
+ * from @in to @offset of @page. The aligned words are swapped at once, and
+ * the bytes around them are swizzled.
+ */
+static void guest_copy_out(unsigned char *out, const unsigned char *page, unsigned int offset,
+		unsigned int length)
+{
+	while (length) {
+		if (!(offset & 0x3) && length >= 4) {
+			uint32_t word;
+
+			memcpy(&word, page + offset, 4);
+			word = host_to_guest_word(word);
+			memcpy(out, &word, 4);
+			out += 4, offset += 4, length -= 4;
+		} else {
+			*out++ = page[offset++ ^ GUEST_BYTE_SWIZZLE];
+			length--;
+		}
+	}
+}
+
+static void guest_copy_in(unsigned char *page, unsigned int offset, const unsigned char *in,
+		unsigned int length)
+{
+	while (length) {
+		if (!(offset & 0x3) && length >= 4) {
+			uint32_t word;
+
+			memcpy(&word, in, 4);
+			word = guest_to_host_word(word);
+			memcpy(page + offset, &word, 4);
+			in += 4, offset += 4, length -= 4;
+		} else {
+			page[offset++ ^ GUEST_BYTE_SWIZZLE] = *in++;
+			length--;
+		}
+	}
+}
+
+
+/**
+ * Host protection of the page of @pte in the flat view. Stores to the pages
+ * not dirty yet fault to be marked dirty.
+ */
+static inline int guest_host_prot(guest_pte_t pte)
+{
+	int prot = PROT_NONE;
+
+	/* The host cannot write without reading. Keep write-only pages closed */
+	if (!(pte & PAGE_READ)) return PROT_NONE;
+
+	prot |= PROT_READ;
+	if ((pte & PAGE_WRITE) && (pte & PAGE_DIRTY)) prot |= PROT_WRITE;
+	return prot;
+}
+
+/**
+ * Update the entry @pte of the page at @addr to @value, and the flat view
+ * along with it
+ */
+static inline bool guest_pte_set(struct guest_memory *mem, guest_pte_t *pte, unsigned int addr,
+		guest_pte_t value)
+{
+	*pte = value;
+	if (!mem->flat) return true;
+
+	return !mprotect(mem->flat + (addr & ~(GUEST_PAGE_SIZE - 1)), GUEST_PAGE_SIZE,
+			guest_host_prot(value));
+}
+
+static inline bool guest_fault(struct guest_memory *mem, enum guest_fault_type type,
+		unsigned int addr)
+{
+	mem->fault = (struct guest_fault) {
+		.type = type,
+		.addr = addr,
+	};
+	return false;
+}
+
+
+/**********************************************************************
+ * guest_memory_init
+ *
+ * DESCRIPTION
+ *   Initialize @mem to have no page. Pages are allocated readable, writable,
+ *   and executable when they are touched first.
+ */
+void guest_memory_init(struct guest_memory *mem)
+{
+	*mem = (struct guest_memory) {
+		.prot = PAGE_RWX,
+		.fd = -1,
+	};
+}
+
+
+/**
+ * The flat view has a page closed for good past the address space, which
+ * the words wrapping around the address space hit
+ */
+#define GUEST_FLAT_SIZE		(GUEST_SPACE_SIZE + GUEST_PAGE_SIZE)
+
+/**
+ * The memory catching the faults in the flat view on this thread. The
+ * handler below runs on the thread that faults.
+ */
+static __thread struct guest_memory *guest_catching;
+static struct sigaction guest_old_action;
+
+static void guest_flat_fault(int signo, siginfo_t *info, void *context)
+{
+	struct guest_memory *mem = guest_catching;
+	unsigned char *host = info->si_addr;
+
+	if (!mem || host < mem->flat || host >= mem->flat + GUEST_FLAT_SIZE) {
+		/* Not ours. Pass it on to the previous handler, and stay installed */
+		if (guest_old_action.sa_flags & SA_SIGINFO) {
+			guest_old_action.sa_sigaction(signo, info, context);
+		} else if (guest_old_action.sa_handler != SIG_DFL &&
+				guest_old_action.sa_handler != SIG_IGN) {
+			guest_old_action.sa_handler(signo);
+		} else {
+			/* Fault again to die as the default does. There is no coming back */
+			signal(signo, SIG_DFL);
+		}
+		return;
+	}
+
+	/**
+	 * Bringing in the page may allocate, which is not safe in a signal
+	 * handler. Leave the whole access to the paged path of the engine,
+	 * which opens the page up in @flat for the accesses that follow.
+	 */
+	guest_fault(mem, GUEST_FAULT_NONE, host - mem->flat);
+	siglongjmp(*mem->catch, 1);
+}
+
+
+/**********************************************************************
+ * guest_memory_init_flat
+ *
+ * DESCRIPTION
+ *   Initialize @mem to have no page with the flat backend. Transparent huge
+ *   pages are asked for @huge, which the host may or may not honor.
+ *
+ * RETURN
+ *   0 on success
+ *   -errno if the host cannot reserve the address space
+ */
+int guest_memory_init_flat(struct guest_memory *mem, bool huge)
+{
+	static bool installed = false;
+	int ret;
+
+	guest_memory_init(mem);
+
+	if (!__atomic_exchange_n(&installed, true, __ATOMIC_ACQ_REL)) {
+		struct sigaction action = {
+			.sa_sigaction = guest_flat_fault,
+			.sa_flags = SA_SIGINFO,
+		};
+		sigaction(SIGSEGV, &action, &guest_old_action);
+	}
+
+	mem->fd = memfd_create("guest", MFD_CLOEXEC);
+	if (mem->fd < 0) goto out_errno;
+	if (ftruncate(mem->fd, GUEST_SPACE_SIZE)) goto out_errno;
+
+	mem->backing = mmap(NULL, GUEST_SPACE_SIZE, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_NORESERVE, mem->fd, 0);
+	if (mem->backing == MAP_FAILED) goto out_errno;
+
+	mem->flat = mmap(NULL, GUEST_FLAT_SIZE, PROT_NONE, MAP_SHARED | MAP_NORESERVE, mem->fd, 0);
+	if (mem->flat == MAP_FAILED) goto out_errno;
+
+	if (huge) {
+		madvise(mem->backing, GUEST_SPACE_SIZE, MADV_HUGEPAGE);
+		madvise(mem->flat, GUEST_SPACE_SIZE, MADV_HUGEPAGE);
+	}
+	return 0;
+
+out_errno:
+	ret = -errno;
+	if (mem->backing == MAP_FAILED) mem->backing = NULL;
+	if (mem->flat == MAP_FAILED) mem->flat = NULL;
+	guest_memory_release(mem);
+	return ret;
+}
+
+
+/**********************************************************************
+ * guest_catch
+ *
+ * DESCRIPTION
+ *   Let the engine on this thread access the flat view of @mem directly,
+ *   and go to @env set by sigsetjmp() when the access faults. NULL @env
+ *   stops it. The engine should stop it before @env goes out of scope.
+ */
+void guest_catch(struct guest_memory *mem, sigjmp_buf *env)
+{
+	mem->catch = env;
+	guest_catching = env ? mem : NULL;
+}
+
+
+/**
+ * The checkpoint being written in the background, and the file the
+ * checkpoints go to. The next checkpoint to the same file is appended with
+ * the pages changed since this one.
+ */
+struct guest_writer {
+	pthread_t thread;
+	bool busy;
+	char *filename;
+	bool append;
+	void *record;
+	size_t size;
+	int error;
+};
+
+
+/**
+ * A host file mapped into the memory by @guest_map(), and shared by the
+ * memories copied from the one it is mapped into. The file is in the guest
+ * byte order, and its pages are converted into the pages of the memories
+ * as they are touched first.
+ */
+struct guest_mapping {
+	unsigned int addr;			/* Guest address of the file, page aligned */
+	size_t length;				/* Of the file */
+	unsigned char *host;		/* The file mapped shared on the host */
+	bool writable;				/* Stores to it go back to the file */
+	unsigned int users;
+};
+
+static inline uint64_t guest_mapping_end(const struct guest_mapping *mapping)
+{
+	return ((uint64_t)mapping->addr + mapping->length + GUEST_PAGE_SIZE - 1) &
+			~(uint64_t)(GUEST_PAGE_SIZE - 1);
+}
+
+/* The file mapped over @addr, or NULL */
+static struct guest_mapping *guest_mapping_at(const struct guest_memory *mem, unsigned int addr)
+{
+	for (unsigned int i = 0; i < mem->nr_mappings; i++) {
+		struct guest_mapping *mapping = mem->mappings[i];
+
+		if (addr >= mapping->addr && addr < guest_mapping_end(mapping)) return mapping;
+	}
+	return NULL;
+}
+
+/* Bytes of the file mapped in the page at @addr */
+static inline unsigned int guest_mapping_chunk(const struct guest_mapping *mapping,
+		unsigned int addr)
+{
+	size_t left = mapping->length - ((addr & ~(GUEST_PAGE_SIZE - 1)) - mapping->addr);
+
+	return left < GUEST_PAGE_SIZE ? left : GUEST_PAGE_SIZE;
+}
+
+static inline guest_pte_t guest_mapping_prot(const struct guest_mapping *mapping)
+{
+	return mapping->writable ? PAGE_READ | PAGE_WRITE : PAGE_READ;
+}
+
+/**
+ * Fill the zero-filled @page at @addr from the file mapped there, and give
+ * the permissions the page gets. Pages with no file stay zero-filled with
+ * the permissions of the pages allocated on demand.
+ */
+static guest_pte_t guest_map_in(const struct guest_memory *mem, unsigned char *page,
+		unsigned int addr)
+{
+	const struct guest_mapping *mapping = guest_mapping_at(mem, addr);
+	unsigned int start = addr & ~(GUEST_PAGE_SIZE - 1);
+
+	if (!mapping) return mem->prot;
+
+	guest_copy_in(page, 0, mapping->host + (start - mapping->addr), guest_mapping_chunk(mapping, addr));
+	return guest_mapping_prot(mapping);
+}
+
+
+/**********************************************************************
+ * guest_memory_release
+ *
+ * DESCRIPTION
+ *   Release all the pages and the tables of @mem
+ */
+void guest_memory_release(struct guest_memory *mem)
+{
+	guest_checkpoint_wait(mem);
+	if (mem->writer) {
+		free(mem->writer->filename);
+		free(mem->writer);
+		mem->writer = NULL;
+	}
+
+	for (unsigned int t = 0; t < NR_GUEST_TABLES; t++) {
+		guest_pte_t *table = mem->tables[t];
+
+		if (!table) continue;
+		for (unsigned int i = 0; i < NR_GUEST_TABLE_ENTRIES && !mem->flat; i++) {
+			if (table[i]) free(guest_pte_page(table[i]));
+		}
+		free(table);
+		mem->tables[t] = NULL;
+	}
+	if (mem->flat) munmap(mem->flat, GUEST_FLAT_SIZE);
+	if (mem->backing) munmap(mem->backing, GUEST_SPACE_SIZE);
+	if (mem->fd >= 0) close(mem->fd);
+	mem->flat = mem->backing = NULL;
+	mem->fd = -1;
+	free(mem->dirty);
+	mem->dirty = NULL;
+	mem->nr_dirty = mem->max_dirty = 0;
+	mem->nr_pages = 0;
+
+	for (unsigned int i = 0; i < mem->nr_mappings; i++) {
+		struct guest_mapping *mapping = mem->mappings[i];
+
+		if (__atomic_sub_fetch(&mapping->users, 1, __ATOMIC_ACQ_REL)) continue;
+		munmap(mapping->host, mapping->length);
+		free(mapping);
+	}
+	free(mem->mappings);
+	mem->mappings = NULL;
+	mem->nr_mappings = 0;
+
+	for (unsigned int i = 0; i < mem->nr_saved; i++) {
+		free(mem->saved[i].data);
+	}
+	free(mem->saved);
+	mem->saved = NULL;
+	mem->nr_saved = mem->max_saved = 0;
+	mem->snapshot = false;
+}
+
+
+/**
+ * Entry for the page at @addr, allocating the table and the page if they
+ * are not there yet. NULL if they cannot be allocated.
+ */
+static guest_pte_t *guest_pte_alloc(struct guest_memory *mem, unsigned int addr)
+{
+	guest_pte_t **table = mem->tables + (addr >> GUEST_TABLE_SHIFT);
+	guest_pte_t *pte;
+
+	if (!*table) {
+		*table = calloc(NR_GUEST_TABLE_ENTRIES, sizeof(**table));
+		if (!*table) return NULL;
+	}
+
+	pte = *table + ((addr >> GUEST_PAGE_SHIFT) & (NR_GUEST_TABLE_ENTRIES - 1));
+	if (!*pte) {
+		unsigned char *page;
+
+		if (mem->flat) {
+			/* Zero-filled in the file already */
+			page = mem->backing + (addr & ~(GUEST_PAGE_SIZE - 1));
+		} else {
+			page = aligned_alloc(GUEST_PAGE_SIZE, GUEST_PAGE_SIZE);
+			if (!page) return NULL;
+			memset(page, 0x00, GUEST_PAGE_SIZE);
+		}
+		if (!guest_pte_set(mem, pte, addr, (guest_pte_t)page | guest_map_in(mem, page, addr))) {
+			if (!mem->flat) free(page);
+			*pte = 0;
+			return NULL;
+		}
+		mem->nr_pages++;
+	}
+	return pte;
+}
+
+/**
+ * Save the page of @pte at @addr in the snapshot before it is changed first
+ */
+static bool guest_save_page(struct guest_memory *mem, guest_pte_t *pte, unsigned int addr)
+{
+	unsigned char *data;
+
+	if (!mem->snapshot || (*pte & PAGE_SAVED)) return true;
+
+	if (mem->nr_saved == mem->max_saved) {
+		unsigned int max = mem->max_saved ? mem->max_saved * 2 : 64;
+		struct guest_saved_page *saved = realloc(mem->saved, sizeof(*saved) * max);
+
+		if (!saved) return false;
+		mem->saved = saved;
+		mem->max_saved = max;
+	}
+	data = malloc(GUEST_PAGE_SIZE);
+	if (!data) return false;
+	memcpy(data, guest_pte_page(*pte), GUEST_PAGE_SIZE);
+
+	if (!guest_pte_set(mem, pte, addr, *pte | PAGE_SAVED)) {
+		free(data);
+		return false;
+	}
+	mem->saved[mem->nr_saved++] = (struct guest_saved_page) {
+		.page = addr >> GUEST_PAGE_SHIFT,
+		.prot = *pte & PAGE_RWX,
+		.data = data,
+	};
+	return true;
+}
+
+/**
+ * Remember the page of @pte at @addr in @dirty[] as changed
+ */
+static bool guest_list_page(struct guest_memory *mem, guest_pte_t *pte, unsigned int addr)
+{
+	if (*pte & PAGE_LISTED) return true;
+
+	if (mem->nr_dirty == mem->max_dirty) {
+		unsigned int max = mem->max_dirty ? mem->max_dirty * 2 : 64;
+		unsigned int *dirty = realloc(mem->dirty, sizeof(*dirty) * max);
+
+		if (!dirty) return false;
+		mem->dirty = dirty;
+		mem->max_dirty = max;
+	}
+	if (!guest_pte_set(mem, pte, addr, *pte | PAGE_LISTED)) return false;
+	mem->dirty[mem->nr_dirty++] = addr >> GUEST_PAGE_SHIFT;
+	return true;
+}
+
+/**
+ * Mark the page of @pte at @addr dirty and remember it
+ */
+static bool guest_mark_dirty(struct guest_memory *mem, guest_pte_t *pte, unsigned int addr)
+{
+	if (*pte & PAGE_DIRTY) return true;
+	if (!guest_save_page(mem, pte, addr) || !guest_list_page(mem, pte, addr)) return false;
+
+	return guest_pte_set(mem, pte, addr, *pte | PAGE_DIRTY | PAGE_MODIFIED);
+}
+
+
+/**********************************************************************
+ * guest_page_in
+ *
+ * DESCRIPTION
+ *   The slow path of @guest_translate(). Allocate the page at @addr if it
+ *   is not there, check the permissions in @flags against it, and mark it
+ *   dirty if PAGE_DIRTY is in @flags.
+ *
+ * RETURN
+ *   The host address of @addr
+ *   NULL if the access faults. @fault tells why.
+ */
+unsigned char *guest_page_in(struct guest_memory *mem, unsigned int addr, guest_pte_t flags)
+{
+	guest_pte_t *pte = guest_pte_alloc(mem, addr);
+	guest_pte_t prot = flags & PAGE_RWX;
+
+	if (!pte) {
+		guest_fault(mem, GUEST_FAULT_NOMEM, addr);
+		return NULL;
+	}
+	if ((*pte & prot) != prot) {
+		guest_fault(mem, (prot & PAGE_WRITE) ? GUEST_FAULT_WRITE :
+				(prot & PAGE_EXEC) ? GUEST_FAULT_EXEC : GUEST_FAULT_READ, addr);
+		return NULL;
+	}
+	if ((flags & PAGE_DIRTY) && !guest_mark_dirty(mem, pte, addr)) {
+		guest_fault(mem, GUEST_FAULT_NOMEM, addr);
+		return NULL;
+	}
+	return guest_pte_page(*pte) + (addr & (GUEST_PAGE_SIZE - 1));
+}
+
+
+/* Host address of the byte at @addr, as @guest_page_in() does */
+static inline unsigned char *guest_byte_in(struct guest_memory *mem, unsigned int addr,
+		guest_pte_t flags)
+{
+	unsigned char *p = guest_page_in(mem, addr, flags);
+
+	return p ? p - (addr & 0x3) + ((addr ^ GUEST_BYTE_SWIZZLE) & 0x3) : NULL;
+}
+
+
+/**********************************************************************
+ * guest_load
+ *
+ * DESCRIPTION
+ *   The slow path of loading the big-endian word at @addr into @word, byte
+ *   by byte. The word may be unaligned, and may cross pages. @flags is PAGE_READ for data and PAGE_EXEC for
+ *   instructions.
+ *
+ * RETURN
+ *   true on success
+ *   false if the access faults
+ */
+static bool guest_load_flags(struct guest_memory *mem, unsigned int addr, unsigned int *word,
+		guest_pte_t flags)
+{
+	unsigned int value = 0;
+
+	for (unsigned int i = 0; i < 4; i++) {
+		const unsigned char *p = guest_byte_in(mem, addr + i, flags);
+
+		if (!p) return false;
+		value = (value << 8) | *p;
+	}
+	*word = value;
+	return true;
+}
+
+bool guest_load(struct guest_memory *mem, unsigned int addr, unsigned int *word)
+{
+	return guest_load_flags(mem, addr, word, PAGE_READ);
+}
+
+bool guest_fetch(struct guest_memory *mem, unsigned int addr, unsigned int *word)
+{
+	return guest_load_flags(mem, addr, word, PAGE_EXEC);
+}
+
+
+/**********************************************************************
+ * guest_store
+ *
+ * DESCRIPTION
+ *   The slow path of storing @word at @addr in big endian. Nothing is
+ *   stored if any byte of it faults.
+ *
+ * RETURN
+ *   true on success
+ *   false if the access faults
+ */
+bool guest_store(struct guest_memory *mem, unsigned int addr, unsigned int word)
+{
+	unsigned char *p[4];
+
+	for (unsigned int i = 0; i < 4; i++) {
+		p[i] = guest_byte_in(mem, addr + i, PAGE_WRITE | PAGE_DIRTY);
+		if (!p[i]) return false;
+	}
+	for (unsigned int i = 0; i < 4; i++) {
+		*p[i] = word >> (24 - 8 * i);
+	}
+	return true;
+}
+
+
+/**********************************************************************
+ * guest_check
+ *
+ * DESCRIPTION
+ *   See if all the pages over [@addr, @addr + @length) allow @flags, or
+ *   will allow once they are allocated. Nothing is allocated.
+ */
+bool guest_check(const struct guest_memory *mem, unsigned int addr, size_t length,
+		guest_pte_t flags)
+{
+	guest_pte_t prot = flags & PAGE_RWX;
+
+	while (length) {
+		const guest_pte_t *pte = guest_pte(mem, addr);
+		unsigned int room = guest_page_room(addr);
+		const struct guest_mapping *mapping;
+		guest_pte_t have = mem->prot;
+
+		if (pte && *pte) {
+			have = *pte;
+		} else if ((mapping = guest_mapping_at(mem, addr))) {
+			have = guest_mapping_prot(mapping);
+		}
+
+		if ((have & prot) != prot) return false;
+		if (length <= room) break;
+		length -= room;
+		addr += room;
+	}
+	return true;
+}
+
+
+/**********************************************************************
+ * guest_protect
+ *
+ * DESCRIPTION
+ *   Set the permissions of the pages over [@addr, @addr + @length) to
+ *   @prot, which is a combination of PAGE_READ, PAGE_WRITE, and PAGE_EXEC.
+ *   The pages are allocated if they are not there yet.
+ *
+ * RETURN
+ *   0 on success
+ *   -ENOMEM if the pages cannot be allocated
+ */
+int guest_protect(struct guest_memory *mem, unsigned int addr, size_t length, unsigned int prot)
+{
+	while (length) {
+		guest_pte_t *pte = guest_pte_alloc(mem, addr);
+		unsigned int room = guest_page_room(addr);
+
+		if (!pte || !guest_save_page(mem, pte, addr) || !guest_list_page(mem, pte, addr)) {
+			return -ENOMEM;
+		}
+		if (!guest_pte_set(mem, pte, addr, (*pte & ~(guest_pte_t)PAGE_RWX) | (prot & PAGE_RWX))) {
+			return -ENOMEM;
+		}
+
+		if (length <= room) break;
+		length -= room;
+		addr += room;
+	}
+	return 0;
+}
+
+
+/**********************************************************************
+ * guest_peek
+ *
+ * DESCRIPTION
+ *   Copy @length bytes from @addr of the guest memory to @buffer regardless
+ *   of the permissions. Pages not allocated read as zero, or as the file
+ *   mapped there, and are left unallocated.
+ */
+void guest_peek(const struct guest_memory *mem, unsigned int addr, void *buffer, size_t length)
+{
+	unsigned char *out = buffer;
+
+	while (length) {
+		const guest_pte_t *pte = guest_pte(mem, addr);
+		const struct guest_mapping *mapping;
+		unsigned int chunk = guest_page_room(addr);
+
+		if (chunk > length) chunk = length;
+		if (pte && *pte) {
+			guest_copy_out(out, guest_pte_page(*pte), addr & (GUEST_PAGE_SIZE - 1), chunk);
+		} else if ((mapping = guest_mapping_at(mem, addr))) {
+			size_t offset = addr - mapping->addr;
+			size_t in_file = offset < mapping->length ? mapping->length - offset : 0;
+
+			if (in_file > chunk) in_file = chunk;
+			memcpy(out, mapping->host + offset, in_file);
+			memset(out + in_file, 0x00, chunk - in_file);
+		} else {
+			memset(out, 0x00, chunk);
+		}
+		out += chunk;
+		addr += chunk;
+		length -= chunk;
+	}
+}
+
+
+/**********************************************************************
+ * guest_poke
+ *
+ * DESCRIPTION
+ *   Copy @length bytes from @buffer to @addr of the guest memory regardless
+ *   of the permissions, as the loader does. The pages become dirty.
+ *
+ * RETURN
+ *   0 on success
+ *   -ENOMEM if the pages cannot be allocated
+ */
+int guest_poke(struct guest_memory *mem, unsigned int addr, const void *buffer, size_t length)
+{
+	const unsigned char *in = buffer;
+
+	while (length) {
+		guest_pte_t *pte = guest_pte_alloc(mem, addr);
+		unsigned int chunk = guest_page_room(addr);
+
+		if (!pte || !guest_mark_dirty(mem, pte, addr)) return -ENOMEM;
+
+		if (chunk > length) chunk = length;
+		guest_copy_in(guest_pte_page(*pte), addr & (GUEST_PAGE_SIZE - 1), in, chunk);
+		in += chunk;
+		addr += chunk;
+		length -= chunk;
+	}
+	return 0;
+}
+
+
+/**********************************************************************
+ * guest_clear_dirty
+ *
+ * DESCRIPTION
+ *   Forget the dirty pages of @mem
+ */
+void guest_clear_dirty(struct guest_memory *mem)
+{
+	for (unsigned int i = 0; i < mem->nr_dirty; i++) {
+		unsigned int addr = mem->dirty[i] << GUEST_PAGE_SHIFT;
+		guest_pte_t *pte = guest_pte(mem, addr);
+
+		if (pte) guest_pte_set(mem, pte, addr, *pte & ~(guest_pte_t)(PAGE_DIRTY | PAGE_LISTED));
+	}
+	mem->nr_dirty = 0;
+}
+
+
+/**********************************************************************
+ * guest_snapshot
+ *
+ * DESCRIPTION
+ *   Take the snapshot of @mem, replacing the previous one. No page is
+ *   copied here; the pages are made clean, and saved as they are changed
+ *   from now on.
+ *
+ * RETURN
+ *   0
+ */
+int guest_snapshot(struct guest_memory *mem)
+{
+	for (unsigned int i = 0; i < mem->nr_saved; i++) {
+		unsigned int addr = mem->saved[i].page << GUEST_PAGE_SHIFT;
+		guest_pte_t *pte = guest_pte(mem, addr);
+
+		guest_pte_set(mem, pte, addr, *pte & ~(guest_pte_t)PAGE_SAVED);
+		free(mem->saved[i].data);
+	}
+	mem->nr_saved = 0;
+
+	for (unsigned int i = 0; i < mem->nr_dirty; i++) {
+		unsigned int addr = mem->dirty[i] << GUEST_PAGE_SHIFT;
+		guest_pte_t *pte = guest_pte(mem, addr);
+
+		guest_pte_set(mem, pte, addr, *pte & ~(guest_pte_t)PAGE_DIRTY);
+	}
+	mem->snapshot_prot = mem->prot;
+	mem->snapshot = true;
+	return 0;
+}
+
+
+/**********************************************************************
+ * guest_restore
+ *
+ * DESCRIPTION
+ *   Put @mem back to the snapshot. This takes time proportional to the
+ *   pages changed since the snapshot is taken. The pages put back become
+ *   dirty, and the snapshot is kept to be restored again.
+ *
+ * RETURN
+ *   0 on success
+ *   -ENOENT if no snapshot is taken
+ *   -ENOMEM if the dirty pages cannot be kept
+ */
+int guest_restore(struct guest_memory *mem)
+{
+	if (!mem->snapshot) return -ENOENT;
+
+	for (unsigned int i = 0; i < mem->nr_saved; i++) {
+		const struct guest_saved_page *saved = mem->saved + i;
+		unsigned int addr = saved->page << GUEST_PAGE_SHIFT;
+		guest_pte_t *pte = guest_pte(mem, addr);
+
+		memcpy(guest_pte_page(*pte), saved->data, GUEST_PAGE_SIZE);
+		if (!guest_pte_set(mem, pte, addr, (*pte & ~(guest_pte_t)PAGE_RWX) | saved->prot) ||
+				!guest_mark_dirty(mem, pte, addr)) return -ENOMEM;
+	}
+	mem->prot = mem->snapshot_prot;
+	return 0;
+}
+
+
+/**********************************************************************
+ * guest_memory_copy
+ *
+ * DESCRIPTION
+ *   Make @dst, which has no page, a copy of @src. The copy has no dirty
+ *   page nor the snapshot, and shares the files mapped into @src.
+ *
+ * RETURN
+ *   0 on success
+ *   -ENOMEM if the pages cannot be allocated
+ */
+int guest_memory_copy(struct guest_memory *dst, const struct guest_memory *src)
+{
+	dst->prot = src->prot;
+
+	for (unsigned int t = 0; t < NR_GUEST_TABLES; t++) {
+		const guest_pte_t *table = src->tables[t];
+
+		if (!table) continue;
+		for (unsigned int i = 0; i < NR_GUEST_TABLE_ENTRIES; i++) {
+			unsigned int addr = (t << GUEST_TABLE_SHIFT) | (i << GUEST_PAGE_SHIFT);
+			guest_pte_t *pte;
+
+			if (!table[i]) continue;
+
+			pte = guest_pte_alloc(dst, addr);
+			if (!pte) return -ENOMEM;
+			memcpy(guest_pte_page(*pte), guest_pte_page(table[i]), GUEST_PAGE_SIZE);
+			if (!guest_pte_set(dst, pte, addr, (*pte & ~(guest_pte_t)PAGE_FLAGS) |
+					(table[i] & (PAGE_RWX | PAGE_MODIFIED)))) return -ENOMEM;
+		}
+	}
+	return guest_map_share(dst, src);
+}
+
+
+/**********************************************************************
+ * guest_memory_reset
+ *
+ * DESCRIPTION
+ *   Put the dirty pages of @dst, which is a copy of @src, back to the ones
+ *   of @src, and clear them. Pages not in @src are zero-filled, or filled
+ *   from the file mapped there. This takes time proportional to the pages
+ *   dirtied since @dst is copied or reset.
+ *
+ * RETURN
+ *   0
+ */
+int guest_memory_reset(struct guest_memory *dst, const struct guest_memory *src)
+{
+	for (unsigned int i = 0; i < dst->nr_dirty; i++) {
+		unsigned int addr = dst->dirty[i] << GUEST_PAGE_SHIFT;
+		guest_pte_t *pte = guest_pte(dst, addr);
+		const guest_pte_t *orig = guest_pte(src, addr);
+
+		if (!pte || !*pte) continue;
+
+		if (orig && *orig) {
+			memcpy(guest_pte_page(*pte), guest_pte_page(*orig), GUEST_PAGE_SIZE);
+			guest_pte_set(dst, pte, addr, (*pte & ~(guest_pte_t)PAGE_FLAGS) | (*orig & PAGE_RWX));
+		} else {
+			memset(guest_pte_page(*pte), 0x00, GUEST_PAGE_SIZE);
+			guest_pte_set(dst, pte, addr, (*pte & ~(guest_pte_t)PAGE_FLAGS) |
+					guest_map_in(dst, guest_pte_page(*pte), addr));
+		}
+	}
+	dst->nr_dirty = 0;
+	return 0;
+}
+
+
+/**
+ * Checkpoint files. A file is a series of records, each of which is the
+ * header, the state of the machine, and the pages below. The first record
+ * has all the pages, and each of the others has the pages changed since the
+ * record before it. The state is the one of the last record, and the pages
+ * are the latest ones over the records.
+ */
+#define GUEST_CHECKPOINT_MAGIC		"MIPSCKPT"
+#define GUEST_CHECKPOINT_VERSION	1
+
+struct guest_checkpoint_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t state_size;
+	uint32_t prot;				/* Permissions of the pages allocated on demand */
+	uint32_t nr_pages;
+};
+
+struct guest_checkpoint_page {
+	uint32_t page;				/* Page number */
+	uint32_t prot;
+	unsigned char data[GUEST_PAGE_SIZE];	/* In the guest byte order */
+};
+
+/* The state is padded to keep the pages aligned */
+static inline size_t guest_state_room(size_t size)
+{
+	return (size + 7) & ~(size_t)7;
+}
+
+static void *guest_write_checkpoint(void *arg)
+{
+	struct guest_writer *writer = arg;
+	const char *p = writer->record;
+	size_t left = writer->size;
+	int fd;
+
+	writer->error = 0;
+	fd = open(writer->filename, O_WRONLY | O_CREAT | (writer->append ? O_APPEND : O_TRUNC), 0644);
+	if (fd < 0) {
+		writer->error = -errno;
+		goto out;
+	}
+	while (left) {
+		ssize_t written = write(fd, p, left);
+
+		if (written < 0) {
+			if (errno == EINTR) continue;
+			writer->error = -errno;
+			break;
+		}
+		p += written;
+		left -= written;
+	}
+	if (!writer->error && fsync(fd)) writer->error = -errno;
+	close(fd);
+
+out:
+	if (writer->error) {
+		fprintf(stderr, "checkpoint: %s: %s\n", writer->filename, strerror(-writer->error));
+	}
+	free(writer->record);
+	writer->record = NULL;
+	return NULL;
+}
+
+
+/**********************************************************************
+ * guest_checkpoint_wait
+ *
+ * DESCRIPTION
+ *   Wait for the checkpoint of @mem being written. When it has failed, the
+ *   next checkpoint starts the file over with all the pages.
+ *
+ * RETURN
+ *   0 when the checkpoint is written, or no checkpoint is being written
+ *   -errno if the checkpoint has failed to be written
+ */
+int guest_checkpoint_wait(struct guest_memory *mem)
+{
+	struct guest_writer *writer = mem->writer;
+
+	if (!writer || !writer->busy) return 0;
+
+	pthread_join(writer->thread, NULL);
+	writer->busy = false;
+	if (writer->error) {
+		free(writer->filename);
+		writer->filename = NULL;
+	}
+	return writer->error;
+}
+
+
+/**********************************************************************
+ * guest_checkpoint
+ *
+ * DESCRIPTION
+ *   Checkpoint @mem and the machine state in @state of @size bytes to the
+ *   file @filename. When the last checkpoint of @mem has gone to the same
+ *   file, only the pages changed since then are appended. Otherwise the
+ *   file is written over with all the pages.
+ *
+ *   The state and the pages are copied here, and the file is written by a
+ *   thread in the background while the machine keeps running. It is waited
+ *   for by the next checkpoint, @guest_checkpoint_wait(), or releasing @mem.
+ *
+ * RETURN
+ *   0 on success
+ *   -ENOMEM if the checkpoint cannot be put together
+ */
+int guest_checkpoint(struct guest_memory *mem, const char *filename, const void *state, size_t size)
+{
+	struct guest_writer *writer = mem->writer;
+	struct guest_checkpoint_header *header;
+	struct guest_checkpoint_page *pages, *page;
+	unsigned int nr_pages = 0;
+	bool append;
+	void *record;
+
+	guest_checkpoint_wait(mem);
+	if (!writer) {
+		writer = mem->writer = calloc(1, sizeof(*writer));
+		if (!writer) return -ENOMEM;
+	}
+	append = writer->filename && !strcmp(writer->filename, filename);
+
+	if (append) {
+		nr_pages = mem->nr_dirty;
+	} else {
+		char *name = strdup(filename);
+
+		if (!name) return -ENOMEM;
+		free(writer->filename);
+		writer->filename = name;
+		nr_pages = mem->nr_pages;
+	}
+
+	record = calloc(1, sizeof(*header) + guest_state_room(size) + sizeof(*page) * nr_pages);
+	if (!record) {
+		free(writer->filename);
+		writer->filename = NULL;
+		return -ENOMEM;
+	}
+	header = record;
+	*header = (struct guest_checkpoint_header) {
+		.magic = GUEST_CHECKPOINT_MAGIC,
+		.version = GUEST_CHECKPOINT_VERSION,
+		.state_size = size,
+		.prot = mem->prot,
+	};
+	memcpy(header + 1, state, size);
+	pages = page = (void *)((char *)(header + 1) + guest_state_room(size));
+
+	for (unsigned int i = 0; i < (append ? nr_pages : NR_GUEST_TABLES); i++) {
+		unsigned int addr = append ? mem->dirty[i] << GUEST_PAGE_SHIFT : i << GUEST_TABLE_SHIFT;
+		unsigned int nr = append ? 1 : NR_GUEST_TABLE_ENTRIES;
+
+		if (!mem->tables[addr >> GUEST_TABLE_SHIFT]) continue;
+		for (unsigned int j = 0; j < nr; j++, addr += GUEST_PAGE_SIZE) {
+			const guest_pte_t *pte = guest_pte(mem, addr);
+
+			if (!*pte) continue;
+			page->page = addr >> GUEST_PAGE_SHIFT;
+			page->prot = *pte & PAGE_RWX;
+			guest_copy_out(page->data, guest_pte_page(*pte), 0, GUEST_PAGE_SIZE);
+			page++;
+		}
+	}
+	header->nr_pages = page - pages;
+	guest_clear_dirty(mem);
+
+	writer->record = record;
+	writer->size = (char *)page - (char *)record;
+	writer->append = append;
+	writer->busy = true;
+	if (pthread_create(&writer->thread, NULL, guest_write_checkpoint, writer)) {
+		/* Write it here then */
+		writer->busy = false;
+		guest_write_checkpoint(writer);
+	}
+	return 0;
+}
+
+
+/**********************************************************************
+ * guest_resume
+ *
+ * DESCRIPTION
+ *   Fill @mem, which has no page, and @state of @size bytes from the
+ *   checkpoint file @filename. A record cut short at the end of the file,
+ *   say by a crash while it is written, is left out, and the next
+ *   checkpoint of @mem starts the file over. Otherwise it goes on appending
+ *   to the file.
+ *
+ * RETURN
+ *   0 on success
+ *   -errno if the file cannot be read
+ *   -EINVAL if the file is not a checkpoint of the machine
+ *   -ENOMEM if the pages cannot be allocated
+ */
+int guest_resume(struct guest_memory *mem, const char *filename, void *state, size_t size)
+{
+	FILE *file = fopen(filename, "rb");
+	struct guest_checkpoint_header header;
+	unsigned int nr_records = 0;
+	bool complete = true;
+	int ret = 0;
+
+	if (!file) return -errno;
+
+	while (!ret && fread(&header, sizeof(header), 1, file) == 1) {
+		size_t length;
+		char *record;
+		const struct guest_checkpoint_page *page;
+
+		if (memcmp(header.magic, GUEST_CHECKPOINT_MAGIC, sizeof(header.magic)) ||
+				header.version != GUEST_CHECKPOINT_VERSION || header.state_size != size) {
+			ret = -EINVAL;
+			break;
+		}
+
+		length = guest_state_room(size) + sizeof(*page) * header.nr_pages;
+		record = malloc(length);
+		if (!record) {
+			ret = -ENOMEM;
+			break;
+		}
+		if (fread(record, length, 1, file) != 1) {
+			free(record);
+			complete = false;
+			break;
+		}
+
+		memcpy(state, record, size);
+		mem->prot = header.prot;
+		page = (void *)(record + guest_state_room(size));
+		for (unsigned int i = 0; i < header.nr_pages; i++, page++) {
+			unsigned int addr = page->page << GUEST_PAGE_SHIFT;
+
+			if (guest_poke(mem, addr, page->data, GUEST_PAGE_SIZE) ||
+					guest_protect(mem, addr, GUEST_PAGE_SIZE, page->prot)) {
+				ret = -ENOMEM;
+				break;
+			}
+		}
+		free(record);
+		nr_records++;
+	}
+	fclose(file);
+
+	if (!ret && !nr_records) ret = -EINVAL;
+	if (ret) return ret;
+
+	guest_clear_dirty(mem);
+	if (complete) {
+		mem->writer = calloc(1, sizeof(*mem->writer));
+		if (mem->writer) mem->writer->filename = strdup(filename);
+	}
+	return 0;
+}
+
+
+/**********************************************************************
+ * guest_map
+ *
+ * DESCRIPTION
+ *   Map the host file @filename into @mem at @addr, read-only to the guest
+ *   unless @writable. Nothing is read here. The file is mapped shared on the
+ *   host, and each page over it is filled from it as the page is touched
+ *   first, converting the words into the host byte order; the pages over it
+ *   allocated already are filled now. When @writable, the stores of the
+ *   guest go back to the file with @guest_sync().
+ *
+ * RETURN
+ *   0 on success
+ *   -errno if the file cannot be opened or mapped
+ *   -EINVAL if @addr is not page aligned, or the file is empty or does not
+ *    fit in the address space
+ *   -EBUSY if the file would overlap a file mapped already
+ *   -ENOMEM if the mapping cannot be kept
+ */
+int guest_map(struct guest_memory *mem, const char *filename, unsigned int addr, bool writable)
+{
+	struct guest_mapping *mapping = NULL, **mappings;
+	struct stat st;
+	int fd, ret = 0;
+
+	if (addr & (GUEST_PAGE_SIZE - 1)) return -EINVAL;
+
+	fd = open(filename, (writable ? O_RDWR : O_RDONLY) | O_CLOEXEC);
+	if (fd < 0) return -errno;
+	if (fstat(fd, &st)) goto out_errno;
+	if (!st.st_size || addr + (uint64_t)st.st_size > GUEST_SPACE_SIZE) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	mapping = calloc(1, sizeof(*mapping));
+	if (!mapping) goto out_nomem;
+	*mapping = (struct guest_mapping) {
+		.addr = addr,
+		.length = st.st_size,
+		.writable = writable,
+		.users = 1,
+	};
+	for (unsigned int i = 0; i < mem->nr_mappings; i++) {
+		if (addr < guest_mapping_end(mem->mappings[i]) &&
+				mem->mappings[i]->addr < guest_mapping_end(mapping)) {
+			ret = -EBUSY;
+			goto out;
+		}
+	}
+
+	mappings = realloc(mem->mappings, sizeof(*mappings) * (mem->nr_mappings + 1));
+	if (!mappings) goto out_nomem;
+	mem->mappings = mappings;
+
+	mapping->host = mmap(NULL, mapping->length, PROT_READ | (writable ? PROT_WRITE : 0),
+			MAP_SHARED, fd, 0);
+	if (mapping->host == MAP_FAILED) goto out_errno;
+	close(fd);
+	mem->mappings[mem->nr_mappings++] = mapping;
+
+	for (uint64_t a = addr; a < guest_mapping_end(mapping); a += GUEST_PAGE_SIZE) {
+		guest_pte_t *pte = guest_pte(mem, a);
+
+		if (!pte || !*pte) continue;
+		if (!guest_mark_dirty(mem, pte, a)) return -ENOMEM;
+
+		memset(guest_pte_page(*pte), 0x00, GUEST_PAGE_SIZE);
+		if (!guest_pte_set(mem, pte, a, (*pte & ~(guest_pte_t)(PAGE_RWX | PAGE_MODIFIED)) |
+				guest_map_in(mem, guest_pte_page(*pte), a))) return -ENOMEM;
+	}
+	return 0;
+
+out_nomem:
+	ret = -ENOMEM;
+	goto out;
+out_errno:
+	ret = -errno;
+out:
+	free(mapping);
+	close(fd);
+	return ret;
+}
+
+
+/**********************************************************************
+ * guest_map_share
+ *
+ * DESCRIPTION
+ *   Share the files mapped into @src with @dst, which has none. Only the
+ *   pages of @src written back by @guest_sync() reach the files.
+ *
+ * RETURN
+ *   0 on success
+ *   -ENOMEM if the mappings cannot be kept
+ */
+int guest_map_share(struct guest_memory *dst, const struct guest_memory *src)
+{
+	if (!src->nr_mappings) return 0;
+
+	dst->mappings = malloc(sizeof(*dst->mappings) * src->nr_mappings);
+	if (!dst->mappings) return -ENOMEM;
+
+	for (unsigned int i = 0; i < src->nr_mappings; i++) {
+		dst->mappings[i] = src->mappings[i];
+		__atomic_add_fetch(&dst->mappings[i]->users, 1, __ATOMIC_ACQ_REL);
+	}
+	dst->nr_mappings = src->nr_mappings;
+	return 0;
+}
+
+
+/**********************************************************************
+ * guest_sync
+ *
+ * DESCRIPTION
+ *   Write the pages of @mem stored to since they are written back last to
+ *   the files mapped writable there. The pages become clean for the next
+ *   store to be seen, while they stay in @dirty[] for the checkpoints.
+ *
+ * RETURN
+ *   0 on success
+ *   -ENOMEM if the pages cannot be made clean
+ */
+int guest_sync(struct guest_memory *mem)
+{
+	for (unsigned int i = 0; i < mem->nr_mappings; i++) {
+		struct guest_mapping *mapping = mem->mappings[i];
+
+		if (!mapping->writable) continue;
+		for (uint64_t a = mapping->addr; a < guest_mapping_end(mapping); a += GUEST_PAGE_SIZE) {
+			guest_pte_t *pte = guest_pte(mem, a);
+
+			if (!pte || !(*pte & PAGE_MODIFIED)) continue;
+
+			guest_copy_out(mapping->host + (a - mapping->addr), guest_pte_page(*pte), 0,
+					guest_mapping_chunk(mapping, a));
+			if (!guest_pte_set(mem, pte, a,
+					*pte & ~(guest_pte_t)(PAGE_DIRTY | PAGE_MODIFIED))) return -ENOMEM;
+		}
+	}
+	return 0;
+}
+
+
+/**********************************************************************
+ * guest_mmu_set
+ *
+ * DESCRIPTION
+ *   Turn the MMU on with the page directory at the physical address @root,
+ *   or off, and flush the TLB. The statistics start over.
+ */
+void guest_mmu_set(struct guest_mmu *mmu, bool enabled, unsigned int root)
+{
+	*mmu = (struct guest_mmu) {
+		.enabled = enabled,
+		.root = root & ~(GUEST_PAGE_SIZE - 1),
+		.table_pages = GUEST_MMU_TABLE_BIT(root >> GUEST_PAGE_SHIFT),
+	};
+	for (unsigned int i = 0; i < GUEST_TLB_SIZE; i++) {
+		mmu->tlb[i].page = ~0U;
+	}
+}
+
+/**
+ * The slow path of @guest_mmu_stored(). A store to the directory may change
+ * any table, so it flushes the whole TLB. A store to a table drops the
+ * entries read from it.
+ */
+void guest_mmu_invalidate(struct guest_mmu *mmu, unsigned int paddr)
+{
+	unsigned int page = paddr >> GUEST_PAGE_SHIFT;
+
+	mmu->table_pages = GUEST_MMU_TABLE_BIT(mmu->root >> GUEST_PAGE_SHIFT);
+	for (unsigned int i = 0; i < GUEST_TLB_SIZE; i++) {
+		struct guest_tlb_entry *entry = mmu->tlb + i;
+
+		if (entry->page == ~0U) continue;
+
+		if (page == mmu->root >> GUEST_PAGE_SHIFT || entry->table == page) {
+			entry->page = ~0U;
+		} else {
+			mmu->table_pages |= GUEST_MMU_TABLE_BIT(entry->table);
+		}
+	}
+}
+
+/* Word of the page tables at the physical @addr. Pages not allocated read as zero */
+static unsigned int guest_mmu_word(const struct guest_memory *mem, unsigned int addr)
+{
+	unsigned char bytes[4];
+
+	guest_peek(mem, addr, bytes, sizeof(bytes));
+	return (bytes[0] << 24) | (bytes[1] << 16) | (bytes[2] << 8) | bytes[3];
+}
+
+
+/**********************************************************************
+ * guest_mmu_refill
+ *
+ * DESCRIPTION
+ *   The slow path of @guest_mmu_translate(). Walk the page tables for the
+ *   virtual @addr, put the translation in the TLB, and check @flags against
+ *   it.
+ *
+ * RETURN
+ *   true with the physical address in @paddr
+ *   false if the page is not mapped or does not allow @flags. @fault tells
+ *   which, with the virtual address.
+ */
+bool guest_mmu_refill(struct guest_mmu *mmu, struct guest_memory *mem, unsigned int addr,
+		guest_pte_t flags, unsigned int *paddr)
+{
+	struct guest_tlb_entry *entry = mmu->tlb + ((addr >> GUEST_PAGE_SHIFT) & (GUEST_TLB_SIZE - 1));
+	unsigned int prot = flags & PAGE_RWX;
+	unsigned int table, pte = 0;
+
+	mmu->nr_misses++;
+
+	table = guest_mmu_word(mem, mmu->root + (addr >> GUEST_TABLE_SHIFT) * 4);
+	if (table & MMU_PRESENT) {
+		pte = guest_mmu_word(mem, (table & ~(GUEST_PAGE_SIZE - 1)) +
+				((addr >> GUEST_PAGE_SHIFT) & (NR_GUEST_TABLE_ENTRIES - 1)) * 4);
+	}
+	if (!(pte & PAGE_RWX)) {
+		mmu->nr_faults++;
+		return guest_fault(mem, GUEST_FAULT_PAGE, addr);
+	}
+
+	*entry = (struct guest_tlb_entry) {
+		.page = addr >> GUEST_PAGE_SHIFT,
+		.frame = pte & ~(GUEST_PAGE_SIZE - 1),
+		.prot = pte & PAGE_RWX,
+		.table = table >> GUEST_PAGE_SHIFT,
+	};
+	mmu->table_pages |= GUEST_MMU_TABLE_BIT(entry->table);
+	if ((entry->prot & prot) != prot) {
+		mmu->nr_faults++;
+		return guest_fault(mem, (prot & PAGE_WRITE) ? GUEST_FAULT_WRITE :
+				(prot & PAGE_EXEC) ? GUEST_FAULT_EXEC : GUEST_FAULT_READ, addr);
+	}
+	*paddr = entry->frame | (addr & (GUEST_PAGE_SIZE - 1));
+	return true;
+}
+
+/**
+ * Host addresses of the bytes of the word at the virtual @addr into @p[],
+ * and their physical addresses into @paddr[], translating each page the word
+ * is on
+ */
+static bool guest_mmu_bytes(struct guest_mmu *mmu, struct guest_memory *mem, unsigned int addr,
+		guest_pte_t flags, unsigned char *p[4], unsigned int paddr[4])
+{
+	for (unsigned int i = 0; i < 4; i++) {
+		if (!i || !((addr + i) & (GUEST_PAGE_SIZE - 1))) {
+			if (!guest_mmu_translate(mmu, mem, addr + i, flags, paddr + i)) return false;
+		} else {
+			paddr[i] = paddr[i - 1] + 1;
+		}
+		p[i] = guest_byte_in(mem, paddr[i], flags);
+		if (!p[i]) return false;
+	}
+	return true;
+}
+
+
+/**********************************************************************
+ * guest_mmu_load
+ * guest_mmu_store
+ *
+ * DESCRIPTION
+ *   The slow paths of the accesses to the virtual @addr, going byte by byte
+ *   as @guest_load() and @guest_store() do. The word may be unaligned, and
+ *   may cross pages mapped anywhere. @flags of the load is PAGE_READ for
+ *   data and PAGE_EXEC for instructions. Nothing is stored if any byte of
+ *   the word faults.
+ *
+ * RETURN
+ *   true on success
+ *   false if the access faults
+ */
+bool guest_mmu_load(struct guest_mmu *mmu, struct guest_memory *mem, unsigned int addr,
+		unsigned int *word, guest_pte_t flags)
+{
+	unsigned char *p[4];
+	unsigned int paddr[4];
+
+	if (!guest_mmu_bytes(mmu, mem, addr, flags, p, paddr)) return false;
+
+	*word = (*p[0] << 24) | (*p[1] << 16) | (*p[2] << 8) | *p[3];
+	return true;
+}
+
+bool guest_mmu_store(struct guest_mmu *mmu, struct guest_memory *mem, unsigned int addr,
+		unsigned int word)
+{
+	unsigned char *p[4];
+	unsigned int paddr[4];
+
+	if (!guest_mmu_bytes(mmu, mem, addr, PAGE_WRITE | PAGE_DIRTY, p, paddr)) return false;
+
+	for (unsigned int i = 0; i < 4; i++) {
+		*p[i] = word >> (24 - 8 * i);
+	}
+	guest_mmu_stored(mmu, paddr[0]);
+	guest_mmu_stored(mmu, paddr[3]);
+	return true;
+}
+
+
+const char *guest_fault_name(enum guest_fault_type type)
+{
+	static const char * const names[] = {
+		[GUEST_FAULT_NONE] = "no fault",
+		[GUEST_FAULT_READ] = "read fault",
+		[GUEST_FAULT_WRITE] = "write fault",
+		[GUEST_FAULT_EXEC] = "execute fault",
+		[GUEST_FAULT_NOMEM] = "out of host memory",
+		[GUEST_FAULT_PAGE] = "page fault",
+	};
+
+	return names[type];
+}
@@ -0,0 +1,299 @@
+/**********************************************************************
+ * Copyright (c) 2019-2023
+ *  Sang-Hoon Kim <sanghoonkim@ajou.ac.kr>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTIABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ **********************************************************************/
+
+#ifndef __MIPS_MEMORY_H__
+#define __MIPS_MEMORY_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <setjmp.h>
+
+#include "types.h"		/* Of the emulator built with this file */
+
+/**
+ * Guest memory covering the whole 32-bit address space. Addresses are
+ * translated through a two-level page table; the upper 10 bits select a
+ * table in @tables[], the next 10 bits select an entry of the table, and
+ * the entry points to the 4 KiB page holding the lower 12 bits.
+ *
+ * Tables and pages are allocated when they are touched first, so the memory
+ * grows only with the pages in use. An entry is the host address of the page
+ * with the flags below in the lower bits, or 0 if the page is not allocated.
+ */
+#define GUEST_PAGE_SHIFT	12
+#define GUEST_PAGE_SIZE		(1 << GUEST_PAGE_SHIFT)
+#define GUEST_TABLE_SHIFT	22
+#define NR_GUEST_TABLES		(1 << (32 - GUEST_TABLE_SHIFT))
+#define NR_GUEST_TABLE_ENTRIES	(1 << (GUEST_TABLE_SHIFT - GUEST_PAGE_SHIFT))
+#define GUEST_SPACE_SIZE		(1ULL << 32)
+
+/**
+ * The pages hold the words in the byte order of the host, so that an aligned
+ * word is loaded and stored as it is. The byte at guest address a is at
+ * a ^ GUEST_BYTE_SWIZZLE in its page then. The big-endian bytes the guest
+ * sees are put in and taken out by @guest_poke() and @guest_peek() only, and
+ * by the slow paths going byte by byte.
+ */
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define GUEST_BYTE_SWIZZLE	3
+#define guest_to_host_word(word)	__builtin_bswap32(word)
+#else
+#define GUEST_BYTE_SWIZZLE	0
+#define guest_to_host_word(word)	(word)
+#endif
+#define host_to_guest_word(word)	guest_to_host_word(word)
+
+typedef uintptr_t guest_pte_t;
+
+enum guest_page_flags {
+	PAGE_READ	= 0x01,
+	PAGE_WRITE	= 0x02,
+	PAGE_EXEC	= 0x04,
+	PAGE_DIRTY	= 0x08,			/* Stored to since the dirty pages are cleared */
+	PAGE_SAVED	= 0x10,			/* Saved in the snapshot since it is taken */
+	PAGE_LISTED	= 0x20,			/* In @dirty[] */
+	PAGE_MODIFIED	= 0x40,			/* Stored to since it is written back to its file */
+
+	PAGE_RWX	= PAGE_READ | PAGE_WRITE | PAGE_EXEC,
+	PAGE_FLAGS	= GUEST_PAGE_SIZE - 1,
+};
+
+/**
+ * An access the permissions of the page do not allow, or a page that cannot
+ * be allocated. The engines and the pipeline stop at the instruction, and
+ * fill @pc.
+ */
+enum guest_fault_type {
+	GUEST_FAULT_NONE = 0,
+	GUEST_FAULT_READ,
+	GUEST_FAULT_WRITE,
+	GUEST_FAULT_EXEC,
+	GUEST_FAULT_NOMEM,
+	GUEST_FAULT_PAGE,			/* Not mapped by the guest page tables */
+};
+
+struct guest_fault {
+	enum guest_fault_type type;
+	unsigned int addr;
+	unsigned int pc;
+};
+
+/* A page as it was when the snapshot is taken */
+struct guest_saved_page {
+	unsigned int page;			/* Page number */
+	unsigned int prot;
+	unsigned char *data;
+};
+
+struct guest_memory {
+	guest_pte_t *tables[NR_GUEST_TABLES];
+	unsigned int prot;			/* Permissions of the pages allocated on demand */
+	unsigned long nr_pages;		/* Pages allocated */
+
+	/**
+	 * Pages made dirty or given new permissions since the dirty pages are
+	 * cleared, by their page numbers. The snapshot makes the pages clean to
+	 * see them changed again, but leaves them here for the checkpoints.
+	 */
+	unsigned int *dirty;
+	unsigned int nr_dirty;
+	unsigned int max_dirty;
+
+	struct guest_fault fault;
+
+	/**
+	 * The snapshot, copied on write. @guest_snapshot() clears the dirty pages
+	 * so that every page is saved here before it is changed first, and
+	 * @guest_restore() puts back the pages saved only.
+	 */
+	bool snapshot;
+	unsigned int snapshot_prot;
+	struct guest_saved_page *saved;
+	unsigned int nr_saved;
+	unsigned int max_saved;
+
+	/* Writes the checkpoints in the background. See memory.c */
+	struct guest_writer *writer;
+
+	/* Host files mapped in by @guest_map(). See memory.c */
+	struct guest_mapping **mappings;
+	unsigned int nr_mappings;
+
+	/**
+	 * The flat backend. The pages live in a 4 GiB file in memory mapped
+	 * twice; the entries point to @backing, which the slow paths and the
+	 * JIT read and write freely, and @flat is the guest view reserved with
+	 * PROT_NONE and opened up page by page as the entries allow. The engines
+	 * access @flat + address directly while @catch is set, and the faults
+	 * there are caught by the SIGSEGV handler, which jumps to @catch with
+	 * no fault. The engine redoes the access on the paged path then, which
+	 * brings in the page, marks it dirty, or reports the fault, out of the
+	 * signal handler as they allocate. The first store to a page faults too
+	 * so that the page is marked dirty.
+	 *
+	 * The host cannot give a page write permission without the read one,
+	 * so write-only pages stay closed in @flat, and always go through the
+	 * paged path.
+	 */
+	unsigned char *flat;
+	unsigned char *backing;
+	int fd;
+	sigjmp_buf *catch;
+};
+
+/**
+ * The MMU, which is off unless it is given the page directory of the guest.
+ * Virtual addresses are translated by the two-level page tables the guest
+ * keeps in the memory, which is physical then, splitting the addresses as
+ * @tables[] does. The directory at @root has a word for each table, the
+ * physical address of the table with MMU_PRESENT, and a table has a word
+ * for each page, the physical address of the page with the permissions of
+ * the page in PAGE_READ, PAGE_WRITE, and PAGE_EXEC. The words are in big
+ * endian as the guest stores them, and a page with no permission is not
+ * mapped.
+ *
+ * The translations are cached in a direct-mapped TLB, which is flushed when
+ * the MMU is set. Each entry remembers the table it is read from, and the
+ * stores through the MMU to the directory or to such a table drop the entries
+ * read from there by @guest_mmu_stored(), so the guest changes its page
+ * tables with plain sw and sees the change on the next access.
+ */
+#define GUEST_TLB_SIZE		64
+#define MMU_PRESENT			0x01
+
+struct guest_tlb_entry {
+	unsigned int page;			/* Virtual page number, or ~0 if empty */
+	unsigned int frame;			/* Physical address of the page */
+	unsigned int prot;
+	unsigned int table;			/* Physical page number of the table */
+};
+
+/* Bit of the physical page number @page in @guest_mmu.table_pages */
+#define GUEST_MMU_TABLE_BIT(page)	(1ULL << ((page) & 63))
+
+struct guest_mmu {
+	bool enabled;
+	unsigned int root;			/* Physical address of the page directory */
+	struct guest_tlb_entry tlb[GUEST_TLB_SIZE];
+	uint64_t table_pages;		/* Bits of the directory and the tables in @tlb */
+
+	unsigned long nr_hits;
+	unsigned long nr_misses;
+	unsigned long nr_faults;
+};
+
+extern void guest_memory_init(struct guest_memory *mem);
+extern int guest_memory_init_flat(struct guest_memory *mem, bool huge);
+extern void guest_memory_release(struct guest_memory *mem);
+extern int guest_memory_copy(struct guest_memory *dst, const struct guest_memory *src);
+extern int guest_memory_reset(struct guest_memory *dst, const struct guest_memory *src);
+extern void guest_clear_dirty(struct guest_memory *mem);
+extern int guest_snapshot(struct guest_memory *mem);
+extern int guest_restore(struct guest_memory *mem);
+
+extern int guest_checkpoint(struct guest_memory *mem, const char *filename,
+		const void *state, size_t size);
+extern int guest_checkpoint_wait(struct guest_memory *mem);
+extern int guest_resume(struct guest_memory *mem, const char *filename, void *state, size_t size);
+
+extern int guest_map(struct guest_memory *mem, const char *filename, unsigned int addr,
+		bool writable);
+extern int guest_map_share(struct guest_memory *dst, const struct guest_memory *src);
+extern int guest_sync(struct guest_memory *mem);
+
+extern unsigned char *guest_page_in(struct guest_memory *mem, unsigned int addr, guest_pte_t flags);
+extern bool guest_load(struct guest_memory *mem, unsigned int addr, unsigned int *word);
+extern bool guest_fetch(struct guest_memory *mem, unsigned int addr, unsigned int *word);
+extern bool guest_store(struct guest_memory *mem, unsigned int addr, unsigned int word);
+extern bool guest_check(const struct guest_memory *mem, unsigned int addr, size_t length,
+		guest_pte_t flags);
+extern int guest_protect(struct guest_memory *mem, unsigned int addr, size_t length,
+		unsigned int prot);
+
+extern void guest_peek(const struct guest_memory *mem, unsigned int addr, void *buffer,
+		size_t length);
+extern int guest_poke(struct guest_memory *mem, unsigned int addr, const void *buffer,
+		size_t length);
+
+extern void guest_catch(struct guest_memory *mem, sigjmp_buf *env);
+
+extern void guest_mmu_set(struct guest_mmu *mmu, bool enabled, unsigned int root);
+extern bool guest_mmu_refill(struct guest_mmu *mmu, struct guest_memory *mem, unsigned int addr,
+		guest_pte_t flags, unsigned int *paddr);
+extern bool guest_mmu_load(struct guest_mmu *mmu, struct guest_memory *mem, unsigned int addr,
+		unsigned int *word, guest_pte_t flags);
+extern bool guest_mmu_store(struct guest_mmu *mmu, struct guest_memory *mem, unsigned int addr,
+		unsigned int word);
+extern void guest_mmu_invalidate(struct guest_mmu *mmu, unsigned int paddr);
+
+extern const char *guest_fault_name(enum guest_fault_type type);
+
+/**
+ * Host address of @addr if its page is allocated with all @flags, or NULL.
+ * This is the fast path of the accesses; anything else goes to the slow
+ * paths, which allocate the page, keep the dirty pages, and report faults.
+ */
+static inline unsigned char *guest_translate(const struct guest_memory *mem, unsigned int addr,
+		guest_pte_t flags)
+{
+	const guest_pte_t *table = mem->tables[addr >> GUEST_TABLE_SHIFT];
+	guest_pte_t pte;
+
+	if (!table) return NULL;
+
+	pte = table[(addr >> GUEST_PAGE_SHIFT) & (NR_GUEST_TABLE_ENTRIES - 1)];
+	if ((pte & flags) != flags) return NULL;
+
+	return (unsigned char *)(pte & ~(guest_pte_t)PAGE_FLAGS) + (addr & (GUEST_PAGE_SIZE - 1));
+}
+
+/**
+ * Physical address of the virtual @addr for an access with @flags. The TLB
+ * is refilled from the page tables when it misses, and @mem->fault is left
+ * when the page is not mapped or does not allow the access.
+ */
+static inline bool guest_mmu_translate(struct guest_mmu *mmu, struct guest_memory *mem,
+		unsigned int addr, guest_pte_t flags, unsigned int *paddr)
+{
+	const struct guest_tlb_entry *entry = mmu->tlb + ((addr >> GUEST_PAGE_SHIFT) & (GUEST_TLB_SIZE - 1));
+	unsigned int prot = flags & PAGE_RWX;
+
+	if (entry->page != addr >> GUEST_PAGE_SHIFT || (entry->prot & prot) != prot) {
+		return guest_mmu_refill(mmu, mem, addr, flags, paddr);
+	}
+	mmu->nr_hits++;
+	*paddr = entry->frame | (addr & (GUEST_PAGE_SIZE - 1));
+	return true;
+}
+
+/**
+ * Drop the translations read from the page at the physical @paddr, which a
+ * store has just written. Most stores are to no table, which @table_pages
+ * tells at a glance.
+ */
+static inline void guest_mmu_stored(struct guest_mmu *mmu, unsigned int paddr)
+{
+	if (mmu->table_pages & GUEST_MMU_TABLE_BIT(paddr >> GUEST_PAGE_SHIFT)) {
+		guest_mmu_invalidate(mmu, paddr);
+	}
+}
+
+/* Whether a word at @addr is aligned, and is a host word in the page then */
+static inline bool guest_word_aligned(unsigned int addr)
+{
+	return !(addr & 0x3);
+}
+
+#endif
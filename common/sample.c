@@ -0,0 +1,154 @@
+/**********************************************************************
+ * Copyright (c) 2019-2023
+ *  Sang-Hoon Kim <sanghoonkim@ajou.ac.kr>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTIABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ **********************************************************************/
+
+/**
+ * The sampling profiler. See sample.h
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/time.h>
+
+#include "sample.h"
+
+/* The sampler the timer fills, or NULL */
+static struct sampler *sampling;
+
+static void sampler_tick(int signo)
+{
+	struct sampler *s = __atomic_load_n(&sampling, __ATOMIC_ACQUIRE);
+	unsigned long head;
+	unsigned int *sample;
+
+	(void)signo;
+	if (!s) return;
+
+	head = __atomic_load_n(&s->head, __ATOMIC_RELAXED);
+	if (head - __atomic_load_n(&s->tail, __ATOMIC_ACQUIRE) == NR_SAMPLES) {
+		s->nr_dropped++;
+		return;
+	}
+	sample = s->ring + (head & (NR_SAMPLES - 1)) * s->nr_words;
+	for (unsigned int i = 0; i < s->nr_words; i++) {
+		sample[i] = *s->words[i];
+	}
+	__atomic_store_n(&s->head, head + 1, __ATOMIC_RELEASE);
+}
+
+
+/**********************************************************************
+ * sampler_start
+ *
+ * DESCRIPTION
+ *   Start sampling the @nr_words words at @words[] @hz times a second. The
+ *   ring is allocated when it is started first, and the samples left in it
+ *   are kept.
+ *
+ * RETURN
+ *   0 on success
+ *   -EINVAL if @hz or @nr_words is out of the range
+ *   -EBUSY if another sampler is running
+ *   -ENOMEM if the ring cannot be allocated
+ *   -errno if the timer cannot be set
+ */
+int sampler_start(struct sampler *s, unsigned int hz,
+		const volatile unsigned int *words[], unsigned int nr_words)
+{
+	struct sigaction action = {
+		.sa_handler = sampler_tick,
+		.sa_flags = SA_RESTART,
+	};
+	struct itimerval timer = {
+		/* tv_usec is below a second, which 1 Hz takes whole */
+		.it_interval = {
+			.tv_sec = 1 / (hz ? hz : 1),
+			.tv_usec = (1000000 / (hz ? hz : 1)) % 1000000,
+		},
+	};
+	struct sampler *idle = NULL;
+
+	if (!hz || hz > MAX_SAMPLE_HZ || !nr_words || nr_words > MAX_SAMPLE_WORDS) return -EINVAL;
+	if (s->ring && s->nr_words != nr_words) return -EINVAL;
+
+	if (!s->ring) {
+		s->ring = calloc(NR_SAMPLES, sizeof(*s->ring) * nr_words);
+		if (!s->ring) return -ENOMEM;
+	}
+	memcpy(s->words, words, sizeof(*words) * nr_words);
+	s->nr_words = nr_words;
+	s->hz = hz;
+
+	if (!__atomic_compare_exchange_n(&sampling, &idle, s, false,
+			__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		return -EBUSY;
+	}
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGPROF, &action, &s->old_action);
+
+	timer.it_value = timer.it_interval;
+	if (setitimer(ITIMER_PROF, &timer, &s->old_timer)) {
+		int ret = -errno;
+
+		sigaction(SIGPROF, &s->old_action, NULL);
+		__atomic_store_n(&sampling, NULL, __ATOMIC_RELEASE);
+		return ret;
+	}
+	return 0;
+}
+
+
+/**
+ * Stop the timer, and put back what was there before @s was started. The
+ * samples are left in the ring
+ */
+void sampler_stop(struct sampler *s)
+{
+	if (__atomic_load_n(&sampling, __ATOMIC_ACQUIRE) != s) return;
+
+	setitimer(ITIMER_PROF, &s->old_timer, NULL);
+	__atomic_store_n(&sampling, NULL, __ATOMIC_RELEASE);
+	sigaction(SIGPROF, &s->old_action, NULL);
+}
+
+
+/**
+ * Take the oldest sample into @sample, @nr_words words. This may go along
+ * with the handler filling the ring
+ */
+bool sampler_read(struct sampler *s, unsigned int *sample)
+{
+	unsigned long tail = __atomic_load_n(&s->tail, __ATOMIC_RELAXED);
+
+	if (tail == __atomic_load_n(&s->head, __ATOMIC_ACQUIRE)) return false;
+
+	memcpy(sample, s->ring + (tail & (NR_SAMPLES - 1)) * s->nr_words,
+			sizeof(*sample) * s->nr_words);
+	__atomic_store_n(&s->tail, tail + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+
+/**
+ * Stop @s, and release the ring
+ */
+void sampler_release(struct sampler *s)
+{
+	sampler_stop(s);
+	free(s->ring);
+	memset(s, 0x00, sizeof(*s));
+}
@@ -0,0 +1,62 @@
+/**********************************************************************
+ * Copyright (c) 2019-2023
+ *  Sang-Hoon Kim <sanghoonkim@ajou.ac.kr>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTIABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ **********************************************************************/
+
+#ifndef __MIPS_SAMPLE_H__
+#define __MIPS_SAMPLE_H__
+
+#include <signal.h>
+#include <sys/time.h>
+
+#include "types.h"		/* Of the emulator built with this file */
+
+/**
+ * The sampling profiler. While it is started, SIGPROF comes in at @hz times
+ * a second of the CPU time of the process, and the handler copies the words
+ * at @words[], say, @pc of the machine being run, into a sample in @ring.
+ * Nothing is done on the engines; they only keep the words up to date as
+ * they do anyway.
+ *
+ * The ring is lock-free with a single producer, the handler, which moves
+ * @head past the sample it has filled, and a single consumer, which takes
+ * the samples by @sampler_read() and moves @tail. The samples coming in
+ * while the ring is full are dropped and counted.
+ *
+ * The timer and the handler are process-wide, so one sampler runs at a time.
+ */
+#define MAX_SAMPLE_WORDS	8
+#define NR_SAMPLES			(1 << 20)	/* 17 minutes at 1 kHz */
+#define MAX_SAMPLE_HZ		100000
+
+struct sampler {
+	const volatile unsigned int *words[MAX_SAMPLE_WORDS];
+	unsigned int nr_words;
+	unsigned int hz;
+
+	unsigned int *ring;				/* NR_SAMPLES samples of @nr_words words */
+	unsigned long head;
+	unsigned long tail;
+	unsigned long nr_dropped;
+
+	struct sigaction old_action;
+	struct itimerval old_timer;
+};
+
+extern int sampler_start(struct sampler *s, unsigned int hz,
+		const volatile unsigned int *words[], unsigned int nr_words);
+extern void sampler_stop(struct sampler *s);
+extern bool sampler_read(struct sampler *s, unsigned int *sample);
+extern void sampler_release(struct sampler *s);
+
+#endif